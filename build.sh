@@ -129,6 +129,13 @@ ffmpegPath="${DST}/ffmpeg"
         mkdir -p "${ffmpegPath}/include/libavformat"
         cp config.h "${ffmpegPath}/include/ffmpeg_config.h" || checkErr "ffmpeg headers delivery failed"
         cp libavformat/internal.h "${ffmpegPath}/include/libavformat/internal.h" || checkErr "ffmpeg headers delivery failed"
+        # rtsp_input.c reads the state of the RTSP demuxer; "config.h" is included by network.h and os_support.h
+        for header in rtsp.h rtspcodes.h rtpdec.h rtp.h srtp.h url.h network.h os_support.h httpauth.h; do
+            if [ -f "libavformat/$header" ]; then
+                cp "libavformat/$header" "${ffmpegPath}/include/libavformat/$header" || checkErr "ffmpeg headers delivery failed"
+            fi
+        done
+        cp config.h "${ffmpegPath}/include/libavformat/config.h" || checkErr "ffmpeg headers delivery failed"
     fi
     ProjectBuildFinish
     ffmpegIncludeDir="-I${ffmpegPath}/include"  
@@ -41,6 +41,8 @@ public:
 protected:
     mt_const Cb<Frontend> frontend;
 
+    AtomicInt pollable_count;
+
 public:
     virtual mt_throws Result poll (Uint64 timeout_millisec = (Uint64) -1) = 0;
 
@@ -49,6 +51,8 @@ public:
     void setFrontend (Cb<Frontend> const &frontend)
         { this->frontend = frontend; }
 
+    Count getNumPollables () { return (Count) pollable_count.get(); }
+
     virtual ~ActivePollGroup () {}
 };
 
@@ -24,6 +24,11 @@
 // Condition variables can only be sanely used in multithreaded code.
 #ifdef LIBMARY_MT_SAFE
 
+#ifdef __linux__
+  #include <errno.h>
+  #include <time.h>
+#endif
+
 #include <libmary/mutex.h>
 #include <libmary/state_mutex.h>
 
@@ -39,6 +44,18 @@ public:
     void signal () { pthread_cond_signal (&cond); }
     void wait (Mutex      &mutex) { pthread_cond_wait (&cond, mutex.get_pthread_mutex()); }
     void wait (StateMutex &mutex) { pthread_cond_wait (&cond, mutex.get_pthread_mutex()); }
+
+    // Returns 'false' if the timeout has expired.
+    bool timedWait (StateMutex &mutex, Time const timeout_microsec)
+    {
+        struct timespec ts;
+        clock_gettime (CLOCK_REALTIME, &ts);
+        Uint64 const nsec = (Uint64) ts.tv_nsec + (timeout_microsec % 1000000) * 1000;
+        ts.tv_sec  += (time_t) (timeout_microsec / 1000000 + nsec / 1000000000);
+        ts.tv_nsec  = (long) (nsec % 1000000000);
+        return pthread_cond_timedwait (&cond, mutex.get_pthread_mutex(), &ts) != ETIMEDOUT;
+    }
+
      Cond () { pthread_cond_init (&cond, NULL /* cond_attr */); }
     ~Cond () { pthread_cond_destroy (&cond); }
 #elif defined (LIBMARY__OLD_GTHREAD_API)
@@ -48,6 +65,16 @@ public:
     void signal () { g_cond_signal (cond); }
     void wait (Mutex      &mutex) { g_cond_wait (cond, mutex.get_glib_mutex()); }
     void wait (StateMutex &mutex) { g_cond_wait (cond, mutex.get_glib_mutex()); }
+
+    // Returns 'false' if the timeout has expired.
+    bool timedWait (StateMutex &mutex, Time const timeout_microsec)
+    {
+        GTimeVal tv;
+        g_get_current_time (&tv);
+        g_time_val_add (&tv, (glong) timeout_microsec);
+        return g_cond_timed_wait (cond, mutex.get_glib_mutex(), &tv);
+    }
+
      Cond () { cond = g_cond_new (); }
     ~Cond () { g_cond_free (cond); }
 #else
@@ -57,6 +84,14 @@ public:
     void signal () { g_cond_signal (&cond); }
     void wait (Mutex      &mutex) { g_cond_wait (&cond, mutex.get_glib_mutex()); }
     void wait (StateMutex &mutex) { g_cond_wait (&cond, mutex.get_glib_mutex()); }
+
+    // Returns 'false' if the timeout has expired.
+    bool timedWait (StateMutex &mutex, Time const timeout_microsec)
+    {
+        return g_cond_wait_until (&cond, mutex.get_glib_mutex(),
+                                  g_get_monotonic_time () + (gint64) timeout_microsec);
+    }
+
      Cond () { g_cond_init  (&cond); }
     ~Cond () { g_cond_clear (&cond); }
 #endif
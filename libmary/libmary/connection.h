@@ -38,7 +38,7 @@ public:
     //                // НО нужно помнить о SO_LINGER, хотя он здесь и не нужен.
 //    virtual mt_throws Result close () = 0;
 
-#ifdef LIBMARY_ENABLE_MWRITEV
+#if defined (LIBMARY_ENABLE_MWRITEV) || defined (LIBMARY_ENABLE_URING)
     virtual int getFd () = 0;
 #endif
 
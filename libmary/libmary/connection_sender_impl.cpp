@@ -177,7 +177,7 @@ ConnectionSenderImpl::sendPendingMessages ()
     return sendPendingMessages_writev ();
 }
 
-#ifdef LIBMARY_ENABLE_MWRITEV
+#if defined (LIBMARY_ENABLE_MWRITEV) || defined (LIBMARY_ENABLE_URING)
 void
 ConnectionSenderImpl::sendPendingMessages_fillIovs (Count        * const ret_num_iovs,
 						    struct iovec * const ret_iovs,
@@ -242,7 +242,7 @@ ConnectionSenderImpl::sendPendingMessages_react (AsyncIoResult res,
 	return;
     }
 }
-#endif // LIBMARY_ENABLE_MWRITEV
+#endif // LIBMARY_ENABLE_MWRITEV || LIBMARY_ENABLE_URING
 
 AsyncIoResult
 ConnectionSenderImpl::sendPendingMessages_writev ()
@@ -105,7 +105,7 @@ public:
 
     mt_throws AsyncIoResult sendPendingMessages ();
 
-#ifdef LIBMARY_ENABLE_MWRITEV
+#if defined (LIBMARY_ENABLE_MWRITEV) || defined (LIBMARY_ENABLE_URING)
     void sendPendingMessages_fillIovs (Count        *ret_num_iovs,
 				       struct iovec *ret_iovs,
 				       Count         max_iovs);
@@ -128,7 +128,7 @@ public:
 
     mt_const void setConnection (Connection * const conn) { this->conn = conn; }
 
-#ifdef LIBMARY_ENABLE_MWRITEV
+#if defined (LIBMARY_ENABLE_MWRITEV) || defined (LIBMARY_ENABLE_URING)
     Connection* getConnection () { return conn; }
 #endif
 
@@ -40,7 +40,7 @@ LogGroup libMary_logGroup_sender ("deferred_sender", LogLevel::I);
 LogGroup libMary_logGroup_close ("deferred_sender_close", LogLevel::I);
 }
 
-#ifdef LIBMARY_ENABLE_MWRITEV
+#if defined (LIBMARY_ENABLE_MWRITEV) || defined (LIBMARY_ENABLE_URING)
 namespace {
 
 enum {
@@ -49,6 +49,11 @@ enum {
     Mwritev_MaxIovsPerFd = 1024
 };
 
+#ifdef LIBMARY_ENABLE_URING
+// Batches larger than this are submitted in several rounds.
+enum { Uring_NumEntries = 256 };
+#endif
+
 mt_sync (DeferredSender::pollIterationEnd)
 mt_begin
 mt_end
@@ -466,9 +471,35 @@ DeferredConnectionSenderQueue::process (void * const _self)
     return extra_iteration_needed;
 }
 
+#if defined (LIBMARY_ENABLE_MWRITEV) || defined (LIBMARY_ENABLE_URING)
+mt_throws Result
+DeferredConnectionSenderQueue::writevBatch (LibMary_MwritevData * const mt_nonnull mwritev,
+                                            Count                 const num_fds)
+{
+#ifdef LIBMARY_ENABLE_URING
+    if (use_uring) {
+        return uring.writevBatch (num_fds,
+                                  mwritev->fds,
+                                  mwritev->iovs,
+                                  mwritev->num_iovs,
+                                  mwritev->res);
+    }
+#endif
+
 #ifdef LIBMARY_ENABLE_MWRITEV
+    return libMary_mwritev (num_fds,
+                            mwritev->fds,
+                            mwritev->iovs,
+                            mwritev->num_iovs,
+                            mwritev->res);
+#else
+    unreachable ();
+    return Result::Failure;
+#endif
+}
+
 bool
-DeferredConnectionSenderQueue::process_mwritev (void *_self)
+DeferredConnectionSenderQueue::process_batched (void *_self)
 {
     logD (sender, _func_);
 
@@ -503,8 +534,6 @@ DeferredConnectionSenderQueue::process_mwritev (void *_self)
 
     self->queue_mutex.unlock ();
 
-    bool extra_iteration_needed = false;
-
     ProcessingQueue::iter start_iter (processing_queue);
     while (!processing_queue.iter_done (start_iter)) {
 	ProcessingQueue::iter next_iter;
@@ -516,7 +545,7 @@ DeferredConnectionSenderQueue::process_mwritev (void *_self)
 	    ProcessingQueue::iter iter = start_iter;
 	    while (!processing_queue.iter_done (iter)) {
 		if (fd_idx >= Mwritev_MaxFds) {
-		    logD_ (_func, "max fds");
+		    logD (mwritev, _func, "max fds");
 		    break;
 		}
 
@@ -524,6 +553,8 @@ DeferredConnectionSenderQueue::process_mwritev (void *_self)
 
 		mwritev->fds [fd_idx] = deferred_sender->conn_sender_impl.getConnection()->getFd();
 
+	      // deferred_sender->mutex stays locked until the results of the batch
+	      // are processed below.
 		deferred_sender->mutex.lock ();
 
 		assert (deferred_sender->in_output_queue);
@@ -534,12 +565,7 @@ DeferredConnectionSenderQueue::process_mwritev (void *_self)
 		Count num_iovs = 0;
 		deferred_sender->conn_sender_impl.sendPendingMessages_fillIovs (&num_iovs,
 										mwritev->iovs_heap + total_iovs,
-										Mwritev_MaxIovsPerFd,
-                                                                                false /* deferred_events */);
-
-		// TODO Try leaving the lock here and unlocking after mwritev() call.
-		// TEST (uncomment)
-//		deferred_sender->mutex.unlock ();
+										Mwritev_MaxIovsPerFd);
 
 		mwritev->iovs [fd_idx] = mwritev->iovs_heap + total_iovs;
 		mwritev->num_iovs [fd_idx] = num_iovs;
@@ -549,7 +575,7 @@ DeferredConnectionSenderQueue::process_mwritev (void *_self)
 		++fd_idx;
 
 		if (Mwritev_MaxTotalIovs - total_iovs < Mwritev_MaxIovsPerFd) {
-		    logD_ (_func, "max total iovs");
+		    logD (mwritev, _func, "max total iovs");
 		    break;
 		}
 	    }
@@ -557,18 +583,12 @@ DeferredConnectionSenderQueue::process_mwritev (void *_self)
 	    next_iter = iter;
 	}
 
-	{
-	    Result const res = libMary_mwritev (fd_idx,
-						mwritev->fds,
-						mwritev->iovs,
-						mwritev->num_iovs,
-						mwritev->res);
-	    if (!res) {
-		logE_ (_func, "libMary_mwritev() failed: ", errnoString (errno));
-		self->processing = false;
-		self->queue_mutex.unlock ();
-		return false;
-	    }
+	if (!self->writevBatch (mwritev, fd_idx)) {
+	    logE_ (_func, "batched writev failed: ", exc->toString());
+
+	  // Nothing is known about the state of the connections.
+	    for (Count i = 0; i < fd_idx; ++i)
+		mwritev->res [i] = -EIO;
 	}
 
 	fd_idx = 0;
@@ -582,10 +602,12 @@ DeferredConnectionSenderQueue::process_mwritev (void *_self)
 		bool eintr = false;
 		Size num_written = 0;
 		int const posix_res = mwritev->res [fd_idx];
-		AsyncIoResult async_res;
+		++fd_idx;
+
+		AsyncIoResult async_res = AsyncIoResult::Normal;
 		if (posix_res >= 0) {
 		    num_written = (Size) posix_res;
-		    async_res = AsyncIoResult::Normal;
+		    libMary_getThreadLocal()->io_bytes += (Uint64) posix_res;
 		} else
 		if (posix_res == -EAGAIN ||
 		    posix_res == -EWOULDBLOCK)
@@ -597,27 +619,25 @@ DeferredConnectionSenderQueue::process_mwritev (void *_self)
 		} else
 		if (posix_res == -EPIPE) {
 		    async_res = AsyncIoResult::Eof;
-		} else  {
+		} else {
 		    async_res = AsyncIoResult::Error;
 		}
 
-		logD (mwritev, _func, "async_res: ", async_res);
+		logD (mwritev, _func, "deferred_sender: 0x", fmt_hex, (UintPtr) deferred_sender, fmt_def, ", "
+		      "posix_res: ", posix_res);
 
 		if (async_res == AsyncIoResult::Error ||
 		    async_res == AsyncIoResult::Eof)
 		{
-		    // TODO Questionable lock.
-		    // TEST (uncomment)
-//		    deferred_sender->mutex.lock ();
 		    deferred_sender->ready_for_output = false;
 
 		    // exc is NULL for Eof.
 		    if (async_res == AsyncIoResult::Error) {
-			exc_throw <PosixException> (-posix_res);
+			exc_throw (PosixException, -posix_res);
 			logE_ (_func, exc->toString());
 
-                        if (!closed) {
-                            closed = true;
+                        if (!deferred_sender->closed) {
+                            deferred_sender->closed = true;
 
                             ExceptionBuffer * const exc_buf = exc_swap_nounref ();
 
@@ -635,14 +655,14 @@ DeferredConnectionSenderQueue::process_mwritev (void *_self)
                             deferred_sender->mutex.unlock ();
                         }
 		    } else {
-                        if (!closed) {
-                            closed = true;
+                        if (!deferred_sender->closed) {
+                            deferred_sender->closed = true;
 
                             deferred_sender->fireClosed_unlocked (NULL /* exc_buf */);
                             if (deferred_sender->frontend && deferred_sender->frontend->closed) {
                                 deferred_sender->mutex.unlock ();
                                 deferred_sender->frontend.call (deferred_sender->frontend->closed,
-                                                                /*(*/ NULL /* exc_ */ /*)*/);
+                                                                /*(*/ static_cast <Exception*> (NULL) /* exc_ */ /*)*/);
                             } else {
                                 deferred_sender->mutex.unlock ();
                             }
@@ -657,7 +677,6 @@ DeferredConnectionSenderQueue::process_mwritev (void *_self)
 			    coderef_container->unref ();
 		    }
 
-		    ++fd_idx;
 		    continue;
 		}
 
@@ -666,36 +685,33 @@ DeferredConnectionSenderQueue::process_mwritev (void *_self)
 		else
 		    deferred_sender->ready_for_output = true;
 
-		bool tmp_extra_iteration_needed;
-		if (!eintr) {
-		    // TEST (uncomment)
-//		    deferred_sender->mutex.lock ();
-		    deferred_sender->conn_sender_impl.sendPendingMessages_react (async_res,
-                                                                                 num_written,
-                                                                                 false /* deferred_events */);
-		    tmp_extra_iteration_needed = deferred_sender->conn_sender_impl.processingBarrierHit();
-		} else {
-		    tmp_extra_iteration_needed = true;
-		}
+		if (!eintr)
+		    deferred_sender->conn_sender_impl.sendPendingMessages_react (async_res, num_written);
 
-		if (!tmp_extra_iteration_needed) {
+		// Only one writev() per connection is made in a batch. If there is
+		// more data to send, the sender goes back to the end of the queue,
+		// keeping its reference.
+		if (eintr
+		    || deferred_sender->conn_sender_impl.processingBarrierHit()
+		    || (async_res == AsyncIoResult::Normal
+			&& deferred_sender->conn_sender_impl.gotDataToSend()))
+		{
+		    mt_unlocks (deferred_sender->mutex) deferred_sender->toGlobOutputQueue (false /* add_ref */, true /* unlock */);
+		} else {
 		    mt_unlocks (deferred_sender->mutex) deferred_sender->closeIfNeeded (false /* deferred_event */);
 
 		    Object * const coderef_container = deferred_sender->getCoderefContainer ();
 		    if (coderef_container)
 			coderef_container->unref ();
-		} else {
-		    mt_unlocks (deferred_sender->mtuex) deferred_sender->closeIfNeeded (false /* deferred_event */);
-		    extra_iteration_needed = true;
 		}
-
-		++fd_idx;
 	    }
 	}
 
 	start_iter = next_iter;
     }
 
+    bool extra_iteration_needed = false;
+
     self->queue_mutex.lock ();
     if (!self->output_queue.isEmpty())
 	extra_iteration_needed = true;
@@ -705,17 +721,24 @@ DeferredConnectionSenderQueue::process_mwritev (void *_self)
 
     return extra_iteration_needed;
 }
-#endif /* LIBMARY_ENABLE_MWRITEV */
+#endif /* LIBMARY_ENABLE_MWRITEV || LIBMARY_ENABLE_URING */
 
 mt_const void
 DeferredConnectionSenderQueue::setDeferredProcessor (DeferredProcessor * const deferred_processor)
 {
     this->deferred_processor = deferred_processor;
 
+#ifdef LIBMARY_ENABLE_URING
+    use_uring = uring.init (Uring_NumEntries);
+    if (use_uring) {
+	send_task.cb = CbDesc<DeferredProcessor::TaskCallback> (
+		process_batched, this /* cb_data */, getCoderefContainer());
+    } else
+#endif
 #ifdef LIBMARY_ENABLE_MWRITEV
     if (libMary_mwritevAvailable()) {
 	send_task.cb = CbDesc<DeferredProcessor::TaskCallback> (
-		process_mwritev, this /* cb_data */, getCoderefContainer());
+		process_batched, this /* cb_data */, getCoderefContainer());
     } else
 #endif
     {
@@ -774,6 +797,9 @@ DeferredConnectionSenderQueue::DeferredConnectionSenderQueue (Object * const cod
       deferred_processor (coderef_container),
       processing (false),
       released (false)
+#ifdef LIBMARY_ENABLE_URING
+      , use_uring (false)
+#endif
 {
 }
 
@@ -28,10 +28,17 @@
 #include <libmary/code_referenced.h>
 #include <libmary/deferred_processor.h>
 
+#ifdef LIBMARY_ENABLE_URING
+#include <libmary/uring_writev.h>
+#endif
+
 
 namespace M {
 
 class DeferredConnectionSenderQueue;
+#if defined (LIBMARY_ENABLE_MWRITEV) || defined (LIBMARY_ENABLE_URING)
+class LibMary_MwritevData;
+#endif
 
 class DeferredConnectionSender_OutputQueue_name;
 class DeferredConnectionSender_ProcessingQueue_name;
@@ -134,10 +141,21 @@ private:
 
     mt_mutex (queue_mutex) bool released;
 
+#ifdef LIBMARY_ENABLE_URING
+    // Used by process_batched() only, which is never called concurrently.
+    UringWritev uring;
+    mt_const bool use_uring;
+#endif
+
     static bool process (void *_self);
 
-#ifdef LIBMARY_ENABLE_MWRITEV
-    static bool process_mwritev (void *_self);
+#if defined (LIBMARY_ENABLE_MWRITEV) || defined (LIBMARY_ENABLE_URING)
+    mt_throws Result writevBatch (LibMary_MwritevData * mt_nonnull mwritev,
+                                  Count                num_fds);
+
+    // Sends data for all queued connections with one batched syscall
+    // (io_uring or mwritev) instead of a writev() call per connection.
+    static bool process_batched (void *_self);
 #endif
 
 public:
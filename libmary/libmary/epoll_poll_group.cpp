@@ -72,6 +72,7 @@ EpollPollGroup::addPollable (CbDesc<Pollable> const &pollable,
 	    goto _failure;
     }
 
+    pollable_count.inc ();
     return pollable_entry;
 
 _failure:
@@ -153,6 +154,8 @@ EpollPollGroup::removePollable (PollableKey const mt_nonnull key)
     pollable_list.remove (pollable_entry);
     pollable_deletion_queue.append (pollable_entry);
     mutex.unlock ();
+
+    pollable_count.dec ();
 }
 
 mt_throws Result
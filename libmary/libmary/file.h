@@ -48,7 +48,7 @@ public:
 
     virtual mt_throws Result close (bool flush_data = true) = 0;
 
-#ifdef LIBMARY_ENABLE_MWRITEV
+#if defined (LIBMARY_ENABLE_MWRITEV) || defined (LIBMARY_ENABLE_URING)
     virtual int getFd () = 0;
 #endif
 
@@ -80,7 +80,7 @@ public:
 				      Size         *ret_nwrittev);
     mt_iface_end
 
-#ifdef LIBMARY_ENABLE_MWRITEV
+#if defined (LIBMARY_ENABLE_MWRITEV) || defined (LIBMARY_ENABLE_URING)
     int getFd () { return file->getFd(); }
 #endif
   mt_iface_end
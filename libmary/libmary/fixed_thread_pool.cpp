@@ -113,6 +113,7 @@ FixedThreadPool::pollIterationBegin (void * const _thread_ctx)
     if (!updateTime ())
 	logE_ (_func, "updateTime() failed: ", exc->toString());
 
+    thread_ctx->loadIterationBegin ();
     thread_ctx->getTimers()->processTimers ();
 }
 
@@ -120,7 +121,9 @@ bool
 FixedThreadPool::pollIterationEnd (void * const _thread_ctx)
 {
     ServerThreadContext * const thread_ctx = static_cast <ServerThreadContext*> (_thread_ctx);
-    return thread_ctx->getDeferredProcessor()->process ();
+    bool const extra_iteration_needed = thread_ctx->getDeferredProcessor()->process ();
+    thread_ctx->loadIterationEnd ();
+    return extra_iteration_needed;
 }
 
 mt_throws CodeDepRef<ServerThreadContext>
@@ -131,6 +134,9 @@ FixedThreadPool::grabThreadContext (ConstMemory const & /* filename */)
 
   StateMutexLock l (&mutex);
 
+    if (load_aware_selection && !thread_data_list.isEmpty())
+        return selectLeastLoadedThreadContext (thread_data_list, &thread_selector);
+
     if (thread_selector) {
 	thread_ctx = &thread_selector->data->thread_ctx;
 	thread_selector = thread_selector->next;
@@ -155,6 +161,25 @@ FixedThreadPool::releaseThreadContext (ServerThreadContext * const /* thread_ctx
   // No-op
 }
 
+void
+FixedThreadPool::getThreadLoadStats (List<ServerThreadContext::LoadStats> * const mt_nonnull ret_list)
+{
+#ifdef LIBMARY_MT_SAFE
+  StateMutexLock l (&mutex);
+
+    ThreadDataList::iter iter (thread_data_list);
+    while (!thread_data_list.iter_done (iter)) {
+        ThreadData * const thread_data = thread_data_list.iter_next (iter)->data;
+
+        ServerThreadContext::LoadStats stats;
+        thread_data->thread_ctx.getLoadStats (&stats);
+        ret_list->append (stats);
+    }
+#else
+    (void) ret_list;
+#endif
+}
+
 #if 0
 // Unnecessary
 mt_throws Result
@@ -201,7 +226,8 @@ FixedThreadPool::stop ()
 FixedThreadPool::FixedThreadPool (Object * const coderef_container,
 				  Count    const num_threads)
     : DependentCodeReferenced (coderef_container),
-      main_thread_ctx (coderef_container)
+      main_thread_ctx (coderef_container),
+      load_aware_selection (true)
 #ifdef LIBMARY_MT_SAFE
       , thread_selector (NULL)
 #endif
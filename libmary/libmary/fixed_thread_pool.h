@@ -65,6 +65,8 @@ private:
 
     mt_const DataDepRef<ServerThreadContext> main_thread_ctx;
 
+    mt_const bool load_aware_selection;
+
 #ifdef LIBMARY_MT_SAFE
     mt_const Ref<MultiThread> multi_thread;
 
@@ -92,6 +94,8 @@ public:
     mt_throws CodeDepRef<ServerThreadContext> grabThreadContext (ConstMemory const &filename);
 
     void releaseThreadContext (ServerThreadContext *thread_ctx);
+
+    void getThreadLoadStats (List<ServerThreadContext::LoadStats> * mt_nonnull ret_list);
   mt_iface_end
 
 // Unnecessary    mt_throws Result init ();
@@ -113,6 +117,10 @@ public:
     mt_const void setMainThreadContext (ServerThreadContext * const main_thread_ctx)
         { this->main_thread_ctx = main_thread_ctx; }
 
+    // See ServerApp::setLoadAwareSelection().
+    mt_const void setLoadAwareSelection (bool const enable)
+        { load_aware_selection = enable; }
+
     FixedThreadPool (Object *coderef_container,
 		     Count   num_threads = 0);
 };
@@ -67,6 +67,14 @@ class HashEntry : public IntrusiveAvlTree_Node<HashName>,
               class Base>
             friend class Hash;
 
+    template <class T,
+              class KeyType,
+              class Extractor,
+              class Comparator,
+              class Hasher,
+              class HashName_>
+            friend class TreeHash_anybase;
+
 private:
     Uint32 unrolled_hash;
 };
@@ -79,6 +87,14 @@ class Hash_common
 };
 #endif
 
+// Open addressing hash table with linear probing.
+//
+// Slots keep the hashes of the entries, probing compares keys only when
+// the hashes match. When the table gets half full, entries are moved to
+// a new table a few slots at a time by subsequent add() and remove()
+// calls, so that no single call pays for the whole rehash. Lookups search
+// both tables meanwhile. Entries are iterated in the order of addition.
+//
 // TODO Default template parameter values are poorly thought.
 template < class T,
 	   class KeyType,
@@ -89,58 +105,190 @@ template < class T,
 class Hash_anybase
 {
 private:
-#if 0
-    class HashEntryComparator
+    enum {
+	MinTableSize = 8,
+	// Old table slots moved to the new table per add() or remove().
+	RehashStep = 8
+    };
+
+    class Slot
     {
     public:
-#if 0
-	static bool greater (HashEntry<HashName> * const left,
-			     HashEntry<HashName> * const right)
+	T      *entry;       // NULL for an empty or a deleted slot
+	Uint32  unrolled_hash;
+	bool    deleted;
+
+	Slot ()
+	    : entry (NULL),
+	      unrolled_hash (0),
+	      deleted (false)
+	{}
+    };
+
+    class Table
+    {
+    public:
+	Slot     *slots;
+	Size      size;      // a power of two
+	unsigned  shift;     // 32 - log2 (size)
+	Count     num_entries;
+	Count     num_deleted;
+
+	void init (Size const new_size)
 	{
-	    if (left->unrolled_hash > right->unrolled_hash)
-		return true;
+	    size = MinTableSize;
+	    shift = 32 - 3;
+	    while (size < new_size) {
+		size <<= 1;
+		--shift;
+	    }
+
+	    slots = new Slot [size];
+	    num_entries = 0;
+	    num_deleted = 0;
+	}
 
-//	    if (Comparator::greater (left, right))
-	    // FIXME This is a hack. There's no place for pointer casts.
-	    if ((UintPtr) left > (UintPtr) right)
-		return true;
+	void release ()
+	{
+	    delete[] slots;
+	    slots = NULL;
+	    size = 0;
+	    num_entries = 0;
+	    num_deleted = 0;
+	}
 
-	    return false;
+	// Fibonacci hashing: upper bits of the product depend on all bits
+	// of the hash, which is not the case for its lower bits.
+	Size index (Uint32 const unrolled_hash) const
+	{
+	    return (Uint32) (unrolled_hash * 2654435769U) >> shift;
 	}
 
-	static bool equals (HashEntry<HashName> * const left,
-			    HashEntry<HashName> * const right)
+	void insert (T      * const entry,
+		     Uint32   const unrolled_hash)
 	{
-	    if (left->unrolled_hash != right->unrolled_hash)
-		return false;
+	    Size const mask = size - 1;
+	    for (Size i = index (unrolled_hash); ; i = (i + 1) & mask) {
+		Slot * const slot = &slots [i];
+		if (slot->entry)
+		    continue;
+
+		if (slot->deleted) {
+		    slot->deleted = false;
+		    --num_deleted;
+		}
+
+		slot->entry = entry;
+		slot->unrolled_hash = unrolled_hash;
+		++num_entries;
+		return;
+	    }
+	}
 
-	    if ((UintPtr) left == (UintPtr) right)
-		return true;
+	void erase (Slot * const slot)
+	{
+	    slot->entry = NULL;
+	    slot->deleted = true;
+	    --num_entries;
+	    ++num_deleted;
+	}
 
-	    return false;
+	// Tables always have empty slots, which terminates probing.
+	Slot* findEntry (T * const entry)
+	{
+	    if (!slots)
+		return NULL;
+
+	    Size const mask = size - 1;
+	    for (Size i = index (entry->unrolled_hash); ; i = (i + 1) & mask) {
+		Slot * const slot = &slots [i];
+		if (slot->entry == entry)
+		    return slot;
+
+		if (!slot->entry && !slot->deleted)
+		    return NULL;
+	    }
 	}
-#endif
 
-	static bool greater (KeyType left,
-			     KeyType right)
+	template <class C>
+	T* lookup (C             key,
+		   Uint32  const unrolled_hash)
 	{
+	    if (!slots)
+		return NULL;
+
+	    Size const mask = size - 1;
+	    for (Size i = index (unrolled_hash); ; i = (i + 1) & mask) {
+		Slot * const slot = &slots [i];
+		if (slot->entry) {
+		    if (slot->unrolled_hash == unrolled_hash
+			&& Comparator::equals (Extractor::getValue (*slot->entry), key))
+		    {
+			return slot->entry;
+		    }
+		} else
+		if (!slot->deleted) {
+		    return NULL;
+		}
+	    }
 	}
-    };
-#endif
 
-    class Cell
-    {
-    public:
-	IntrusiveAvlTree< T, Extractor, Comparator, HashName > tree;
+	Table ()
+	    : slots (NULL),
+	      size (0),
+	      shift (0),
+	      num_entries (0),
+	      num_deleted (0)
+	{}
     };
 
-    bool growing;
+    Size initial_size;
 
-    Cell *hash_table;
-    Size  hash_size;
+    Table table;
+    // Not NULL while the entries are being moved from it to 'table'.
+    Table old_table;
+    // Slots of 'old_table' before this one are empty already.
+    Size rehash_pos;
 
     IntrusiveList<T, HashName> node_list;
 
+    void rehashStep (Size const num_slots)
+    {
+	if (!old_table.slots)
+	    return;
+
+	Size const end = (old_table.size - rehash_pos > num_slots ? rehash_pos + num_slots : old_table.size);
+	for (; rehash_pos < end; ++rehash_pos) {
+	    Slot * const slot = &old_table.slots [rehash_pos];
+	    if (slot->entry) {
+		table.insert (slot->entry, slot->unrolled_hash);
+		// Probing for the rest of the old entries goes through this slot.
+		old_table.erase (slot);
+	    }
+	}
+
+	if (rehash_pos == old_table.size || old_table.num_entries == 0)
+	    old_table.release ();
+    }
+
+    void grow ()
+    {
+	// Finishing the previous rehash, which happens only if the table
+	// fills up faster than RehashStep allows for.
+	rehashStep (old_table.size);
+
+	Count const num_entries = table.num_entries;
+
+	// Same size if the table is mostly deleted slots.
+	Size new_size = table.size;
+	if (num_entries * 4 >= table.size)
+	    new_size = table.size * 2;
+
+	old_table = table;
+	table.init (new_size);
+	rehash_pos = 0;
+    }
+
 public:
     bool isEmpty () const
     {
@@ -150,19 +298,30 @@ public:
     void add (T * const entry)
     {
 	Uint32 const unrolled_hash = Hasher::hash (Extractor::getValue (entry));
-	Uint32 const hash = unrolled_hash % hash_size;
-
 	entry->unrolled_hash = unrolled_hash;
-	hash_table [hash].tree.add (entry);
 
-	node_list.append (entry);
+	// Keeping at least a half of the slots empty.
+	if ((table.num_entries + table.num_deleted + old_table.num_entries + 1) * 2 > table.size)
+	    grow ();
+
+	table.insert (entry, unrolled_hash);
+	rehashStep (RehashStep);
 
-	// TODO if (growing) ... then grow.
+	node_list.append (entry);
     }
 
     void remove (T * const entry)
     {
-	hash_table [entry->unrolled_hash % hash_size].tree.remove (entry);
+	if (Slot * const slot = table.findEntry (entry))
+	    table.erase (slot);
+	else
+	if (Slot * const slot = old_table.findEntry (entry))
+	    old_table.erase (slot);
+	else
+	    unreachable ();
+
+	rehashStep (RehashStep);
+
 	node_list.remove (entry);
     }
 
@@ -170,44 +329,38 @@ public:
     {
 	node_list.clear ();
 
-	delete[] hash_table;
-	hash_table = new Cell [hash_size];
+	old_table.release ();
+	table.release ();
+	table.init (initial_size);
     }
 
     template <class C>
     T* lookup (C key)
     {
 	Uint32 const unrolled_hash = Hasher::hash (key);
-	Uint32 const hash = unrolled_hash % hash_size;
 
-	return hash_table [hash].tree.lookup (key);
-    }
+	if (T * const entry = table.lookup (key, unrolled_hash))
+	    return entry;
 
-    Hash_anybase (Size const initial_hash_size,
-		  bool const growing)
-	: growing (growing),
-	  hash_size (initial_hash_size)
-    {
-	hash_table = new Cell [hash_size];
+	return old_table.lookup (key, unrolled_hash);
     }
 
-#if 0
-// Unnecessary
-    // Default hash configuration suitable for most uses.
-    Hash_anybase ()
-	: growing (true),
-	  hash_size (16)
+    // The table always grows as needed. 'growing' is accepted for
+    // compatibility with the former fixed-size implementation.
+    Hash_anybase (Size const initial_hash_size,
+		  bool const /* growing */)
+	: initial_size (initial_hash_size),
+	  rehash_pos (0)
     {
-	hash_table = new Cell [hash_size];
+	table.init (initial_size);
     }
-#endif
 
     ~Hash_anybase ()
     {
-	delete[] hash_table;
+	old_table.release ();
+	table.release ();
     }
 
-
   // ________________________________ iterator _________________________________
 
     class iterator
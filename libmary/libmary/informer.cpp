@@ -45,6 +45,21 @@ GenericInformer::releaseSubscription (Subscription * const mt_nonnull sbn)
     delete sbn;
 }
 
+// The subscription is released at the end of the last traversal.
+mt_mutex (mutex) void
+GenericInformer::invalidateSubscription (Subscription * const mt_nonnull sbn)
+{
+    assert (traversing > 0);
+
+    sbn->valid = false;
+    dropSnapshot ();
+
+    if (!sbn->invalidation_pending) {
+        sbn->invalidation_pending = true;
+        sbn_invalidation_list.append (sbn);
+    }
+}
+
 mt_mutex (mutex) void
 GenericInformer::releaseSubscriptionFromDestructor (Subscription * const mt_nonnull sbn)
 {
@@ -65,6 +80,89 @@ GenericInformer::releaseSubscriptionFromDestructor (Subscription * const mt_nonn
     delete sbn;
 }
 
+mt_mutex (mutex) void
+GenericInformer::releaseInvalidSubscriptions ()
+{
+    Subscription *sbn = sbn_invalidation_list.getFirst();
+    while (sbn) {
+        Subscription * const next_sbn = sbn_invalidation_list.getNext (sbn);
+        assert (!sbn->valid);
+
+        sbn->invalidation_pending = false;
+        releaseSubscription (sbn);
+
+        sbn = next_sbn;
+    }
+    sbn_invalidation_list.clear ();
+}
+
+mt_mutex (mutex) GenericInformer::SubscriptionSnapshot*
+GenericInformer::grabSnapshot ()
+{
+    if (!cur_snapshot) {
+        Count num_sbns = 0;
+        {
+            Subscription *sbn = sbn_list.getFirst();
+            while (sbn) {
+                if (sbn->valid)
+                    ++num_sbns;
+
+                sbn = sbn_list.getNext (sbn);
+            }
+        }
+
+        SubscriptionSnapshot * const snapshot = new (std::nothrow) SubscriptionSnapshot;
+        assert (snapshot);
+        snapshot->refcount = 1;
+        snapshot->num_sbns = num_sbns;
+        snapshot->sbns = NULL;
+        snapshot->num_oneshot = 0;
+
+        if (num_sbns) {
+            snapshot->sbns = new (std::nothrow) Subscription* [num_sbns];
+            assert (snapshot->sbns);
+
+            Count i = 0;
+            Subscription *sbn = sbn_list.getFirst();
+            while (sbn) {
+                if (sbn->valid) {
+                    snapshot->sbns [i] = sbn;
+                    if (sbn->oneshot)
+                        ++snapshot->num_oneshot;
+                    ++i;
+                }
+
+                sbn = sbn_list.getNext (sbn);
+            }
+        }
+
+        cur_snapshot = snapshot;
+    }
+
+    ++cur_snapshot->refcount;
+    return cur_snapshot;
+}
+
+mt_mutex (mutex) void
+GenericInformer::releaseSnapshot (SubscriptionSnapshot * const mt_nonnull snapshot)
+{
+    assert (snapshot->refcount > 0);
+    --snapshot->refcount;
+    if (snapshot->refcount == 0) {
+        delete[] snapshot->sbns;
+        delete snapshot;
+    }
+}
+
+mt_mutex (mutex) void
+GenericInformer::dropSnapshot ()
+{
+    if (cur_snapshot) {
+        releaseSnapshot (cur_snapshot);
+        cur_snapshot = NULL;
+    }
+}
+
 void
 GenericInformer::subscriberDeletionCallback (void * const _sbn)
 {
@@ -72,6 +170,25 @@ GenericInformer::subscriberDeletionCallback (void * const _sbn)
     GenericInformer * const self = sbn->informer;
 
     self->mutex->lock ();
+    self->dropSnapshot ();
+
+    if (self->traversing) {
+      // Snapshot traversals may still be referencing the subscription.
+      // It will be released when the last traversal ends.
+        sbn->valid = false;
+        sbn->del_sbn = NULL;
+        if (!sbn->invalidation_pending) {
+            sbn->invalidation_pending = true;
+            self->sbn_invalidation_list.append (sbn);
+        }
+
+        self->mutex->unlock ();
+        return;
+    }
+
+    if (sbn->invalidation_pending)
+        self->sbn_invalidation_list.remove (sbn);
+
     self->sbn_list.remove (sbn);
     self->mutex->unlock ();
 
@@ -103,7 +220,7 @@ GenericInformer::informAll_unlocked (ProxyInformCallback   const mt_nonnull prox
 	}
 
 	if (sbn->oneshot)
-	    sbn->valid = false;
+	    invalidateSubscription (sbn);
 
 	CodeRef code_ref;
 	if (sbn->weak_code_ref.isValid()) {
@@ -142,30 +259,83 @@ GenericInformer::informAll_unlocked (ProxyInformCallback   const mt_nonnull prox
     }
 
     --traversing;
-    if (traversing == 0) {
-	sbn = sbn_invalidation_list.getFirst();
-	while (sbn) {
-	    Subscription * const next_sbn = sbn_invalidation_list.getNext (sbn);
-	    assert (!sbn->valid);
+    if (traversing == 0)
+        releaseInvalidSubscriptions ();
+}
 
-	    releaseSubscription (sbn);
+mt_unlocks_locks (mutex) void
+GenericInformer::informAllSnapshot_unlocked (ProxyInformCallback   const mt_nonnull proxy_inform_cb,
+                                             VoidFunction          const inform_cb,
+                                             void                * const inform_cb_data)
+{
+    ++traversing;
+    SubscriptionSnapshot * const snapshot = grabSnapshot ();
+
+    // Oneshot subscriptions which this traversal informs. They're invalidated
+    // right away, so that concurrent and subsequent events skip them.
+    bool *oneshot_taken = NULL;
+    if (snapshot->num_oneshot) {
+        oneshot_taken = new (std::nothrow) bool [snapshot->num_sbns];
+        assert (oneshot_taken);
+
+        for (Count i = 0; i < snapshot->num_sbns; ++i) {
+            Subscription * const sbn = snapshot->sbns [i];
+            oneshot_taken [i] = (sbn->oneshot && sbn->valid);
+            if (oneshot_taken [i])
+                invalidateSubscription (sbn);
+        }
+    }
 
-	    sbn = next_sbn;
-	}
-	sbn_invalidation_list.clear ();
+    mutex->unlock ();
+
+    LibMary_ThreadLocal * const tlocal = libMary_getThreadLocal();
+    for (Count i = 0; i < snapshot->num_sbns; ++i) {
+        Subscription * const sbn = snapshot->sbns [i];
+        // Unsynchronized check: the subscription may be invalidated
+        // concurrently, which is acceptable for snapshot traversals.
+        if (!sbn->valid && !(oneshot_taken && oneshot_taken [i]))
+            continue;
+
+        if (sbn->weak_code_ref.isValid()
+            && sbn->weak_code_ref.getShadowPtr() != tlocal->last_coderef_container_shadow)
+        {
+            CodeRef const code_ref = sbn->weak_code_ref;
+            if (!code_ref)
+                continue;
+
+            Object::Shadow * const prv_coderef_container_shadow = tlocal->last_coderef_container_shadow;
+            tlocal->last_coderef_container_shadow = sbn->weak_code_ref.getShadowPtr();
+
+            proxy_inform_cb (sbn->cb_ptr, sbn->cb_data, inform_cb, inform_cb_data);
+
+            tlocal->last_coderef_container_shadow = prv_coderef_container_shadow;
+            continue;
+        }
+
+        proxy_inform_cb (sbn->cb_ptr, sbn->cb_data, inform_cb, inform_cb_data);
     }
+
+    delete[] oneshot_taken;
+
+    mutex->lock ();
+    releaseSnapshot (snapshot);
+
+    --traversing;
+    if (traversing == 0)
+        releaseInvalidSubscriptions ();
 }
 
 GenericInformer::SubscriptionKey
 GenericInformer::subscribeVoid (CallbackPtr      const cb_ptr,
 				void           * const cb_data,
 				VirtReferenced * const ref_data,
-				Object         * const coderef_container)
+				Object         * const coderef_container,
+                                bool             const oneshot)
 {
     Subscription * const sbn = new Subscription (cb_ptr, cb_data, ref_data, coderef_container);
     sbn->valid = true;
     sbn->informer = this;
-    sbn->oneshot = false;
+    sbn->oneshot = oneshot;
 
     if (coderef_container) {
 	sbn->del_sbn = coderef_container->addDeletionCallback (
@@ -177,6 +347,7 @@ GenericInformer::subscribeVoid (CallbackPtr      const cb_ptr,
 
     mutex->lock ();
     sbn_list.prepend (sbn);
+    dropSnapshot ();
     mutex->unlock ();
 
     return sbn;
@@ -186,12 +357,13 @@ mt_mutex (mutex) GenericInformer::SubscriptionKey
 GenericInformer::subscribeVoid_unlocked (CallbackPtr      const cb_ptr,
 					 void           * const cb_data,
 					 VirtReferenced * const ref_data,
-					 Object         * const coderef_container)
+					 Object         * const coderef_container,
+                                         bool             const oneshot)
 {
     Subscription * const sbn = new Subscription (cb_ptr, cb_data, ref_data, coderef_container);
     sbn->valid = true;
     sbn->informer = this;
-    sbn->oneshot = false;
+    sbn->oneshot = oneshot;
 
     if (coderef_container) {
 	sbn->del_sbn = coderef_container->addDeletionCallback (
@@ -202,6 +374,7 @@ GenericInformer::subscribeVoid_unlocked (CallbackPtr      const cb_ptr,
     }
 
     sbn_list.prepend (sbn);
+    dropSnapshot ();
 
     return sbn;
 }
@@ -218,11 +391,17 @@ mt_mutex (mutex) void
 GenericInformer::unsubscribe_unlocked (SubscriptionKey const sbn_key)
 {
     sbn_key.sbn->valid = false;
+    dropSnapshot ();
+
     if (traversing == 0) {
 	releaseSubscription (sbn_key.sbn);
         return;
     }
-    sbn_invalidation_list.append (sbn_key.sbn);
+
+    if (!sbn_key.sbn->invalidation_pending) {
+        sbn_key.sbn->invalidation_pending = true;
+        sbn_invalidation_list.append (sbn_key.sbn);
+    }
 }
 
 GenericInformer::~GenericInformer ()
@@ -230,6 +409,7 @@ GenericInformer::~GenericInformer ()
     mutex->lock ();
 
     assert (sbn_invalidation_list.isEmpty());
+    dropSnapshot ();
 
     Subscription *sbn = sbn_list.getFirst();
     while (sbn) {
@@ -37,7 +37,6 @@ class GenericInformer : public DependentCodeReferenced
 {
 public:
     enum InformFlags {
-	// TODO Support oneshot subscriptions.
 	InformOneshot = 1
     };
 
@@ -64,8 +63,11 @@ protected:
     {
     public:
 	bool valid;
+        // True while the subscription is in 'sbn_invalidation_list'.
+        bool invalidation_pending;
 
 	GenericInformer *informer;
+        // Oneshot subscriptions are invalidated by the first event.
 	bool oneshot;
 	Object::DeletionSubscriptionKey del_sbn;
 
@@ -79,7 +81,8 @@ protected:
 		      void           * const cb_data,
 		      VirtReferenced * const ref_data,
 		      Object         * const coderef_container)
-	    : cb_ptr (cb_ptr),
+	    : invalidation_pending (false),
+              cb_ptr (cb_ptr),
 	      cb_data (cb_data),
 	      weak_code_ref (coderef_container),
 	      ref_data (ref_data)
@@ -108,13 +111,36 @@ public:
    };
 
 protected:
+    // Immutable array of subscriptions for traversal with 'mutex' unlocked.
+    // Subscriptions referenced from a snapshot are not deleted while
+    // 'traversing' is non-zero.
+    class SubscriptionSnapshot
+    {
+    public:
+        mt_mutex (mutex) Count refcount;
+
+        Count num_sbns;
+        Subscription **sbns;
+        // Number of oneshot subscriptions in 'sbns'.
+        Count num_oneshot;
+    };
+
     StateMutex * const mutex;
 
     mt_mutex (mutex) SubscriptionList sbn_list;
     mt_mutex (mutex) SubscriptionInvalidationList sbn_invalidation_list;
     mt_mutex (mutex) Count traversing;
 
+    // Rebuilt on demand after changes to 'sbn_list'.
+    mt_mutex (mutex) SubscriptionSnapshot *cur_snapshot;
+
     mt_mutex (mutex) void releaseSubscription (Subscription *sbn);
+    mt_mutex (mutex) void invalidateSubscription (Subscription * mt_nonnull sbn);
+    mt_mutex (mutex) void releaseInvalidSubscriptions ();
+
+    mt_mutex (mutex) SubscriptionSnapshot* grabSnapshot ();
+    mt_mutex (mutex) void releaseSnapshot (SubscriptionSnapshot * mt_nonnull snapshot);
+    mt_mutex (mutex) void dropSnapshot ();
     mt_mutex (mutex) void releaseSubscriptionFromDestructor (Subscription *sbn);
 
     static void subscriberDeletionCallback (void *_sbn);
@@ -127,15 +153,21 @@ protected:
                                                       VoidFunction         inform_cb,
                                                       void                *inform_cb_data);
 
+    mt_unlocks_locks (mutex) void informAllSnapshot_unlocked (ProxyInformCallback  mt_nonnull proxy_inform_cb,
+                                                              VoidFunction         inform_cb,
+                                                              void                *inform_cb_data);
+
     SubscriptionKey subscribeVoid (CallbackPtr     cb_ptr,
 				   void           *cb_data,
 				   VirtReferenced *ref_data,
-				   Object         *coderef_container);
+				   Object         *coderef_container,
+                                   bool            oneshot = false);
 
     mt_mutex (mutex) SubscriptionKey subscribeVoid_unlocked (CallbackPtr     cb_ptr,
                                                              void           *cb_data,
                                                              VirtReferenced *ref_data,
-                                                             Object         *coderef_container);
+                                                             Object         *coderef_container,
+                                                             bool            oneshot = false);
 
 public:
     mt_mutex (mutex) bool gotSubscriptions_unlocked ()
@@ -154,7 +186,8 @@ public:
 		     StateMutex * const mutex)
 	: DependentCodeReferenced (coderef_container),
 	  mutex (mutex),
-	  traversing (0)
+	  traversing (0),
+          cur_snapshot (NULL)
     {
     }
 
@@ -193,6 +226,19 @@ public:
 	mt_unlocks_locks (mutex) GenericInformer::informAll_unlocked (proxyInformCallback, (VoidFunction) inform_cb, inform_cb_data);
     }
 
+    // Unlocks 'mutex' once for the whole traversal instead of once per
+    // subscriber, which is better for informers with many subscribers and
+    // frequent events. The list of subscribers is taken as a snapshot:
+    // a subscriber which is being removed concurrently may still receive
+    // the event, so subscribers should be protected by coderef containers.
+    // Oneshot subscribers are taken off the list along with the snapshot.
+    mt_unlocks_locks (mutex) void informAllSnapshot_unlocked (InformCallback    const inform_cb,
+                                                              void            * const inform_cb_data)
+    {
+	mt_unlocks_locks (mutex) GenericInformer::informAllSnapshot_unlocked (
+                proxyInformCallback, (VoidFunction) inform_cb, inform_cb_data);
+    }
+
     SubscriptionKey subscribe (T const        * const ev_struct,
 			       void           * const cb_data,
 			       VirtReferenced * const ref_data,
@@ -201,9 +247,11 @@ public:
 	return subscribeVoid ((void*) ev_struct, cb_data, ref_data, coderef_container);
     }
 
-    SubscriptionKey subscribe (CbDesc<T> const &cb)
+    // A oneshot subscriber is informed of one event only.
+    SubscriptionKey subscribe (CbDesc<T> const &cb,
+                               bool             const oneshot = false)
     {
-	return subscribeVoid ((void*) cb.cb, cb.cb_data, cb.ref_data, cb.coderef_container);
+	return subscribeVoid ((void*) cb.cb, cb.cb_data, cb.ref_data, cb.coderef_container, oneshot);
     }
 
     SubscriptionKey subscribe_unlocked (T const        * const ev_struct,
@@ -214,9 +262,10 @@ public:
 	return subscribeVoid_unlocked ((void*) ev_struct, cb_data, ref_data, coderef_container);
     }
 
-    SubscriptionKey subscribe_unlocked (CbDesc<T> const &cb)
+    SubscriptionKey subscribe_unlocked (CbDesc<T> const &cb,
+                                        bool             const oneshot = false)
     {
-	return subscribeVoid_unlocked ((void*) cb.cb, cb.cb_data, cb.ref_data, cb.coderef_container);
+	return subscribeVoid_unlocked ((void*) cb.cb, cb.cb_data, cb.ref_data, cb.coderef_container, oneshot);
     }
 
     Informer_ (Object     * const coderef_container,
@@ -267,14 +316,17 @@ public:
 	return subscribeVoid ((VoidFunction) cb, cb_data, ref_data, coderef_container);
     }
 
-    SubscriptionKey subscribe (CbDesc<T> const &cb)
+    // A oneshot subscriber is informed of one event only.
+    SubscriptionKey subscribe (CbDesc<T> const &cb,
+                               bool             const oneshot = false)
     {
-	return subscribeVoid ((VoidFunction) cb.cb, cb.cb_data, cb.ref_data, cb.coderef_container);
+	return subscribeVoid ((VoidFunction) cb.cb, cb.cb_data, cb.ref_data, cb.coderef_container, oneshot);
     }
 
-    mt_mutex (mutex) SubscriptionKey subscribe_unlocked (CbDesc<T> const &cb)
+    mt_mutex (mutex) SubscriptionKey subscribe_unlocked (CbDesc<T> const &cb,
+                                                         bool             const oneshot = false)
     {
-	return subscribeVoid_unlocked ((VoidFunction) cb.cb, cb.cb_data, cb.ref_data, cb.coderef_container);
+	return subscribeVoid_unlocked ((VoidFunction) cb.cb, cb.cb_data, cb.ref_data, cb.coderef_container, oneshot);
     }
 
     Informer (Object     * const coderef_container,
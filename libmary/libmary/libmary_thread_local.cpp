@@ -23,6 +23,8 @@
 //#include <cstdio>
 
 #include <libmary/exception.h>
+#include <libmary/page_pool.h>
+#include <libmary/log.h>
 
 #include <libmary/libmary_thread_local.h>
 
@@ -62,6 +64,10 @@ LibMary_ThreadLocal::LibMary_ThreadLocal ()
 
       last_coderef_container_shadow (NULL),
 
+      page_pool_caches (NULL),
+      log_ring (NULL),
+      io_bytes (0),
+
       time_seconds (0),
       time_microseconds (0),
       unixtime (0),
@@ -93,6 +99,9 @@ LibMary_ThreadLocal::~LibMary_ThreadLocal ()
 {
 //    fprintf (stderr, "--- ~LibMary_ThreadLocal() 0x%lx\n", (unsigned long) this);
 
+    // Before exceptions cleanup: writing out the lines may throw.
+    libMary_releaseLogRing (this);
+
     // Exceptions cleanup
     while (!exc_block_stack.isEmpty() || !exc_free_stack.isEmpty()) {
         {
@@ -119,6 +128,8 @@ LibMary_ThreadLocal::~LibMary_ThreadLocal ()
             exc_buffer = NULL;
     }
 
+    PagePool::releaseThreadCaches (this);
+
     delete[] strerr_buf;
 }
 
@@ -24,7 +24,7 @@
 #include <libmary/types.h>
 #include <time.h>
 
-#ifdef LIBMARY_ENABLE_MWRITEV
+#if defined (LIBMARY_ENABLE_MWRITEV) || defined (LIBMARY_ENABLE_URING)
 #include <sys/uio.h>
 #endif
 
@@ -59,8 +59,10 @@ class Exception;
 
 class CodeReferenced;
 class Object;
+class PagePool_ThreadCache;
+class LogRing;
 
-#ifdef LIBMARY_ENABLE_MWRITEV
+#if defined (LIBMARY_ENABLE_MWRITEV) || defined (LIBMARY_ENABLE_URING)
 // DeferredConnectionSender's mwritev data.
 class LibMary_MwritevData
 {
@@ -98,6 +100,16 @@ public:
     char *strerr_buf;
     Size strerr_buf_size;
 
+    // Per-thread page magazines, one for each PagePool used by the thread.
+    PagePool_ThreadCache *page_pool_caches;
+
+    // Buffered log lines of this thread, see _libMary_log_async.
+    LogRing *log_ring;
+
+    // Bytes received and sent over TCP connections by this thread.
+    // Sampled by ServerThreadContext to estimate the thread's load.
+    Uint64 io_bytes;
+
   // Time-related data fields
 
     Time time_seconds;
@@ -118,7 +130,7 @@ public:
     Time win_time_offs;
 #endif
 
-#ifdef LIBMARY_ENABLE_MWRITEV
+#if defined (LIBMARY_ENABLE_MWRITEV) || defined (LIBMARY_ENABLE_URING)
     LibMary_MwritevData mwritev;
 #endif
 
@@ -17,7 +17,11 @@
 */
 
 
+#include <cstring>
+
 #include <libmary/buffered_output_stream.h>
+#include <libmary/atomic.h>
+#include <libmary/thread.h>
 #include <libmary/io.h>
 
 #include <libmary/log.h>
@@ -157,5 +161,336 @@ void setLogStream (OutputStream             * const new_logs,
     delete old_logs_buffered_stream;
 }
 
+// Longer lines are cut when logging asynchronously.
+#define LIBMARY__LOG_LINE_MAX 4096
+// Rings are written out once in this period, in microseconds.
+#define LIBMARY__LOG_FLUSH_INTERVAL 10000
+
+AtomicInt _libMary_log_async (0);
+
+namespace {
+class LogLineStream : public OutputStream
+{
+public:
+    Byte *buf;
+    Size  len;
+
+    mt_throws Result write (ConstMemory   const mem,
+                            Size        * const ret_nwritten)
+    {
+        // The last byte is left for the newline.
+        Size tocopy = mem.len();
+        if (tocopy > LIBMARY__LOG_LINE_MAX - 1 - len)
+            tocopy = LIBMARY__LOG_LINE_MAX - 1 - len;
+
+        memcpy (buf + len, mem.mem(), tocopy);
+        len += tocopy;
+
+        if (ret_nwritten)
+            *ret_nwritten = mem.len();
+
+        return Result::Success;
+    }
+
+    mt_throws Result flush ()
+    {
+        return Result::Success;
+    }
+};
+}
+
+static Mutex rings_mutex;
+
+// Single producer (the owner thread), single consumer (the flusher) ring of
+// complete log lines. Positions are not wrapped to the size of the ring.
+class LogRing
+{
+public:
+    mt_const Byte *buf;
+    mt_const Size  size;
+
+    AtomicInt head;
+    AtomicInt tail;
+    AtomicInt dropped;
+
+    mt_mutex (rings_mutex) Uint32   dropped_reported;
+    mt_mutex (rings_mutex) bool     orphaned;
+    mt_mutex (rings_mutex) LogRing *next;
+
+  // Owner thread's data
+
+    LogLineStream line;
+    bool in_line;
+
+    // "YYYY/MM/DD HH:MM:SS." for 'prefix_unixtime', formatted once a second.
+    Time prefix_unixtime;
+    char prefix [32];
+    Size prefix_len;
+
+    LogRing (Size const size)
+        : size (size),
+          dropped_reported (0),
+          orphaned (false),
+          next (NULL),
+          in_line (false),
+          prefix_unixtime (0),
+          prefix_len (0)
+    {
+        buf = new (std::nothrow) Byte [size];
+        assert (buf);
+
+        line.buf = new (std::nothrow) Byte [LIBMARY__LOG_LINE_MAX];
+        assert (line.buf);
+        line.len = 0;
+    }
+
+    ~LogRing ()
+    {
+        delete[] buf;
+        delete[] line.buf;
+    }
+};
+
+static mt_mutex (rings_mutex) LogRing *rings = NULL;
+static mt_mutex (rings_mutex) bool flusher_running = false;
+
+static mt_const Size log_ring_size = 0;
+static mt_const Thread *flusher_thread = NULL;
+static AtomicInt flusher_stop;
+
+static void ringCommit (LogRing    * const mt_nonnull ring,
+                        Byte const * const data,
+                        Size         const len)
+{
+    Uint32 const head = (Uint32) ring->head.get ();
+    Uint32 const tail = (Uint32) ring->tail.get ();
+
+    if (len > ring->size - (Uint32) (head - tail)) {
+        ring->dropped.inc ();
+        return;
+    }
+
+    Size const pos = head & (ring->size - 1);
+    Size const first = (len < ring->size - pos ? len : ring->size - pos);
+    memcpy (ring->buf + pos, data, first);
+    memcpy (ring->buf, data + first, len - first);
+
+    ring->head.set ((int) (head + len));
+}
+
+// Called with rings_mutex and the log mutex held.
+static bool drainRing (LogRing * const mt_nonnull ring)
+{
+    Uint32 const head = (Uint32) ring->head.get ();
+    Uint32 const tail = (Uint32) ring->tail.get ();
+
+    bool written = false;
+    if (head != tail) {
+        Size const len = (Uint32) (head - tail);
+        Size const pos = tail & (ring->size - 1);
+        Size const first = (len < ring->size - pos ? len : ring->size - pos);
+
+        logs->writeFull (ConstMemory (ring->buf + pos, first), NULL /* ret_nwritten */);
+        if (len > first)
+            logs->writeFull (ConstMemory (ring->buf, len - first), NULL /* ret_nwritten */);
+
+        ring->tail.set ((int) head);
+        written = true;
+    }
+
+    Uint32 const dropped = (Uint32) ring->dropped.get ();
+    if (dropped != ring->dropped_reported) {
+        logW_unlocked_ (_func, (Uint32) (dropped - ring->dropped_reported), " log lines dropped, log buffer is full");
+        ring->dropped_reported = dropped;
+        written = true;
+    }
+
+    return written;
 }
 
+// Writes out all rings and deletes the ones of exited threads.
+// Called with rings_mutex held.
+static void flushRings ()
+{
+    logLock ();
+    exc_push_scope ();
+
+    bool written = false;
+
+    LogRing **prv_next = &rings;
+    while (LogRing * const ring = *prv_next) {
+        if (drainRing (ring))
+            written = true;
+
+        if (ring->orphaned) {
+            *prv_next = ring->next;
+            delete ring;
+        } else {
+            prv_next = &ring->next;
+        }
+    }
+
+    if (written)
+        logs->flush ();
+
+    exc_pop_scope ();
+    logUnlock ();
+}
+
+static void flusherThreadFunc (void * const /* cb_data */)
+{
+    while (!flusher_stop.get ()) {
+        updateTime ();
+
+        rings_mutex.lock ();
+        flushRings ();
+        rings_mutex.unlock ();
+
+        uSleep (LIBMARY__LOG_FLUSH_INTERVAL);
+    }
+}
+
+OutputStream* _libMary_log_async_begin (char const * const loglevel_str)
+{
+    LibMary_ThreadLocal * const tlocal = libMary_getThreadLocal ();
+
+    LogRing *ring = tlocal->log_ring;
+    if (!ring) {
+        ring = new (std::nothrow) LogRing (log_ring_size);
+        assert (ring);
+
+        rings_mutex.lock ();
+        ring->next = rings;
+        rings = ring;
+        rings_mutex.unlock ();
+
+        tlocal->log_ring = ring;
+    }
+
+    // Logging from within print_() of an argument.
+    if (ring->in_line)
+        return NULL;
+
+    ring->in_line = true;
+
+    if (ring->prefix_len == 0 || ring->prefix_unixtime != tlocal->unixtime) {
+        int const res = snprintf (ring->prefix, sizeof (ring->prefix),
+                                  "%d/%02d/%02d %02d:%02d:%02d.",
+                                  tlocal->localtime.tm_year + 1900, tlocal->localtime.tm_mon + 1, tlocal->localtime.tm_mday,
+                                  tlocal->localtime.tm_hour, tlocal->localtime.tm_min, tlocal->localtime.tm_sec);
+        ring->prefix_len = (res > 0 && (Size) res < sizeof (ring->prefix) ? (Size) res : 0);
+        ring->prefix_unixtime = tlocal->unixtime;
+    }
+
+    memcpy (ring->line.buf, ring->prefix, ring->prefix_len);
+    ring->line.len = ring->prefix_len;
+
+    Format fmt_frac;
+    fmt_frac.min_digits = 4;
+    ring->line.print_ (tlocal->time_log_frac, fmt_frac);
+    ring->line.print_ (loglevel_str);
+
+    return &ring->line;
+}
+
+void _libMary_log_async_end ()
+{
+    LogRing * const ring = libMary_getThreadLocal()->log_ring;
+
+    ring->line.buf [ring->line.len] = '\n';
+    ringCommit (ring, ring->line.buf, ring->line.len + 1);
+
+    ring->in_line = false;
+}
+
+void _libMary_log_sync_lock ()
+{
+    rings_mutex.lock ();
+    logLock ();
+
+    // The flusher can't be draining the ring while we're holding rings_mutex.
+    if (LogRing * const ring = libMary_getThreadLocal()->log_ring) {
+        exc_push_scope ();
+        drainRing (ring);
+        exc_pop_scope ();
+    }
+}
+
+void _libMary_log_sync_unlock ()
+{
+    logUnlock ();
+    rings_mutex.unlock ();
+}
+
+void libMary_releaseLogRing (LibMary_ThreadLocal * const mt_nonnull tlocal)
+{
+    LogRing * const ring = tlocal->log_ring;
+    if (!ring)
+        return;
+
+    tlocal->log_ring = NULL;
+
+    rings_mutex.lock ();
+    ring->orphaned = true;
+    // Otherwise the flusher writes out and deletes the ring.
+    if (!flusher_running)
+        flushRings ();
+    rings_mutex.unlock ();
+}
+
+mt_throws Result startAsyncLogging (Size const ring_size)
+{
+    assert (!flusher_thread);
+
+    // Powers of two only, and enough for a couple of the longest lines.
+    Size size = 2 * LIBMARY__LOG_LINE_MAX;
+    while (size < ring_size)
+        size <<= 1;
+
+    log_ring_size = size;
+    flusher_stop.set (0);
+
+    Thread * const thread = new (std::nothrow) Thread (
+            CbDesc<Thread::ThreadFunc> (flusherThreadFunc, NULL /* cb_data */, NULL /* coderef_container */));
+    assert (thread);
+
+    rings_mutex.lock ();
+    flusher_running = true;
+    rings_mutex.unlock ();
+
+    if (!thread->spawn (true /* joinable */)) {
+        logE_ (_func, "could not spawn the log flusher thread: ", exc->toString());
+
+        rings_mutex.lock ();
+        flusher_running = false;
+        rings_mutex.unlock ();
+
+        thread->unref ();
+        return Result::Failure;
+    }
+
+    flusher_thread = thread;
+    _libMary_log_async.set (1);
+
+    return Result::Success;
+}
+
+void stopAsyncLogging ()
+{
+    if (!flusher_thread)
+        return;
+
+    _libMary_log_async.set (0);
+
+    flusher_stop.set (1);
+    flusher_thread->join ();
+    flusher_thread->unref ();
+    flusher_thread = NULL;
+
+    rings_mutex.lock ();
+    flusher_running = false;
+    flushRings ();
+    rings_mutex.unlock ();
+}
+
+}
@@ -25,6 +25,7 @@
 #include <cstdio>
 
 #include <libmary/exception.h>
+#include <libmary/atomic.h>
 #include <libmary/mutex.h>
 #include <libmary/output_stream.h>
 #include <libmary/util_time.h>
@@ -184,9 +185,80 @@ void _libMary_log_unlocked (char const * const loglevel_str, Args const &...args
     exc_pop_scope ();
 }
 
+// Asynchronous logging: every thread formats its lines into a ring buffer of
+// its own without taking _libMary_log_mutex, and a flusher thread writes
+// the rings to 'logs'. If a ring is full, the line is dropped and counted,
+// the number of dropped lines is reported in the log by the flusher.
+// Lines of different threads may come out of order within a flush interval.
+// Lines of Error level and above are written synchronously, after the lines
+// which the calling thread has buffered, so that they get to the log before
+// a following abort().
+// *_unlocked() log functions always write to 'logs' directly.
+extern AtomicInt _libMary_log_async;
+
+static inline void _libMary_do_log_to (OutputStream * const mt_nonnull /* outs */,
+                                       Format const & /* fmt */)
+{
+  // No-op
+}
+
+template <class T, class ...Args>
+void _libMary_do_log_to (OutputStream * const mt_nonnull outs, Format const &fmt, T const &value, Args const &...args)
+{
+    outs->print_ (value, fmt);
+    _libMary_do_log_to (outs, fmt, args...);
+}
+
+template <class ...Args>
+void _libMary_do_log_to (OutputStream * const mt_nonnull outs, Format const & /* fmt */, Format const &new_fmt, Args const &...args)
+{
+    _libMary_do_log_to (outs, new_fmt, args...);
+}
+
+// Starts a line in the ring of the calling thread, with the time and
+// loglevel already printed. Returns NULL if the line should go to 'logs'
+// the usual way.
+OutputStream* _libMary_log_async_begin (char const *loglevel_str);
+
+void _libMary_log_async_end ();
+
+// Takes the log lock after writing out the ring of the calling thread.
+void _libMary_log_sync_lock ();
+
+void _libMary_log_sync_unlock ();
+
 template <class ...Args>
 void _libMary_log (char const * const loglevel_str, Args const &...args)
 {
+    if (_libMary_log_async.get()) {
+        exc_push_scope ();
+
+        if (OutputStream * const line_outs = _libMary_log_async_begin (loglevel_str)) {
+            _libMary_do_log_to (line_outs, fmt_def, args...);
+            _libMary_log_async_end ();
+
+            exc_pop_scope ();
+            return;
+        }
+
+        exc_pop_scope ();
+    }
+
+    logLock ();
+    _libMary_log_unlocked (loglevel_str, args...);
+    logUnlock ();
+}
+
+template <class ...Args>
+void _libMary_log_sync (char const * const loglevel_str, Args const &...args)
+{
+    if (_libMary_log_async.get()) {
+        _libMary_log_sync_lock ();
+        _libMary_log_unlocked (loglevel_str, args...);
+        _libMary_log_sync_unlock ();
+        return;
+    }
+
     logLock ();
     _libMary_log_unlocked (loglevel_str, args...);
     logUnlock ();
@@ -216,6 +288,19 @@ extern char const _libMary_loglevel_str_N [4];
 	    }										\
 	} while (0)
 
+// For loglevels which are not known at compile time.
+#define _libMary_log_macro_l(group, loglevel, ...)					\
+	do {										\
+	    if (mt_unlikely ((loglevel) >= libMary_logGroup_ ## group .getLogLevel() &&	\
+			     (loglevel) >= libMary_globalLogLevel))			\
+	    {										\
+		if ((loglevel) >= LogLevel::E)						\
+		    _libMary_log_sync (" ", LogLevel (loglevel).toCompactCstr(), " ", __VA_ARGS__); \
+		else									\
+		    _libMary_log (" ", LogLevel (loglevel).toCompactCstr(), " ", __VA_ARGS__); \
+	    }										\
+	} while (0)
+
 #define _libMary_log_macro_s(log_func, group, loglevel, loglevel_str, ...)		\
 	do {										\
 	    if (mt_unlikely ((loglevel) >= libMary_logGroup_ ## group .getLogLevel() &&	\
@@ -229,9 +314,9 @@ extern char const _libMary_loglevel_str_N [4];
 #define log_unlocked__(...) _libMary_log_macro_s (_libMary_log_unlocked, default, LogLevel::None, _libMary_loglevel_str_N, __VA_ARGS__)
 
 // log() macro would conflict with log() library function definition
-#define log_plain(group, loglevel, ...)          _libMary_log_macro (_libMary_log,          group,   (loglevel), __VA_ARGS__)
+#define log_plain(group, loglevel, ...)          _libMary_log_macro_l (                      group,   (loglevel), __VA_ARGS__)
 #define log_unlocked(group, loglevel, ...) _libMary_log_macro (_libMary_log_unlocked, group,   (loglevel), __VA_ARGS__)
-#define log_(loglevel, ...)                _libMary_log_macro (_libMary_log,          default, (loglevel), __VA_ARGS__)
+#define log_(loglevel, ...)                _libMary_log_macro_l (                      default, (loglevel), __VA_ARGS__)
 #define log_unlocked_(loglevel, ...)       _libMary_log_macro (_libMary_log_unlocked, default, (loglevel), __VA_ARGS__)
 
 #define logS(group, ...)          _libMary_log_macro_s (_libMary_log,          group,   LogLevel::S, _libMary_loglevel_str_S, __VA_ARGS__)
@@ -259,19 +344,19 @@ extern char const _libMary_loglevel_str_N [4];
 #define logA_(...)                _libMary_log_macro_s (_libMary_log,          default, LogLevel::A, _libMary_loglevel_str_A, __VA_ARGS__)
 #define logA_unlocked_(...)       _libMary_log_macro_s (_libMary_log_unlocked, default, LogLevel::A, _libMary_loglevel_str_A, __VA_ARGS__)
 
-#define logE(group, ...)          _libMary_log_macro_s (_libMary_log,          group,   LogLevel::E, _libMary_loglevel_str_E, __VA_ARGS__)
+#define logE(group, ...)          _libMary_log_macro_s (_libMary_log_sync,     group,   LogLevel::E, _libMary_loglevel_str_E, __VA_ARGS__)
 #define logE_unlocked(group, ...) _libMary_log_macro_s (_libMary_log_unlocked, group,   LogLevel::E, _libMary_loglevel_str_E, __VA_ARGS__)
-#define logE_(...)                _libMary_log_macro_s (_libMary_log,          default, LogLevel::E, _libMary_loglevel_str_E, __VA_ARGS__)
+#define logE_(...)                _libMary_log_macro_s (_libMary_log_sync,     default, LogLevel::E, _libMary_loglevel_str_E, __VA_ARGS__)
 #define logE_unlocked_(...)       _libMary_log_macro_s (_libMary_log_unlocked, default, LogLevel::E, _libMary_loglevel_str_E, __VA_ARGS__)
 
-#define logH(group, ...)          _libMary_log_macro_s (_libMary_log,          group,   LogLevel::H, _libMary_loglevel_str_H, __VA_ARGS__)
+#define logH(group, ...)          _libMary_log_macro_s (_libMary_log_sync,     group,   LogLevel::H, _libMary_loglevel_str_H, __VA_ARGS__)
 #define logH_unlocked(group, ...) _libMary_log_macro_s (_libMary_log_unlocked, group,   LogLevel::H, _libMary_loglevel_str_H, __VA_ARGS__)
-#define logH_(...)                _libMary_log_macro_s (_libMary_log,          default, LogLevel::H, _libMary_loglevel_str_H, __VA_ARGS__)
+#define logH_(...)                _libMary_log_macro_s (_libMary_log_sync,     default, LogLevel::H, _libMary_loglevel_str_H, __VA_ARGS__)
 #define logH_unlocked_(...)       _libMary_log_macro_s (_libMary_log_unlocked, default, LogLevel::H, _libMary_loglevel_str_H, __VA_ARGS__)
 
-#define logF(group, ...)          _libMary_log_macro_s (_libMary_log,          group,   LogLevel::F, _libMary_loglevel_str_F, __VA_ARGS__)
+#define logF(group, ...)          _libMary_log_macro_s (_libMary_log_sync,     group,   LogLevel::F, _libMary_loglevel_str_F, __VA_ARGS__)
 #define logF_unlocked(group, ...) _libMary_log_macro_s (_libMary_log_unlocked, group,   LogLevel::F, _libMary_loglevel_str_F, __VA_ARGS__)
-#define logF_(...)                _libMary_log_macro_s (_libMary_log,          default, LogLevel::F, _libMary_loglevel_str_F, __VA_ARGS__)
+#define logF_(...)                _libMary_log_macro_s (_libMary_log_sync,     default, LogLevel::F, _libMary_loglevel_str_F, __VA_ARGS__)
 #define logF_unlocked_(...)       _libMary_log_macro_s (_libMary_log_unlocked, default, LogLevel::F, _libMary_loglevel_str_F, __VA_ARGS__)
 
 typedef void (*LogStreamReleaseCallback) (void *cb_data);
@@ -281,6 +366,18 @@ void setLogStream (OutputStream             *new_logs,
                    void                     *new_logs_release_cb_data,
                    bool                      add_buffered_stream);
 
+// Starts the flusher thread and switches log macros to per-thread rings
+// of 'ring_size' bytes. Should be called once, after setLogStream().
+mt_throws Result startAsyncLogging (Size ring_size);
+
+// Writes out the rings and switches back to synchronous logging.
+void stopAsyncLogging ();
+
+class LibMary_ThreadLocal;
+
+// Called when a thread exits. Its buffered lines are written out first.
+void libMary_releaseLogRing (LibMary_ThreadLocal * mt_nonnull tlocal);
+
 }
 
 
@@ -60,6 +60,9 @@ public:
 
     mt_throws Result close (bool flush_data = true);
 
+#if defined (LIBMARY_ENABLE_MWRITEV) || defined (LIBMARY_ENABLE_URING)
+    int getFd () { return -1; }
+#endif
   mt_iface_end
 
     MemoryFile (Memory mem);
@@ -64,7 +64,7 @@ public:
     // Resets fd so that it won't be closed in the destructor.
     void resetFd ();
 
-#ifdef LIBMARY_ENABLE_MWRITEV
+#if defined (LIBMARY_ENABLE_MWRITEV) || defined (LIBMARY_ENABLE_URING)
     int getFd () { return fd; }
 #endif
 
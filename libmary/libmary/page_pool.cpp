@@ -23,6 +23,7 @@
 
 #include <libmary/log.h>
 #include <libmary/util_dev.h>
+#include <libmary/libmary_thread_local.h>
 
 #include <libmary/page_pool.h>
 
@@ -122,36 +123,178 @@ PagePool::PageListArray::set (Size const offset,
     doGetSet (offset, NULL /* data_get */, mem.mem() /* data_set */, mem.len(), false /* get */);
 }
 
-mt_mutex (mutex) PagePool::Page*
-PagePool::grabPage ()
+// Lock order: page_pool_caches_mutex -> PagePool::mutex.
+// Protects PagePool::first_thread_cache lists and PagePool_ThreadCache::page_pool.
+static Mutex page_pool_caches_mutex;
+
+static void deletePage (PagePool::Page * const page)
 {
-    Page *page;
-    if (!first_spare_page) {
-        // Default page refcount is 1.
-        page = new (new (std::nothrow) Byte [sizeof (Page) + page_size]) Page;
-        assert (page);
+    page->~Page();
+    delete[] (Byte*) page;
+}
+
+PagePool_ThreadCache*
+PagePool::getThreadCache ()
+{
+    LibMary_ThreadLocal * const tlocal = libMary_getThreadLocal();
 
-        logD (pool, _func, "new page 0x", fmt_hex, (UintPtr) page);
+    {
+        PagePool_ThreadCache *cache = tlocal->page_pool_caches;
+        while (cache) {
+            if (cache->page_pool == this)
+                return cache;
 
-        ++num_pages;
-    } else {
-        page = first_spare_page;
+            cache = cache->next_in_thread;
+        }
+    }
+
+    PagePool_ThreadCache * const cache = new (std::nothrow) PagePool_ThreadCache (this);
+    assert (cache);
+
+    cache->next_in_thread = tlocal->page_pool_caches;
+    tlocal->page_pool_caches = cache;
+
+    page_pool_caches_mutex.lock ();
+    cache->next_in_pool = first_thread_cache;
+    first_thread_cache = cache;
+    page_pool_caches_mutex.unlock ();
+
+    logD (pool, _func, "new thread cache 0x", fmt_hex, (UintPtr) cache);
+
+    return cache;
+}
+
+void
+PagePool::refillThreadCache (PagePool_ThreadCache * const mt_nonnull cache)
+{
+    Page *first_page = NULL;
+    Count num_got = 0;
+
+    mutex.lock ();
+    while (first_spare_page && num_got < thread_cache_batch) {
+        Page * const page = first_spare_page;
         first_spare_page = first_spare_page->next_pool_page;
 
-        pageRef (page);
+        page->next_pool_page = first_page;
+        first_page = page;
+        ++num_got;
+    }
+    assert (num_spare_pages >= num_got);
+    num_spare_pages -= num_got;
 
-        logD (pool, _func, "spare page 0x", fmt_hex, (UintPtr) page);
+    Count const num_new = thread_cache_batch - num_got;
+    num_pages += num_new;
+    mutex.unlock ();
 
-        assert (stats.num_spare_pages > 0);
-        --stats.num_spare_pages;
+    // New pages are allocated with the mutex unlocked.
+    for (Count i = 0; i < num_new; ++i) {
+        Page * const page =
+                new (new (std::nothrow) Byte [sizeof (Page) + page_size]) Page (0);
+        assert (page);
+
+        page->next_pool_page = first_page;
+        first_page = page;
     }
 
+    logD (pool, _func, "spare: ", num_got, ", new: ", num_new);
+
+    cache->first_spare_page = first_page;
+    cache->num_spare_pages.add ((int) thread_cache_batch);
+}
+
+PagePool::Page*
+PagePool::grabPage (PagePool_ThreadCache * const mt_nonnull cache)
+{
+    if (!cache->first_spare_page)
+        refillThreadCache (cache);
+
+    Page * const page = cache->first_spare_page;
+    cache->first_spare_page = page->next_pool_page;
+
+    cache->num_spare_pages.dec ();
+    cache->num_busy_pages.inc ();
+
+    // Spare pages have zero refcount.
+    page->refcount.set (1);
     page->next_msg_page = NULL;
 
-    ++stats.num_busy_pages;
     return page;
 }
 
+void
+PagePool::flushThreadCache (PagePool_ThreadCache * const mt_nonnull cache,
+                            Count const num_to_flush)
+{
+    Page *first_page = NULL;
+    Count num_flushed = 0;
+    while (cache->first_spare_page && num_flushed < num_to_flush) {
+        Page * const page = cache->first_spare_page;
+        cache->first_spare_page = page->next_pool_page;
+
+        page->next_pool_page = first_page;
+        first_page = page;
+        ++num_flushed;
+    }
+    cache->num_spare_pages.add (- (int) num_flushed);
+
+    if (!first_page)
+        return;
+
+    Page *to_free = NULL;
+    Count num_freed = 0;
+
+    mutex.lock ();
+    {
+        Page *page = first_page;
+        while (page) {
+            Page * const next_page = page->next_pool_page;
+
+            if (num_spare_pages < min_pages) {
+                page->next_pool_page = first_spare_page;
+                first_spare_page = page;
+                ++num_spare_pages;
+            } else {
+                page->next_pool_page = to_free;
+                to_free = page;
+                ++num_freed;
+            }
+
+            page = next_page;
+        }
+    }
+
+    assert (num_pages >= num_freed);
+    num_pages -= num_freed;
+    mutex.unlock ();
+
+    logD (pool, _func, "flushed: ", num_flushed, ", freed: ", num_freed);
+
+    while (to_free) {
+        Page * const next_page = to_free->next_pool_page;
+        deletePage (to_free);
+        to_free = next_page;
+    }
+}
+
+void
+PagePool::releasePages (PagePool_ThreadCache * const mt_nonnull cache,
+                        Page  * const first_page,
+                        Page  * const last_page,
+                        Count   const num_released)
+{
+    if (!first_page)
+        return;
+
+    last_page->next_pool_page = cache->first_spare_page;
+    cache->first_spare_page = first_page;
+
+    cache->num_spare_pages.add ((int) num_released);
+    cache->num_busy_pages.add (- (int) num_released);
+
+    if ((Count) cache->num_spare_pages.get() > thread_cache_max)
+        flushThreadCache (cache, (Count) cache->num_spare_pages.get() - thread_cache_batch);
+}
+
 void
 PagePool::doGetPages (PageListHead * const mt_nonnull page_list,
 		      ConstMemory    const &mem,
@@ -181,14 +324,9 @@ PagePool::doGetPages (PageListHead * const mt_nonnull page_list,
     if (cur_data_len == 0)
         return;
 
-    mutex.lock ();
+    PagePool_ThreadCache * const cache = getThreadCache ();
     while (cur_data_len > 0) {
-        // TODO Grab all pages with mutex locked, then unlock the mutex, then do memcpy.
-        //      Don't forget about proper synchronization for memcpy.
-        //
-        //      It'd also be better to decide how many pages are needed and malloc them
-        //      in advance before locking 'mutex' (bulk grab).
-	Page * const page = grabPage ();
+	Page * const page = grabPage (cache);
 	{
 	  // Dealing with the linked list.
 
@@ -210,7 +348,6 @@ PagePool::doGetPages (PageListHead * const mt_nonnull page_list,
 	cur_data += tocopy;
 	cur_data_len -= tocopy;
     }
-    mutex.unlock ();
 }
 
 void
@@ -261,9 +398,9 @@ PagePool::getFillPagesFromPages (PageListHead * const mt_nonnull page_list,
     if (from_len == 0)
         return;
 
-    mutex.lock ();
+    PagePool_ThreadCache * const cache = getThreadCache ();
     while (from_len > 0) {
-        Page * const page = grabPage ();
+        Page * const page = grabPage (cache);
 	{
 	  // Dealing with the linked list.
 
@@ -294,7 +431,6 @@ PagePool::getFillPagesFromPages (PageListHead * const mt_nonnull page_list,
             from_offset = 0;
         }
     }
-    mutex.unlock ();
 }
 
 void
@@ -319,31 +455,7 @@ PagePool::pageUnref (Page * const mt_nonnull page)
     if (!page->refcount.decAndTest ())
 	return;
 
-    mutex.lock ();
-
-    assert (stats.num_busy_pages > 0);
-    --stats.num_busy_pages;
-
-    if (stats.num_spare_pages < min_pages) {
-	logD (pool, _func, "num_pages: ", num_pages, ", spare page 0x", fmt_hex, (UintPtr) page);
-
-	page->next_pool_page = first_spare_page;
-	first_spare_page = page;
-	++stats.num_spare_pages;
-    } else {
-	logD (pool, _func, "num_pages: ", num_pages, ", freeing page 0x", fmt_hex, (UintPtr) page);
-
-	assert (num_pages > 0);
-	--num_pages;
-	mutex.unlock ();
-
-	page->~Page();
-	delete[] (Byte*) page;
-
-	return;
-    }
-
-    mutex.unlock ();
+    releasePages (getThreadCache (), page, page, 1 /* num_released */);
 }
 
 void
@@ -364,13 +476,29 @@ PagePool::msgUnref (Page * const first_page)
 {
     logD (pool, _func_);
 
+    // Released pages are collected first and then put into the magazine at once.
+    Page *released_first = NULL;
+    Page *released_last  = NULL;
+    Count num_released = 0;
+
     Page *cur_page = first_page;
     while (cur_page) {
 	Page * const next_page = cur_page->next_msg_page;
-        // TODO bulk unref (single lock)
-	pageUnref (cur_page);
+
+        if (cur_page->refcount.decAndTest ()) {
+            cur_page->next_pool_page = released_first;
+            if (!released_first)
+                released_last = cur_page;
+
+            released_first = cur_page;
+            ++num_released;
+        }
+
 	cur_page = next_page;
     }
+
+    if (released_first)
+        releasePages (getThreadCache (), released_first, released_last, num_released);
 }
 
 void
@@ -380,7 +508,7 @@ PagePool::setMinPages (Count const min_pages)
 
     this->min_pages = min_pages;
 
-    while (stats.num_spare_pages < min_pages) {
+    while (num_spare_pages < min_pages) {
         Page * const page =
                 new (new (std::nothrow) Byte [sizeof (Page) + page_size]) Page (0);
         assert (page);
@@ -388,21 +516,20 @@ PagePool::setMinPages (Count const min_pages)
         page->next_pool_page = first_spare_page;
         first_spare_page = page;
 
-        ++stats.num_spare_pages;
+        ++num_spare_pages;
         ++num_pages;
     }
 
-    while (stats.num_spare_pages > min_pages) {
+    while (num_spare_pages > min_pages) {
         assert (first_spare_page && num_pages);
 
         Page * const page = first_spare_page;
         first_spare_page = first_spare_page->next_pool_page;
 
-        page->~Page();
-        delete[] (Byte*) page;
+        deletePage (page);
 
-        assert (stats.num_spare_pages > 0);
-        --stats.num_spare_pages;
+        assert (num_spare_pages > 0);
+        --num_spare_pages;
         --num_pages;
     }
 
@@ -413,10 +540,12 @@ PagePool::PagePool (Object * const coderef_container,
                     Size     const page_size,
 		    Count    const min_pages)
     : DependentCodeReferenced (coderef_container),
-      page_size (page_size),
-      min_pages (min_pages),
-      num_pages (min_pages),
-      first_spare_page (NULL)
+      page_size          (page_size),
+      min_pages          (min_pages),
+      num_pages          (min_pages),
+      num_spare_pages    (min_pages),
+      first_spare_page   (NULL),
+      first_thread_cache (NULL)
 {
     Page *prv_page = NULL;
     for (Count i = 0; i < min_pages; ++i) {
@@ -436,32 +565,121 @@ PagePool::PagePool (Object * const coderef_container,
     }
     if (prv_page)
 	prv_page->next_pool_page = NULL;
-
-    stats.num_busy_pages = 0;
-    stats.num_spare_pages = min_pages;
 }
 
 PagePool::~PagePool ()
 {
+    page_pool_caches_mutex.lock ();
     mutex.lock ();
 
-    if (stats.num_busy_pages) {
-	logW_ (_func, stats.num_busy_pages, " busy pages lost");
+    // The pool is not used by any thread at this point, so spare pages
+    // can be taken from the magazines of other threads directly.
+    {
+        PagePool_ThreadCache *cache = first_thread_cache;
+        while (cache) {
+            PagePool_ThreadCache * const next_cache = cache->next_in_pool;
+
+            Page *page = cache->first_spare_page;
+            while (page) {
+                Page * const next_page = page->next_pool_page;
+
+                page->next_pool_page = first_spare_page;
+                first_spare_page = page;
+                ++num_spare_pages;
+
+                page = next_page;
+            }
+
+            cache->first_spare_page = NULL;
+            cache->num_spare_pages.set (0);
+            cache->page_pool = NULL;
+            cache->next_in_pool = NULL;
+
+            cache = next_cache;
+        }
+        first_thread_cache = NULL;
+    }
+
+    page_pool_caches_mutex.unlock ();
+
+    assert (num_pages >= num_spare_pages);
+    if (num_pages > num_spare_pages) {
+	logW_ (_func, num_pages - num_spare_pages, " busy pages lost");
 	// Not freeing any pages (debugging mode).
+        mutex.unlock ();
 	return;
     }
 
     Page *cur_page = first_spare_page;
     while (cur_page) {
 	Page * const next_page = cur_page->next_pool_page;
+        deletePage (cur_page);
+	cur_page = next_page;
+    }
 
-	cur_page->~Page();
-	delete[] (Byte*) cur_page;
+    mutex.unlock ();
+}
 
-	cur_page = next_page;
+void
+PagePool::getStats (Statistics             * const mt_nonnull ret_stats,
+                    List<ThreadStatistics> * const ret_thread_stats)
+{
+    Count num_cached_pages = 0;
+
+    page_pool_caches_mutex.lock ();
+    {
+        PagePool_ThreadCache *cache = first_thread_cache;
+        while (cache) {
+            int const cache_num_spare = cache->num_spare_pages.get();
+            // Changes of the counters by the owning thread are not atomic
+            // as a whole, hence the check.
+            if (cache_num_spare > 0)
+                num_cached_pages += (Count) cache_num_spare;
+
+            if (ret_thread_stats) {
+                ThreadStatistics * const thread_stats = &ret_thread_stats->appendEmpty()->data;
+                thread_stats->num_spare_pages = (cache_num_spare > 0 ? (Count) cache_num_spare : 0);
+                thread_stats->num_busy_pages  = (Int64) cache->num_busy_pages.get();
+            }
+
+            cache = cache->next_in_pool;
+        }
     }
 
+    mutex.lock ();
+    ret_stats->num_spare_pages = num_spare_pages + num_cached_pages;
+    ret_stats->num_busy_pages  =
+            (num_pages > ret_stats->num_spare_pages ? num_pages - ret_stats->num_spare_pages : 0);
     mutex.unlock ();
+
+    page_pool_caches_mutex.unlock ();
+}
+
+void
+PagePool::releaseThreadCaches (LibMary_ThreadLocal * const mt_nonnull tlocal)
+{
+    PagePool_ThreadCache *cache = tlocal->page_pool_caches;
+    tlocal->page_pool_caches = NULL;
+
+    while (cache) {
+        PagePool_ThreadCache * const next_cache = cache->next_in_thread;
+
+        page_pool_caches_mutex.lock ();
+        if (PagePool * const page_pool = cache->page_pool) {
+            page_pool->flushThreadCache (cache, Count_Max);
+
+            PagePool_ThreadCache **prv_next = &page_pool->first_thread_cache;
+            while (*prv_next != cache) {
+                assert (*prv_next);
+                prv_next = &(*prv_next)->next_in_pool;
+            }
+            *prv_next = cache->next_in_pool;
+        }
+        page_pool_caches_mutex.unlock ();
+
+        delete cache;
+        cache = next_cache;
+    }
 }
 
 void
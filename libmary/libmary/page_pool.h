@@ -25,14 +25,22 @@
 #include <libmary/array.h>
 #include <libmary/atomic.h>
 #include <libmary/mutex.h>
+#include <libmary/list.h>
 #include <libmary/output_stream.h>
 
 
 namespace M {
 
-// TODO Per-thread page pools. When a page is released in a given thread,
-//      it is put into page pool of that thread, which may be different
-//      from the one we took the page from.
+class LibMary_ThreadLocal;
+class PagePool_ThreadCache;
+
+// Every thread which grabs or releases pages has its own cache of spare pages
+// for each PagePool ("magazine"). Pages are taken from and returned to
+// the magazine without locking. The central pool is only locked to refill
+// an empty magazine or to take back a batch of pages from a full one.
+// When a page is released in a given thread, it is put into the magazine
+// of that thread, which may be different from the one we took the page from.
+// Such pages are routed back to the central pool in bulk.
 
 // TODO PagePool should be referenced while there's any referenced page.
 //      This also means that PagePools should be independent objects,
@@ -240,23 +248,52 @@ public:
 	Count num_busy_pages;
     };
 
+    struct ThreadStatistics
+    {
+        Count num_spare_pages;
+        // Pages grabbed minus pages released in the thread. Negative for
+        // threads which mostly release pages grabbed by other threads.
+        Int64 num_busy_pages;
+    };
+
 private:
+    friend class PagePool_ThreadCache;
+
+    // Number of pages moved between a magazine and the central pool at once.
+    static Count const thread_cache_batch = 32;
+    // A magazine holding more spare pages than this gives a batch back.
+    static Count const thread_cache_max = 2 * thread_cache_batch;
+
     mt_const Size const page_size;
-    mt_const Count min_pages;
+    mt_mutex (mutex) Count min_pages;
+
+    mt_mutex (mutex) Count num_pages;
+    mt_mutex (mutex) Count num_spare_pages;
 
-    Count num_pages;
+    mt_mutex (mutex) Page *first_spare_page;
 
-    Page *first_spare_page;
+    // Protected by the global page_pool_caches_mutex.
+    PagePool_ThreadCache *first_thread_cache;
 
-    mt_mutex (mutex) Page* grabPage ();
+    PagePool_ThreadCache* getThreadCache ();
+
+    Page* grabPage (PagePool_ThreadCache * mt_nonnull cache);
+
+    void refillThreadCache (PagePool_ThreadCache * mt_nonnull cache);
+
+    void releasePages (PagePool_ThreadCache * mt_nonnull cache,
+                       Page  *first_page,
+                       Page  *last_page,
+                       Count  num_released);
+
+    void flushThreadCache (PagePool_ThreadCache * mt_nonnull cache,
+                           Count num_to_flush);
 
     void doGetPages (PageListHead * mt_nonnull page_list,
 		     ConstMemory const &mem,
 		     bool fill);
 
 public:
-    Statistics stats;
-
     Size getPageSize () const { return page_size; }
 
     void getFillPages (PageListHead * mt_nonnull page_list,
@@ -284,6 +321,10 @@ public:
 	pl_outs.print (args...);
     }
 
+    // Totals include pages in per-thread magazines. 'ret_thread_stats' may be NULL.
+    void getStats (Statistics             * mt_nonnull ret_stats,
+                   List<ThreadStatistics> *ret_thread_stats);
+
     void setMinPages (Count min_pages);
 
     PagePool (Object *coderef_container,
@@ -292,6 +333,9 @@ public:
 
     ~PagePool ();
 
+    // Returns the pages cached by an exiting thread to their pools.
+    static void releaseThreadCaches (LibMary_ThreadLocal * mt_nonnull tlocal);
+
     static void dumpPages (OutputStream * mt_nonnull outs,
                            PageListHead * mt_nonnull page_list,
                            Size          first_page_offs = 0);
@@ -340,6 +384,35 @@ public:
     }
 };
 
+// Spare pages of a PagePool owned by a single thread.
+class PagePool_ThreadCache
+{
+    friend class PagePool;
+
+private:
+    // NULL after the pool has been destroyed.
+    PagePool *page_pool;
+
+    PagePool_ThreadCache *next_in_thread;
+    PagePool_ThreadCache *next_in_pool;
+
+    PagePool::Page *first_spare_page;
+
+    // Written by the owning thread only, read by PagePool::getStats().
+    AtomicInt num_spare_pages;
+    AtomicInt num_busy_pages;
+
+    PagePool_ThreadCache (PagePool * const page_pool)
+        : page_pool        (page_pool),
+          next_in_thread   (NULL),
+          next_in_pool     (NULL),
+          first_spare_page (NULL),
+          num_spare_pages  (0),
+          num_busy_pages   (0)
+    {
+    }
+};
+
 }
 
 
@@ -123,6 +123,10 @@ public:
 
     virtual void eventsUnsubscribe (EventSubscriptionKey /* sbn_key */) {}
 
+    // Number of pollables currently in the group. Used as a load estimate
+    // when choosing a thread for a new connection, hence may be approximate.
+    virtual Count getNumPollables () { return 0; }
+
     virtual ~PollGroup () {}
 };
 
@@ -103,6 +103,7 @@ PollPollGroup::addPollable (CbDesc<Pollable> const &pollable,
 	inactive_pollable_list.append (pollable_entry);
 
     ++num_pollables;
+    pollable_count.inc ();
 
     if (activate
 	&& !(poll_tlocal && poll_tlocal == libMary_getThreadLocal()))
@@ -149,6 +150,7 @@ PollPollGroup::removePollable (PollableKey const mt_nonnull key)
 
     pollable_entry->unref ();
     --num_pollables;
+    pollable_count.dec ();
 
     mutex.unlock ();
 }
@@ -127,6 +127,8 @@ SelectPollGroup::addPollable (CbDesc<Pollable> const &pollable,
     else
 	inactive_pollable_list.append (pollable_entry);
 
+    pollable_count.inc ();
+
     if (activate
 	&& !(poll_tlocal && poll_tlocal == libMary_getThreadLocal()))
     {
@@ -172,6 +174,7 @@ SelectPollGroup::removePollable (PollableKey const mt_nonnull key)
 	inactive_pollable_list.remove (pollable_entry);
     }
     pollable_entry->unref ();
+    pollable_count.dec ();
     mutex.unlock ();
 }
 
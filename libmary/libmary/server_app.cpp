@@ -46,6 +46,13 @@ ServerApp::SA_ServerContext::selectThreadContext ()
 
   StateMutexLock l (&server_app->mutex);
 
+    if (server_app->load_aware_selection
+        && !server_app->thread_data_list.isEmpty())
+    {
+        return selectLeastLoadedThreadContext (server_app->thread_data_list,
+                                               &server_app->thread_selector);
+    }
+
     if (server_app->thread_selector) {
 	thread_ctx = &server_app->thread_selector->data->thread_ctx;
 	server_app->thread_selector = server_app->thread_selector->next;
@@ -101,6 +108,7 @@ ServerApp::pollIterationBegin (void * const _thread_ctx)
     if (!updateTime ())
 	logE_ (_func, "updateTime() failed: ", exc->toString());
 
+    thread_ctx->loadIterationBegin ();
     thread_ctx->getTimers()->processTimers ();
 }
 
@@ -108,7 +116,9 @@ bool
 ServerApp::pollIterationEnd (void * const _thread_ctx)
 {
     ServerThreadContext * const thread_ctx = static_cast <ServerThreadContext*> (_thread_ctx);
-    return thread_ctx->getDeferredProcessor()->process ();
+    bool const extra_iteration_needed = thread_ctx->getDeferredProcessor()->process ();
+    thread_ctx->loadIterationEnd ();
+    return extra_iteration_needed;
 }
 
 static void deferred_processor_trigger (void * const _active_poll_group)
@@ -271,6 +281,29 @@ ServerApp::stop ()
 #endif
 }
 
+void
+ServerApp::getThreadLoadStats (List<ServerThreadContext::LoadStats> * const mt_nonnull ret_list)
+{
+    {
+        ServerThreadContext::LoadStats stats;
+        main_thread_ctx.getLoadStats (&stats);
+        ret_list->append (stats);
+    }
+
+#ifdef LIBMARY_MT_SAFE
+  StateMutexLock l (&mutex);
+
+    ThreadDataList::iter iter (thread_data_list);
+    while (!thread_data_list.iter_done (iter)) {
+        ThreadData * const thread_data = thread_data_list.iter_next (iter)->data;
+
+        ServerThreadContext::LoadStats stats;
+        thread_data->thread_ctx.getLoadStats (&stats);
+        ret_list->append (stats);
+    }
+#endif
+}
+
 void
 ServerApp::release ()
 {
@@ -300,6 +333,7 @@ ServerApp::ServerApp (Object * const coderef_container,
 #ifdef LIBMARY_MT_SAFE
       , thread_selector (NULL)
 #endif
+      , load_aware_selection (true)
 {
 #ifdef LIBMARY_MT_SAFE
     multi_thread = grab (new MultiThread (
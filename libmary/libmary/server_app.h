@@ -110,6 +110,8 @@ private:
     mt_mutex (mutex) ThreadDataList::Element *thread_selector;
 #endif
 
+    mt_const bool load_aware_selection;
+
     AtomicInt should_stop;
 
     static void informThreadStarted (Events *events,
@@ -155,6 +157,15 @@ public:
 #endif
     }
 
+    // If enabled (the default), selectThreadContext() returns the least
+    // loaded thread instead of the next one in round-robin order.
+    mt_const void setLoadAwareSelection (bool const enable)
+        { load_aware_selection = enable; }
+
+    // Appends load stats of the main thread followed by the ones
+    // of all spawned threads to 'ret_list'.
+    void getThreadLoadStats (List<ServerThreadContext::LoadStats> * mt_nonnull ret_list);
+
     void release ();
 
     ServerApp (Object *coderef_container,
@@ -0,0 +1,124 @@
+/*  LibMary - C++ library for high-performance network servers
+    Copyright (C) 2011-2013 Dmitry Shatrov
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+
+#include <libmary/types.h>
+
+#include <libmary/libmary_thread_local.h>
+#include <libmary/util_time.h>
+#include <libmary/log.h>
+
+#include <libmary/server_context.h>
+
+
+namespace M {
+
+void
+ServerThreadContext::loadIterationBegin ()
+{
+    Time const now = getTimeMicroseconds ();
+
+    if (load_window_start == 0) {
+	load_window_start = now;
+	load_window_start_bytes = libMary_getThreadLocal()->io_bytes;
+    }
+
+    load_iteration_start = now;
+}
+
+void
+ServerThreadContext::loadIterationEnd ()
+{
+    // pollIterationBegin is not called for every poll() return.
+    if (load_iteration_start == 0)
+	return;
+
+    if (!updateTime ())
+	logE_ (_func, "updateTime() failed: ", exc->toString());
+
+    Time const now = getTimeMicroseconds ();
+    if (now > load_iteration_start)
+	load_busy_time += now - load_iteration_start;
+
+    load_iteration_start = 0;
+    ++load_num_iterations;
+
+    if (now < load_window_start + LoadSampleInterval_Microsec)
+	return;
+
+    Time const window = now - load_window_start;
+    Uint64 const cur_bytes = libMary_getThreadLocal()->io_bytes;
+
+    Time busy = load_busy_time * 1000 / window;
+    if (busy > 1000)
+	busy = 1000;
+
+    busy_permille.set ((int) busy);
+    kbytes_per_sec.set ((int) ((cur_bytes - load_window_start_bytes) * 1000 / window / 1024));
+    avg_iteration_microsec.set ((int) (load_busy_time / load_num_iterations));
+    load_sample_time.set ((int) getTime());
+    num_placed.set (0);
+
+    load_window_start = now;
+    load_window_start_bytes = cur_bytes;
+    load_busy_time = 0;
+    load_num_iterations = 0;
+}
+
+bool
+ServerThreadContext::loadSampleIsFresh ()
+{
+    Time const sample_time = (Time) load_sample_time.get();
+    return sample_time != 0 && getTime() <= sample_time + LoadSampleMaxAge_Sec;
+}
+
+void
+ServerThreadContext::getLoadStats (LoadStats * const mt_nonnull ret_stats)
+{
+    ret_stats->num_pollables = poll_group->getNumPollables ();
+
+    if (loadSampleIsFresh ()) {
+	ret_stats->busy_permille          = (Uint32) busy_permille.get();
+	ret_stats->kbytes_per_sec         = (Uint32) kbytes_per_sec.get();
+	ret_stats->avg_iteration_microsec = (Uint32) avg_iteration_microsec.get();
+    } else {
+	ret_stats->busy_permille          = 0;
+	ret_stats->kbytes_per_sec         = 0;
+	ret_stats->avg_iteration_microsec = 0;
+    }
+}
+
+Uint64
+ServerThreadContext::getLoadScore ()
+{
+    Uint64 busy = loadSampleIsFresh () ? (Uint64) busy_permille.get() : 0;
+    // Accounts for connections which have been placed on the thread but
+    // have not been reflected in its busy time yet, so that a burst of
+    // new connections doesn't go to a single thread.
+    busy += (Uint64) num_placed.get() * LoadPlacementCost_Permille;
+
+    Uint64 num_pollables = poll_group->getNumPollables ();
+    if (num_pollables > 0xffffffff)
+	num_pollables = 0xffffffff;
+
+    return ((busy / LoadBusyGranularity_Permille) << 32) | num_pollables;
+}
+
+}
+
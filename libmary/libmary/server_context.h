@@ -31,12 +31,61 @@ namespace M {
 
 class ServerThreadContext : public DependentCodeReferenced
 {
+public:
+    struct LoadStats
+    {
+        Count  num_pollables;
+        // Share of wall-clock time spent processing events rather than
+        // waiting in poll(), in 1/1000 units.
+        Uint32 busy_permille;
+        Uint32 kbytes_per_sec;
+        Uint32 avg_iteration_microsec;
+
+        LoadStats ()
+            : num_pollables (0),
+              busy_permille (0),
+              kbytes_per_sec (0),
+              avg_iteration_microsec (0)
+        {}
+    };
+
 private:
+    enum {
+        LoadSampleInterval_Microsec = 1000000,
+        // Estimated busy time a new connection adds to a thread until
+        // the next load sample accounts for it.
+        LoadPlacementCost_Permille  = 10,
+        // Threads whose busy time differs by less than this are considered
+        // equally busy and are compared by the number of pollables.
+        LoadBusyGranularity_Permille = 50,
+        // Samples older than this are ignored: an idle thread may sleep
+        // in poll() and not update its load for a long time.
+        LoadSampleMaxAge_Sec = 3
+    };
+
     mt_const DataDepRef<Timers>                        timers;
     mt_const DataDepRef<PollGroup>                     poll_group;
     mt_const DataDepRef<DeferredProcessor>             deferred_processor;
     mt_const DataDepRef<DeferredConnectionSenderQueue> dcs_queue;
 
+    // Updated by the thread itself once per LoadSampleInterval_Microsec.
+    AtomicInt busy_permille;
+    AtomicInt kbytes_per_sec;
+    AtomicInt avg_iteration_microsec;
+    // Connections placed on the thread since the last load sample.
+    AtomicInt num_placed;
+    // getTime() of the last sample.
+    AtomicInt load_sample_time;
+
+    // Accessed from the thread's poll iterations only.
+    Time   load_window_start;
+    Time   load_iteration_start;
+    Time   load_busy_time;
+    Count  load_num_iterations;
+    Uint64 load_window_start_bytes;
+
+    bool loadSampleIsFresh ();
+
 public:
     Timers*            getTimers            () const { return timers; }
     PollGroup*         getPollGroup         () const { return poll_group; }
@@ -56,15 +105,68 @@ public:
 	this->dcs_queue          = dcs_queue;
     }
 
+  // Load tracking. loadIterationBegin() and loadIterationEnd() are called
+  // by the owner of the poll group from its ActivePollGroup::Frontend.
+
+    void loadIterationBegin ();
+    void loadIterationEnd ();
+
+    void getLoadStats (LoadStats * mt_nonnull ret_stats);
+
+    // Lower values mean less loaded threads.
+    Uint64 getLoadScore ();
+
+    // Called when the thread is chosen for a new connection.
+    void notifySelected () { num_placed.inc (); }
+
     ServerThreadContext (Object * const coderef_container)
 	: DependentCodeReferenced (coderef_container),
           timers                  (coderef_container),
 	  poll_group              (coderef_container),
 	  deferred_processor      (coderef_container),
-	  dcs_queue               (coderef_container)
+	  dcs_queue               (coderef_container),
+          load_window_start       (0),
+          load_iteration_start    (0),
+          load_busy_time          (0),
+          load_num_iterations     (0),
+          load_window_start_bytes (0)
     {}
 };
 
+// Chooses the least loaded thread of a non-empty 'thread_data_list' for a new
+// connection. The scan starts at '*thread_selector', so that equally loaded
+// threads are still chosen in turns, and '*thread_selector' is advanced past
+// the chosen thread. Shared by ServerApp and FixedThreadPool, whose list
+// elements hold ThreadData objects with a 'thread_ctx' member.
+template <class ThreadDataList>
+ServerThreadContext* selectLeastLoadedThreadContext (ThreadDataList                    &thread_data_list,
+                                                     typename ThreadDataList::Element ** const mt_nonnull thread_selector)
+{
+    typename ThreadDataList::Element *start_el = *thread_selector;
+    if (!start_el)
+        start_el = thread_data_list.getFirstElement();
+
+    typename ThreadDataList::Element *best_el = NULL;
+    Uint64 best_score = 0;
+    typename ThreadDataList::Element *el = start_el;
+    do {
+        Uint64 const score = el->data->thread_ctx.getLoadScore ();
+        if (!best_el || score < best_score) {
+            best_el = el;
+            best_score = score;
+        }
+
+        el = el->next;
+        if (!el)
+            el = thread_data_list.getFirstElement();
+    } while (el != start_el);
+
+    ServerThreadContext * const thread_ctx = &best_el->data->thread_ctx;
+    *thread_selector = best_el->next;
+    thread_ctx->notifySelected ();
+    return thread_ctx;
+}
+
 class ServerContext : public DependentCodeReferenced
 {
 public:
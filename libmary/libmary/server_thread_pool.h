@@ -22,6 +22,7 @@
 
 
 #include <libmary/types.h>
+#include <libmary/list.h>
 #include <libmary/server_context.h>
 
 
@@ -34,6 +35,9 @@ public:
 
     virtual void releaseThreadContext (ServerThreadContext *thread_ctx) = 0;
 
+    // Appends load stats of every thread of the pool to 'ret_list'.
+    virtual void getThreadLoadStats (List<ServerThreadContext::LoadStats> * const mt_nonnull /* ret_list */) {}
+
     virtual ~ServerThreadPool () {}
 };
 
@@ -249,6 +249,8 @@ TcpConnection::read (Memory   const mem,
     if (ret_nread)
 	*ret_nread = (Size) res;
 
+    libMary_getThreadLocal()->io_bytes += (Uint64) res;
+
     if ((Size) res < len) {
 	if (hup_received) {
 	    return AsyncIoResult::Normal_Eof;
@@ -307,6 +309,8 @@ TcpConnection::write (ConstMemory   const mem,
     if (ret_nwritten)
 	*ret_nwritten = (Size) res;
 
+    libMary_getThreadLocal()->io_bytes += (Uint64) res;
+
     return AsyncIoResult::Normal;
 }
 
@@ -382,6 +386,8 @@ TcpConnection::writev (struct iovec * const iovs,
     if (ret_nwritten)
 		*ret_nwritten = (Size) res;
 
+    libMary_getThreadLocal()->io_bytes += (Uint64) res;
+
     logD (tcp_conn, _func_, "we have written ", res, " bytes");
 #ifdef LIBMARY_PERFORMANCE_TESTING
     if (!measurer_ || !checker_) {
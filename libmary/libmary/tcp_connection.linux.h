@@ -103,7 +103,7 @@ public:
     mt_throws Result close ();
 #endif
 
-#ifdef LIBMARY_ENABLE_MWRITEV
+#if defined (LIBMARY_ENABLE_MWRITEV) || defined (LIBMARY_ENABLE_URING)
     int getFd () { return fd; }
 #endif
   mt_iface_end
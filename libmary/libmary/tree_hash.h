@@ -0,0 +1,198 @@
+/*  LibMary - C++ library for high-performance network servers
+    Copyright (C) 2011-2013 Dmitry Shatrov
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+#ifndef LIBMARY__TREE_HASH__H__
+#define LIBMARY__TREE_HASH__H__
+
+
+#include <libmary/types.h>
+#include <libmary/intrusive_list.h>
+#include <libmary/intrusive_avl_tree.h>
+#include <libmary/hash.h>
+
+
+namespace M {
+
+// The former implementation of Hash: a fixed number of cells, each cell
+// is an AVL tree of entries. Lookups degrade to tree searches when there
+// are many more entries than cells. Kept for comparison with Hash.
+template < class T,
+	   class KeyType,
+	   class Extractor = DirectExtractor<T>,
+	   class Comparator = DirectComparator<T>,
+	   class Hasher = DefaultStringHasher,
+	   class HashName = Hash_Default>
+class TreeHash_anybase
+{
+private:
+    class Cell
+    {
+    public:
+	IntrusiveAvlTree< T, Extractor, Comparator, HashName > tree;
+    };
+
+    bool growing;
+
+    Cell *hash_table;
+    Size  hash_size;
+
+    IntrusiveList<T, HashName> node_list;
+
+public:
+    bool isEmpty () const
+    {
+	return node_list.isEmpty();
+    }
+
+    void add (T * const entry)
+    {
+	Uint32 const unrolled_hash = Hasher::hash (Extractor::getValue (entry));
+	Uint32 const hash = unrolled_hash % hash_size;
+
+	entry->unrolled_hash = unrolled_hash;
+	hash_table [hash].tree.add (entry);
+
+	node_list.append (entry);
+
+	// TODO if (growing) ... then grow.
+    }
+
+    void remove (T * const entry)
+    {
+	hash_table [entry->unrolled_hash % hash_size].tree.remove (entry);
+	node_list.remove (entry);
+    }
+
+    void clear ()
+    {
+	node_list.clear ();
+
+	delete[] hash_table;
+	hash_table = new Cell [hash_size];
+    }
+
+    template <class C>
+    T* lookup (C key)
+    {
+	Uint32 const unrolled_hash = Hasher::hash (key);
+	Uint32 const hash = unrolled_hash % hash_size;
+
+	return hash_table [hash].tree.lookup (key);
+    }
+
+    TreeHash_anybase (Size const initial_hash_size,
+		      bool const growing)
+	: growing (growing),
+	  hash_size (initial_hash_size)
+    {
+	hash_table = new Cell [hash_size];
+    }
+
+    ~TreeHash_anybase ()
+    {
+	delete[] hash_table;
+    }
+
+
+  // ________________________________ iterator _________________________________
+
+    class iterator
+    {
+    private:
+	typename IntrusiveList<T, HashName>::iterator node_iter;
+
+    public:
+        iterator (TreeHash_anybase< T, KeyType, Extractor, Comparator, Hasher, HashName > &hash)
+                : node_iter (hash.node_list) {}
+        iterator () {}
+
+        bool operator == (iterator const &iter) const { return node_iter == iter.node_iter; }
+        bool operator != (iterator const &iter) const { return node_iter != iter.node_iter; }
+
+        bool done () const { return node_iter.done(); }
+        T* next () { return node_iter.next(); }
+    };
+
+
+  // __________________________________ iter ___________________________________
+
+    class iter
+    {
+	friend class TreeHash_anybase< T, KeyType, Extractor, Comparator, Hasher, HashName >;
+
+    private:
+	typename IntrusiveList<T, HashName>::iter node_iter;
+
+    public:
+	iter (TreeHash_anybase< T, KeyType, Extractor, Comparator, Hasher, HashName > &hash)
+	    : node_iter (hash.node_list) {}
+	iter () {}
+
+ 	// Methods for C API binding.
+	void *getAsVoidPtr () const { return node_iter.getAsVoidPtr (); }
+	static iter fromVoidPtr (void *ptr)
+	{
+	    iter it;
+	    it.node_iter = IntrusiveList<T, HashName>::iter::fromVoidPtr (ptr);
+	    return it;
+	}
+    };
+
+    void iter_begin (iter &iter) const
+    {
+	node_list.iter_begin (iter.node_iter);
+    }
+
+    T* iter_next (iter &iter) const
+    {
+	return node_list.iter_next (iter.node_iter);
+    }
+
+    bool iter_done (iter &iter) const
+    {
+	return node_list.iter_done (iter.node_iter);
+    }
+
+  // ___________________________________________________________________________
+
+};
+
+template < class T,
+	   class KeyType,
+	   class Extractor = DirectExtractor<T>,
+	   class Comparator = DirectComparator<T>,
+	   class Hasher = DefaultStringHasher,
+	   class HashName = Hash_Default,
+	   class Base = EmptyBase>
+class TreeHash : public TreeHash_anybase< T, KeyType, Extractor, Comparator, Hasher, HashName >,
+		 public Base
+{
+public:
+    TreeHash (Size const initial_hash_size = 16,
+	      bool const growing = true)
+	: TreeHash_anybase< T, KeyType, Extractor, Comparator, Hasher, HashName > (initial_hash_size, growing)
+    {
+    }
+};
+
+}
+
+
+#endif /* LIBMARY__TREE_HASH__H__ */
+
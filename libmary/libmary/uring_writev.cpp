@@ -0,0 +1,448 @@
+/*  LibMary - C++ library for high-performance network servers
+    Copyright (C) 2011 Dmitry Shatrov
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+
+#include <libmary/types.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <libmary/log.h>
+
+#include <libmary/uring_writev.h>
+
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+
+
+namespace M {
+
+static LogGroup libMary_logGroup_uring ("uring_writev", LogLevel::I);
+
+static inline unsigned loadAcquire (unsigned * const ptr)
+{
+    return __atomic_load_n (ptr, __ATOMIC_ACQUIRE);
+}
+
+static inline void storeRelease (unsigned * const ptr,
+                                 unsigned   const value)
+{
+    __atomic_store_n (ptr, value, __ATOMIC_RELEASE);
+}
+
+// Results of the writes which have not completed.
+static int const res_pending = G_MININT;
+
+// Marks completions of cancel requests.
+static Uint64 const cancel_user_data_flag = (Uint64) 1 << 63;
+
+Count
+UringWritev::reapCompletions (Count   const num_fds,
+                              int   * const ret_res,
+                              Count * const ret_num_cancels)
+{
+    struct io_uring_cqe * const cqe_arr = static_cast <struct io_uring_cqe*> (cqes);
+
+    Count num_completed = 0;
+
+    unsigned head = *cq_head;
+    unsigned const cur_tail = loadAcquire (cq_tail);
+    while (head != cur_tail) {
+        struct io_uring_cqe * const cqe = &cqe_arr [head & *cq_mask];
+        if (cqe->user_data & cancel_user_data_flag) {
+            ++*ret_num_cancels;
+        } else {
+            assert (cqe->user_data < num_fds);
+            ret_res [cqe->user_data] = cqe->res;
+            ++num_completed;
+        }
+        ++head;
+    }
+    storeRelease (cq_head, head);
+
+    return num_completed;
+}
+
+mt_throws Result
+UringWritev::submitAndReap (Count   const num_fds,
+                            int   * const fds,
+                            struct iovec ** const iovs,
+                            int   * const num_iovs,
+                            int   * const ret_res,
+                            Count * const ret_num_submitted,
+                            bool  * const ret_nowait_broken)
+{
+    *ret_num_submitted = 0;
+    *ret_nowait_broken = false;
+
+    assert (num_fds <= num_entries);
+
+    struct io_uring_sqe * const sqes = static_cast <struct io_uring_sqe*> (sqes_ptr);
+
+    unsigned tail = *sq_tail;
+    for (Count i = 0; i < num_fds; ++i) {
+        unsigned const idx = tail & *sq_mask;
+
+        struct io_uring_sqe * const sqe = &sqes [idx];
+        memset (sqe, 0, sizeof (*sqe));
+        sqe->opcode    = IORING_OP_WRITEV;
+        sqe->fd        = fds [i];
+        sqe->addr      = (Uint64) (UintPtr) iovs [i];
+        sqe->len       = (Uint32) num_iovs [i];
+        sqe->off       = 0;
+        // Without RWF_NOWAIT, io_uring waits for a socket to become writable
+        // even if it is in non-blocking mode. We want EAGAIN, as with writev().
+        sqe->rw_flags  = RWF_NOWAIT;
+        sqe->user_data = (Uint64) i;
+
+        sq_array [idx] = idx;
+        ++tail;
+
+        ret_res [i] = res_pending;
+    }
+    storeRelease (sq_tail, tail);
+
+    Count num_submitted = 0;
+    while (num_submitted < num_fds) {
+        int const res = syscall (__NR_io_uring_enter,
+                                 ring_fd,
+                                 (unsigned) (num_fds - num_submitted) /* to_submit */,
+                                 (unsigned) 0 /* min_complete */,
+                                 (unsigned) 0 /* flags */,
+                                 (void*) NULL /* sig */,
+                                 (Size) 0);
+        if (res == -1 && errno == EINTR)
+            continue;
+
+        if (res <= 0) {
+            exc_throw (PosixException, res == -1 ? errno : EAGAIN);
+            logE_ (_func, "io_uring_enter() failed: ", exc->toString());
+
+            return Result::Failure;
+        }
+
+        num_submitted += (Count) res;
+        assert (num_submitted <= num_fds);
+        *ret_num_submitted = num_submitted;
+    }
+
+    Count num_cancels = 0;
+    Count num_completed = reapCompletions (num_fds, ret_res, &num_cancels);
+    if (num_completed == num_fds)
+        return Result::Success;
+
+    // The kernel has queued the writes until the sockets become writable.
+    // They are cancelled, which completes them right away.
+    *ret_nowait_broken = true;
+
+    Count num_cancel_reqs = 0;
+    tail = *sq_tail;
+    for (Count i = 0; i < num_fds; ++i) {
+        if (ret_res [i] != res_pending)
+            continue;
+
+        unsigned const idx = tail & *sq_mask;
+
+        struct io_uring_sqe * const sqe = &sqes [idx];
+        memset (sqe, 0, sizeof (*sqe));
+        sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+        sqe->fd        = -1;
+        sqe->addr      = (Uint64) i;
+        sqe->user_data = cancel_user_data_flag | (Uint64) i;
+
+        sq_array [idx] = idx;
+        ++tail;
+        ++num_cancel_reqs;
+    }
+    storeRelease (sq_tail, tail);
+
+    Count num_to_submit = num_cancel_reqs;
+    while (num_completed < num_fds || num_cancels < num_cancel_reqs) {
+        int const res = syscall (__NR_io_uring_enter,
+                                 ring_fd,
+                                 (unsigned) num_to_submit /* to_submit */,
+                                 (unsigned) 1 /* min_complete */,
+                                 (unsigned) IORING_ENTER_GETEVENTS,
+                                 (void*) NULL /* sig */,
+                                 (Size) 0);
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+
+            exc_throw (PosixException, errno);
+            logE_ (_func, "io_uring_enter() failed: ", errnoString (errno));
+
+            return Result::Failure;
+        }
+
+        num_to_submit -= ((Count) res <= num_to_submit ? (Count) res : num_to_submit);
+        num_completed += reapCompletions (num_fds, ret_res, &num_cancels);
+    }
+
+    // Nothing has been written for the cancelled requests.
+    for (Count i = 0; i < num_fds; ++i) {
+        if (ret_res [i] == -ECANCELED)
+            ret_res [i] = -EAGAIN;
+    }
+
+    return Result::Success;
+}
+
+mt_throws Result
+UringWritev::writevBatch (Count   const num_fds,
+                          int   * const fds,
+                          struct iovec ** const iovs,
+                          int   * const num_iovs,
+                          int   * const ret_res)
+{
+    Count i = 0;
+    while (i < num_fds && isAvailable()) {
+        Count const chunk = (num_fds - i <= num_entries ? num_fds - i : num_entries);
+
+        Count num_submitted = 0;
+        bool nowait_broken = false;
+        if (!submitAndReap (chunk, fds + i, iovs + i, num_iovs + i, ret_res + i, &num_submitted, &nowait_broken)) {
+          // The ring is not reliable anymore. Requests which have been
+          // submitted but not completed are lost, their connections
+          // will be closed. Others are sent with writev(), as well as
+          // all subsequent batches.
+            logE_ (_func, "disabling io_uring");
+            releaseRing ();
+
+            for (Count j = i; j < i + num_submitted; ++j) {
+                if (ret_res [j] == res_pending)
+                    ret_res [j] = -EIO;
+            }
+
+            i += num_submitted;
+            break;
+        }
+
+        i += chunk;
+
+        if (nowait_broken) {
+          // Waiting for the sockets would stall the poll loop.
+            logE_ (_func, "writes to sockets do not complete at once, disabling io_uring");
+            releaseRing ();
+            break;
+        }
+    }
+
+    for (; i < num_fds; ++i) {
+        ssize_t const res = ::writev (fds [i], iovs [i], num_iovs [i]);
+        ret_res [i] = (res >= 0 ? (int) res : -errno);
+    }
+
+    return Result::Success;
+}
+
+void
+UringWritev::releaseRing ()
+{
+    if (sqes_ptr) {
+        munmap (sqes_ptr, sqes_size);
+        sqes_ptr = NULL;
+    }
+
+    if (cq_ring_ptr && cq_ring_ptr != sq_ring_ptr)
+        munmap (cq_ring_ptr, cq_ring_size);
+    cq_ring_ptr = NULL;
+
+    if (sq_ring_ptr) {
+        munmap (sq_ring_ptr, sq_ring_size);
+        sq_ring_ptr = NULL;
+    }
+
+    if (ring_fd != -1) {
+        for (;;) {
+            if (::close (ring_fd) == -1) {
+                if (errno == EINTR)
+                    continue;
+
+                logE_ (_func, "close() failed: ", errnoString (errno));
+            }
+            break;
+        }
+        ring_fd = -1;
+    }
+}
+
+mt_const bool
+UringWritev::init (unsigned const num_entries)
+{
+    struct io_uring_params params;
+    memset (&params, 0, sizeof (params));
+
+    ring_fd = syscall (__NR_io_uring_setup, num_entries, &params);
+    if (ring_fd == -1) {
+        logI (uring, _func, "io_uring is not available, using writev(): ", errnoString (errno));
+        return false;
+    }
+
+    this->num_entries = params.sq_entries;
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+    cq_ring_size = params.cq_off.cqes  + params.cq_entries * sizeof (struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_ring_size > sq_ring_size)
+            sq_ring_size = cq_ring_size;
+        cq_ring_size = sq_ring_size;
+    }
+
+    sq_ring_ptr = mmap (NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring_ptr == MAP_FAILED) {
+        logE_ (_func, "mmap() failed: ", errnoString (errno));
+        sq_ring_ptr = NULL;
+        releaseRing ();
+        return false;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ring_ptr = sq_ring_ptr;
+    } else {
+        cq_ring_ptr = mmap (NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring_ptr == MAP_FAILED) {
+            logE_ (_func, "mmap() failed: ", errnoString (errno));
+            cq_ring_ptr = NULL;
+            releaseRing ();
+            return false;
+        }
+    }
+
+    sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+    sqes_ptr = mmap (NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring_fd, IORING_OFF_SQES);
+    if (sqes_ptr == MAP_FAILED) {
+        logE_ (_func, "mmap() failed: ", errnoString (errno));
+        sqes_ptr = NULL;
+        releaseRing ();
+        return false;
+    }
+
+    Byte * const sq_base = static_cast <Byte*> (sq_ring_ptr);
+    sq_head  = (unsigned*) (sq_base + params.sq_off.head);
+    sq_tail  = (unsigned*) (sq_base + params.sq_off.tail);
+    sq_mask  = (unsigned*) (sq_base + params.sq_off.ring_mask);
+    sq_array = (unsigned*) (sq_base + params.sq_off.array);
+
+    Byte * const cq_base = static_cast <Byte*> (cq_ring_ptr);
+    cq_head = (unsigned*) (cq_base + params.cq_off.head);
+    cq_tail = (unsigned*) (cq_base + params.cq_off.tail);
+    cq_mask = (unsigned*) (cq_base + params.cq_off.ring_mask);
+    cqes    = cq_base + params.cq_off.cqes;
+
+    if (!probe ()) {
+        logI (uring, _func, "io_uring writev is not usable for sockets, using writev()");
+        releaseRing ();
+        return false;
+    }
+
+    logD (uring, _func, "sq_entries: ", params.sq_entries, ", cq_entries: ", params.cq_entries);
+    return true;
+}
+
+bool
+UringWritev::probe ()
+{
+    // Older kernels do not support RWF_NOWAIT for sockets. They either fail
+    // such writes or wait for the socket to become writable, so a write to
+    // a socket with a full send buffer must fail with EAGAIN at once.
+    int sv [2];
+    if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == -1) {
+        logE_ (_func, "socketpair() failed: ", errnoString (errno));
+        return false;
+    }
+
+    char data = 0;
+    struct iovec iov;
+    iov.iov_base = &data;
+    iov.iov_len = 1;
+
+    struct iovec *iovs = &iov;
+    int num_iovs = 1;
+    int res = 0;
+    Count num_submitted = 0;
+    bool nowait_broken = false;
+    bool ok = submitAndReap (1, &sv [0], &iovs, &num_iovs, &res, &num_submitted, &nowait_broken)
+              && !nowait_broken
+              && res == 1;
+
+    if (ok) {
+        bool filled = false;
+        char buf [4096];
+        memset (buf, 0, sizeof (buf));
+        for (Count i = 0; i < 65536; ++i) {
+            if (::write (sv [0], buf, sizeof (buf)) == -1) {
+                filled = (errno == EAGAIN || errno == EWOULDBLOCK);
+                break;
+            }
+        }
+
+        ok = filled
+             && submitAndReap (1, &sv [0], &iovs, &num_iovs, &res, &num_submitted, &nowait_broken)
+             && !nowait_broken
+             && res == -EAGAIN;
+    }
+
+    ::close (sv [0]);
+    ::close (sv [1]);
+    return ok;
+}
+
+UringWritev::UringWritev ()
+    : ring_fd      (-1),
+      num_entries  (0),
+      sq_ring_ptr  (NULL),
+      sq_ring_size (0),
+      cq_ring_ptr  (NULL),
+      cq_ring_size (0),
+      sqes_ptr     (NULL),
+      sqes_size    (0),
+      sq_head      (NULL),
+      sq_tail      (NULL),
+      sq_mask      (NULL),
+      sq_array     (NULL),
+      cq_head      (NULL),
+      cq_tail      (NULL),
+      cq_mask      (NULL),
+      cqes         (NULL)
+{
+}
+
+UringWritev::~UringWritev ()
+{
+    releaseRing ();
+}
+
+}
+
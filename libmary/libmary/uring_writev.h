@@ -0,0 +1,104 @@
+/*  LibMary - C++ library for high-performance network servers
+    Copyright (C) 2011 Dmitry Shatrov
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+
+#ifndef LIBMARY__URING_WRITEV__H__
+#define LIBMARY__URING_WRITEV__H__
+
+
+#include <libmary/types.h>
+
+#include <sys/uio.h>
+
+
+namespace M {
+
+// Batched writev() for many connections with a single io_uring_enter() call.
+// The ring is set up with raw syscalls, liburing is not required.
+mt_unsafe class UringWritev
+{
+private:
+    int ring_fd;
+
+    unsigned num_entries;
+
+    void *sq_ring_ptr;
+    Size  sq_ring_size;
+    void *cq_ring_ptr;
+    Size  cq_ring_size;
+    void *sqes_ptr;
+    Size  sqes_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    void     *cqes;
+
+    // Takes the completions which are in the ring, without waiting.
+    // Returns the number of completions taken, cancel requests included.
+    Count reapCompletions (Count  num_fds,
+                           int   *ret_res,
+                           Count *ret_num_cancels);
+
+    // Submits the writes and takes their results. With RWF_NOWAIT, writes to
+    // sockets complete during submission, so nothing is waited for. Writes
+    // which have not completed are cancelled, and 'ret_nowait_broken' is set.
+    mt_throws Result submitAndReap (Count  num_fds,
+                                    int   *fds,
+                                    struct iovec **iovs,
+                                    int   *num_iovs,
+                                    int   *ret_res,
+                                    Count *ret_num_submitted,
+                                    bool  *ret_nowait_broken);
+
+    bool probe ();
+
+    void releaseRing ();
+
+public:
+    bool isAvailable () const { return ring_fd != -1; }
+
+    // Calls writev() for each of 'num_fds' file descriptors. 'ret_res' receives
+    // the number of bytes written or a negated errno value for each of them,
+    // the same way as with libMary_mwritev(). Plain writev() is used if
+    // the ring could not be set up or has failed.
+    mt_throws Result writevBatch (Count  num_fds,
+                                  int   *fds,
+                                  struct iovec **iovs,
+                                  int   *num_iovs,
+                                  int   *ret_res);
+
+    // Returns false if io_uring is not supported by the kernel. writev() should
+    // be used in that case.
+    mt_const bool init (unsigned num_entries);
+
+     UringWritev ();
+    ~UringWritev ();
+};
+
+}
+
+
+#endif /* LIBMARY__URING_WRITEV__H__ */
+
@@ -0,0 +1,161 @@
+#include <libmary/libmary.h>
+#include <libmary/tree_hash.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <time.h>
+
+
+using namespace M;
+
+
+namespace {
+class Entry : public HashEntry<>
+{
+public:
+    char name [32];
+    Size name_len;
+
+    ConstMemory getName () const { return ConstMemory (name, name_len); }
+};
+
+typedef Hash< Entry,
+              ConstMemory,
+              AccessorExtractor< Entry,
+                                 ConstMemory,
+                                 &Entry::getName >,
+              MemoryComparator<> >
+        EntryHash;
+
+typedef TreeHash< Entry,
+                  ConstMemory,
+                  AccessorExtractor< Entry,
+                                     ConstMemory,
+                                     &Entry::getName >,
+                  MemoryComparator<> >
+        EntryTreeHash;
+}
+
+static Uint64 getMicroseconds ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (Uint64) ts.tv_sec * 1000000 + (Uint64) ts.tv_nsec / 1000;
+}
+
+static void fillEntries (Entry * const entries,
+                         Count   const num_entries)
+{
+    for (Count i = 0; i < num_entries; ++i) {
+        int const len = snprintf (entries [i].name, sizeof (entries [i].name), "stream_%lu", (unsigned long) i);
+        entries [i].name_len = len;
+    }
+}
+
+// Adds, looks up and removes entries in random order, checking the results.
+static void checkHash (Count const num_entries)
+{
+    Entry * const entries = new Entry [num_entries];
+    bool  * const added = new bool [num_entries];
+    fillEntries (entries, num_entries);
+
+    EntryHash hash;
+    for (Count i = 0; i < num_entries; ++i)
+        added [i] = false;
+
+    Count num_added = 0;
+    for (Count n = 0; n < num_entries * 20; ++n) {
+        Count const i = (Count) rand () % num_entries;
+        Entry * const found = hash.lookup (entries [i].getName());
+        assert (found == (added [i] ? &entries [i] : NULL));
+
+        if (added [i]) {
+            if (rand () % 3 == 0) {
+                hash.remove (&entries [i]);
+                added [i] = false;
+                --num_added;
+            }
+        } else {
+            hash.add (&entries [i]);
+            added [i] = true;
+            ++num_added;
+        }
+    }
+
+    Count num_iterated = 0;
+    {
+        EntryHash::iterator iter (hash);
+        while (!iter.done()) {
+            Entry * const entry = iter.next ();
+            assert (added [entry - entries]);
+            ++num_iterated;
+        }
+    }
+    assert (num_iterated == num_added);
+
+    hash.clear ();
+    assert (hash.isEmpty());
+    assert (hash.lookup (entries [0].getName()) == NULL);
+
+    delete[] added;
+    delete[] entries;
+}
+
+template <class H>
+static void benchHash (char const * const name,
+                       Count        const num_entries)
+{
+    Entry * const entries = new Entry [num_entries];
+    fillEntries (entries, num_entries);
+
+    Count const num_lookups = 1000000;
+
+    H * const hash = new H;
+
+    Uint64 const add_start = getMicroseconds ();
+    for (Count i = 0; i < num_entries; ++i)
+        hash->add (&entries [i]);
+    Uint64 const add_time = getMicroseconds () - add_start;
+
+    Count num_found = 0;
+    Uint64 const lookup_start = getMicroseconds ();
+    for (Count i = 0; i < num_lookups; ++i) {
+        if (hash->lookup (entries [(i * 7919) % num_entries].getName()))
+            ++num_found;
+    }
+    Uint64 const lookup_time = getMicroseconds () - lookup_start;
+    assert (num_found == num_lookups);
+
+    Uint64 const remove_start = getMicroseconds ();
+    for (Count i = 0; i < num_entries; ++i)
+        hash->remove (&entries [i]);
+    Uint64 const remove_time = getMicroseconds () - remove_start;
+    assert (hash->isEmpty());
+
+    printf ("%-9s %7lu entries: add %7.1f ns, lookup %7.1f ns, remove %7.1f ns\n",
+            name,
+            (unsigned long) num_entries,
+            add_time * 1000.0 / num_entries,
+            lookup_time * 1000.0 / num_lookups,
+            remove_time * 1000.0 / num_entries);
+
+    delete hash;
+    delete[] entries;
+}
+
+int main (void)
+{
+    libMaryInit ();
+
+    checkHash (10);
+    checkHash (1000);
+    checkHash (20000);
+
+    Count const sizes [] = { 1000, 10000, 100000 };
+    for (unsigned i = 0; i < sizeof (sizes) / sizeof (sizes [0]); ++i) {
+        benchHash <EntryTreeHash> ("TreeHash", sizes [i]);
+        benchHash <EntryHash>     ("Hash",     sizes [i]);
+    }
+
+    return 0;
+}
@@ -87,6 +87,14 @@ public:
 	event_informer.informAll (informBirdFlies, &inform_data);
     }
 
+    void fireBirdFliesSnapshot (ConstMemory const &bird_kind)
+    {
+	InformBirdFlies_Data inform_data (bird_kind);
+        mutex.lock ();
+	event_informer.informAllSnapshot_unlocked (informBirdFlies, &inform_data);
+        mutex.unlock ();
+    }
+
     void fireEclipse ()
     {
 	eclipse_informer.informAll (informEclipse, NULL /* inform_cb_data */);
@@ -132,6 +140,60 @@ static void eclipseCallback (void * const /* cb_data */)
     logD_ (_func);
 }
 
+static void countingManWalksCallback (ConstMemory   const & /* man_name */,
+				      Uint32        const   /* man_age */,
+				      void        * const   /* cb_data */)
+{
+}
+
+static void countingBirdFliesCallback (ConstMemory   const & /* bird_kind */,
+				       void        * const cb_data)
+{
+    ++*static_cast <Count*> (cb_data);
+}
+
+static EventSource::EventHandler counting_event_handler = {
+    countingManWalksCallback,
+    countingBirdFliesCallback
+};
+
+// A oneshot subscriber is informed of the first event only,
+// both by plain and by snapshot traversals.
+static void testOneshot ()
+{
+    Ref<EventSource> const event_source = grab (new EventSource);
+
+    Count snapshot_count = 0;
+    event_source->getEventInformer()->subscribe (
+	    CbDesc<EventSource::EventHandler> (&counting_event_handler, &snapshot_count, NULL /* coderef_container */),
+	    true /* oneshot */);
+
+    Count count = 0;
+    event_source->getEventInformer()->subscribe (
+	    CbDesc<EventSource::EventHandler> (&counting_event_handler, &count, NULL /* coderef_container */),
+	    false /* oneshot */);
+
+    event_source->fireBirdFliesSnapshot ("Sparrow");
+    event_source->fireBirdFliesSnapshot ("Sparrow");
+    event_source->fireBirdFlies ("Sparrow");
+
+    assert (snapshot_count == 1);
+    assert (count == 3);
+
+    Count plain_count = 0;
+    event_source->getEventInformer()->subscribe (
+	    CbDesc<EventSource::EventHandler> (&counting_event_handler, &plain_count, NULL /* coderef_container */),
+	    true /* oneshot */);
+
+    event_source->fireBirdFlies ("Sparrow");
+    event_source->fireBirdFliesSnapshot ("Sparrow");
+    event_source->fireBirdFlies ("Sparrow");
+
+    assert (plain_count == 1);
+    assert (snapshot_count == 1);
+    assert (count == 6);
+}
+
 int main (void)
 {
     libMaryInit ();
@@ -145,8 +207,11 @@ int main (void)
 
     event_source->fireManWalks ("Just a man", 26);
     event_source->fireBirdFlies ("Phoenix");
+    event_source->fireBirdFliesSnapshot ("Albatross");
     event_source->fireEclipse ();
 
+    testOneshot ();
+
     return 0;
 }
 
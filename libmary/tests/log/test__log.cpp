@@ -1,11 +1,193 @@
 #include <libmary/libmary.h>
 
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
 
 using namespace M;
 
 
 static LogGroup libMary_logGroup_mytest ("mytest", LogLevel::All);
 
+namespace {
+class CaptureStream : public OutputStream
+{
+public:
+    Mutex       mutex;
+    std::string data;
+
+    mt_throws Result write (ConstMemory   const mem,
+                            Size        * const ret_nwritten)
+    {
+        mutex.lock ();
+        data.append ((char const *) mem.mem(), mem.len());
+        mutex.unlock ();
+
+        if (ret_nwritten)
+            *ret_nwritten = mem.len();
+
+        return Result::Success;
+    }
+
+    mt_throws Result flush ()
+    {
+        return Result::Success;
+    }
+
+    std::string get ()
+    {
+        mutex.lock ();
+        std::string const res = data;
+        mutex.unlock ();
+        return res;
+    }
+
+    void clear ()
+    {
+        mutex.lock ();
+        data.clear ();
+        mutex.unlock ();
+    }
+};
+}
+
+static CaptureStream capture;
+
+// Calls 'cb' for every "seq <thread> <n>" line in the captured log.
+template <class Cb>
+static void forEachSeq (std::string const &log, Cb cb)
+{
+    Size pos = 0;
+    while ((pos = log.find ("seq ", pos)) != std::string::npos) {
+        unsigned long thread_idx = 0;
+        unsigned long n = 0;
+        if (sscanf (log.c_str() + pos, "seq %lu %lu", &thread_idx, &n) == 2)
+            cb (thread_idx, n);
+
+        pos += 4;
+    }
+}
+
+static Count countDropped (std::string const &log)
+{
+    Count total = 0;
+    Size pos = 0;
+    while ((pos = log.find (" log lines dropped", pos)) != std::string::npos) {
+        Size start = pos;
+        while (start > 0 && log [start - 1] >= '0' && log [start - 1] <= '9')
+            --start;
+
+        total += strtoul (log.c_str() + start, NULL, 10);
+        ++pos;
+    }
+    return total;
+}
+
+enum {
+    NumThreads     = 4,
+    LinesPerThread = 100
+};
+
+static void orderThreadFunc (void * const _thread_idx)
+{
+    unsigned long const thread_idx = (unsigned long) (UintPtr) _thread_idx;
+    for (unsigned long i = 0; i < LinesPerThread; ++i)
+        logD (mytest, "seq ", thread_idx, " ", i);
+}
+
+// Lines of one thread come out in the order they've been logged.
+static void testPerThreadOrder ()
+{
+    capture.clear ();
+    startAsyncLogging (1 << 20);
+
+    std::vector< Ref<Thread> > threads;
+    for (unsigned long i = 0; i < NumThreads; ++i) {
+        Ref<Thread> const thread = grab (new (std::nothrow) Thread (
+                CbDesc<Thread::ThreadFunc> (orderThreadFunc, (void*) (UintPtr) i, NULL /* coderef_container */)));
+        bool const spawned = thread->spawn (true /* joinable */);
+        assert (spawned);
+        threads.push_back (thread);
+    }
+    for (Count i = 0; i < threads.size(); ++i)
+        threads [i]->join ();
+
+    stopAsyncLogging ();
+
+    std::vector<unsigned long> next (NumThreads, 0);
+    forEachSeq (capture.get(), [&next] (unsigned long const thread_idx, unsigned long const n) {
+        assert (thread_idx < NumThreads);
+        assert (n == next [thread_idx]);
+        ++next [thread_idx];
+    });
+
+    for (Count i = 0; i < NumThreads; ++i)
+        assert (next [i] == LinesPerThread);
+}
+
+// Every line is either written or counted as dropped.
+static void testOverflow ()
+{
+    capture.clear ();
+    // The smallest ring possible.
+    startAsyncLogging (0);
+
+    Count const num_lines = 20000;
+    std::string const padding (200, 'x');
+    for (unsigned long i = 0; i < num_lines; ++i)
+        logD (mytest, "seq 0 ", i, " ", padding.c_str());
+
+    stopAsyncLogging ();
+
+    std::string const log = capture.get();
+
+    Count num_written = 0;
+    unsigned long last = 0;
+    forEachSeq (log, [&num_written, &last] (unsigned long /* thread_idx */, unsigned long const n) {
+        assert (num_written == 0 || n > last);
+        last = n;
+        ++num_written;
+    });
+
+    Count const num_dropped = countDropped (log);
+    assert (num_dropped > 0);
+    assert (num_written + num_dropped == num_lines);
+}
+
+// Buffered lines are written out by stopAsyncLogging(), errors are written
+// at once and after the lines which have been buffered before them.
+static void testFlush ()
+{
+    capture.clear ();
+    startAsyncLogging (1 << 16);
+
+    logD (mytest, "seq 0 0");
+    logD (mytest, "seq 0 1");
+    logE_ ("seq 0 2");
+
+    {
+        unsigned long next = 0;
+        forEachSeq (capture.get(), [&next] (unsigned long /* thread_idx */, unsigned long const n) {
+            assert (n == next);
+            ++next;
+        });
+        assert (next == 3);
+    }
+
+    logD (mytest, "seq 0 3");
+    stopAsyncLogging ();
+
+    {
+        unsigned long next = 0;
+        forEachSeq (capture.get(), [&next] (unsigned long /* thread_idx */, unsigned long const n) {
+            assert (n == next);
+            ++next;
+        });
+        assert (next == 4);
+    }
+}
 
 int main (void)
 {
@@ -15,5 +197,21 @@ int main (void)
     logD (mytest, "Starting!\n");
     logD (mytest, "Habahaba, ", "and this is just ", grab (new String ("The beginning\n")));
     logE_ ("Muhahahaha! -> ", 13, " ", 42, "\n");
-}
 
+    startAsyncLogging (1 << 16);
+    logD (mytest, "Buffered, ", "written by the flusher thread");
+    logE_ ("Buffered too -> ", 13, " ", 42);
+    stopAsyncLogging ();
+    logD (mytest, "Synchronous again");
+
+    setLogStream (&capture, NULL /* release_cb */, NULL /* release_cb_data */, false /* add_buffered_stream */);
+
+    testPerThreadOrder ();
+    testOverflow ();
+    testFlush ();
+
+    setLogStream (errs, NULL /* release_cb */, NULL /* release_cb_data */, true /* add_buffered_stream */);
+
+    printf ("OK\n");
+    return 0;
+}
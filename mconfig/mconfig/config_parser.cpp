@@ -320,13 +320,31 @@ mconfig_accept_option (MConfig_Option         * const option,
     return true;
 }
 
+// The grammar is created once and is never released. Parsing only reads it,
+// so that config files may be parsed by several threads at once.
+static Pargen::Grammar* getMConfigGrammar ()
+{
+    static Pargen::Grammar *grammar = NULL;
+
+    helperLock ();
+    if (!grammar) {
+        // create_mconfig_grammar() keeps a reference to the grammar.
+        StRef<Pargen::Grammar> const tmp_grammar = create_mconfig_grammar ();
+        grammar = tmp_grammar;
+    }
+    Pargen::Grammar * const res = grammar;
+    helperUnlock ();
+
+    return res;
+}
+
 Result parseConfig (ConstMemory   const filename,
 		    Config      * const config)
 {
 //    logD_ (_func, "filename: ", filename);
 
 try {
-    StRef<Pargen::Grammar> const grammar = create_mconfig_grammar ();
+    Pargen::Grammar * const grammar = getMConfigGrammar ();
 
     NativeFile file;
     if (!file.open (filename, 0 /* open_flags */, FileAccessMode::ReadOnly)) {
@@ -0,0 +1,466 @@
+/*  Moment-FFmpeg - FFmpeg support module for Moment Video Server
+    Copyright (C) 2011-2013 Dmitry Shatrov
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifdef __linux__
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#endif
+
+#include <vector>
+
+#include <moment-ffmpeg/capture_engine.h>
+
+
+using namespace M;
+using namespace Moment;
+
+namespace MomentFFmpeg {
+
+static LogGroup libMary_logGroup_capture ("mod_ffmpeg.capture", LogLevel::E);
+
+#define POLL_TIMEOUT 1000 // in milliseconds, how soon stop() and expired waits are noticed
+#define POLL_EVENTS  64   // events per epoll_wait() call
+
+mt_mutex (mutex) void
+CaptureEngine::doEnqueue (Source * const mt_nonnull source)
+{
+    if (source->removed)
+        return;
+
+    if (source->running) {
+        source->rerun = true;
+        return;
+    }
+
+    if (source->queued)
+        return;
+
+    doStopWaiting (source);
+
+    source->queued = true;
+    run_queue.append (source);
+    run_cond.signal ();
+}
+
+mt_mutex (mutex) bool
+CaptureEngine::doWaitInput (Source * const mt_nonnull source)
+{
+#ifdef __linux__
+    if (efd == -1 || source->input_fd == -1)
+        return false;
+
+    struct epoll_event event;
+    memset (&event, 0, sizeof (event));
+    // Level-triggered: data which has arrived before the call is reported too.
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.u64 = ++wait_id_counter;
+
+    if (epoll_ctl (efd,
+                   source->input_fd_added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                   source->input_fd,
+                   &event) == -1)
+    {
+        logE_ (_func, "epoll_ctl() failed: ", errnoString (errno));
+        return false;
+    }
+    source->input_fd_added = true;
+
+    source->wait_id = event.data.u64;
+    source->wait_start_millisec = getTimeMilliseconds();
+    waiting_map [source->wait_id] = source;
+
+    return true;
+#else
+    (void) source;
+    return false;
+#endif
+}
+
+mt_mutex (mutex) void
+CaptureEngine::doStopWaiting (Source * const mt_nonnull source)
+{
+    if (!source->wait_id)
+        return;
+
+    // An event which is reported for the fd later on is ignored.
+    waiting_map.erase (source->wait_id);
+    source->wait_id = 0;
+}
+
+mt_mutex (mutex) void
+CaptureEngine::doRemoveInputFd (Source * const mt_nonnull source)
+{
+    doStopWaiting (source);
+
+#ifdef __linux__
+    if (source->input_fd_added) {
+        if (epoll_ctl (efd, EPOLL_CTL_DEL, source->input_fd, NULL /* event */) == -1)
+            logE_ (_func, "epoll_ctl() failed: ", errnoString (errno));
+    }
+#endif
+
+    source->input_fd = -1;
+    source->input_fd_added = false;
+}
+
+mt_unlocks_locks (mutex) CaptureEngine::TurnResult
+CaptureEngine::doRunTurn (Source * const mt_nonnull source)
+{
+    source->running = true;
+    source->rerun = false;
+    source->running_tlocal = libMary_getThreadLocal();
+
+    Cb<Frontend> const tmp_frontend = source->frontend;
+    Count const tmp_quantum = quantum;
+    mutex.unlock ();
+
+    updateTime ();
+
+    TurnResult res = TurnResult_Idle;
+    if (!tmp_frontend.call_ret<TurnResult> (&res, tmp_frontend->turn, /*(*/ tmp_quantum /*)*/)) {
+        // The stream is gone.
+        res = TurnResult_Idle;
+    }
+
+    mutex.lock ();
+    source->running = false;
+    source->running_tlocal = NULL;
+
+    return res;
+}
+
+void
+CaptureEngine::threadFunc (void * const _self)
+{
+    CaptureEngine * const self = static_cast <CaptureEngine*> (_self);
+
+    updateTime ();
+
+    logD (capture, _func_);
+
+    self->mutex.lock ();
+    for (;;) {
+        while (!self->should_stop && self->run_queue.isEmpty())
+            self->run_cond.wait (self->mutex);
+
+        if (self->should_stop)
+            break;
+
+        Ref<Source> const source = self->run_queue.getFirst();
+        self->run_queue.remove (self->run_queue.getFirstElement());
+
+        source->queued = false;
+        if (source->removed)
+            continue;
+
+        TurnResult const res = self->doRunTurn (source);
+
+        if (!source->removed
+            && (res == TurnResult_Again
+                || source->rerun
+                || (res == TurnResult_WaitInput && !self->doWaitInput (source))))
+        {
+            source->rerun = false;
+            source->queued = true;
+            // Appending to the tail gives other runnable sources their turn first.
+            self->run_queue.append (source);
+            self->run_cond.signal ();
+        }
+
+        source->turn_done_cond.signal ();
+    }
+    self->mutex.unlock ();
+
+    logD (capture, _func_, "done");
+}
+
+#ifdef __linux__
+void
+CaptureEngine::pollThreadFunc (void * const _self)
+{
+    CaptureEngine * const self = static_cast <CaptureEngine*> (_self);
+
+    updateTime ();
+
+    logD (capture, _func_);
+
+    Time last_check_millisec = getTimeMilliseconds();
+
+    for (;;) {
+        self->mutex.lock ();
+        bool const should_stop = self->should_stop;
+        self->mutex.unlock ();
+        if (should_stop)
+            break;
+
+        struct epoll_event events [POLL_EVENTS];
+        int const res = epoll_wait (self->efd, events, POLL_EVENTS, POLL_TIMEOUT);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+
+            logE_ (_func, "epoll_wait() failed: ", errnoString (errno));
+            break;
+        }
+
+        updateTime ();
+        Time const cur_time_millisec = getTimeMilliseconds();
+
+        self->mutex.lock ();
+
+        for (int i = 0; i < res; ++i) {
+            WaitingMap::iterator const iter = self->waiting_map.find (events [i].data.u64);
+            if (iter != self->waiting_map.end()) {
+                Ref<Source> const source = iter->second;
+                self->doEnqueue (source);
+            }
+        }
+
+        if (cur_time_millisec - last_check_millisec >= POLL_TIMEOUT) {
+            last_check_millisec = cur_time_millisec;
+
+            std::vector< Ref<Source> > expired;
+            for (WaitingMap::iterator iter = self->waiting_map.begin(); iter != self->waiting_map.end(); ++iter) {
+                if (cur_time_millisec - iter->second->wait_start_millisec >= self->wait_timeout_millisec)
+                    expired.push_back (iter->second);
+            }
+
+            for (Count i = 0; i < expired.size(); ++i)
+                self->doEnqueue (expired [i]);
+        }
+
+        self->mutex.unlock ();
+    }
+
+    logD (capture, _func_, "done");
+}
+#else
+void
+CaptureEngine::pollThreadFunc (void * const /* _self */)
+{
+}
+#endif
+
+Ref<CaptureEngine::Source>
+CaptureEngine::addSource (CbDesc<Frontend> const &frontend)
+{
+    Ref<Source> const source = grab (new (std::nothrow) Source);
+    source->frontend = frontend;
+    return source;
+}
+
+void
+CaptureEngine::removeSource (Source * const mt_nonnull source)
+{
+    mutex.lock ();
+
+    if (source->removed) {
+        mutex.unlock ();
+        return;
+    }
+
+    source->removed = true;
+
+    doRemoveInputFd (source);
+
+    if (source->queued) {
+        SourceList::iter iter (run_queue);
+        while (!run_queue.iter_done (iter)) {
+            SourceList::Element * const el = run_queue.iter_next (iter);
+            if (el->data == source) {
+                run_queue.remove (el);
+                break;
+            }
+        }
+        source->queued = false;
+    }
+
+    if (source->running_tlocal != libMary_getThreadLocal()) {
+        while (source->running)
+            source->turn_done_cond.wait (mutex);
+    }
+
+    mutex.unlock ();
+}
+
+void
+CaptureEngine::schedule (Source * const mt_nonnull source)
+{
+    mutex.lock ();
+
+    if (!stopped) {
+        doEnqueue (source);
+        mutex.unlock ();
+        return;
+    }
+
+    // There are no capture threads anymore. A single turn is run right here,
+    // which is enough for a stream to release its pipeline.
+    if (source->removed || source->running) {
+        mutex.unlock ();
+        return;
+    }
+
+    doStopWaiting (source);
+    doRunTurn (source);
+    source->turn_done_cond.signal ();
+
+    mutex.unlock ();
+}
+
+void
+CaptureEngine::setInputFd (Source * const mt_nonnull source,
+                           int      const fd)
+{
+    mutex.lock ();
+    if (source->input_fd != fd) {
+        doRemoveInputFd (source);
+        if (!source->removed)
+            source->input_fd = fd;
+    }
+    mutex.unlock ();
+}
+
+bool
+CaptureEngine::isInTurn (Source * const mt_nonnull source)
+{
+    mutex.lock ();
+    bool const res = source->running && source->running_tlocal == libMary_getThreadLocal();
+    mutex.unlock ();
+    return res;
+}
+
+mt_throws Result
+CaptureEngine::spawn ()
+{
+    logD (capture, _func_, "num_threads: ", num_threads, ", quantum: ", quantum, ", "
+          "wait_timeout_millisec: ", wait_timeout_millisec);
+
+#ifdef __linux__
+    efd = epoll_create1 (EPOLL_CLOEXEC);
+    if (efd == -1) {
+        // Sources are read as if their input was always ready.
+        logE_ (_func, "epoll_create1() failed: ", errnoString (errno));
+    } else
+    if (!poll_thread->spawn (true /* joinable */)) {
+        logE_ (_func, "poll_thread->spawn() failed: ", exc->toString());
+        close (efd);
+        efd = -1;
+        return Result::Failure;
+    }
+#endif
+
+    multi_thread->setNumThreads (num_threads);
+    if (!multi_thread->spawn (true /* joinable */)) {
+        logE_ (_func, "multi_thread->spawn() failed: ", exc->toString());
+        return Result::Failure;
+    }
+
+    spawned = true;
+    return Result::Success;
+}
+
+void
+CaptureEngine::stop ()
+{
+    if (!spawned)
+        return;
+
+    mutex.lock ();
+    should_stop = true;
+    // Waking up all threads.
+    for (Count i = 0; i < num_threads; ++i)
+        run_cond.signal ();
+    mutex.unlock ();
+
+    if (!multi_thread->join ())
+        logE_ (_func, "multi_thread->join() failed: ", exc->toString());
+
+    if (efd != -1) {
+        if (!poll_thread->join ())
+            logE_ (_func, "poll_thread->join() failed: ", exc->toString());
+    }
+
+    mutex.lock ();
+    stopped = true;
+    // Sources which were scheduled while the threads were exiting get their
+    // last turn here, so that a release waiting for it is not left hanging.
+    while (!run_queue.isEmpty()) {
+        Ref<Source> const source = run_queue.getFirst();
+        run_queue.remove (run_queue.getFirstElement());
+        source->queued = false;
+        if (source->removed)
+            continue;
+
+        doRunTurn (source);
+        source->turn_done_cond.signal ();
+    }
+    mutex.unlock ();
+
+    spawned = false;
+}
+
+mt_const void
+CaptureEngine::init (Count const num_threads,
+                     Count const quantum,
+                     Time  const wait_timeout_millisec)
+{
+    this->num_threads = (num_threads > 0 ? num_threads : 1);
+    this->quantum     = (quantum     > 0 ? quantum     : 1);
+    this->wait_timeout_millisec = (wait_timeout_millisec > 0 ? wait_timeout_millisec : 1);
+}
+
+CaptureEngine::CaptureEngine ()
+    : num_threads (1),
+      quantum (1),
+      wait_timeout_millisec (1000),
+      efd (-1),
+      spawned (false),
+      wait_id_counter (0),
+      should_stop (false),
+      stopped (false)
+{
+    multi_thread = grab (new (std::nothrow) MultiThread (
+            1 /* num_threads */,
+            CbDesc<Thread::ThreadFunc> (threadFunc,
+                                        this /* cb_data */,
+                                        this /* coderef_container */)));
+
+    poll_thread = grab (new (std::nothrow) Thread (
+            CbDesc<Thread::ThreadFunc> (pollThreadFunc,
+                                        this /* cb_data */,
+                                        this /* coderef_container */)));
+}
+
+CaptureEngine::~CaptureEngine ()
+{
+    mutex.lock ();
+    waiting_map.clear ();
+    while (!run_queue.isEmpty())
+        run_queue.remove (run_queue.getFirstElement());
+    mutex.unlock ();
+
+#ifdef __linux__
+    if (efd != -1)
+        close (efd);
+#endif
+}
+
+}
@@ -0,0 +1,189 @@
+/*  Moment-FFmpeg - FFmpeg support module for Moment Video Server
+    Copyright (C) 2011-2013 Dmitry Shatrov
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef MOMENT_FFMPEG__CAPTURE_ENGINE__H__
+#define MOMENT_FFMPEG__CAPTURE_ENGINE__H__
+
+
+#include <map>
+
+#include <libmary/types.h>
+#include <moment/libmoment.h>
+
+
+namespace MomentFFmpeg {
+
+using namespace M;
+using namespace Moment;
+
+// A bounded pool of capture threads shared by all FFmpegStream instances.
+//
+// Every source gets a "turn" on one of the pool threads. A turn does a bounded
+// amount of work (one workqueue item or up to 'quantum' packets) and then
+// tells the engine whether the source should be requeued. Runnable sources
+// are served in FIFO order, which gives each channel a fair share of
+// the capture threads no matter how many channels there are.
+//
+// A read which has been interrupted can't be resumed, so a source is not read
+// until its socket has data: the turn returns TurnResult_WaitInput, and
+// a single poll thread puts the source back to the run queue once the socket
+// set with setInputFd() becomes readable. A waiting source gets a turn after
+// 'wait_timeout' anyway, which lets it notice that the source has gone silent.
+class CaptureEngine : public Object
+{
+private:
+    StateMutex mutex;
+
+public:
+    enum TurnResult {
+        // The source has more work to do, put it at the tail of the run queue.
+        TurnResult_Again,
+        // The source has nothing to do until schedule() is called for it.
+        TurnResult_Idle,
+        // The source has nothing to do until its input fd becomes readable,
+        // 'wait_timeout' expires or schedule() is called for it.
+        TurnResult_WaitInput
+    };
+
+    struct Frontend
+    {
+        // Called on one of the capture threads. At most one turn is in progress
+        // for a given source at any moment.
+        TurnResult (*turn) (Count  quantum,
+                            void  *cb_data);
+    };
+
+    class Source : public Referenced
+    {
+        friend class CaptureEngine;
+
+    private:
+        mt_const Cb<Frontend> frontend;
+
+        mt_mutex (CaptureEngine::mutex) bool queued;
+        mt_mutex (CaptureEngine::mutex) bool running;
+        // schedule() has been called while the source was running.
+        mt_mutex (CaptureEngine::mutex) bool rerun;
+        mt_mutex (CaptureEngine::mutex) bool removed;
+
+        mt_mutex (CaptureEngine::mutex) LibMary_ThreadLocal *running_tlocal;
+
+        // -1 if the source has no input to wait for.
+        mt_mutex (CaptureEngine::mutex) int input_fd;
+        // The fd is in the engine's epoll set.
+        mt_mutex (CaptureEngine::mutex) bool input_fd_added;
+        // Non-zero while the source is in 'waiting_map'.
+        mt_mutex (CaptureEngine::mutex) Uint64 wait_id;
+        mt_mutex (CaptureEngine::mutex) Time wait_start_millisec;
+
+        // Signalled when a turn for this source completes.
+        mt_mutex (CaptureEngine::mutex) Cond turn_done_cond;
+
+        Source ()
+            : queued (false),
+              running (false),
+              rerun (false),
+              removed (false),
+              running_tlocal (NULL),
+              input_fd (-1),
+              input_fd_added (false),
+              wait_id (0),
+              wait_start_millisec (0)
+        {}
+    };
+
+private:
+    typedef List< Ref<Source> > SourceList;
+    // Sources waiting for input by wait id. The id is what epoll reports,
+    // so that events for sources which have stopped waiting are ignored.
+    typedef std::map< Uint64, Ref<Source> > WaitingMap;
+
+    mt_const Count num_threads;
+    mt_const Count quantum;
+    mt_const Time  wait_timeout_millisec;
+
+    mt_const int efd;
+    mt_const bool spawned;
+
+    mt_const Ref<MultiThread> multi_thread;
+    mt_const Ref<Thread> poll_thread;
+
+    mt_mutex (mutex) SourceList run_queue;
+    mt_mutex (mutex) Cond run_cond;
+
+    mt_mutex (mutex) WaitingMap waiting_map;
+    mt_mutex (mutex) Uint64 wait_id_counter;
+
+    mt_mutex (mutex) bool should_stop;
+    // The capture threads have been joined.
+    mt_mutex (mutex) bool stopped;
+
+    mt_mutex (mutex) void doEnqueue (Source * mt_nonnull source);
+
+    mt_unlocks_locks (mutex) TurnResult doRunTurn (Source * mt_nonnull source);
+
+    // Returns false if the source can't wait for its input.
+    mt_mutex (mutex) bool doWaitInput (Source * mt_nonnull source);
+
+    mt_mutex (mutex) void doStopWaiting (Source * mt_nonnull source);
+
+    mt_mutex (mutex) void doRemoveInputFd (Source * mt_nonnull source);
+
+    static void threadFunc (void *_self);
+
+    static void pollThreadFunc (void *_self);
+
+public:
+    Ref<Source> addSource (CbDesc<Frontend> const &frontend);
+
+    // Detaches the source from the engine. If a turn is in progress on another
+    // thread, waits for it to complete. Safe to call from within the turn.
+    void removeSource (Source * mt_nonnull source);
+
+    // Makes the source runnable. Cheap to call repeatedly. After stop(),
+    // runs a single turn for the source on the calling thread.
+    void schedule (Source * mt_nonnull source);
+
+    // Sets the fd which TurnResult_WaitInput waits for, -1 for none. Must be
+    // reset to -1 before the fd is closed. Without an fd, TurnResult_WaitInput
+    // is the same as TurnResult_Again.
+    void setInputFd (Source * mt_nonnull source,
+                     int     fd);
+
+    // Returns true if the calling thread is running a turn for 'source'.
+    bool isInTurn (Source * mt_nonnull source);
+
+    mt_throws Result spawn ();
+
+    // Joins the capture threads. Turns in progress are completed first.
+    // Sources can still be released afterwards, see schedule().
+    void stop ();
+
+    mt_const void init (Count num_threads,
+                        Count quantum,
+                        Time  wait_timeout_millisec);
+
+     CaptureEngine ();
+    ~CaptureEngine ();
+};
+
+}
+
+
+#endif /* MOMENT_FFMPEG__CAPTURE_ENGINE__H__ */
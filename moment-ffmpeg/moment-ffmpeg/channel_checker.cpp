@@ -4,6 +4,11 @@
 #include <moment-ffmpeg/media_reader.h>
 #include <moment-ffmpeg/time_checker.h>
 #include <moment-ffmpeg/naming_scheme.h>
+#include <moment-ffmpeg/record_index.h>
+#include <moment-ffmpeg/duration_probe.h>
+#include <moment-ffmpeg/record_scanner.h>
+
+#include <climits>
 
 #ifdef __linux__
 #include <dirent.h>
@@ -21,6 +26,7 @@ namespace MomentFFmpeg {
 
 #define CONCAT_INTERVAL 6
 #define TIMER_TICK 5 // in seconds
+#define CATALOG_TIMER_TICK 600 // in seconds, new recordings are reported by RecordCatalog
 
 static LogGroup libMary_logGroup_channelcheck ("mod_ffmpeg.channelcheck", LogLevel::E);
 static LogGroup libMary_logGroup_mutex ("mod_ffmpeg.mutex", LogLevel::E);
@@ -170,24 +176,25 @@ bool ChannelChecker::writeIdx(const std::string & dir_name, std::vector<std::str
     {
         StRef<String> const str_idx_file = st_makeString (dir_name.c_str(), "/", paths_idx[i].c_str(), "/", m_channel_name, ".idx");
         std::string idxFileName = str_idx_file->cstr();
-        std::ofstream idxFile;
-        idxFile.open(idxFileName);
         logD(channelcheck, _func_,"ChannelChecker.writeIdx idxFileName = ", idxFileName.c_str());
         ChannelFileTimes * channelFileTimes = & m_chDiskFileTimes[dir_name];
         ChannelFileTimes::const_iterator it = channelFileTimes->begin();
         bool bIsDone = false;
         logD(channelcheck, _func_,"ChannelChecker.writeIdx files_existence.size() = ", channelFileTimes->size());
+
+        // records are kept by file name, the directory is given by the idx location
+        RecordIndex::EntryList entries;
         for(it; it != channelFileTimes->end(); ++it)
         {
-            std::string path = it->first.substr(0,it->first.rfind("/"));
+            size_t const pos = it->first.rfind("/");
+            std::string path = it->first.substr(0,pos);
             if(path.compare(paths_idx[i]) == 0)
             {
-                idxFile << it->first;
-                idxFile << "|";
-                idxFile << it->second.timeStart;
-                idxFile << "|";
-                idxFile << it->second.timeEnd;
-                idxFile << std::endl;
+                RecordIndex::Entry entry;
+                entry.name = it->first.substr(pos + 1);
+                entry.timeStart = it->second.timeStart;
+                entry.timeEnd = it->second.timeEnd;
+                entries.push_back(entry);
 
                 bIsDone = true;
                 bRes = true;
@@ -197,7 +204,11 @@ bool ChannelChecker::writeIdx(const std::string & dir_name, std::vector<std::str
                 break;
             }
         }
-        idxFile.close();
+
+        if(!RecordIndex::update(idxFileName.c_str(), entries))
+        {
+            logD(channelcheck, _func_, "fail to write idxFile: ", idxFileName.c_str());
+        }
     }
 
     Time t;tc.Stop(&t);
@@ -206,79 +217,117 @@ bool ChannelChecker::writeIdx(const std::string & dir_name, std::vector<std::str
     return bRes;
 }
 
-bool ChannelChecker::readIdx()
+void ChannelChecker::setRecord(const std::string & path, const ChChDiskTimes & chChDiskTimes)
 {
-    TimeChecker tc;tc.Start();
+    ChannelFileDiskTimes::iterator it = m_chFileDiskTimes.find(path);
+    if(it != m_chFileDiskTimes.end())
+    {
+        ChChTimes const & times = it->second.times;
+        if(it->second.diskName.compare(chChDiskTimes.diskName) == 0 && times.timeStart == chChDiskTimes.times.timeStart)
+        {
+            if(times.timeEnd == chChDiskTimes.times.timeEnd)
+                return;
 
-    bool bRes = false;
+            // the record which is being written, the file list of the snapshot stays the same
+            Count const numFiles = m_fileIndex ? m_fileIndex->getNumFiles() : 0;
+            if(numFiles && m_fileIndex->getPath(numFiles - 1).compare(path) == 0)
+                m_fileIndex = m_fileIndex->withLastEnd(chChDiskTimes.times.timeEnd);
+            else
+                m_fileIndex = NULL;
 
-    std::string curPath = m_recpathConfig->GetNextPath();
+            if(m_timeline.extend(times, chChDiskTimes.times.timeEnd))
+            {
+                it->second.times.timeEnd = chChDiskTimes.times.timeEnd;
+                m_chDiskFileTimes[chChDiskTimes.diskName][path].timeEnd = chChDiskTimes.times.timeEnd;
+                return;
+            }
+        }
+        else
+        {
+            m_fileIndex = NULL;
+        }
 
-    while(curPath.length() != 0)
+        m_timeline.remove(it->second.times);
+        if(it->second.diskName.compare(chChDiskTimes.diskName) != 0)
+            m_chDiskFileTimes[it->second.diskName].erase(path);
+    }
+    else
     {
-        StRef<String> strRecDir = st_makeString(curPath.c_str());
-
-        IdxFileIterator idx_iter;
-        Ref<Vfs> const vfs = Vfs::createDefaultLocalVfs (strRecDir->mem());
-        idx_iter.init (vfs, m_channel_name->mem(), 0);
+        m_fileIndex = NULL;
+    }
 
-        StRef<String> str_path = idx_iter.getNext();
-        while(str_path != NULL)
-        {
-            StRef<String> full_str_path = st_makeString(strRecDir, "/", str_path);
-            std::string path = full_str_path->cstr();
-            std::ifstream idxFile;
-            idxFile.open(path);
+    m_chFileDiskTimes[path] = chChDiskTimes;
+    m_chDiskFileTimes[chChDiskTimes.diskName][path] = chChDiskTimes.times;
+    m_timeline.add(chChDiskTimes.times);
+}
 
-            std::string delimiter = "|";
-            if (idxFile.is_open())
-            {
-                std::string line;
-                while ( std::getline (idxFile, line) )
-                {
-                    StRef<String> strToken;
-                    int initTime = 0;
-                    int endTime = 0;
-                    size_t pos = 0;
+void ChannelChecker::eraseRecord(const std::string & path)
+{
+    ChannelFileDiskTimes::iterator it = m_chFileDiskTimes.find(path);
+    if(it == m_chFileDiskTimes.end())
+        return;
+
+    m_timeline.remove(it->second.times);
+    m_chDiskFileTimes[it->second.diskName].erase(path);
+    m_chFileDiskTimes.erase(it);
+    m_fileIndex = NULL;
+}
 
-                    pos = line.rfind(delimiter);
-                    strToken = st_makeString(line.substr(pos + delimiter.length()).c_str());
-                    strToInt32_safe(strToken->cstr(), &endTime);
-                    line.erase(pos);
+bool ChannelChecker::readIdxOnDisk(const std::string & diskName, ChannelFileTimes * fileTimes)
+{
+    TimeChecker tc;tc.Start();
 
-                    pos = line.rfind(delimiter);
-                    strToken = st_makeString(line.substr(pos + delimiter.length()).c_str());
-                    strToInt32_safe(strToken->cstr(), &initTime);
-                    line.erase(pos);
+    bool bRes = false;
 
-                    ChChDiskTimes chChDiskTimes;
-                    chChDiskTimes.times.timeStart = initTime;
-                    chChDiskTimes.times.timeEnd = endTime;
-                    chChDiskTimes.diskName = std::string(curPath);
+    StRef<String> strRecDir = st_makeString(diskName.c_str());
 
-                    m_chFileDiskTimes[line] = chChDiskTimes;
+    IdxFileIterator idx_iter;
+    Ref<Vfs> const vfs = Vfs::createDefaultLocalVfs (strRecDir->mem());
+    idx_iter.init (vfs, m_channel_name->mem(), 0);
 
-                    m_chDiskFileTimes[chChDiskTimes.diskName][line] = chChDiskTimes.times;
+    StRef<String> str_path = idx_iter.getNext();
+    while(str_path != NULL)
+    {
+        StRef<String> full_str_path = st_makeString(strRecDir, "/", str_path);
+        std::string path = full_str_path->cstr();
 
-                }
-                idxFile.close();
-                logD(channelcheck, _func_, "read successful, idxfile: ", path.c_str());
-                bRes = true;
-            }
+        // text indexes of older versions are converted once
+        if(!RecordIndex::isBinary(path.c_str()))
+        {
+            if(RecordIndex::convertText(path.c_str()))
+                logD(channelcheck, _func_, "converted text idxfile: ", path.c_str());
             else
+                logE_(_func_, "fail to convert text idxfile: ", path.c_str());
+        }
+
+        RecordIndex idx;
+        if (idx.open(path.c_str()))
+        {
+            std::string strIdxPath = str_path->cstr();
+            std::string prefix = strIdxPath.substr(0, strIdxPath.rfind("/") + 1);
+
+            RecordIndex::EntryList entries;
+            idx.getEntries(&entries);
+            for(int i = 0; i < entries.size(); i++)
             {
-                logD(channelcheck, _func_, "fail to open idxFile: ", path.c_str());
-                bRes = false;
+                ChChTimes & times = (*fileTimes)[prefix + entries[i].name];
+                times.timeStart = entries[i].timeStart;
+                times.timeEnd = entries[i].timeEnd;
             }
-
-            str_path = idx_iter.getNext();
+            logD(channelcheck, _func_, "read successful, idxfile: ", path.c_str());
+            bRes = true;
+        }
+        else
+        {
+            logD(channelcheck, _func_, "fail to open idxFile: ", path.c_str());
+            bRes = false;
         }
 
-        curPath = m_recpathConfig->GetNextPath(curPath);
+        str_path = idx_iter.getNext();
     }
 
     Time t;tc.Stop(&t);
-    logD(channelcheck, _func_, "ChannelChecker.readIdx exectime = [", t, "]");
+    logD(channelcheck, _func_, "ChannelChecker.readIdxOnDisk exectime = [", t, "]");
 
     return bRes;
 }
@@ -286,69 +335,24 @@ bool ChannelChecker::readIdx()
 ChannelChecker::ChannelTimes
 ChannelChecker::GetChannelTimes()
 {
-    logD(channelcheck, _func_,"channel_name: [", m_channel_name, "]");
+    return GetChannelTimes(INT_MIN, INT_MAX);
+}
+
+ChannelChecker::ChannelTimes
+ChannelChecker::GetChannelTimes(int timeFrom, int timeTo)
+{
+    logD(channelcheck, _func_,"channel_name: [", m_channel_name, "], timeFrom: [", timeFrom, "], timeTo: [", timeTo, "]");
 
     TimeChecker tc;tc.Start();
 
-    logD(mutex, _func_, "QQQQC 1");
-    cleanCache();
-    logD(mutex, _func_, "QQQQC 2");
-    updateCache(true);
+    refreshForReaders();
 
     logD(mutex, _func_, "QQQQC MUTEX _locked");
     m_mutex.lock();
 
     ChannelTimes chFileTimes;
-    ChannelFileDiskTimes::iterator it;
-    chFileTimes.reserve(m_chFileDiskTimes.size());
-    for(it = m_chFileDiskTimes.begin(); it != m_chFileDiskTimes.end(); ++it)
-    {
-        ChChTimes chChTimes;
-        chChTimes.timeStart = (*it).second.times.timeStart;
-        chChTimes.timeEnd = (*it).second.times.timeEnd;
-        chFileTimes.push_back(chChTimes);
-    }
-
-    if(chFileTimes.size() >= 2)
-    {
-        logD(mutex, _func_, "QQQQC chFileTimes.size() >= 2");
-        ChannelTimes::iterator itr = chFileTimes.begin();
-        std::advance (itr,1);
-logD(mutex, _func_, "QQQQC BEFORE concatination");
-        while(1)
-        {
-            if (itr == chFileTimes.end())
-                break;
-
-            std::vector<ChChTimes>::iterator it1 = itr;
-            std::advance (it1,-1);
-            if ((itr->timeStart - (it1)->timeEnd) < CONCAT_INTERVAL)
-            {
-                ChChTimes chChTimes;
-                chChTimes.timeStart = (it1)->timeStart;
-                chChTimes.timeEnd = (itr)->timeEnd;
-
-                std::vector<ChChTimes>::iterator prev = itr;
-                std::advance (prev,-1);
-                std::vector<ChChTimes>::iterator prevPrev = itr;
-                std::advance (prevPrev,-2);
-
-                chFileTimes.erase(itr);
-                chFileTimes.erase(prev);
-                std::vector<ChChTimes>::iterator prevPrev1 = prevPrev;
-                std::advance (prevPrev1,1);
-                chFileTimes.insert(prevPrev1, chChTimes);
-                itr = chFileTimes.begin();
-                std::advance (itr,1);
-            }
-            else ++itr;
-        }
-logD(mutex, _func_, "QQQQC AFTER concatination");
-    }
-    else
-    {
-        logD(mutex, _func_, "QQQQC chFileTimes.size() IS NOT >= 2");
-    }
+    chFileTimes.reserve(m_timeline.getRangeCount());
+    m_timeline.getRanges(timeFrom, timeTo, &chFileTimes);
 
     logD(mutex, _func_, "QQQQC MUTEX unlocked");
     m_mutex.unlock();
@@ -382,13 +386,78 @@ ChannelChecker::GetChannelFileDiskTimes ()
 
     TimeChecker tc;tc.Start();
 
-    cleanCache();
-    updateCache(true);
+    refreshForReaders();
+
+    logD(mutex, _func_, "QQQQC MUTEX _locked");
+    m_mutex.lock();
+
+    ChannelFileDiskTimes chFileDiskTimes = m_chFileDiskTimes;
+
+    logD(mutex, _func_, "QQQQC MUTEX unlocked");
+    m_mutex.unlock();
 
     Time t;tc.Stop(&t);
     logD(channelcheck, _func_,"getChannelFileDiskTimes exectime = [", t, "]");
 
-    return m_chFileDiskTimes;
+    return chFileDiskTimes;
+}
+
+Ref<RecordFileIndex>
+ChannelChecker::GetFileIndex ()
+{
+    logD(channelcheck, _func_,"channel_name: [", m_channel_name, "]");
+
+    refreshForReaders();
+
+    logD(mutex, _func_, "QQQQC MUTEX _locked");
+    m_mutex.lock();
+
+    if(!m_fileIndex)
+    {
+        TimeChecker tc;tc.Start();
+
+        RecordFileIndex::EntryList entries;
+        entries.reserve(m_chFileDiskTimes.size());
+        for(ChannelFileDiskTimes::iterator itr = m_chFileDiskTimes.begin(); itr != m_chFileDiskTimes.end(); ++itr)
+        {
+            RecordFileIndex::Entry entry;
+            entry.path = itr->first;
+            entry.diskName = itr->second.diskName;
+            entry.times = itr->second.times;
+            entries.push_back(entry);
+        }
+        m_fileIndex = RecordFileIndex::create(&entries);
+
+        Time t;tc.Stop(&t);
+        logD(channelcheck, _func_,"file index is rebuilt, files: ", m_fileIndex->getNumFiles(), ", exectime = [", t, "]");
+    }
+
+    Ref<RecordFileIndex> const fileIndex = m_fileIndex;
+
+    logD(mutex, _func_, "QQQQC MUTEX unlocked");
+    m_mutex.unlock();
+
+    return fileIndex;
+}
+
+void
+ChannelChecker::refreshForReaders()
+{
+    time_t const curTime = time(NULL);
+
+    m_mutex.lock();
+    bool const stale = (curTime != m_readerRefreshTime);
+    m_readerRefreshTime = curTime;
+    m_mutex.unlock();
+
+    if(!stale)
+        return;
+
+    cleanCache();
+    if(m_catalogued)
+        refreshLastRecord();
+    else
+        updateCache(true);
 }
 
 ChannelChecker::DiskSizes
@@ -425,14 +494,12 @@ ChannelChecker::initCache()
 
     TimeChecker tc;tc.Start();
 
-    logD(mutex, _func_, "QQQQC MUTEX _locked");
-    m_mutex.lock();
-
-    initCacheFromIdx();
-    completeCache();
-
-    logD(mutex, _func_, "QQQQC MUTEX unlocked");
-    m_mutex.unlock();
+    std::string curPath = m_recpathConfig->GetNextPath();
+    while(curPath.length() != 0)
+    {
+        scanDisk(curPath);
+        curPath = m_recpathConfig->GetNextPath(curPath);
+    }
 
     Time t;tc.Stop(&t);
     logD(channelcheck, _func_,"ChannelChecker.initCache exectime = [", t, "]");
@@ -440,32 +507,95 @@ ChannelChecker::initCache()
     return CheckResult_Success;
 }
 
-ChannelChecker::CheckResult
-ChannelChecker::initCacheFromIdx()
+void
+ChannelChecker::scanDisk(const std::string & diskName)
 {
-    logD(channelcheck, _func_,"channel_name: [", m_channel_name, "]");
+    logD(channelcheck, _func_,"channel_name: [", m_channel_name, "], disk: [", diskName.c_str(), "]");
 
     TimeChecker tc;tc.Start();
 
-    readIdx();
+    // the disk is read without holding m_mutex, the records are published at the end
+    ChannelFileTimes fileTimes;
+    readIdxOnDisk(diskName, &fileTimes);
+
+    std::vector<std::string> files_changed;
 
-    if(!m_chFileDiskTimes.empty()) // if cache is not empty, then we update only last record duration
+    // the last indexed record might have been written after the idx
+    std::string lastfile;
+    Time timeOfRecord = 0;
+    if(!fileTimes.empty())
     {
-        ChannelFileDiskTimes::reverse_iterator itr = m_chFileDiskTimes.rbegin();
-        addRecordInCache(itr->first, itr->second.diskName, true);
+        lastfile = fileTimes.rbegin()->first;
+        fileTimes[lastfile] = probeRecordTimes(lastfile, diskName, true);
+        files_changed.push_back(lastfile);
+
+        StRef<String> const flv_filename = st_makeString (lastfile.c_str(), ".flv");
+        FileNameToUnixTimeStamp().Convert(flv_filename, timeOfRecord);
+        timeOfRecord = timeOfRecord / 1000000000LL;
     }
 
-    ChannelFileDiskTimes::iterator itr = m_chFileDiskTimes.begin();
-    for(itr; itr != m_chFileDiskTimes.end(); itr++)
+    // files which are not indexed yet
     {
-        StRef<String> st_fullname = st_makeString(itr->second.diskName.c_str(), "/", itr->first.c_str(), ".flv");
-        m_occupSizes[itr->second.diskName][itr->first] = get_file_space(st_fullname->cstr());
+        NvrFileIterator file_iter;
+        StRef<String> strRecDir = st_makeString(diskName.c_str());
+        Ref<Vfs> const vfs = Vfs::createDefaultLocalVfs (strRecDir->mem());
+        file_iter.init (vfs, m_channel_name->mem(), timeOfRecord);
+
+        StRef<String> path = file_iter.getNext();
+        while(path != NULL && !path->isNullString())
+        {
+            std::string strpath = std::string(path->cstr());
+            if(strpath.compare(lastfile) != 0)
+            {
+                fileTimes[strpath] = probeRecordTimes(strpath, diskName, true);
+                files_changed.push_back(strpath);
+            }
+            path = file_iter.getNext();
+        }
     }
 
-    Time t;tc.Stop(&t);
-    logD(channelcheck, _func_,"ChannelChecker.initCacheFromIdx exectime = [", t, "]");
+    std::map<std::string, Uint64> occupSizes;
+    for(ChannelFileTimes::iterator itr = fileTimes.begin(); itr != fileTimes.end(); itr++)
+    {
+        StRef<String> st_fullname = st_makeString(diskName.c_str(), "/", itr->first.c_str(), ".flv");
+        occupSizes[itr->first] = get_file_space(st_fullname->cstr());
+    }
 
-    return CheckResult_Success;
+    logD(mutex, _func_, "QQQQC MUTEX _locked");
+    m_mutex.lock();
+
+    // records which have been added by the recording events during the scan
+    // are more recent than the ones read from the disk, deleted ones stay deleted
+    Count numPublished = 0;
+    for(ChannelFileTimes::iterator itr = fileTimes.begin(); itr != fileTimes.end(); itr++)
+    {
+        if(m_chFileDiskTimes.find(itr->first) != m_chFileDiskTimes.end()
+           || m_deletedDuringScan.find(itr->first) != m_deletedDuringScan.end())
+        {
+            continue;
+        }
+
+        ChChDiskTimes chChDiskTimes;
+        chChDiskTimes.times = itr->second;
+        chChDiskTimes.diskName = diskName;
+        setRecord(itr->first, chChDiskTimes);
+
+        m_occupSizes[diskName][itr->first] = occupSizes[itr->first];
+        ++numPublished;
+    }
+
+    writeIdx(diskName, files_changed);
+
+    if(m_scanPending > 0)
+        m_scanPending--;
+    if(!m_scanPending)
+        m_deletedDuringScan.clear();
+
+    logD(mutex, _func_, "QQQQC MUTEX unlocked");
+    m_mutex.unlock();
+
+    Time t;tc.Stop(&t);
+    logD(channelcheck, _func_,"ChannelChecker.scanDisk exectime = [", t, "], records: ", fileTimes.size(), ", published: ", numPublished);
 }
 
 bool
@@ -476,12 +606,21 @@ ChannelChecker::DeleteFromCache(const std::string & dirName, const std::string &
     logD(mutex, _func_, "QQQQC MUTEX _locked");
     m_mutex.lock();
 
-    m_chFileDiskTimes.erase(fileName);
+    eraseRecord(fileName);
     m_chDiskFileTimes[dirName].erase(fileName);
 
-    std::vector<std::string> files_changed;
-    files_changed.push_back(fileName);
-    writeIdx(dirName, files_changed);
+    // while the channel is being scanned the cache may lack the other records
+    // of this idx, the first cleanCache() after the scan writes it instead
+    if(!m_scanPending)
+    {
+        std::vector<std::string> files_changed;
+        files_changed.push_back(fileName);
+        writeIdx(dirName, files_changed);
+    }
+    else
+    {
+        m_deletedDuringScan.insert(fileName);
+    }
 
     m_occupSizes[dirName].erase(fileName);
 
@@ -491,6 +630,99 @@ ChannelChecker::DeleteFromCache(const std::string & dirName, const std::string &
     return true;
 }
 
+void
+ChannelChecker::OnRecordCreated(const std::string & dirName, const std::string & fileName)
+{
+    logD(channelcheck, _func_,"filename: [", dirName.c_str(), "/", fileName.c_str(), "]");
+
+    logD(mutex, _func_, "QQQQC MUTEX _locked");
+    m_mutex.lock();
+
+    // the previous record of the channel has been closed before this one was created
+    ChannelFileDiskTimes::reverse_iterator itr = m_chFileDiskTimes.rbegin();
+    if(itr != m_chFileDiskTimes.rend() && itr->first.compare(fileName) < 0)
+    {
+        std::string lastfile = itr->first;
+        std::string lastdir = itr->second.diskName;
+
+        addRecordInCache(lastfile, lastdir, true);
+
+        StRef<String> st_fullname = st_makeString(lastdir.c_str(), "/", lastfile.c_str(), ".flv");
+        m_occupSizes[lastdir][lastfile] = get_file_space(st_fullname->cstr());
+
+        if(!m_scanPending)
+        {
+            std::vector<std::string> files_changed;
+            files_changed.push_back(lastfile);
+            writeIdx(lastdir, files_changed);
+        }
+    }
+
+    addRecordInCache(fileName, dirName, false);
+
+    StRef<String> st_fullname = st_makeString(dirName.c_str(), "/", fileName.c_str(), ".flv");
+    m_occupSizes[dirName][fileName] = get_file_space(st_fullname->cstr());
+
+    if(!m_scanPending)
+    {
+        std::vector<std::string> files_changed;
+        files_changed.push_back(fileName);
+        writeIdx(dirName, files_changed);
+    }
+
+    logD(mutex, _func_, "QQQQC MUTEX unlocked");
+    m_mutex.unlock();
+}
+
+void
+ChannelChecker::OnRecordClosed(const std::string & dirName, const std::string & fileName)
+{
+    logD(channelcheck, _func_,"filename: [", dirName.c_str(), "/", fileName.c_str(), "]");
+
+    logD(mutex, _func_, "QQQQC MUTEX _locked");
+    m_mutex.lock();
+
+    addRecordInCache(fileName, dirName, true);
+
+    StRef<String> st_fullname = st_makeString(dirName.c_str(), "/", fileName.c_str(), ".flv");
+    m_occupSizes[dirName][fileName] = get_file_space(st_fullname->cstr());
+
+    if(!m_scanPending)
+    {
+        std::vector<std::string> files_changed;
+        files_changed.push_back(fileName);
+        writeIdx(dirName, files_changed);
+    }
+
+    logD(mutex, _func_, "QQQQC MUTEX unlocked");
+    m_mutex.unlock();
+}
+
+void
+ChannelChecker::Rescan()
+{
+    cleanCache();
+    updateCache(false);
+}
+
+void
+ChannelChecker::refreshLastRecord()
+{
+    logD(mutex, _func_, "QQQQC MUTEX _locked");
+    m_mutex.lock();
+
+    ChannelFileDiskTimes::reverse_iterator itr = m_chFileDiskTimes.rbegin();
+    if(itr != m_chFileDiskTimes.rend())
+    {
+        std::string lastfile = itr->first;
+        std::string lastdir = itr->second.diskName;
+        addRecordInCache(lastfile, lastdir, true);
+    }
+
+    logD(mutex, _func_, "QQQQC MUTEX unlocked");
+    m_mutex.unlock();
+}
+
 ChannelChecker::CheckResult
 ChannelChecker::updateCache(bool bForceUpdate)
 {
@@ -501,6 +733,14 @@ ChannelChecker::updateCache(bool bForceUpdate)
     logD(mutex, _func_, "QQQQC 2 MUTEX _locked");
     m_mutex.lock();
 
+    if(m_scanPending)
+    {
+        // the scan picks up new files itself, partial results are served meanwhile
+        logD(mutex, _func_, "QQQQC 2 MUTEX unlocked");
+        m_mutex.unlock();
+        return rez;
+    }
+
     TimeChecker tc;tc.Start();
 
     ChannelFileDiskTimes::reverse_iterator itr = m_chFileDiskTimes.rbegin();
@@ -611,59 +851,6 @@ logD(mutex, _func_, "QQQQC update 4");
     return rez;
 }
 
-ChannelChecker::CheckResult
-ChannelChecker::completeCache()
-{
-    logD(channelcheck, _func_,"channel_name: [", m_channel_name, "]");
-
-    TimeChecker tc;tc.Start();
-
-    CheckResult rez = CheckResult_Success;
-    std::string curPath = m_recpathConfig->GetNextPath();
-    while(curPath.length() != 0)
-    {
-        Time timeOfRecord = 0;
-        ChannelFileTimes * channelFileTimes = & m_chDiskFileTimes[curPath];
-        if(!channelFileTimes->empty())
-        {
-            std::string lastfile = channelFileTimes->rbegin()->first;
-            StRef<String> const flv_filename = st_makeString (lastfile.c_str(), ".flv");
-            FileNameToUnixTimeStamp().Convert(flv_filename, timeOfRecord);
-            timeOfRecord = timeOfRecord / 1000000000LL;
-        }
-
-        NvrFileIterator file_iter;
-        StRef<String> strRecDir = st_makeString(curPath.c_str());
-        Ref<Vfs> const vfs = Vfs::createDefaultLocalVfs (strRecDir->mem());
-        file_iter.init (vfs, m_channel_name->mem(), timeOfRecord);
-
-        std::vector<std::string> files_changed;
-
-        StRef<String> path = file_iter.getNext();
-        while(path != NULL && !path->isNullString())
-        {
-            std::string strpath = std::string(path->cstr());
-            addRecordInCache(strpath, curPath, true);
-            ChannelFileDiskTimes::iterator itr = m_chFileDiskTimes.begin();
-
-            StRef<String> st_fullname = st_makeString(curPath.c_str(), "/", strpath.c_str(), ".flv");
-            m_occupSizes[curPath][strpath] = get_file_space(st_fullname->cstr());
-
-            files_changed.push_back(strpath);
-            path = file_iter.getNext();
-        }
-
-        writeIdx(curPath, files_changed);
-
-        curPath = m_recpathConfig->GetNextPath(curPath);
-    }
-
-    Time t;tc.Stop(&t);
-    logD (channelcheck, _func_,"ChannelChecker.completeCache exectime = [", t, "]");
-
-    return rez;
-}
-
 ChannelChecker::CheckResult
 ChannelChecker::cleanCache()
 {
@@ -672,7 +859,7 @@ ChannelChecker::cleanCache()
     logD(mutex, _func_, "QQQQC 1 MUTEX _locked");
     m_mutex.lock();
 
-    if(m_chFileDiskTimes.empty())
+    if(m_chFileDiskTimes.empty() || m_scanPending)
     {
         logD(mutex, _func_, "QQQQC 1 MUTEX unlocked");
         m_mutex.unlock();
@@ -724,12 +911,10 @@ logD(mutex, _func_, "QQQQC clean 3.1");
                         logD(channelcheck, _func_,"clean it!");
                         files_changed.push_back(it->first);
 
-                        m_chDiskFileTimes[it->second.diskName].erase(it->first);
-                        m_chFileDiskTimes.erase(it);
-
                         m_occupSizes[it->second.diskName].erase(it->first);
 
-                        it++;
+                        std::string const expiredPath = (it++)->first;
+                        eraseRecord(expiredPath);
                     }
                     else
                     {
@@ -756,11 +941,15 @@ logD(mutex, _func_, "QQQQC clean 4");
                 {
                     files_changed.push_back(itr->first);
 
-                    m_chDiskFileTimes[itr->second.diskName].erase(itr->first);
-                    m_chFileDiskTimes.erase(itr);
                     m_occupSizes[itr->second.diskName].erase(itr->first);
+
+                    std::string const expiredPath = (itr++)->first;
+                    eraseRecord(expiredPath);
+                }
+                else
+                {
+                    itr++;
                 }
-                itr++;
             }
 logD(mutex, _func_, "QQQQC clean 4.1");
         }
@@ -780,6 +969,47 @@ logD(mutex, _func_, "QQQQC clean 6");
     return CheckResult_Success;
 }
 
+ChChTimes
+ChannelChecker::probeRecordTimes(const std::string & path, const std::string & strRecDir, bool bUpdate)
+{
+    StRef<String> const flv_filename = st_makeString (path.c_str(), ".flv");
+    StRef<String> flv_filenameFull = st_makeString(strRecDir.c_str(), "/", flv_filename);
+
+    Time timeOfRecord = 0;
+    FileNameToUnixTimeStamp().Convert(flv_filenameFull, timeOfRecord);
+    int const unixtime_timestamp_start = timeOfRecord / 1000000000LL;
+
+    int duration = FastGetDuration(flv_filenameFull->cstr());
+    if(duration < 0.1)
+    {
+        // onMetaData has no duration until the file is closed,
+        // so the timestamps are taken from the tags themselves
+        double probedDuration = 0.0;
+        if(DurationProbe::probe(flv_filenameFull->cstr(), &probedDuration))
+        {
+            duration = (int)probedDuration;
+        }
+        else if(bUpdate)
+        {
+            logD(channelcheck, _func_, "fast duration is failed");
+            // trying to get duration by ffmpeg
+            FileReader fileReader;
+            fileReader.Init(flv_filenameFull);
+            duration = (int)fileReader.GetDuration();
+        }
+        else
+        {
+            duration = 0;
+        }
+    }
+    logD(channelcheck, _func_,"flv duration = [", duration, "]");
+
+    ChChTimes times;
+    times.timeStart = unixtime_timestamp_start;
+    times.timeEnd = unixtime_timestamp_start + duration;
+    return times;
+}
+
 ChannelChecker::CheckResult
 ChannelChecker::addRecordInCache(const std::string & path, const std::string & strRecDir, bool bUpdate)
 {
@@ -789,39 +1019,10 @@ ChannelChecker::addRecordInCache(const std::string & path, const std::string & s
 
     if(m_chFileDiskTimes.find(path) == m_chFileDiskTimes.end() || bUpdate)
     {
-        StRef<String> const flv_filename = st_makeString (path.c_str(), ".flv");
-        StRef<String> flv_filenameFull = st_makeString(strRecDir.c_str(), "/", flv_filename);
-
-        Time timeOfRecord = 0;
-        FileNameToUnixTimeStamp().Convert(flv_filenameFull, timeOfRecord);
-        int const unixtime_timestamp_start = timeOfRecord / 1000000000LL;
-
-        int duration = FastGetDuration(flv_filenameFull->cstr());
-        if(duration < 0.1)
-        {
-            if(bUpdate)
-            {
-                logD(channelcheck, _func_, "fast duration is failed");
-                // trying to get duration by ffmpeg
-                FileReader fileReader;
-                fileReader.Init(flv_filenameFull);
-                duration = (int)fileReader.GetDuration();
-            }
-            else
-            {
-                duration = 0;
-            }
-        }
-        int const unixtime_timestamp_end = unixtime_timestamp_start + duration;
-        logD(channelcheck, _func_,"flv duration = [", duration, "]");
-
         ChChDiskTimes chChDiskTimes;
-        chChDiskTimes.times.timeStart = unixtime_timestamp_start;
-        chChDiskTimes.times.timeEnd = unixtime_timestamp_end;
+        chChDiskTimes.times = probeRecordTimes(path, strRecDir, bUpdate);
         chChDiskTimes.diskName = strRecDir;
-        m_chFileDiskTimes[path] = chChDiskTimes;
-
-        m_chDiskFileTimes[chChDiskTimes.diskName][path] = chChDiskTimes.times;
+        setRecord(path, chChDiskTimes);
     }
 
     Time t;tc.Stop(&t);
@@ -837,25 +1038,42 @@ ChannelChecker::refreshTimerTick (void * const _self)
 
     logD (channelcheck, _func_);
 
-    self->cleanCache();
-    self->updateCache(false);
+    self->Rescan();
 }
 
 mt_const void
-ChannelChecker::init (Timers * const mt_nonnull timers, RecpathConfig * recpathConfig, StRef<String> & channel_name)
+ChannelChecker::init (Timers * const mt_nonnull timers, RecpathConfig * recpathConfig, StRef<String> & channel_name,
+                      RecordScanner * const scanner, bool const catalogued)
 {
     m_recpathConfig = recpathConfig;
     m_channel_name = channel_name;
+    m_catalogued = catalogued;
 
     logD(channelcheck, _func_,"m_channel_name=", m_channel_name);
 
-    initCache();
-    dumpData();
+    if(scanner)
+    {
+        std::vector<std::string> diskNames;
+        std::string curPath = m_recpathConfig->GetNextPath();
+        while(curPath.length() != 0)
+        {
+            diskNames.push_back(curPath);
+            curPath = m_recpathConfig->GetNextPath(curPath);
+        }
+
+        m_scanPending = diskNames.size();
+        scanner->addChannel(this, diskNames);
+    }
+    else
+    {
+        initCache();
+        dumpData();
+    }
 
     m_timers = timers;
 
     m_timer_key = m_timers->addTimer (CbDesc<Timers::TimerCallback> (refreshTimerTick, this, this),
-                      TIMER_TICK,
+                      m_catalogued ? CATALOG_TIMER_TICK : TIMER_TICK,
                       true /* periodical */,
                       false /* auto_delete */);
 }
@@ -878,7 +1096,7 @@ void ChannelChecker::dumpData()
     m_mutex.unlock();
 }
 
-ChannelChecker::ChannelChecker(): m_timers(this),m_timer_key(NULL), m_recpathConfig(NULL)
+ChannelChecker::ChannelChecker(): m_timers(this),m_timer_key(NULL), m_recpathConfig(NULL), m_timeline(CONCAT_INTERVAL), m_catalogued(false), m_scanPending(0), m_readerRefreshTime(0)
 {
 
 }
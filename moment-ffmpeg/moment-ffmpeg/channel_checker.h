@@ -4,6 +4,7 @@
 
 #include <vector>
 #include <map>
+#include <set>
 #include <string>
 #include <utility>
 #include <fstream>
@@ -11,6 +12,8 @@
 #include <moment/libmoment.h>
 #include <moment-ffmpeg/nvr_file_iterator.h>
 #include <moment-ffmpeg/rec_path_config.h>
+#include <moment-ffmpeg/record_timeline.h>
+#include <moment-ffmpeg/record_file_index.h>
 
 using namespace M;
 using namespace Moment;
@@ -18,12 +21,7 @@ using namespace Moment;
 namespace MomentFFmpeg {
 
 class RecpathConfig;
-
-struct ChChTimes
-{
-    int timeStart;
-    int timeEnd;
-};
+class RecordScanner;
 
 struct ChChDiskTimes
 {
@@ -54,14 +52,33 @@ public:
 
     typedef std::map<std::string, ChChDiskTimes> ChannelFileDiskTimes; // [filename,[diskname,[start time, end time]]]
 
-    mt_const void init (Timers * mt_nonnull timers, RecpathConfig * recpathConfig, StRef<String> & channel_name);
+    // With a scanner the cache is built in the background, otherwise right away.
+    // 'catalogued' means that RecordCatalog reports new recordings, so the
+    // directories are rescanned rarely, as a consistency check.
+    mt_const void init (Timers * mt_nonnull timers, RecpathConfig * recpathConfig, StRef<String> & channel_name,
+                        RecordScanner * scanner = NULL, bool catalogued = false);
+
+    // Reads the records of the channel on one recording disk and adds them to the cache.
+    // Called on the scanner threads.
+    void scanDisk (const std::string & diskName);
 
     // return by value because ChannelFileDiskTimes should be available from different threads and relatively long time
     ChannelTimes GetChannelTimes ();
+    // recorded ranges intersecting [timeFrom, timeTo]
+    ChannelTimes GetChannelTimes (int timeFrom, int timeTo);
     ChannelFileDiskTimes GetChannelFileDiskTimes ();
+    // the current snapshot of the records, shared with the other readers
+    Ref<RecordFileIndex> GetFileIndex ();
     DiskSizes GetDiskSizes ();
     bool DeleteFromCache(const std::string & dir_name, const std::string & fileName);
 
+    // recording events from RecordCatalog, fileName is without ".flv"
+    void OnRecordCreated(const std::string & dir_name, const std::string & fileName);
+    void OnRecordClosed(const std::string & dir_name, const std::string & fileName);
+
+    // checks the cache against the recording directories
+    void Rescan();
+
     // helper func (for performance reason)
     std::pair<std::string, ChChDiskTimes> GetOldestFileDiskTimes();
 
@@ -75,20 +92,40 @@ private:
      // cache of all records. it is doubled to keep different convenient(low demand cpu operations) variants for media reader and writing idx
      ChannelDiskFileTimes m_chDiskFileTimes;
      ChannelFileDiskTimes m_chFileDiskTimes;
+     // merged time ranges of m_chFileDiskTimes, kept in sync by setRecord/eraseRecord
+     RecordTimeline m_timeline;
 
      StateMutex m_mutex;
      mt_const DataDepRef<Timers> m_timers;
      Timers::TimerKey m_timer_key;
 
+     // snapshot of m_chFileDiskTimes for GetFileIndex(), NULL if it is to be rebuilt
+     mt_mutex(m_mutex) Ref<RecordFileIndex> m_fileIndex;
+
+     // readers bring the cache up to date at most once a second
+     mt_mutex(m_mutex) time_t m_readerRefreshTime;
+     void refreshForReaders();
+
+     void setRecord(const std::string & path, const ChChDiskTimes & chChDiskTimes);
+     void eraseRecord(const std::string & path);
+
+     mt_const bool m_catalogued;
+
+     // disks which haven't been scanned yet, the idx files aren't rewritten until then
+     mt_mutex(m_mutex) Count m_scanPending;
+     // records deleted while the scan is pending, the scan must not bring them back
+     mt_mutex(m_mutex) std::set<std::string> m_deletedDuringScan;
+
      bool writeIdx(const std::string & dir_name, std::vector<std::string> & files_changed);
-     bool readIdx();
+     bool readIdxOnDisk(const std::string & diskName, ChannelFileTimes * fileTimes);
 
      CheckResult initCache ();
-     CheckResult initCacheFromIdx ();
-     CheckResult completeCache ();
      CheckResult cleanCache ();
      CheckResult updateCache(bool bForceUpdate);
+     // updates the duration of the record which is being written, without listing directories
+     void refreshLastRecord();
      CheckResult addRecordInCache (const std::string & path, const std::string & record_dir, bool bUpdate);
+     static ChChTimes probeRecordTimes (const std::string & path, const std::string & record_dir, bool bUpdate);
 
      void dumpData();
 
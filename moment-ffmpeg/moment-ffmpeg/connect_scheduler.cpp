@@ -0,0 +1,312 @@
+/*  Moment-FFmpeg - FFmpeg support module for Moment Video Server
+    Copyright (C) 2011-2013 Dmitry Shatrov
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include <json/json.h>
+
+#include <moment-ffmpeg/connect_scheduler.h>
+
+
+using namespace M;
+using namespace Moment;
+
+namespace MomentFFmpeg {
+
+static LogGroup libMary_logGroup_connect ("mod_ffmpeg.connect", LogLevel::E);
+
+mt_mutex (mutex) void
+ConnectScheduler::removeFromPending (Source * const mt_nonnull source)
+{
+    if (!source->pending_el)
+        return;
+
+    if (source->has_viewers)
+        priority_queue.remove (source->pending_el);
+    else
+        pending_queue.remove (source->pending_el);
+
+    source->pending_el = NULL;
+}
+
+mt_mutex (mutex) void
+ConnectScheduler::grantConnects (SourceList * const mt_nonnull ret_granted)
+{
+    while (num_connects < max_connects) {
+        SourceList * const queue = (!priority_queue.isEmpty() ? &priority_queue : &pending_queue);
+        if (queue->isEmpty())
+            break;
+
+        Ref<Source> const source = queue->getFirst();
+        queue->remove (queue->getFirstElement());
+        source->pending_el = NULL;
+
+        source->state = SourceState_Connecting;
+        ++num_connects;
+
+        ret_granted->append (source);
+    }
+}
+
+void
+ConnectScheduler::notifyGranted (SourceList * const mt_nonnull granted)
+{
+    while (!granted->isEmpty()) {
+        Ref<Source> const source = granted->getFirst();
+        granted->remove (granted->getFirstElement());
+
+        logD (connect, _func, "granted: ", source->name);
+
+        // If the stream is gone, it has called removeSource() already
+        // or will do so from its destructor, which frees the slot.
+        source->frontend.call (source->frontend->connectGranted);
+    }
+}
+
+Ref<ConnectScheduler::Source>
+ConnectScheduler::addSource (CbDesc<Frontend> const &frontend,
+                             ConstMemory        const name)
+{
+    Ref<Source> const source = grab (new (std::nothrow) Source);
+    source->frontend = frontend;
+    source->name = st_grab (new (std::nothrow) String (name));
+
+    mutex.lock ();
+    source->source_el = source_list.append (source);
+    mutex.unlock ();
+
+    return source;
+}
+
+void
+ConnectScheduler::removeSource (Source * const mt_nonnull source)
+{
+    SourceList granted;
+
+    mutex.lock ();
+
+    if (source->removed) {
+        mutex.unlock ();
+        return;
+    }
+
+    source->removed = true;
+
+    removeFromPending (source);
+
+    if (source->state == SourceState_Connecting) {
+        assert (num_connects > 0);
+        --num_connects;
+        grantConnects (&granted);
+    }
+    source->state = SourceState_Idle;
+
+    source_list.remove (source->source_el);
+    source->source_el = NULL;
+
+    mutex.unlock ();
+
+    notifyGranted (&granted);
+}
+
+void
+ConnectScheduler::requestConnect (Source * const mt_nonnull source)
+{
+    SourceList granted;
+
+    mutex.lock ();
+
+    if (source->removed
+        || source->state == SourceState_Pending
+        || source->state == SourceState_Connecting)
+    {
+        mutex.unlock ();
+        return;
+    }
+
+    source->state = SourceState_Pending;
+    if (source->has_viewers)
+        source->pending_el = priority_queue.append (source);
+    else
+        source->pending_el = pending_queue.append (source);
+
+    grantConnects (&granted);
+
+    mutex.unlock ();
+
+    notifyGranted (&granted);
+}
+
+Time
+ConnectScheduler::connectDone (Source * const mt_nonnull source,
+                               bool     const success)
+{
+    SourceList granted;
+    Time delay_millisec = 0;
+
+    mutex.lock ();
+
+    if (source->state == SourceState_Connecting) {
+        assert (num_connects > 0);
+        --num_connects;
+        grantConnects (&granted);
+    }
+
+    if (success) {
+        source->num_failures = 0;
+        source->state = SourceState_Idle;
+    } else {
+        delay_millisec = min_backoff_millisec;
+        for (Count i = 0; i < source->num_failures && delay_millisec < max_backoff_millisec; ++i)
+            delay_millisec *= 2;
+
+        if (delay_millisec > max_backoff_millisec)
+            delay_millisec = max_backoff_millisec;
+
+        // Jitter keeps the sources which have failed at the same moment
+        // from retrying at the same moment.
+        delay_millisec = delay_millisec / 2 + randomUint32() % (delay_millisec / 2 + 1);
+
+        ++source->num_failures;
+
+        if (!source->removed) {
+            source->state = SourceState_BackingOff;
+            source->retry_time_millisec = getTimeMilliseconds() + delay_millisec;
+        }
+    }
+
+    logD (connect, _func, source->name, " success: ", success, ", "
+          "failures: ", source->num_failures, ", delay_millisec: ", delay_millisec);
+
+    mutex.unlock ();
+
+    notifyGranted (&granted);
+
+    return delay_millisec;
+}
+
+void
+ConnectScheduler::setHasViewers (Source * const mt_nonnull source,
+                                 bool     const has_viewers)
+{
+    mutex.lock ();
+
+    if (source->has_viewers == has_viewers) {
+        mutex.unlock ();
+        return;
+    }
+
+    if (source->pending_el) {
+        removeFromPending (source);
+        source->has_viewers = has_viewers;
+        // Going to the tail: the source doesn't overtake the ones which
+        // have been waiting at the same priority.
+        if (has_viewers)
+            source->pending_el = priority_queue.append (source);
+        else
+            source->pending_el = pending_queue.append (source);
+    } else {
+        source->has_viewers = has_viewers;
+    }
+
+    mutex.unlock ();
+}
+
+StRef<String>
+ConnectScheduler::stateToJson ()
+{
+    static char const * const state_names [] = {
+        "idle",
+        "pending",
+        "connecting",
+        "backing_off"
+    };
+
+    updateTime ();
+    Time const cur_time_millisec = getTimeMilliseconds();
+
+    Json::Value json_root;
+    Json::Value json_sources (Json::arrayValue);
+
+    mutex.lock ();
+
+    json_root["max_connects"] = Json::UInt64 (max_connects);
+    json_root["connecting"]   = Json::UInt64 (num_connects);
+    json_root["pending"]      = Json::UInt64 (priority_queue.getNumElements() + pending_queue.getNumElements());
+
+    {
+        SourceList::iter iter (source_list);
+        while (!source_list.iter_done (iter)) {
+            Source * const source = source_list.iter_next (iter)->data;
+
+            Json::Value json_source;
+            json_source["name"] = source->name->cstr();
+            json_source["state"] = state_names [source->state];
+            json_source["has_viewers"] = source->has_viewers;
+            json_source["failures"] = Json::UInt64 (source->num_failures);
+            if (source->state == SourceState_BackingOff) {
+                json_source["retry_in_millisec"] = Json::UInt64 (
+                        source->retry_time_millisec > cur_time_millisec ?
+                                source->retry_time_millisec - cur_time_millisec : 0);
+            }
+
+            json_sources.append (json_source);
+        }
+    }
+
+    mutex.unlock ();
+
+    json_root["sources"] = json_sources;
+
+    Json::StyledWriter json_writer_styled;
+    std::string const json_respond = json_writer_styled.write (json_root);
+
+    return st_makeString (json_respond.c_str());
+}
+
+mt_const void
+ConnectScheduler::init (Count const max_connects,
+                        Time  const min_backoff_millisec,
+                        Time  const max_backoff_millisec)
+{
+    this->max_connects = (max_connects > 0 ? max_connects : 1);
+    this->min_backoff_millisec = (min_backoff_millisec > 0 ? min_backoff_millisec : 1);
+    this->max_backoff_millisec = (max_backoff_millisec > this->min_backoff_millisec ?
+                                          max_backoff_millisec : this->min_backoff_millisec);
+}
+
+ConnectScheduler::ConnectScheduler ()
+    : max_connects (1),
+      min_backoff_millisec (1000),
+      max_backoff_millisec (1000),
+      num_connects (0)
+{
+}
+
+ConnectScheduler::~ConnectScheduler ()
+{
+    mutex.lock ();
+    while (!priority_queue.isEmpty())
+        priority_queue.remove (priority_queue.getFirstElement());
+    while (!pending_queue.isEmpty())
+        pending_queue.remove (pending_queue.getFirstElement());
+    while (!source_list.isEmpty())
+        source_list.remove (source_list.getFirstElement());
+    mutex.unlock ();
+}
+
+}
@@ -0,0 +1,150 @@
+/*  Moment-FFmpeg - FFmpeg support module for Moment Video Server
+    Copyright (C) 2011-2013 Dmitry Shatrov
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef MOMENT_FFMPEG__CONNECT_SCHEDULER__H__
+#define MOMENT_FFMPEG__CONNECT_SCHEDULER__H__
+
+
+#include <libmary/types.h>
+#include <moment/libmoment.h>
+
+
+namespace MomentFFmpeg {
+
+using namespace M;
+using namespace Moment;
+
+// Decides when FFmpegStream instances may connect to their sources.
+//
+// Opening an input and probing it is expensive for the server and for
+// the cameras, so at most 'max_connects' attempts are in progress at once.
+// The rest of the sources wait in FIFO order, sources which have viewers
+// are served first. After a failed attempt a source backs off for a random
+// time in [delay / 2, delay], where the delay doubles with every failure
+// in a row up to 'max_backoff'. This spreads reconnects of many cameras
+// after a network failure.
+//
+// The scheduler does not drive the retries: a source asks for a connection
+// with requestConnect() after it has waited for the delay returned by
+// connectDone().
+class ConnectScheduler : public Object
+{
+private:
+    StateMutex mutex;
+
+public:
+    struct Frontend
+    {
+        // The source may connect now. It must call connectDone() when
+        // the attempt is over. Not called with any locks held.
+        void (*connectGranted) (void *cb_data);
+    };
+
+    enum SourceState {
+        SourceState_Idle,
+        SourceState_Pending,
+        SourceState_Connecting,
+        SourceState_BackingOff
+    };
+
+    class Source : public Referenced
+    {
+        friend class ConnectScheduler;
+
+    private:
+        mt_const Cb<Frontend> frontend;
+        mt_const StRef<String> name;
+
+        mt_mutex (ConnectScheduler::mutex) SourceState state;
+        mt_mutex (ConnectScheduler::mutex) bool  has_viewers;
+        mt_mutex (ConnectScheduler::mutex) bool  removed;
+        mt_mutex (ConnectScheduler::mutex) Count num_failures;
+        // For SourceState_BackingOff.
+        mt_mutex (ConnectScheduler::mutex) Time  retry_time_millisec;
+
+        mt_mutex (ConnectScheduler::mutex) List< Ref<Source> >::Element *source_el;
+        mt_mutex (ConnectScheduler::mutex) List< Ref<Source> >::Element *pending_el;
+
+        Source ()
+            : state (SourceState_Idle),
+              has_viewers (false),
+              removed (false),
+              num_failures (0),
+              retry_time_millisec (0),
+              source_el (NULL),
+              pending_el (NULL)
+        {}
+    };
+
+private:
+    typedef List< Ref<Source> > SourceList;
+
+    mt_const Count max_connects;
+    mt_const Time  min_backoff_millisec;
+    mt_const Time  max_backoff_millisec;
+
+    mt_mutex (mutex) SourceList source_list;
+    // Pending sources with viewers.
+    mt_mutex (mutex) SourceList priority_queue;
+    mt_mutex (mutex) SourceList pending_queue;
+
+    mt_mutex (mutex) Count num_connects;
+
+    mt_mutex (mutex) void removeFromPending (Source * mt_nonnull source);
+
+    // Takes the sources which may connect now off the queues.
+    mt_mutex (mutex) void grantConnects (SourceList * mt_nonnull ret_granted);
+
+    void notifyGranted (SourceList * mt_nonnull granted);
+
+public:
+    // 'name' is for the state report only.
+    Ref<Source> addSource (CbDesc<Frontend> const &frontend,
+                           ConstMemory              name);
+
+    // Frees the connection slot if the source holds one.
+    void removeSource (Source * mt_nonnull source);
+
+    // connectGranted() will be called for the source once there's a free slot,
+    // possibly before requestConnect() returns.
+    void requestConnect (Source * mt_nonnull source);
+
+    // Returns the delay before the next attempt in milliseconds,
+    // 0 on success.
+    Time connectDone (Source * mt_nonnull source,
+                      bool    success);
+
+    void setHasViewers (Source * mt_nonnull source,
+                        bool    has_viewers);
+
+    // State of every source in JSON, for the admin HTTP interface.
+    StRef<String> stateToJson ();
+
+    mt_const void init (Count max_connects,
+                        Time  min_backoff_millisec,
+                        Time  max_backoff_millisec);
+
+     ConnectScheduler ();
+    ~ConnectScheduler ();
+};
+
+}
+
+
+#endif /* MOMENT_FFMPEG__CONNECT_SCHEDULER__H__ */
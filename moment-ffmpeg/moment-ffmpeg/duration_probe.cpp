@@ -0,0 +1,322 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <moment-ffmpeg/duration_probe.h>
+
+
+using namespace M;
+using namespace Moment;
+
+namespace MomentFFmpeg {
+
+static LogGroup libMary_logGroup_durprobe ("mod_ffmpeg.duration_probe", LogLevel::E);
+
+// FLV tag header: type (1), data size (3), timestamp (3), extended timestamp (1), stream id (3).
+#define FLV_TAG_HEADER_SIZE 11
+// Tags which are looked at before giving up on finding the first audio/video tag.
+#define FLV_MAX_HEAD_TAGS   64
+// A keyframe of a high bitrate stream fits in this, so the last complete tag
+// of a segment which is being written is found there.
+#define FLV_TAIL_WINDOW     (1 << 20)
+
+#define TS_PACKET_SIZE      188
+#define TS_HEAD_WINDOW      (64 << 10)
+// PCR is sent at least every 100 ms, which is below 256 KB up to 20 Mbit/s.
+#define TS_TAIL_WINDOW      (256 << 10)
+
+static Uint32 readBe24 (Byte const * const buf)
+{
+    return ((Uint32) buf [0] << 16) | ((Uint32) buf [1] << 8) | (Uint32) buf [2];
+}
+
+static Uint32 readBe32 (Byte const * const buf)
+{
+    return ((Uint32) buf [0] << 24) | readBe24 (buf + 1);
+}
+
+// Returns the number of bytes read, which is less than 'len' at the end of the file.
+static Size readAt (int const fd, Byte * const buf, Size const len, Int64 const offset)
+{
+    Size total = 0;
+    while (total < len) {
+        ssize_t const res = pread (fd, buf + total, len - total, offset + total);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+
+            logD (durprobe, _func, "pread() failed: ", errnoString (errno));
+            break;
+        }
+
+        if (res == 0)
+            break;
+
+        total += res;
+    }
+
+    return total;
+}
+
+static int openForProbe (const char * const path, Int64 * const mt_nonnull ret_size)
+{
+    int const fd = ::open (path, O_RDONLY);
+    if (fd < 0) {
+        logD (durprobe, _func, "open() failed: ", path, ": ", errnoString (errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat (fd, &st) == -1) {
+        ::close (fd);
+        return -1;
+    }
+
+    *ret_size = st.st_size;
+    return fd;
+}
+
+static Uint32 flvTagTimestamp (Byte const * const hdr)
+{
+    return readBe24 (hdr + 4) | ((Uint32) hdr [7] << 24);
+}
+
+static bool flvTagIsMedia (Byte const * const hdr)
+{
+    Byte const type = hdr [0] & 0x1f;
+    return type == 8 /* audio */ || type == 9 /* video */;
+}
+
+// 'prev_tag_size' is the PreviousTagSize field which follows the tag.
+static bool flvTagIsValid (Byte const * const hdr, Uint32 const prev_tag_size)
+{
+    Byte const type = hdr [0] & 0x1f;
+    if (type != 8 && type != 9 && type != 18 /* script data */)
+        return false;
+
+    if (readBe24 (hdr + 1) + FLV_TAG_HEADER_SIZE != prev_tag_size)
+        return false;
+
+    // stream id is always 0
+    return hdr [8] == 0 && hdr [9] == 0 && hdr [10] == 0;
+}
+
+static bool flvFindFirstTimestamp (int const fd, Int64 const file_size, Uint32 * const mt_nonnull ret_ts)
+{
+    Byte hdr [FLV_TAG_HEADER_SIZE];
+    if (readAt (fd, hdr, 9, 0) < 9 || hdr [0] != 'F' || hdr [1] != 'L' || hdr [2] != 'V')
+        return false;
+
+    // header, then PreviousTagSize0
+    Int64 pos = (Int64) readBe32 (hdr + 5) + 4;
+    for (Count i = 0; i < FLV_MAX_HEAD_TAGS && pos + FLV_TAG_HEADER_SIZE <= file_size; ++i) {
+        if (readAt (fd, hdr, FLV_TAG_HEADER_SIZE, pos) < FLV_TAG_HEADER_SIZE)
+            return false;
+
+        if (flvTagIsMedia (hdr)) {
+            *ret_ts = flvTagTimestamp (hdr);
+            return true;
+        }
+
+        pos += FLV_TAG_HEADER_SIZE + readBe24 (hdr + 1) + 4;
+    }
+
+    return false;
+}
+
+static bool flvFindLastTimestamp (int const fd, Int64 const file_size, Uint32 * const mt_nonnull ret_ts)
+{
+    // Finished segment: the file ends with the PreviousTagSize of the last tag.
+    {
+        Byte buf [4];
+        if (readAt (fd, buf, 4, file_size - 4) == 4) {
+            Uint32 const prev_tag_size = readBe32 (buf);
+            Int64 const tag_pos = file_size - 4 - (Int64) prev_tag_size;
+            Byte hdr [FLV_TAG_HEADER_SIZE];
+            if (tag_pos > 0
+                && readAt (fd, hdr, FLV_TAG_HEADER_SIZE, tag_pos) == FLV_TAG_HEADER_SIZE
+                && flvTagIsValid (hdr, prev_tag_size)
+                && flvTagIsMedia (hdr))
+            {
+                *ret_ts = flvTagTimestamp (hdr);
+                return true;
+            }
+        }
+    }
+
+    // The tail is a partially written tag. Looking backwards for a
+    // PreviousTagSize which points at a valid tag header.
+    Size const window = file_size < FLV_TAIL_WINDOW ? (Size) file_size : (Size) FLV_TAIL_WINDOW;
+    Int64 const window_pos = file_size - window;
+
+    std::vector<Byte> buf (window);
+    Size const len = readAt (fd, &buf [0], window, window_pos);
+
+    for (Size pos = len >= 4 ? len - 4 : 0; pos > FLV_TAG_HEADER_SIZE; --pos) {
+        Uint32 const prev_tag_size = readBe32 (&buf [pos]);
+        if (prev_tag_size < FLV_TAG_HEADER_SIZE || prev_tag_size > pos)
+            continue;
+
+        Byte const * const hdr = &buf [pos - prev_tag_size];
+        if (flvTagIsValid (hdr, prev_tag_size) && flvTagIsMedia (hdr)) {
+            *ret_ts = flvTagTimestamp (hdr);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool
+DurationProbe::probeFlv (const char * const path, double * const mt_nonnull ret_duration_sec)
+{
+    Int64 file_size = 0;
+    int const fd = openForProbe (path, &file_size);
+    if (fd < 0)
+        return false;
+
+    Uint32 first_ts = 0;
+    Uint32 last_ts  = 0;
+    bool const ok = file_size > 9 + 4 + FLV_TAG_HEADER_SIZE
+                    && flvFindFirstTimestamp (fd, file_size, &first_ts)
+                    && flvFindLastTimestamp  (fd, file_size, &last_ts);
+    ::close (fd);
+
+    if (!ok) {
+        logD (durprobe, _func, "no timestamps: ", path);
+        return false;
+    }
+
+    // FLV timestamps are 32-bit milliseconds and may wrap
+    *ret_duration_sec = (double) (Uint32) (last_ts - first_ts) / 1000.0;
+
+    logD (durprobe, _func, path, ": ", *ret_duration_sec, " sec");
+    return true;
+}
+
+// Returns the offset of the first packet in 'buf', or -1.
+static Int64 tsFindSync (Byte const * const buf, Size const len)
+{
+    for (Size i = 0; i < TS_PACKET_SIZE && i + 2 * TS_PACKET_SIZE < len; ++i) {
+        if (buf [i] == 0x47 && buf [i + TS_PACKET_SIZE] == 0x47 && buf [i + 2 * TS_PACKET_SIZE] == 0x47)
+            return i;
+    }
+
+    return -1;
+}
+
+// Finds the first (or the last if 'last' is set) PCR in 'buf'. If '*pid' is
+// -1, the PCR of any PID is taken and '*pid' is set to it.
+static bool tsFindPcr (Byte const * const buf,
+                       Size         const len,
+                       bool         const last,
+                       int        * const mt_nonnull pid,
+                       Uint64     * const mt_nonnull ret_pcr)
+{
+    Int64 const start = tsFindSync (buf, len);
+    if (start < 0)
+        return false;
+
+    bool found = false;
+    for (Size pos = start; pos + TS_PACKET_SIZE <= len; pos += TS_PACKET_SIZE) {
+        Byte const * const pkt = buf + pos;
+        if (pkt [0] != 0x47)
+            break;
+
+        int const pkt_pid = ((pkt [1] & 0x1f) << 8) | pkt [2];
+        if (*pid >= 0 && pkt_pid != *pid)
+            continue;
+
+        // adaptation field with the PCR flag set
+        if (!(pkt [3] & 0x20) || pkt [4] < 7 || !(pkt [5] & 0x10))
+            continue;
+
+        // 33-bit base in 90 kHz units, the 27 MHz extension is not needed here
+        *ret_pcr = ((Uint64) pkt [6] << 25)
+                   | ((Uint64) pkt [7] << 17)
+                   | ((Uint64) pkt [8] << 9)
+                   | ((Uint64) pkt [9] << 1)
+                   | ((Uint64) pkt [10] >> 7);
+        *pid = pkt_pid;
+        found = true;
+
+        if (!last)
+            break;
+    }
+
+    return found;
+}
+
+bool
+DurationProbe::probeTs (const char * const path, double * const mt_nonnull ret_duration_sec)
+{
+    Int64 file_size = 0;
+    int const fd = openForProbe (path, &file_size);
+    if (fd < 0)
+        return false;
+
+    int pid = -1;
+    Uint64 first_pcr = 0;
+    Uint64 last_pcr  = 0;
+    bool ok = false;
+    {
+        std::vector<Byte> buf (TS_HEAD_WINDOW);
+        Size const len = readAt (fd, &buf [0], buf.size(), 0);
+        ok = tsFindPcr (&buf [0], len, false /* last */, &pid, &first_pcr);
+    }
+
+    if (ok) {
+        Size const window = file_size < TS_TAIL_WINDOW ? (Size) file_size : (Size) TS_TAIL_WINDOW;
+        std::vector<Byte> buf (window);
+        Size const len = readAt (fd, &buf [0], window, file_size - window);
+        ok = tsFindPcr (&buf [0], len, true /* last */, &pid, &last_pcr);
+    }
+    ::close (fd);
+
+    if (!ok) {
+        logD (durprobe, _func, "no PCR: ", path);
+        return false;
+    }
+
+    if (last_pcr < first_pcr)
+        last_pcr += (Uint64) 1 << 33;
+
+    *ret_duration_sec = (double) (last_pcr - first_pcr) / 90000.0;
+
+    logD (durprobe, _func, path, ": ", *ret_duration_sec, " sec");
+    return true;
+}
+
+bool
+DurationProbe::probe (const char * const path, double * const mt_nonnull ret_duration_sec)
+{
+    if (stringHasSuffix (ConstMemory (path, strlen (path)), ".ts", NULL /* ret_str */))
+        return probeTs (path, ret_duration_sec);
+
+    return probeFlv (path, ret_duration_sec);
+}
+
+}
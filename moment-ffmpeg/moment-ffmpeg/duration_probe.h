@@ -0,0 +1,53 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MOMENT_FFMPEG__DURATION_PROBE__H__
+#define MOMENT_FFMPEG__DURATION_PROBE__H__
+
+
+#include <moment/libmoment.h>
+
+
+namespace MomentFFmpeg {
+
+using namespace M;
+using namespace Moment;
+
+// Gets the duration of a recorded segment from the container framing alone,
+// without opening it with libavformat. Only the head and the tail of the file
+// are read, so the cost does not depend on the length of the segment and
+// segments that are still being written are handled as well.
+class DurationProbe
+{
+public:
+    // FLV: timestamp of the last complete tag minus the timestamp of the first
+    // audio/video tag. A partially written tag at the tail is skipped.
+    static bool probeFlv (const char * path, double * mt_nonnull ret_duration_sec);
+
+    // MPEG-TS: the last PCR minus the first PCR of the first PID carrying one.
+    static bool probeTs (const char * path, double * mt_nonnull ret_duration_sec);
+
+    // Picks one of the above by file extension.
+    static bool probe (const char * path, double * mt_nonnull ret_duration_sec);
+};
+
+}
+
+
+#endif /* MOMENT_FFMPEG__DURATION_PROBE__H__ */
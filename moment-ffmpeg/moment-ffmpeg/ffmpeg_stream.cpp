@@ -27,6 +27,9 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#ifndef PLATFORM_WIN32
+#include <poll.h>
+#endif
 
 
 using namespace M;
@@ -62,12 +65,17 @@ static LogGroup libMary_logGroup_frames   ("mod_ffmpeg.frames",   LogLevel::E);
 
 #define PROBESIZE (32768 * 10)
 #define PROBESIZEMAX PROBESIZE * 8
+#define PROBESIZE_MARGIN 32768 // added to the probed size kept in the probe cache
 
 extern "C"
 {
     extern AVOutputFormat ff_segment2_muxer;
     extern AVOutputFormat ff_stream_segment2_muxer;
 
+    // rtsp_input.c
+    extern int RtspInputFd(AVFormatContext * s);
+    extern int RtspInputBuffered(AVFormatContext * s);
+
     int MakeFullPath(const char * channel_name, int const file_duration_sec, char * fullPath, int iBufSize)
     {
         int i, indExtension = -1;
@@ -161,11 +169,9 @@ extern "C"
 static Time ff_blocking_timeout = 30000000; // in microsec
 static int interrupt_cb(void* arg)
 {
-    TimeChecker * tc = static_cast<TimeChecker*>(arg);
-    Time t;
-    tc->Stop(&t);
+    ffmpegStreamData * data = static_cast<ffmpegStreamData*>(arg);
 
-    if (t > ff_blocking_timeout)
+    if (data->IsInterrupted())
     {
         return 1;
     }
@@ -260,15 +266,24 @@ ffmpegStreamData::ffmpegStreamData(void)
     m_bIsRecording = false;
     m_bGotFirstFrame = false;
     m_pRecpathConfig = NULL;
+    m_recordInputCtx = NULL;
+    m_bRecordStreamsPending = false;
+    m_bRecordWaitKeyframe = false;
 
     audio_stream_idx = video_stream_idx = -1;
     m_file_duration_sec = -1;
     m_nProbeSize = PROBESIZE;
+    m_inputFd = -1;
+
+    m_bRecordQueued = false;
 }
 
 ffmpegStreamData::~ffmpegStreamData()
 {
     Deinit();
+
+    if(m_recordQueue)
+        m_recordWriter->removeQueue(m_recordQueue);
 }
 
 void ffmpegStreamData::CloseCodecs(AVFormatContext * pAVFrmtCntxt)
@@ -292,9 +307,22 @@ void ffmpegStreamData::CloseCodecs(AVFormatContext * pAVFrmtCntxt)
 void ffmpegStreamData::Deinit()
 {
     logD(stream, _func_, "ffmpegStreamData Deinit");
+    // pending packets refer to m_recordInputCtx, write them out first
+    if(m_recordQueue)
+        m_recordWriter->flush(m_recordQueue);
+    m_bRecordQueued = false;
+
     // close writer before any actions with reader
     m_nvrData.Deinit();
 
+    if(m_recordInputCtx)
+    {
+        avformat_free_context(m_recordInputCtx);
+        m_recordInputCtx = NULL;
+    }
+    m_bRecordStreamsPending = false;
+    m_bRecordWaitKeyframe = false;
+
     if(format_ctx)
     {
         CloseCodecs(format_ctx);
@@ -303,6 +331,7 @@ void ffmpegStreamData::Deinit()
 
         format_ctx = NULL;
     }
+    m_inputFd = -1;
 
     if (m_absf_ctx)
     {
@@ -321,6 +350,19 @@ void ffmpegStreamData::Deinit()
     m_tsCorrectors.clear();
 }
 
+// Bytes read by avformat_find_stream_info(). Packets read while probing stay
+// in the packet buffer, which is the only measure for inputs without pb (RTSP).
+static Int64 get_probed_size(AVFormatContext *ctx)
+{
+    if(ctx->pb)
+        return avio_tell(ctx->pb);
+
+    Int64 size = 0;
+    for(AVPacketList * pktl = ctx->packet_buffer; pktl; pktl = pktl->next)
+        size += pktl->pkt.size;
+    return size;
+}
+
 static int get_bit_rate(AVCodecContext *ctx)
 {
     int bit_rate;
@@ -344,8 +386,20 @@ static int get_bit_rate(AVCodecContext *ctx)
     return bit_rate;
 }
 
+bool ffmpegStreamData::OpenInput(const char * uri, AVDictionary ** opts)
+{
+    format_ctx = avformat_alloc_context();
+
+    format_ctx->interrupt_callback.callback = interrupt_cb;
+    format_ctx->interrupt_callback.opaque = this;
+
+    m_tcFFTimeout.Start();
+    // frees format_ctx on failure
+    return avformat_open_input(&format_ctx, uri, NULL, opts) == 0;
+}
+
 ffmpegStreamData::InitRes ffmpegStreamData::Init(const char * uri, const char * channel_name, const Ref<MConfig::Config> & config,
-                              Timers * timers, RecpathConfig * recpathConfig, AVDictionary ** opts)
+                              Timers * timers, RecpathConfig * recpathConfig, ProbeCache * probe_cache, AVDictionary ** opts)
 {
     if(!uri || !uri[0])
     {
@@ -365,13 +419,60 @@ ffmpegStreamData::InitRes ffmpegStreamData::Init(const char * uri, const char *
     logD(stream, _func_, "uri: ", uri);
     InitRes res = InitRes::Success;
 
-    format_ctx = avformat_alloc_context();
+    Ref<ProbeCache::Entry> cached;
+    if(probe_cache)
+        cached = probe_cache->lookup(uri);
+    bool bCacheHit = false;
 
-    format_ctx->interrupt_callback.callback = interrupt_cb;
-    format_ctx->interrupt_callback.opaque = &m_tcFFTimeout;
+    // avformat_open_input() takes the options it uses out of 'opts',
+    // a copy is needed to open the input again after a cache mismatch
+    AVDictionary * reopen_opts = NULL;
+    if(cached && opts && *opts)
+        av_dict_copy(&reopen_opts, *opts, 0);
+    // what the full probe has read, to be cached
+    Int64 nProbedSize = m_nProbeSize;
 
-    m_tcFFTimeout.Start();
-    if(avformat_open_input(&format_ctx, uri, NULL, opts) == 0)
+    bool bOpened = OpenInput(uri, opts);
+    bool const bCacheable = bOpened && probe_cache && ProbeCache::isCacheable(format_ctx);
+    if(bCacheable && cached)
+    {
+        logD(stream, _func_, "avformat_open_input, success");
+
+        if(cached->matchesLayout(format_ctx))
+        {
+            // The frame rate is known, so probing stops once the first frames
+            // have been decoded.
+            cached->apply(format_ctx);
+
+            g_mutexFFmpeg.lock();
+            m_tcFFTimeout.Start();
+            // only what was read last time, the full probe size on a mismatch
+            format_ctx->probesize = cached->getProbeSize();
+            format_ctx->fps_probe_size = 0;
+            if(avformat_find_stream_info(format_ctx, NULL) >= 0 && cached->matchesProbed(format_ctx))
+                bCacheHit = true;
+            g_mutexFFmpeg.unlock();
+        }
+
+        if(bCacheHit)
+        {
+            logD(stream, _func_, "probe cache hit");
+            av_dump_format(format_ctx, 0, uri, 0);
+        }
+        else
+        {
+            logD(stream, _func_, "probe cache mismatch, channel_name: ", channel_name);
+            probe_cache->remove(uri);
+
+            // the cached parameters may have been applied already, start over
+            CloseCodecs(format_ctx);
+            avformat_close_input(&format_ctx);
+            bOpened = OpenInput(uri, &reopen_opts);
+        }
+    }
+    av_dict_free(&reopen_opts);
+
+    if(bOpened && !bCacheHit)
     {
         logD(stream, _func_, "avformat_open_input, success");
         // Retrieve stream information
@@ -385,6 +486,11 @@ ffmpegStreamData::InitRes ffmpegStreamData::Init(const char * uri, const char *
         {
             logD(stream, _func_,"avformat_find_stream_info, success");
 
+            nProbedSize = get_probed_size(format_ctx);
+            logD(stream, _func_, "probed ", nProbedSize, " bytes of ", m_nProbeSize);
+            if(nProbedSize <= 0) // packets are not buffered, unknown
+                nProbedSize = m_nProbeSize;
+
             // Dump information about file onto standard error
             av_dump_format(format_ctx, 0, uri, 0);
         }
@@ -398,7 +504,7 @@ ffmpegStreamData::InitRes ffmpegStreamData::Init(const char * uri, const char *
         }
         g_mutexFFmpeg.unlock();
     }
-    else
+    else if(!bOpened)
     {
         logE_(_func_, "Couldn't open uri [", uri, "]");
         res = InitRes::Failure;
@@ -502,6 +608,14 @@ ffmpegStreamData::InitRes ffmpegStreamData::Init(const char * uri, const char *
         }
     }
 
+    if(bCacheable)
+    {
+        if(res == InitRes::Success && !bCacheHit)
+            probe_cache->store(uri, format_ctx, std::min(nProbedSize + PROBESIZE_MARGIN, m_nProbeSize));
+        else if(res != InitRes::Success && bCacheHit)
+            probe_cache->remove(uri);
+    }
+
     if(res == InitRes::Success)
     {
         if(m_absf_ctx == NULL)
@@ -616,6 +730,21 @@ ffmpegStreamData::InitRes ffmpegStreamData::Init(const char * uri, const char *
             }
 
             m_bRecordingState = ! bDisableRecord;
+
+            if(audio_stream_idx != -1
+               && format_ctx->streams[audio_stream_idx]->codec->codec_id == AV_CODEC_ID_AAC
+               && format_ctx->streams[audio_stream_idx]->codec->extradata_size == 0)
+            {
+                // ADTS AAC, the AudioSpecificConfig is set by aac_adtstoasc
+                // when the first audio packet is filtered
+                logD(stream, _func_, "channel_name: ", channel_name, ", copying streams at the first audio packet");
+                m_bRecordStreamsPending = true;
+            }
+            else if(!CopyStreamsForRecord())
+            {
+                logE_(_func_, "channel_name: ", channel_name, ", fail to copy streams, disabling writing");
+                m_bRecordingEnable = false;
+            }
         }
     }
 
@@ -623,10 +752,66 @@ ffmpegStreamData::InitRes ffmpegStreamData::Init(const char * uri, const char *
     {
         Deinit();
     }
+    else if(res == InitRes::Success)
+    {
+#ifndef PLATFORM_WIN32
+        m_inputFd = RtspInputFd(format_ctx);
+#endif
+        if(m_inputFd == -1)
+            logE_(_func_, "channel_name: ", channel_name, ", the input can't be polled, reading it may hold a capture thread");
+
+        m_tcNoData.Start();
+    }
 
     return res;
 }
 
+void ffmpegStreamData::StopReading()
+{
+    m_stopReading.set(1);
+}
+
+bool ffmpegStreamData::HasInput()
+{
+    if(m_inputFd == -1)
+        return true;
+
+    if(RtspInputBuffered(format_ctx))
+        return true;
+
+#ifndef PLATFORM_WIN32
+    struct pollfd pfd;
+    pfd.fd = m_inputFd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    // errors and hangups are reported by av_read_frame
+    return poll(&pfd, 1, 0) != 0;
+#else
+    return true;
+#endif
+}
+
+bool ffmpegStreamData::IsInterrupted()
+{
+    // An interrupted av_read_frame() can't be resumed: the demuxer loses its
+    // position in the stream. So reads are interrupted only when the stream
+    // is being released or the source has been silent for too long.
+    if (m_stopReading.get())
+    {
+        return true;
+    }
+
+    Time t;
+    m_tcFFTimeout.Stop(&t);
+
+    if (t > ff_blocking_timeout)
+    {
+        return true;
+    }
+
+    return false;
+}
+
 int ffmpegStreamData::TsCorrector::CorrectPacket(AVPacket & packet)
 {
     if(!b_Init)
@@ -675,12 +860,12 @@ int ffmpegStreamData::TsCorrector::CorrectPacket(AVPacket & packet)
     return 0;
 }
 
-bool ffmpegStreamData::PushMediaPacket(FFmpegStream * pParent)
+ffmpegStreamData::PushRes ffmpegStreamData::PushMediaPacket(FFmpegStream * pParent)
 {
     if(!format_ctx || video_stream_idx == -1)
     {
         logD(stream, _func_, "PushMediaPacket failed, video_stream_idx = [", video_stream_idx, "]");
-        return false;
+        return PushRes::EndOfStream;
     }
 
     AVPacket packet = {};
@@ -688,6 +873,19 @@ bool ffmpegStreamData::PushMediaPacket(FFmpegStream * pParent)
 
     while(1)
     {
+        if(!HasInput())
+        {
+            Time tNoData;m_tcNoData.Stop(&tNoData);
+            if(tNoData > ff_blocking_timeout)
+            {
+                logE_(_func_, m_channelName, " no data for [", tNoData, "] microsec");
+                break;
+            }
+
+            // av_read_frame would wait for the source, let other channels use the thread
+            return PushRes::NoInput;
+        }
+
 #ifdef LIBMARY_PERFORMANCE_TESTING
 		TimeChecker* tcInOut = dynamic_cast<TimeChecker*>(pParent->getTimeChecker());
         tcInOut->Start();
@@ -700,11 +898,13 @@ bool ffmpegStreamData::PushMediaPacket(FFmpegStream * pParent)
         int res = 0;
 
         m_tcFFTimeout.Start();
-        if((res = av_read_frame(format_ctx, &packet)) < 0)
+        res = av_read_frame(format_ctx, &packet);
+        if(res < 0)
         {
             logD(frames, _func_, "av_read_frame failed, res = [", res, "]");
             break;
         }
+        m_tcNoData.Start();
 
         Time t;tc.Stop(&t);
         logD(frames, _func_, m_channelName, " av_read_frame exectime = [", t, "]");
@@ -791,6 +991,26 @@ bool ffmpegStreamData::PushMediaPacket(FFmpegStream * pParent)
             logD(frames, _func_, "PACKET IS NEITHER");
         }
 
+        if(m_bRecordStreamsPending && packet.stream_index == audio_stream_idx)
+        {
+            // nothing has been queued for recording yet, so the writer threads
+            // don't look at m_recordInputCtx
+            m_bRecordStreamsPending = false;
+            if(!CopyStreamsForRecord())
+            {
+                logE_(_func_, "channel_name: ", m_channelName, ", fail to copy streams, disabling writing");
+                m_bRecordingEnable = false;
+            }
+            else if(video_stream_idx != -1)
+            {
+                // video packets before this one have not been recorded
+                m_bRecordWaitKeyframe = true;
+            }
+        }
+
+        if(m_bRecordWaitKeyframe && packet.stream_index == video_stream_idx && (packet.flags & AV_PKT_FLAG_KEY))
+            m_bRecordWaitKeyframe = false;
+
         logD(frames, _func_, m_channelName, " ORIGIN PACKET,indx=", packet.stream_index,
                             ",pts=", packet.pts,
                             ",dts=", packet.dts,
@@ -836,86 +1056,37 @@ bool ffmpegStreamData::PushMediaPacket(FFmpegStream * pParent)
         }
 
         // write to file
-        bool bRecordingSuccess = false;
-        if(m_bRecordingEnable)
+        if(m_bRecordingEnable && !m_bRecordStreamsPending && !m_bRecordWaitKeyframe)
         {
             if(m_bRecordingState)
             {
-                while(true) // check paths until we got successful writing of packet OR we checked all paths
+                if(m_recordQueue)
                 {
-                    bool bNeedNextPath = false;
-                    // prepare to write in file
-                    if(!m_nvrData.IsInit())
-                    {
-                        if(m_recordDir == NULL || m_recordDir->len() == 0)
-                        {
-                            bNeedNextPath = true;
-                            logD(frames,_func_, "m_recordDir is 0");
-                        }
-                        else
-                        {
-                            StRef<String> filepath = st_makeString (m_recordDir, "/", m_channelName, ".flv");
-                            int nvrResult = m_nvrData.Init(format_ctx, m_channelName->cstr(), filepath->cstr(), "segment2", m_file_duration_sec);
-                            if(nvrResult == 1)
-                                bNeedNextPath = true;
-                            logD(frames,_func_, "m_nvrData.Init = ", (nvrResult == 0) ? "Success" : "Failed");
-                        }
-                    }
-
-                    // write in file
-                    if(m_nvrData.IsInit())
-                    {
-                        TimeChecker tc;tc.Start();
-
-                        int res = m_nvrData.WritePacket(format_ctx, packet);
-                        if(res == ERR_NOSPACE)
-                        {
-                            bNeedNextPath = true;
-                        }
-                        else
-                        {
-                            bRecordingSuccess = true;
-                        }
-
-                        logD(frames, _func_, "NvrData.WritePacket res = ", res);
-
-                        Time t;tc.Stop(&t);
-                        logD(frames, _func_, "NvrData.WritePacket exectime = [", t, "]");
-
-                        Time tInNvr;tcInNvr.Stop(&tInNvr);
-                        pParent->m_statMeasurer.AddTimeInNvr(tInNvr);
-                    }
-                    if(!m_pRecpathConfig->IsPathExist(m_recordDir->cstr()))
-                    {
-                        bNeedNextPath = true;
-                    }
-                    if(bNeedNextPath)
-                    {
-                        if(!m_pRecpathConfig->IsEmpty())
-                        {
-                            m_recordDir = st_makeString(m_pRecpathConfig->GetNextPathForStream().c_str());
-                        }
-                        else
-                            m_recordDir = st_makeString("");
-                        logD(frames,_func_, "next m_recordDir = [", m_recordDir, "]");
-
-                        m_nvrData.Deinit();
-                    }
-
-                    // if packet is successfully written OR we checked all paths and all of them have not free space
-                    if(bRecordingSuccess || m_recordDir == NULL || m_recordDir->len() == 0)
-                    {
-                        break;
-                    }
+                    // a stalled disk must not delay restreaming, the packet is written by a record writer thread
+                    bool const bKeyFrame = (packet.stream_index == video_stream_idx) && (packet.flags & AV_PKT_FLAG_KEY);
+                    m_recordWriter->push(m_recordQueue, &packet, tcInNvr, bKeyFrame);
+                    m_bRecordQueued = true;
+                }
+                else if(WriteRecordPacket(packet))
+                {
+                    Time tInNvr;tcInNvr.Stop(&tInNvr);
+                    pParent->m_statMeasurer.AddTimeInNvr(tInNvr);
                 }
             }
             else
             {
-                if(m_nvrData.IsInit())
-                    m_nvrData.Deinit();
+                if(!m_recordQueue)
+                {
+                    CloseRecord();
+                }
+                else if(m_bRecordQueued)
+                {
+                    // if the queue is full, try again with the next packet
+                    if(m_recordWriter->pushClose(m_recordQueue))
+                        m_bRecordQueued = false;
+                }
             }
         }
-        m_bIsRecording = bRecordingSuccess;
 
         // Free the packet that was allocated by av_read_frame
         av_free_packet(&packet);
@@ -928,7 +1099,7 @@ bool ffmpegStreamData::PushMediaPacket(FFmpegStream * pParent)
         memset(&packet, 0, sizeof(packet));
     }
 
-    return media_found;
+    return media_found ? PushRes::Pushed : PushRes::EndOfStream;
 }
 
 int ffmpegStreamData::SetRecordingState(bool const bState)
@@ -950,7 +1121,127 @@ bool ffmpegStreamData::IsRecording()
 
 stSourceInfo ffmpegStreamData::GetSourceInfo()
 {
-    return m_sourceInfo;
+    stSourceInfo si = m_sourceInfo;
+    if(m_recordQueue)
+    {
+        si.recordQueueUsed = true;
+        si.recordQueueStats = m_recordWriter->getStats(m_recordQueue);
+    }
+    return si;
+}
+
+void ffmpegStreamData::SetRecordQueue(RecordWriter * record_writer, RecordWriter::Queue * record_queue)
+{
+    m_recordWriter = record_writer;
+    m_recordQueue = record_queue;
+}
+
+bool ffmpegStreamData::CopyStreamsForRecord()
+{
+    m_recordInputCtx = avformat_alloc_context();
+    if(!m_recordInputCtx)
+        return false;
+
+    for(unsigned int i = 0; i < format_ctx->nb_streams; ++i)
+    {
+        AVStream * pInpStream = format_ctx->streams[i];
+        AVStream * pStream = avformat_new_stream(m_recordInputCtx, NULL);
+        if(!pStream || avcodec_copy_context(pStream->codec, pInpStream->codec) != 0)
+        {
+            avformat_free_context(m_recordInputCtx);
+            m_recordInputCtx = NULL;
+            return false;
+        }
+
+        pStream->time_base = pInpStream->time_base;
+        pStream->sample_aspect_ratio = pInpStream->sample_aspect_ratio;
+        pStream->avg_frame_rate = pInpStream->avg_frame_rate;
+        pStream->r_frame_rate = pInpStream->r_frame_rate;
+    }
+
+    return true;
+}
+
+bool ffmpegStreamData::WriteRecordPacket(AVPacket & packet)
+{
+    bool bRecordingSuccess = false;
+
+    while(true) // check paths until we got successful writing of packet OR we checked all paths
+    {
+        bool bNeedNextPath = false;
+        // prepare to write in file
+        if(!m_nvrData.IsInit())
+        {
+            if(m_recordDir == NULL || m_recordDir->len() == 0)
+            {
+                bNeedNextPath = true;
+                logD(frames,_func_, "m_recordDir is 0");
+            }
+            else
+            {
+                StRef<String> filepath = st_makeString (m_recordDir, "/", m_channelName, ".flv");
+                int nvrResult = m_nvrData.Init(m_recordInputCtx, m_channelName->cstr(), filepath->cstr(), "segment2", m_file_duration_sec);
+                if(nvrResult == 1)
+                    bNeedNextPath = true;
+                logD(frames,_func_, "m_nvrData.Init = ", (nvrResult == 0) ? "Success" : "Failed");
+            }
+        }
+
+        // write in file
+        if(m_nvrData.IsInit())
+        {
+            TimeChecker tc;tc.Start();
+
+            int res = m_nvrData.WritePacket(m_recordInputCtx, packet);
+            if(res == ERR_NOSPACE)
+            {
+                bNeedNextPath = true;
+            }
+            else
+            {
+                bRecordingSuccess = true;
+            }
+
+            logD(frames, _func_, "NvrData.WritePacket res = ", res);
+
+            Time t;tc.Stop(&t);
+            logD(frames, _func_, "NvrData.WritePacket exectime = [", t, "]");
+        }
+        if(!m_pRecpathConfig->IsPathExist(m_recordDir->cstr()))
+        {
+            bNeedNextPath = true;
+        }
+        if(bNeedNextPath)
+        {
+            if(!m_pRecpathConfig->IsEmpty())
+            {
+                m_recordDir = st_makeString(m_pRecpathConfig->GetNextPathForStream().c_str());
+            }
+            else
+                m_recordDir = st_makeString("");
+            logD(frames,_func_, "next m_recordDir = [", m_recordDir, "]");
+
+            m_nvrData.Deinit();
+        }
+
+        // if packet is successfully written OR we checked all paths and all of them have not free space
+        if(bRecordingSuccess || m_recordDir == NULL || m_recordDir->len() == 0)
+        {
+            break;
+        }
+    }
+
+    m_bIsRecording = bRecordingSuccess;
+
+    return bRecordingSuccess;
+}
+
+void ffmpegStreamData::CloseRecord()
+{
+    if(m_nvrData.IsInit())
+        m_nvrData.Deinit();
+
+    m_bIsRecording = false;
 }
 
 nvrData::nvrData(void)
@@ -1486,34 +1777,24 @@ FFmpegStream::deferredTask (void * const _self)
 }
 
 
-void
-FFmpegStream::workqueueThreadFunc (void * const _self)
+CaptureEngine::Frontend const FFmpegStream::capture_frontend = {
+    captureTurn
+};
+
+CaptureEngine::TurnResult
+FFmpegStream::captureTurn (Count const quantum,
+                           void * const _self)
 {
     FFmpegStream * const self = static_cast <FFmpegStream*> (_self);
 
-    updateTime ();
-
-    logD(pipeline, _func_);
-
     self->mutex.lock ();
 
-    self->tlocal = libMary_getThreadLocal();
-
-    for (;;) {
-        if (self->stream_closed) {
-            self->mutex.unlock ();
-            return;
-        }
-        while (self->workqueue_list.isEmpty()) {
-            self->workqueue_cond.wait (self->mutex);
-            updateTime ();
+    if (self->stream_closed) {
+        self->mutex.unlock ();
+        return CaptureEngine::TurnResult_Idle;
+    }
 
-            if (self->stream_closed) {
-                logD(pipeline, _func_, "stream is closed");
-                self->mutex.unlock ();
-                return;
-            }
-        }
+    if (!self->workqueue_list.isEmpty()) {
         Ref<WorkqueueItem> const workqueue_item = self->workqueue_list.getFirst();
         self->workqueue_list.remove (self->workqueue_list.getFirstElement());
 
@@ -1528,24 +1809,76 @@ FFmpegStream::workqueueThreadFunc (void * const _self)
             default:
                 unreachable ();
         }
-        self->mutex.lock ();
+
+        // Remaining items and packets are handled on the next turns.
+        return CaptureEngine::TurnResult_Again;
+    }
+
+    self->mutex.unlock ();
+
+    if (!self->m_bIsRestreaming)
+        return CaptureEngine::TurnResult_Idle;
+
+    return self->pushPackets (quantum);
+}
+
+RecordWriter::Frontend const FFmpegStream::record_frontend = {
+    recordWritePacket,
+    recordClose
+};
+
+void
+FFmpegStream::recordWritePacket (AVPacket    * const packet,
+                                 TimeChecker * const tc_read,
+                                 void        * const _self)
+{
+    FFmpegStream * const self = static_cast <FFmpegStream*> (_self);
+
+    if (self->m_ffmpegStreamData.WriteRecordPacket (*packet)) {
+        Time tInNvr;tc_read->Stop(&tInNvr);
+        self->m_statMeasurer.AddTimeInNvr(tInNvr);
     }
 }
 
 void
-FFmpegStream::ffmpegThreadFunc (void * const _self)
+FFmpegStream::recordClose (void * const _self)
 {
     FFmpegStream * const self = static_cast <FFmpegStream*> (_self);
+    self->m_ffmpegStreamData.CloseRecord ();
+}
+
+CaptureEngine::TurnResult
+FFmpegStream::pushPackets (Count const quantum)
+{
+    for (Count i = 0; i < quantum; ++i)
+    {
+        if (!m_bIsRestreaming)
+            return CaptureEngine::TurnResult_Idle;
 
-    logD(stream, _func_);
+        ffmpegStreamData::PushRes const res = m_ffmpegStreamData.PushMediaPacket(this);
+        if (res == ffmpegStreamData::PushRes::NoInput)
+            return CaptureEngine::TurnResult_WaitInput;
 
-    self->beginPushPacket();
+        if (res == ffmpegStreamData::PushRes::EndOfStream)
+        {
+            logD(stream, _func_, "EOS");
+
+            m_bIsRestreaming = false;
+            m_bIsReallyRestreaming = false;
 
-    logD(stream, _func_, "End of ffmpeg_thread");
+            eos_pending = true;
+
+            reportStatusEvents ();
+
+            return CaptureEngine::TurnResult_Idle;
+        }
+    }
+
+    return CaptureEngine::TurnResult_Again;
 }
 
 void
-FFmpegStream::beginPushPacket()
+FFmpegStream::startPushPackets ()
 {
     mutex.lock ();
     if (channel_opts->no_video_timeout > 0)
@@ -1560,22 +1893,44 @@ FFmpegStream::beginPushPacket()
                                                                             false /* auto_delete */);
     }
 
+    m_bIsRestreaming = true;
     mutex.unlock ();
 
-    while(m_bIsRestreaming)
-    {
-        if(!m_ffmpegStreamData.PushMediaPacket(this))
-        {
-            logD(stream, _func_, "EOS");
-
-            m_bIsRestreaming = false;
-            m_bIsReallyRestreaming = false;
+    capture_engine->setInputFd (capture_source, m_ffmpegStreamData.GetInputFd());
+    // Packets are read on the next turns.
+    capture_engine->schedule (capture_source);
+}
 
-            eos_pending = true;
+void
+FFmpegStream::retryTimerTick (void * const _self)
+{
+    FFmpegStream * const self = static_cast <FFmpegStream*> (_self);
 
-            reportStatusEvents ();
-        }
+    self->mutex.lock ();
+    if (self->retry_timer) {
+        self->timers->deleteTimer (self->retry_timer);
+        self->retry_timer = NULL;
     }
+    self->mutex.unlock ();
+
+    logD(pipeline, _func_, "init ffmpegStreamData again");
+    self->createPipeline ();
+}
+
+ConnectScheduler::Frontend const FFmpegStream::connect_frontend = {
+    connectGranted
+};
+
+void
+FFmpegStream::connectGranted (void * const _self)
+{
+    FFmpegStream * const self = static_cast <FFmpegStream*> (_self);
+
+    self->mutex.lock ();
+    self->connect_granted = true;
+    self->mutex.unlock ();
+
+    self->createPipeline ();
 }
 
 void
@@ -1591,8 +1946,6 @@ FFmpegStream::createSmartPipelineForUri ()
 
     AVDictionary *opts = 0;
     ffmpegStreamData::InitRes res = ffmpegStreamData::InitRes::Success;
-    bool bForcedTCP = false;
-    bool bForcedTCPTried = false;
 
     if (stream_closed) {
         mutex.lock ();
@@ -1602,52 +1955,54 @@ FFmpegStream::createSmartPipelineForUri ()
 
     logD(pipeline, _func, "uri: ", playback_item->stream_spec);
 
-    while(true)
+    mutex.lock ();
+    if (!connect_granted) {
+        mutex.unlock ();
+        // connectGranted() creates the pipeline again when it's our turn.
+        connect_scheduler->requestConnect (connect_source);
+        goto _return;
+    }
+    connect_granted = false;
+    mutex.unlock ();
+
+    // One connection attempt per turn, so that a dead camera doesn't hold
+    // a capture thread. Retries are driven by retry_timer.
+    //
+    // RTP is interleaved with RTSP: the capture engine waits for the RTSP
+    // socket instead of blocking a thread in av_read_frame.
+    capture_engine->setInputFd (capture_source, -1);
+    av_dict_set(&opts, "rtsp_transport", "tcp", 0);
+    res = m_ffmpegStreamData.Init( playback_item->stream_spec->cstr(), channel_opts->channel_name->cstr(),
+                                        this->config, this->timers, this->m_pRecpathConfig, probe_cache, &opts);
+    av_dict_free(&opts);
+
+    if(res != ffmpegStreamData::InitRes::Success)
     {
-        if(bForcedTCP && !bForcedTCPTried)
-        {
-            av_dict_set(&opts, "rtsp_transport", "tcp", 0);
-            res = m_ffmpegStreamData.Init( playback_item->stream_spec->cstr(), channel_opts->channel_name->cstr(),
-                                                this->config, this->timers, this->m_pRecpathConfig, &opts);
-            bForcedTCPTried = true;
-            bForcedTCP = false;
-        }
-        else
-        {
-            res = m_ffmpegStreamData.Init( playback_item->stream_spec->cstr(), channel_opts->channel_name->cstr(),
-                                                this->config, this->timers, this->m_pRecpathConfig, NULL);
-        }
+        m_ffmpegStreamData.Deinit();
 
-        if(res == ffmpegStreamData::InitRes::FailFindInfo && !bForcedTCPTried)
-        {
-            bForcedTCP = true;
-        }
+        Time const retry_delay_millisec = connect_scheduler->connectDone (connect_source, false /* success */);
 
-        if(res != ffmpegStreamData::InitRes::Success)
-        {
-            m_ffmpegStreamData.Deinit();
-            logD(pipeline, _func_, "wait for 1 sec and init ffmpegStreamData again");
-            sleep(1);
-            if(m_bReleaseCalled)
-            {
-                mutex.lock ();
-                goto _failure;
-            }
-        }
-        else
+        mutex.lock ();
+        if(m_bReleaseCalled || stream_closed)
+            goto _failure;
+
+        logD(pipeline, _func_, "wait for ", retry_delay_millisec, " ms and init ffmpegStreamData again");
+        if (!retry_timer)
         {
-            break;
+            retry_timer = timers->addTimer_microseconds (CbDesc<Timers::TimerCallback> (retryTimerTick,
+                                                                                        this /* cb_data */,
+                                                                                        this /* coderef_container */),
+                                                         retry_delay_millisec * 1000,
+                                                         false /* periodical */,
+                                                         false /* auto_delete */);
         }
+        mutex.unlock ();
+        goto _return;
     }
 
-    ffmpeg_thread =
-            grab (new (std::nothrow) Thread (CbDesc<Thread::ThreadFunc> (ffmpegThreadFunc,
-                                                                         this,
-                                                                         this)));
-    if (!ffmpeg_thread->spawn (true /* joinable */))
-        logE_ (_func, "Failed to spawn ffmpeg thread: ", exc->toString());
+    connect_scheduler->connectDone (connect_source, true /* success */);
 
-    m_bIsRestreaming = true;
+    startPushPackets ();
 
     logD(pipeline, _func, "all ok");
     goto _return;
@@ -1683,23 +2038,27 @@ FFmpegStream::doReleasePipeline ()
     m_bIsRestreaming = false;
     m_bIsReallyRestreaming = false;
 
-//    bool const join = (tlocal != libMary_getThreadLocal());
-
-//    if (join) {
-        if(ffmpeg_thread)
-        {
-            ffmpeg_thread->join();
-        }
-//    }
-
+    // We're in a capture turn, so no packets are being read at the moment.
+    capture_engine->setInputFd (capture_source, -1);
     m_ffmpegStreamData.Deinit();
 
     mutex.lock ();
     {
         stream_closed = true;
+
+        if (retry_timer) {
+            timers->deleteTimer (retry_timer);
+            retry_timer = NULL;
+        }
+
+        closed_cond.signal ();
     }
     mutex.unlock ();
 
+    capture_engine->removeSource (capture_source);
+    connect_scheduler->removeSource (connect_source);
+    video_stream->getEventInformer()->unsubscribe (stream_sbn);
+
 
     reportStatusEvents ();
     logD(pipeline, _func_, "released, m_bIsRestreaming is false");
@@ -1734,22 +2093,25 @@ FFmpegStream::releasePipeline ()
 
     m_bReleaseCalled = true;
 
+    // Unblocks a connection attempt or a read in progress.
+    m_ffmpegStreamData.StopReading();
+
     Ref<WorkqueueItem> const new_item = grab (new (std::nothrow) WorkqueueItem);
     new_item->item_type = WorkqueueItem::ItemType_ReleasePipeline;
 
     workqueue_list.prepend (new_item);
-    workqueue_cond.signal ();
-
-    bool const join = (tlocal != libMary_getThreadLocal());
-
-    Ref<Thread> const tmp_workqueue_thread = workqueue_thread;
-    workqueue_thread = NULL;
 
     mutex.unlock ();
 
-    if (join) {
-        if (tmp_workqueue_thread)
-            tmp_workqueue_thread->join ();
+    capture_engine->schedule (capture_source);
+
+    // Waiting for the release to complete, unless we're called from within
+    // a capture turn of this very stream.
+    if (!capture_engine->isInTurn (capture_source)) {
+        mutex.lock ();
+        while (!stream_closed)
+            closed_cond.wait (mutex);
+        mutex.unlock ();
     }
 
 }
@@ -2366,6 +2728,26 @@ VideoStream::EventHandler FFmpegStream::mix_stream_handler = {
     NULL /* numWatchersChanged */
 };
 
+VideoStream::EventHandler const FFmpegStream::stream_handler = {
+    NULL /* audioMessage */,
+    NULL /* videoMessage */,
+    NULL /* rtmpCommandMessage */,
+    NULL /* closed */,
+    streamNumWatchersChanged
+};
+
+void
+FFmpegStream::streamNumWatchersChanged (Count   const num_watchers,
+                                        void  * const _self)
+{
+    FFmpegStream * const self = static_cast <FFmpegStream*> (_self);
+
+    logD (pipeline, _func, "num_watchers: ", num_watchers);
+
+    // Channels which are being watched connect first.
+    self->connect_scheduler->setHasViewers (self->connect_source, num_watchers > 0);
+}
+
 void
 FFmpegStream::doCreatePipeline ()
 {
@@ -2406,9 +2788,10 @@ FFmpegStream::createPipeline ()
     new_item->item_type = WorkqueueItem::ItemType_CreatePipeline;
 
     workqueue_list.prepend (new_item);
-    workqueue_cond.signal ();
 
     mutex.unlock ();
+
+    capture_engine->schedule (capture_source);
 }
 
 void
@@ -2550,7 +2933,11 @@ FFmpegStream::init (CbDesc<MediaSource::Frontend> const &frontend,
                  PlaybackItem      * const playback_item,
                  MConfig::Config   * const config,
                  RecpathConfig     * const recpathConfig,
-                 ChannelChecker    * const channel_checker)
+                 ChannelChecker    * const channel_checker,
+                 CaptureEngine     * const capture_engine,
+                 ConnectScheduler  * const connect_scheduler,
+                 ProbeCache        * const probe_cache,
+                 RecordWriter      * const record_writer)
 {
     logD (pipeline, _this_func_);
 
@@ -2579,13 +2966,31 @@ FFmpegStream::init (CbDesc<MediaSource::Frontend> const &frontend,
 
     deferred_reg.setDeferredProcessor (deferred_processor);
 
+    this->capture_engine = capture_engine;
+    capture_source = capture_engine->addSource (
+            CbDesc<CaptureEngine::Frontend> (&capture_frontend, this, this));
+
+    this->connect_scheduler = connect_scheduler;
+    this->probe_cache = probe_cache;
+    connect_source = connect_scheduler->addSource (
+            CbDesc<ConnectScheduler::Frontend> (&connect_frontend, this, this),
+            channel_opts->channel_name->mem());
+
     {
-        workqueue_thread =
-                grab (new (std::nothrow) Thread (CbDesc<Thread::ThreadFunc> (workqueueThreadFunc,
-                                                                             this,
-                                                                             this)));
-        if (!workqueue_thread->spawn (true /* joinable */))
-            logE_ (_func, "Failed to spawn workqueue thread: ", exc->toString());
+        video_stream->lock ();
+        Count const num_watchers = video_stream->getNumWatchers_unlocked ();
+        video_stream->unlock ();
+
+        connect_scheduler->setHasViewers (connect_source, num_watchers > 0);
+    }
+
+    stream_sbn = video_stream->getEventInformer()->subscribe (
+            CbDesc<VideoStream::EventHandler> (&stream_handler, this, this));
+
+    if (record_writer) {
+        Ref<RecordWriter::Queue> const record_queue = record_writer->addQueue (
+                CbDesc<RecordWriter::Frontend> (&record_frontend, this, this));
+        m_ffmpegStreamData.SetRecordQueue (record_writer, record_queue);
     }
 }
 
@@ -2611,6 +3016,8 @@ FFmpegStream::FFmpegStream ()
       mix_video_stream (NULL),
 
       no_video_timer (NULL),
+      retry_timer (NULL),
+      connect_granted (false),
 
       initial_seek (0),
       initial_seek_pending  (true),
@@ -2664,7 +3071,6 @@ FFmpegStream::FFmpegStream ()
       rx_audio_bytes (0),
       rx_video_bytes (0),
 
-      tlocal (NULL),
       m_bIsRestreaming(false),
       m_bIsReallyRestreaming(false),
       m_bReleaseCalled(false),
@@ -2681,7 +3087,6 @@ FFmpegStream::~FFmpegStream ()
 
     mutex.lock ();
     assert (stream_closed);
-    assert (!workqueue_thread);
     mutex.unlock ();
 
     m_ffmpegStreamData.Deinit();
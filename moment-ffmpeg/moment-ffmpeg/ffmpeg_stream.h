@@ -35,6 +35,10 @@
 #include <moment-ffmpeg/rec_path_config.h>
 #include <moment-ffmpeg/channel_checker.h>
 #include <moment-ffmpeg/time_checker.h>
+#include <moment-ffmpeg/capture_engine.h>
+#include <moment-ffmpeg/connect_scheduler.h>
+#include <moment-ffmpeg/probe_cache.h>
+#include <moment-ffmpeg/record_writer.h>
 
 extern "C" {
 #ifndef INT64_C
@@ -88,12 +92,15 @@ struct stOtherStream
 
 struct stSourceInfo
 {
+    stSourceInfo():recordQueueUsed(false){}
     std::string sourceName;
     std::string uri;
     std::string title;
     std::vector<stVideoStream> videoStreams;
     std::vector<stAudioStream> audioStreams;
     std::vector<stOtherStream> otherStreams;
+    bool recordQueueUsed;
+    RecordWriter::Stats recordQueueStats;
 };
 
 class nvrData
@@ -171,15 +178,47 @@ public:
         Failure
     };
 
+    enum PushRes {
+        Pushed = 0,
+        NoInput,        // av_read_frame would wait for the source, try again when it's readable
+        EndOfStream
+    };
+
     ffmpegStreamData(void);
     ~ffmpegStreamData();
 
+    // 'probe_cache' may be NULL.
     InitRes Init(const char * uri, const char * channel_name, const Ref<MConfig::Config> & config,
-                Timers * timers, RecpathConfig * recpathConfig, AVDictionary **opts);
+                Timers * timers, RecpathConfig * recpathConfig, ProbeCache * probe_cache, AVDictionary **opts);
     void Deinit();
 
-    // if PushMediaPacket returns 'false' consequently it is the end of stream (EOS).
-    bool PushMediaPacket(FFmpegStream * pParent);
+    // Reads packets until a media packet is pushed to pParent. Stops early
+    // with PushRes::NoInput once there's nothing to read without waiting.
+    // The source is EOS after it has been silent for ff_blocking_timeout.
+    PushRes PushMediaPacket(FFmpegStream * pParent);
+
+    // The socket which the source is read from, -1 if the input can't be polled.
+    int GetInputFd() const { return m_inputFd; }
+
+    // Returns true if av_read_frame won't wait for the source: the demuxer
+    // holds some data or the socket is readable. Always true without a socket.
+    bool HasInput();
+
+    // Makes blocking ffmpeg calls in progress fail as soon as possible.
+    // Can be called from any thread, there's no way back.
+    void StopReading();
+
+    // used by ffmpeg's interrupt callback
+    bool IsInterrupted();
+
+    // Packets are handed over to record_writer's threads instead of being written
+    // to disk on the capture thread. Without a queue they are written synchronously.
+    void SetRecordQueue(RecordWriter * record_writer, RecordWriter::Queue * record_queue);
+
+    // Writes the packet to the current record path, switching paths if needed.
+    // Returns false if there is no path to write to.
+    bool WriteRecordPacket(AVPacket & packet);
+    void CloseRecord();
 
     static void CloseCodecs(AVFormatContext * pAVFrmtCntxt);
 
@@ -192,6 +231,12 @@ public:
 
 private /*functions*/:
 
+    // Allocates format_ctx and opens the input, format_ctx is NULL on failure.
+    bool OpenInput(const char * uri, AVDictionary ** opts);
+
+    // Copies parameters of the input streams to m_recordInputCtx.
+    bool CopyStreamsForRecord();
+
 private /*variables*/:
 
     AVFormatContext *   format_ctx;
@@ -212,9 +257,24 @@ private /*variables*/:
     nvrData m_nvrData;
     RecpathConfig * m_pRecpathConfig;
 
+    // Input streams as seen by the recorder. The reader may change format_ctx's
+    // codec contexts at any time, while recorded packets are written on
+    // record_writer's threads.
+    AVFormatContext * m_recordInputCtx;
+    bool m_bRecordStreamsPending;   // m_recordInputCtx waits for the AAC extradata
+    bool m_bRecordWaitKeyframe;     // recording starts at the next video keyframe
+
+    Ref<RecordWriter>           m_recordWriter;
+    Ref<RecordWriter::Queue>    m_recordQueue;
+    bool m_bRecordQueued;       // packets have been queued since the last close request
+
     AVBitStreamFilterContext * m_absf_ctx; // filter for malformed aac
 
     TimeChecker m_tcFFTimeout; // timer for timeout in ffmpeg blocking operations such as av_read_frame
+    TimeChecker m_tcNoData;    // time since the last packet has been read
+    AtomicInt m_stopReading;   // set by StopReading()
+
+    int m_inputFd;             // RTSP socket of format_ctx, -1 if unknown
 
     stSourceInfo m_sourceInfo;
 
@@ -286,8 +346,15 @@ private:
     mt_const Ref<VideoStream> video_stream;
     mt_const Ref<VideoStream> mix_video_stream;
 
-    mt_const Ref<Thread> workqueue_thread;
-    mt_const Ref<Thread> ffmpeg_thread;
+    mt_const Ref<CaptureEngine> capture_engine;
+    mt_const Ref<CaptureEngine::Source> capture_source;
+
+    mt_const Ref<ConnectScheduler> connect_scheduler;
+    mt_const Ref<ConnectScheduler::Source> connect_source;
+
+    mt_const GenericInformer::SubscriptionKey stream_sbn;
+
+    mt_const Ref<ProbeCache> probe_cache;
 
 
     DeferredProcessor::Task deferred_task;
@@ -302,7 +369,12 @@ private:
     mt_begin
 
     List< Ref<WorkqueueItem> > workqueue_list;
-    Cond workqueue_cond;
+    // Signalled when 'stream_closed' becomes true.
+    Cond closed_cond;
+
+    Timers::TimerKey retry_timer;
+    // The connect scheduler has allowed the next connection attempt.
+    bool connect_granted;
 
     Timers::TimerKey no_video_timer;
 
@@ -381,8 +453,6 @@ private:
     // Bytes generated (video fakesink's sink pad).
     Uint64 rx_video_bytes;
 
-    LibMary_ThreadLocal *tlocal;
-
     volatile bool m_bIsRestreaming;
     volatile bool m_bIsReallyRestreaming; // set by successness of firing msg in doVideo/AudioData
     bool m_bReleaseCalled;      // called releasePipeline when we are in init stage in createSmartPipelineForUri
@@ -391,10 +461,35 @@ private:
 
     mt_const Cb<MediaSource::Frontend> frontend;
 
-    static void workqueueThreadFunc (void *_self);
+  mt_iface (CaptureEngine::Frontend)
+    static CaptureEngine::Frontend const capture_frontend;
+
+    // Runs on one of the capture engine's threads: handles a workqueue item
+    // or sends up to 'quantum' 'ffmpeg' packets (video and/or audio).
+    static CaptureEngine::TurnResult captureTurn (Count quantum, void *_self);
+  mt_iface_end
+
+    CaptureEngine::TurnResult pushPackets (Count quantum);
+
+    void startPushPackets ();
+
+    static void retryTimerTick (void *_self);
+
+  mt_iface (ConnectScheduler::Frontend)
+    static ConnectScheduler::Frontend const connect_frontend;
 
-    // thread for sending of 'ffmpeg' packets (video and/or audio)
-    static void ffmpegThreadFunc (void *_self);
+    static void connectGranted (void *_self);
+  mt_iface_end
+
+  mt_iface (RecordWriter::Frontend)
+    static RecordWriter::Frontend const record_frontend;
+
+    static void recordWritePacket (AVPacket    *packet,
+                                   TimeChecker *tc_read,
+                                   void        *_self);
+
+    static void recordClose (void *_self);
+  mt_iface_end
 
   // Pipeline manipulation
 
@@ -436,6 +531,11 @@ private:
 
     static VideoStream::EventHandler mix_stream_handler;
 
+    static VideoStream::EventHandler const stream_handler;
+
+    static void streamNumWatchersChanged (Count  num_watchers,
+                                          void  *_self);
+
   mt_iface_end
 
 public:
@@ -446,8 +546,6 @@ public:
     void getTrafficStats (TrafficStats * mt_nonnull ret_traffic_stats);
     void resetTrafficStats ();
 
-    void beginPushPacket();
-
     int GetRecordingState(bool & bState);
     int SetRecordingState(bool const bState);
 
@@ -477,7 +575,11 @@ public:
                         PlaybackItem      *playback_item,
                         MConfig::Config *config,
                         RecpathConfig *recpathConfig,
-                        ChannelChecker * channel_checker);
+                        ChannelChecker * channel_checker,
+                        CaptureEngine *capture_engine,
+                        ConnectScheduler *connect_scheduler,
+                        ProbeCache *probe_cache,
+                        RecordWriter *record_writer);
 
      FFmpegStream ();
     ~FFmpegStream ();
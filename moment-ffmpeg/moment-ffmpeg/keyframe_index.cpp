@@ -0,0 +1,249 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <moment-ffmpeg/keyframe_index.h>
+
+
+using namespace M;
+using namespace Moment;
+
+namespace MomentFFmpeg {
+
+static LogGroup libMary_logGroup_kfindex ("mod_ffmpeg.keyframe_index", LogLevel::E);
+
+static char const keyframe_index_magic [8] = { 'M', 'N', 'V', 'R', 'K', 'F', 'I', 0 };
+
+// One hour of video with a keyframe every 100 ms is well below that.
+#define MAX_INDEX_SIZE (4 << 20)
+
+static bool writeAll (int const fd, void const * const data, Size const len)
+{
+    Byte const *buf = (Byte const *) data;
+    Size left = len;
+    while (left > 0) {
+        ssize_t const res = ::write (fd, buf, left);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+
+            logE_ (_func, "write() failed: ", errnoString (errno));
+            return false;
+        }
+
+        buf  += res;
+        left -= res;
+    }
+
+    return true;
+}
+
+static KeyframeIndex::Record const * recordAt (Byte   const * const records,
+                                               Uint32 const   record_size,
+                                               Count  const   idx)
+{
+    return (KeyframeIndex::Record const *) (records + idx * record_size);
+}
+
+StRef<String>
+KeyframeIndex::makeIndexPath (ConstMemory const flv_path)
+{
+    ConstMemory name = flv_path;
+    stringHasSuffix (flv_path, ".flv", &name);
+    return st_makeString (name, ".kfi");
+}
+
+bool
+KeyframeIndex::create (const char * const flv_path)
+{
+    close ();
+
+    StRef<String> const path = makeIndexPath (ConstMemory (flv_path, strlen (flv_path)));
+
+    int const fd = ::open (path->cstr(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) {
+        logE_ (_func, "open() failed: ", path, ": ", errnoString (errno));
+        return false;
+    }
+
+    Header header;
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, keyframe_index_magic, sizeof (keyframe_index_magic));
+    header.version     = Version;
+    header.header_size = sizeof (Header);
+    header.record_size = sizeof (Record);
+
+    if (!writeAll (fd, &header, sizeof (header))) {
+        ::close (fd);
+        ::unlink (path->cstr());
+        return false;
+    }
+
+    m_fd = fd;
+    m_firstTime = -1;
+
+    logD (kfindex, _func, path);
+    return true;
+}
+
+bool
+KeyframeIndex::append (Int64 const pts_millisec, Int64 const offset)
+{
+    if (m_fd < 0)
+        return false;
+
+    if (m_firstTime < 0)
+        m_firstTime = pts_millisec;
+
+    Record record;
+    record.time_millisec = pts_millisec - m_firstTime;
+    record.offset        = offset;
+
+    // A single O_APPEND write per record: readers see either the whole
+    // record or none of it.
+    if (!writeAll (m_fd, &record, sizeof (record))) {
+        close ();
+        return false;
+    }
+
+    return true;
+}
+
+void
+KeyframeIndex::close ()
+{
+    if (m_fd >= 0) {
+        ::close (m_fd);
+        m_fd = -1;
+    }
+}
+
+bool
+KeyframeIndex::lookup (const char * const flv_path,
+                       Int64        const time_millisec,
+                       Int64      * const mt_nonnull ret_offset)
+{
+    StRef<String> const path = makeIndexPath (ConstMemory (flv_path, strlen (flv_path)));
+
+    int const fd = ::open (path->cstr(), O_RDONLY);
+    if (fd < 0) {
+        logD (kfindex, _func, "no index: ", path);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat (fd, &st) == -1
+        || (Size) st.st_size < sizeof (Header) + sizeof (Record)
+        || st.st_size > MAX_INDEX_SIZE)
+    {
+        ::close (fd);
+        return false;
+    }
+
+    std::vector<Byte> buf (st.st_size);
+    ssize_t res;
+    do {
+        res = pread (fd, &buf [0], buf.size(), 0);
+    } while (res < 0 && errno == EINTR);
+    ::close (fd);
+
+    if (res < (ssize_t) (sizeof (Header) + sizeof (Record)))
+        return false;
+
+    Header const * const header = (Header const *) &buf [0];
+    if (memcmp (header->magic, keyframe_index_magic, sizeof (keyframe_index_magic))
+        || header->version != Version
+        || header->header_size < sizeof (Header)
+        || header->record_size < sizeof (Record)
+        || header->header_size >= (Size) res)
+    {
+        logD (kfindex, _func, "not a keyframe index v", (Uint32) Version, ": ", path);
+        return false;
+    }
+
+    Count const count = ((Size) res - header->header_size) / header->record_size;
+    if (count == 0)
+        return false;
+
+    Byte const * const records = &buf [0] + header->header_size;
+
+    // The first record after 'time_millisec'.
+    Count left  = 0;
+    Count right = count;
+    while (left < right) {
+        Count const mid = left + (right - left) / 2;
+        if (recordAt (records, header->record_size, mid)->time_millisec <= time_millisec)
+            left = mid + 1;
+        else
+            right = mid;
+    }
+
+    *ret_offset = recordAt (records, header->record_size, left > 0 ? left - 1 : 0)->offset;
+
+    logD (kfindex, _func, path, ": ", time_millisec, " ms -> offset ", *ret_offset);
+    return true;
+}
+
+KeyframeIndex::KeyframeIndex ()
+    : m_fd (-1),
+      m_firstTime (-1)
+{
+}
+
+KeyframeIndex::~KeyframeIndex ()
+{
+    close ();
+}
+
+}
+
+// Used by the segment muxer, which is plain C.
+extern "C"
+{
+    void * KeyframeIndexCreate (const char * flv_path)
+    {
+        MomentFFmpeg::KeyframeIndex * const index = new (std::nothrow) MomentFFmpeg::KeyframeIndex;
+        if (!index)
+            return NULL;
+
+        if (!index->create (flv_path)) {
+            delete index;
+            return NULL;
+        }
+
+        return index;
+    }
+
+    void KeyframeIndexAppend (void * index, int64_t pts_millisec, int64_t offset)
+    {
+        static_cast <MomentFFmpeg::KeyframeIndex*> (index)->append (pts_millisec, offset);
+    }
+
+    void KeyframeIndexClose (void * index)
+    {
+        delete static_cast <MomentFFmpeg::KeyframeIndex*> (index);
+    }
+}
@@ -0,0 +1,91 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MOMENT_FFMPEG__KEYFRAME_INDEX__H__
+#define MOMENT_FFMPEG__KEYFRAME_INDEX__H__
+
+
+#include <moment/libmoment.h>
+
+
+namespace MomentFFmpeg {
+
+using namespace M;
+using namespace Moment;
+
+// Keyframe table of one recorded segment, kept next to it as <name>.kfi.
+//
+// The segment muxer appends a record for every video keyframe it writes,
+// so the table is usable while the segment is still being recorded.
+// The file is a Header followed by fixed-size Records in write order.
+// Time is counted from the first keyframe of the segment, which is where
+// the segment starts. An incomplete record at the tail is ignored.
+mt_unsafe class KeyframeIndex
+{
+public:
+    enum {
+        Version = 1
+    };
+
+    struct Header
+    {
+        char   magic [8];       // "MNVRKFI\0"
+        Uint32 version;
+        Uint32 header_size;
+        Uint32 record_size;
+        Uint32 reserved;
+    };
+
+    struct Record
+    {
+        Int64 time_millisec;    // since the first keyframe of the segment
+        Int64 offset;           // of the FLV tag holding the keyframe
+    };
+
+private:
+    int   m_fd;
+    Int64 m_firstTime;          // pts of the first keyframe in milliseconds, -1 if none
+
+public:
+    // Starts a new table for the segment at 'flv_path'.
+    bool create (const char * flv_path);
+
+    // 'pts_millisec' is the keyframe's own timestamp, 'offset' is where
+    // its tag starts in the segment.
+    bool append (Int64 pts_millisec, Int64 offset);
+
+    void close ();
+
+    // Finds the last keyframe at or before 'time_millisec' (the first one
+    // if the time is before it). Reads the table with a single pread().
+    static bool lookup (const char * flv_path,
+                        Int64        time_millisec,
+                        Int64      * mt_nonnull ret_offset);
+
+    // <name>.kfi for <name>.flv
+    static StRef<String> makeIndexPath (ConstMemory flv_path);
+
+    KeyframeIndex ();
+    ~KeyframeIndex ();
+};
+
+}
+
+
+#endif /* MOMENT_FFMPEG__KEYFRAME_INDEX__H__ */
@@ -21,6 +21,7 @@
 #include <moment-ffmpeg/time_checker.h>
 #include <moment-ffmpeg/naming_scheme.h>
 #include <moment-ffmpeg/ffmpeg_stream.h>
+#include <moment-ffmpeg/keyframe_index.h>
 #include <string>
 
 #ifdef PLATFORM_WIN32
@@ -685,6 +686,20 @@ bool FileReader::Seek(double dSeconds)
         return false;
     }
 
+    // with a keyframe table the exact position is known, and the file is not searched
+    Int64 offset = 0;
+    if(KeyframeIndex::lookup(m_fileName->cstr(), (Int64)(dSeconds * 1000), &offset))
+    {
+        if(av_seek_frame(format_ctx, -1, offset, AVSEEK_FLAG_BYTE) >= 0)
+        {
+            Time t;tc.Stop(&t);
+            logD(reader, _func_, "FileReader.Seek by keyframe index exectime = [", t, "]");
+            return true;
+        }
+
+        logD(reader, _func_, "byte seek to ", offset, " failed, searching the file");
+    }
+
     int64_t llTimeStamp = (int64_t)(dSeconds * AV_TIME_BASE);
     int res = avformat_seek_file(format_ctx, -1, Int64_Min, llTimeStamp, Int64_Max, 0);
 
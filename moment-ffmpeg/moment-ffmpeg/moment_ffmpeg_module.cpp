@@ -18,6 +18,7 @@
 
 
 #include <cctype>
+#include <climits>
 #ifndef PLATFORM_WIN32
 #include <mntent.h>
 #include <sys/statvfs.h>
@@ -27,8 +28,9 @@
 #include <moment/libmoment.h>
 
 #include <moment-ffmpeg/memory_dispatcher.h>
+#include <moment-ffmpeg/keyframe_index.h>
+#include <moment-ffmpeg/segment_file.h>
 #include <moment-ffmpeg/moment_ffmpeg_module.h>
-#include <moment-ffmpeg/video_part_maker.h>
 
 
 using namespace M;
@@ -41,6 +43,17 @@ namespace MomentFFmpeg {
 #define TIMER_STATMEASURER 5             // 5 seconds
 #define DOWNLOAD_LIMIT 3600             // 1 hour
 #define TIMER_UPDATE_SOURCES_TIMES 2    // 2 seconds
+#define CAPTURE_THREADS 16              // threads reading packets from all sources
+#define CAPTURE_QUANTUM 8               // packets per source in a row
+#define CAPTURE_WAIT_TIMEOUT 1000       // in milliseconds, a quiet source checks for EOS this often
+#define CONNECT_MAX 8                   // sources connecting at the same time
+#define CONNECT_BACKOFF_MIN 1000        // in milliseconds, delay after the first failure
+#define CONNECT_BACKOFF_MAX 60000       // in milliseconds
+#define RECORD_THREADS 4                // threads writing recorded packets to disk
+#define RECORD_QUEUE_SIZE 1024          // packets per source
+#define RECORD_BLOCK_TIMEOUT 100        // in milliseconds, for record_overflow = "block"
+#define SCAN_IO_DEPTH 1                 // concurrent record scans per recording disk
+#define PROBE_CACHE_DIR "/opt/nvr/probe_cache"
 
 static LogGroup libMary_logGroup_ffmpeg_module ("mod_ffmpeg.ffmpeg_module", LogLevel::E);
 static LogGroup libMary_logGroup_mutex ("mod_ffmpeg.mutex", LogLevel::E);
@@ -458,40 +471,74 @@ MomentFFmpegModule::printChannelInfoJson (PagePool::PageListHead * const page_li
 
 StRef<String>
 MomentFFmpegModule::channelFilesExistenceToJson (
-        ChannelChecker::ChannelFileDiskTimes * const mt_nonnull chFileDiskTimes)
+        RecordFileIndex * const mt_nonnull fileIndex,
+        int   const timeFrom,
+        int   const timeTo,
+        Count const offset,
+        Count const limit)
 {
-    if(!chFileDiskTimes)
-    {
-        logE_(_func_, "chFileDiskTimes is NULL");
-        return NULL;
-    }
-	
+     Count begin = 0;
+     Count end = 0;
+     fileIndex->findFiles(timeFrom, timeTo, &begin, &end);
+
      std::ostringstream s;
-	 
-     for(ChannelChecker::ChannelFileDiskTimes::iterator it = chFileDiskTimes->begin(); it != chFileDiskTimes->end(); ++it)
+
+     // every file is counted for "total", only the requested page is printed
+     Count total = 0;
+     for(Count idx = begin; idx < end; idx++)
      {
-         s << "{\n\"path\":\"";
-         s << (*it).first;
-         s <<"\",\n\"start\":";
-         s << (*it).second.times.timeStart;
-         s << ",\n\"end\":";
-         s << (*it).second.times.timeEnd;
-         s << "\n}";
-        ChannelChecker::ChannelFileDiskTimes::iterator it1 = it;
-        it1++;
-         if(it1 != chFileDiskTimes->end())
-             s << ",\n";
-         else
-             s << "\n";
+         if(!fileIndex->overlaps(idx, timeFrom, timeTo))
+             continue;
+
+         if(total >= offset && total - offset < limit)
+         {
+             ChChTimes const times = fileIndex->getTimes(idx);
+             if(total > offset)
+                 s << ",\n";
+             s << "{\n\"path\":\"";
+             s << fileIndex->getPath(idx);
+             s <<"\",\n\"start\":";
+             s << times.timeStart;
+             s << ",\n\"end\":";
+             s << times.timeEnd;
+             s << "\n}";
+         }
+
+         total++;
      }
 
      return st_makeString("{\n"
+                          "\"total\" : ", total, ",\n"
+                          "\"offset\" : ", offset, ",\n"
                           "\"filesSummary\" : [\n",
                           s.str().c_str(),
+                          (total > offset ? "\n" : ""),
                           "]\n"
                           "}\n");
 }
 
+static void
+threadLoadStatsToJson (List<ServerThreadContext::LoadStats> * const mt_nonnull stats_list,
+                       char const * const pool_name,
+                       Json::Value & json_threads)
+{
+    Count idx = 0;
+    List<ServerThreadContext::LoadStats>::iter iter (*stats_list);
+    while(!stats_list->iter_done(iter))
+    {
+        ServerThreadContext::LoadStats const & stats = stats_list->iter_next(iter)->data;
+
+        Json::Value json_thread;
+        json_thread["pool"] = pool_name;
+        json_thread["index"] = Json::UInt(idx++);
+        json_thread["pollables"] = Json::UInt64(stats.num_pollables);
+        json_thread["busy_permille"] = Json::UInt(stats.busy_permille);
+        json_thread["kbytes_per_sec"] = Json::UInt(stats.kbytes_per_sec);
+        json_thread["avg_iteration_usec"] = Json::UInt(stats.avg_iteration_microsec);
+        json_threads.append(json_thread);
+    }
+}
+
 StRef<String>
 MomentFFmpegModule::statisticsToJson (
         std::map<time_t, StatMeasure> * const mt_nonnull statPoints,
@@ -567,6 +614,54 @@ MomentFFmpegModule::statisticsToJson (
 
     json_root["statistics"] = json_statistics;
 
+    if(m_pMoment)
+    {
+        // current load of the server threads, sampled every second
+        Json::Value json_threads(Json::arrayValue);
+        {
+            List<ServerThreadContext::LoadStats> stats_list;
+            m_pMoment->getServerApp()->getThreadLoadStats(&stats_list);
+            threadLoadStatsToJson(&stats_list, "server", json_threads);
+        }
+        {
+            List<ServerThreadContext::LoadStats> stats_list;
+            m_pMoment->getRecorderThreadPool()->getThreadLoadStats(&stats_list);
+            threadLoadStatsToJson(&stats_list, "recorder", json_threads);
+        }
+        {
+            List<ServerThreadContext::LoadStats> stats_list;
+            m_pMoment->getReaderThreadPool()->getThreadLoadStats(&stats_list);
+            threadLoadStatsToJson(&stats_list, "reader", json_threads);
+        }
+        json_root["threads"] = json_threads;
+
+        // spare pages include the ones cached by the threads
+        {
+            PagePool::Statistics pool_stats;
+            List<PagePool::ThreadStatistics> thread_stats_list;
+            m_pMoment->getPagePool()->getStats(&pool_stats, &thread_stats_list);
+
+            Json::Value json_page_pool;
+            json_page_pool["spare_pages"] = Json::UInt64(pool_stats.num_spare_pages);
+            json_page_pool["busy_pages"] = Json::UInt64(pool_stats.num_busy_pages);
+
+            Json::Value json_page_pool_threads(Json::arrayValue);
+            List<PagePool::ThreadStatistics>::iter iter (thread_stats_list);
+            while(!thread_stats_list.iter_done(iter))
+            {
+                PagePool::ThreadStatistics const & thread_stats = thread_stats_list.iter_next(iter)->data;
+
+                Json::Value json_page_pool_thread;
+                json_page_pool_thread["spare_pages"] = Json::UInt64(thread_stats.num_spare_pages);
+                json_page_pool_thread["busy_pages"] = Json::Int64(thread_stats.num_busy_pages);
+                json_page_pool_threads.append(json_page_pool_thread);
+            }
+            json_page_pool["threads"] = json_page_pool_threads;
+
+            json_root["page_pool"] = json_page_pool;
+        }
+    }
+
 
     Json::StyledWriter json_writer_styled;
     std::string json_respond = json_writer_styled.write(json_root);
@@ -622,6 +717,21 @@ MomentFFmpegModule::sourceInfoToJson (const std::string source_name, const stSou
     }
     json_source["stream info"] = json_streams;
 
+    // recording queue
+    if(si.recordQueueUsed)
+    {
+        Json::Value json_record_queue;
+        json_record_queue["depth"] = Json::UInt64(si.recordQueueStats.depth);
+        json_record_queue["max depth"] = Json::UInt64(si.recordQueueStats.max_depth);
+        json_record_queue["capacity"] = Json::UInt64(si.recordQueueStats.capacity);
+        json_record_queue["written"] = Json::UInt64(si.recordQueueStats.written);
+        json_record_queue["dropped"] = Json::UInt64(si.recordQueueStats.dropped);
+        json_record_queue["overflows"] = Json::UInt64(si.recordQueueStats.overflows);
+        json_record_queue["stall time"] = Json::UInt64(si.recordQueueStats.stall_time_microsec);
+        json_record_queue["max write time"] = Json::UInt64(si.recordQueueStats.max_write_time_microsec);
+        json_source["record queue"] = json_record_queue;
+    }
+
     // times
     SourceStateTimes sst = m_sourceStateTimes[source_name];
     Json::Value json_times;
@@ -880,6 +990,7 @@ MomentFFmpegModule::removeVideoFiles(StRef<String> const channel_name,
             logD(ffmpeg_module, _func_, "remove by request: [", filenameFull, "]");
 
             vfs->removeFile (filenameFull->mem());
+            vfs->removeFile (KeyframeIndex::makeIndexPath (filenameFull->mem())->mem());
             vfs->removeSubdirsForFilename (filenameFull->mem());
 
             channelChecker->DeleteFromCache(itr->second.diskName, itr->first);
@@ -1021,6 +1132,42 @@ MomentFFmpegModule::adminHttpRequest (HTTPServerRequest &req, HTTPServerResponse
 
         StRef<String> st_channel_name = st_makeString(channel_name.c_str());
 
+        // all parameters but "stream" are optional: the whole archive in one page by default
+        Uint64 start_unixtime_sec = 0;
+        Uint64 end_unixtime_sec = INT_MAX;
+        Uint64 offset = 0;
+        Uint64 limit = (Uint64) -1;
+        {
+            struct {
+                char const *name;
+                Uint64     *value;
+            } const params [] = {
+                { "start",  &start_unixtime_sec },
+                { "end",    &end_unixtime_sec   },
+                { "offset", &offset             },
+                { "limit",  &limit              }
+            };
+
+            for (Count i = 0; i < sizeof (params) / sizeof (params [0]); ++i)
+            {
+                NameValueCollection::ConstIterator const iter = form.find(params [i].name);
+                if (iter == form.end())
+                    continue;
+
+                if (!strToUint64_safe (iter->second.c_str(), params [i].value, 10 /* base */) ||
+                    (i < 2 && *params [i].value > INT_MAX))
+                {
+                    logE_ (_func, "Bad \"", params [i].name, "\" request parameter value");
+                    resp.setStatus(HTTPResponse::HTTP_BAD_REQUEST);
+                    std::ostream& out = resp.send();
+                    out << "Bad \"" << params [i].name << "\" request parameter value";
+                    out.flush();
+                    logA(ffmpeg_module, _func_, "mod_nvr_admin 400 ", req.clientAddress().toString().c_str(), " ", req.getURI().c_str());
+                    goto _return;
+                }
+            }
+        }
+
         logD(mutex, _func_, "MUTEX _locked");
         self->m_mutex.lock();
 
@@ -1040,12 +1187,16 @@ MomentFFmpegModule::adminHttpRequest (HTTPServerRequest &req, HTTPServerResponse
         }
 
         Ref<ChannelChecker> channelChecker = itFFStream->second.getRefPtr()->GetChannelChecker();
-        ChannelChecker::ChannelFileDiskTimes chFileDiskTimes = channelChecker->GetChannelFileDiskTimes ();
 
         logD(mutex, _func_, "MUTEX unlocked");
         self->m_mutex.unlock();
 
-        StRef<String> const reply_body = channelFilesExistenceToJson (&chFileDiskTimes);
+        Ref<RecordFileIndex> const fileIndex = channelChecker->GetFileIndex ();
+        StRef<String> const reply_body = channelFilesExistenceToJson (fileIndex,
+                                                                      (int) start_unixtime_sec,
+                                                                      (int) end_unixtime_sec,
+                                                                      (Count) offset,
+                                                                      (Count) limit);
         logD(ffmpeg_module, _func, "reply: ", reply_body);
 
         resp.setStatus(HTTPResponse::HTTP_OK);
@@ -1063,6 +1214,15 @@ MomentFFmpegModule::adminHttpRequest (HTTPServerRequest &req, HTTPServerResponse
         out << reply_body->cstr();
         out.flush();
     }
+    else if(segments.size() == 2 && (segments[1].compare("connect_state") == 0))
+    {
+        StRef<String> reply_body = self->m_connect_scheduler->stateToJson();
+        resp.setStatus(HTTPResponse::HTTP_OK);
+        resp.setContentType("text/html");
+        std::ostream& out = resp.send();
+        out << reply_body->cstr();
+        out.flush();
+    }
     else if(segments.size() == 2 && (segments[1].compare("disk_info") == 0))
     {
         std::string jsonRespond;
@@ -1503,20 +1663,64 @@ MomentFFmpegModule::httpRequest (HTTPServerRequest &req, HTTPServerResponse &res
             goto _return;
         }
 
-        StRef<String> const pathToFile = self->doGetFile (channel_name, start_unixtime_sec, end_unixtime_sec);
+        Mp4Exporter mp4Exporter;
+        if(!self->doGetFile (channel_name, start_unixtime_sec, end_unixtime_sec, &mp4Exporter))
+        {
+            logE_(_func_, "fail to build mp4 header");
+            resp.setStatus(HTTPResponse::HTTP_INTERNAL_SERVER_ERROR);
+            std::ostream& out = resp.send();
+            out << "500 Internal Server Error: download file is failed";
+            out.flush();
+            logA(ffmpeg_module, _func_, "mod_nvr 500 ", req.clientAddress().toString().c_str(), " ", req.getURI().c_str());
+            goto _return;
+        }
 
-        if(pathToFile != NULL) // is it correct?
+        Uint64 const total_size = mp4Exporter.GetTotalSize();
+        Uint64 range_start = 0;
+        Uint64 range_end = total_size - 1;
+        bool is_partial = false;
+        if (req.has("Range"))
         {
-            resp.sendFile(pathToFile->cstr(), "application/octet-stream");
+            if (!parseHttpByteRange (req.get("Range"), total_size, &range_start, &range_end, &is_partial))
+            {
+                logD(ffmpeg_module, _func_, "range is not satisfiable: ", req.get("Range").c_str());
+                resp.setStatus(HTTPResponse::HTTP_REQUESTED_RANGE_NOT_SATISFIABLE);
+                resp.set("Content-Range", st_makeString("bytes */", total_size)->cstr());
+                resp.setContentLength(0);
+                resp.send().flush();
+                logA(ffmpeg_module, _func_, "mod_nvr 416 ", req.clientAddress().toString().c_str(), " ", req.getURI().c_str());
+                goto _return;
+            }
         }
-        else
+
+        if (!mp4Exporter.CheckFiles())
         {
-            logE_(_func_, "pathToFile is NULL");
             resp.setStatus(HTTPResponse::HTTP_INTERNAL_SERVER_ERROR);
             std::ostream& out = resp.send();
-            out << "500 Internal Server Error: download file is failed";
+            out << "500 Internal Server Error: recorded files have changed";
             out.flush();
+            logA(ffmpeg_module, _func_, "mod_nvr 500 ", req.clientAddress().toString().c_str(), " ", req.getURI().c_str());
+            goto _return;
+        }
+
+        if (is_partial)
+        {
+            resp.setStatus(HTTPResponse::HTTP_PARTIAL_CONTENT);
+            resp.set("Content-Range", st_makeString("bytes ", range_start, "-", range_end, "/", total_size)->cstr());
         }
+        else
+        {
+            resp.setStatus(HTTPResponse::HTTP_OK);
+        }
+        resp.set("Accept-Ranges", "bytes");
+        resp.setContentType("application/octet-stream");
+        resp.setContentLength((std::streamsize) (range_end - range_start + 1));
+
+        std::ostream& out = resp.send();
+        if (!mp4Exporter.Write (out, range_start, range_end))
+            logD(ffmpeg_module, _func_, "mp4 streaming is interrupted");
+        out.flush();
+        logA(ffmpeg_module, _func_, "mod_nvr ", (is_partial ? "206 " : "200 "), req.clientAddress().toString().c_str(), " ", req.getURI().c_str());
     }
     else if (segments.size() == 2 && segments[1].compare("existence") == 0)
     {	
@@ -1527,6 +1731,37 @@ MomentFFmpegModule::httpRequest (HTTPServerRequest &req, HTTPServerResponse &res
 
         logD(ffmpeg_module, _func_, "channel_name: [", channel_name.c_str(), "]");
 
+        // optional, the whole archive is returned by default
+        Uint64 start_unixtime_sec = 0;
+        NameValueCollection::ConstIterator start_time_iter = form.find("start");
+        if (start_time_iter != form.end() &&
+            (!strToUint64_safe (start_time_iter->second.c_str(), &start_unixtime_sec, 10 /* base */) ||
+             start_unixtime_sec > INT_MAX))
+        {
+            logE_ (_func, "Bad \"start\" request parameter value");
+            resp.setStatus(HTTPResponse::HTTP_BAD_REQUEST);
+            std::ostream& out = resp.send();
+            out << "Bad \"start\" request parameter value";
+            out.flush();
+            logA(ffmpeg_module, _func_, "mod_nvr 400 ", req.clientAddress().toString().c_str(), " ", req.getURI().c_str());
+            goto _return;
+        }
+
+        Uint64 end_unixtime_sec = INT_MAX;
+        NameValueCollection::ConstIterator end_time_iter = form.find("end");
+        if (end_time_iter != form.end() &&
+            (!strToUint64_safe (end_time_iter->second.c_str(), &end_unixtime_sec, 10 /* base */) ||
+             end_unixtime_sec > INT_MAX))
+        {
+            logE_ (_func, "Bad \"end\" request parameter value");
+            resp.setStatus(HTTPResponse::HTTP_BAD_REQUEST);
+            std::ostream& out = resp.send();
+            out << "Bad \"end\" request parameter value";
+            out.flush();
+            logA(ffmpeg_module, _func_, "mod_nvr 400 ", req.clientAddress().toString().c_str(), " ", req.getURI().c_str());
+            goto _return;
+        }
+
         logD(mutex, _func_, "MUTEX _locked");
         self->m_mutex.lock();
 logD(mutex, _func_, "QQQQQ 1");
@@ -1547,11 +1782,17 @@ logD(mutex, _func_, "QQQQQ 1");
 
 logD(mutex, _func_, "QQQQQ 2");
         Ref<ChannelChecker> channelChecker = itFFStream->second.getRefPtr()->GetChannelChecker();
+
+        // the channel checker has its own lock, the streams are not held for the query
+        logD(mutex, _func_, "MUTEX unlocked");
+        self->m_mutex.unlock();
+
         std::string reply_body_str;
         if(!channelChecker.isNull())
         {
             logD(mutex, _func_, "QQQQQ 3");
-            ChannelChecker::ChannelTimes channel_existence = channelChecker->GetChannelTimes ();
+            ChannelChecker::ChannelTimes channel_existence =
+                    channelChecker->GetChannelTimes ((int) start_unixtime_sec, (int) end_unixtime_sec);
             StRef<String> reply_body = channelExistenceToJson (&channel_existence);
             reply_body_str = reply_body->cstr();
         }
@@ -1560,9 +1801,6 @@ logD(mutex, _func_, "QQQQQ 2");
             logE_(_func_, "channelChecker is empty");
         }
 
-        logD(mutex, _func_, "MUTEX unlocked");
-        self->m_mutex.unlock();
-
         //StRef<String> reply_body = channelExistenceToJson (&channel_existence);
         resp.setStatus(HTTPResponse::HTTP_OK);
         resp.setContentType("text/html");
@@ -1595,17 +1833,16 @@ _return:
     return true;
 }
 
-StRef<String>
+bool
 MomentFFmpegModule::doGetFile (ConstMemory   const channel_name,
-                            Time          const start_unixtime_sec,
-                            Time          const end_unixtime_sec)
+                               Time          const start_unixtime_sec,
+                               Time          const end_unixtime_sec,
+                               Mp4Exporter * const mt_nonnull mp4_exporter)
 {
     logD(ffmpeg_module, _func, "channel: ", channel_name, ", "
            "start: ", start_unixtime_sec, ", "
            "end: ", end_unixtime_sec);
 
-    std::string filePathRes;
-    VideoPartMaker vpm;
     StRef<String> str_ch_name = st_makeString(channel_name);
     std::string ch_name = str_ch_name->cstr();
 
@@ -1625,18 +1862,16 @@ MomentFFmpegModule::doGetFile (ConstMemory   const channel_name,
     logD(mutex, _func_, "MUTEX unlocked");
     m_mutex.unlock();
 
-    ChannelChecker::ChannelFileDiskTimes chlFileDiskTimes = channelChecker->GetChannelFileDiskTimes();
-    bool bRes = vpm.Init(&chlFileDiskTimes, ch_name, start_unixtime_sec, end_unixtime_sec, filePathRes);
-    if(!bRes)
+    Ref<RecordFileIndex> const fileIndex = channelChecker->GetFileIndex();
+    if(!mp4_exporter->Init(m_pPage_pool, fileIndex, start_unixtime_sec, end_unixtime_sec))
     {
-        logE_(_func_, "fail to create file");
-        return NULL;
+        logE_(_func_, "fail to build mp4 header");
+        return false;
     }
-    vpm.Process();
 
-    logD(ffmpeg_module, _func_, "mp4 is done: [", filePathRes.c_str(), "]");
+    logD(ffmpeg_module, _func_, "mp4 header is done, size: ", mp4_exporter->GetTotalSize());
 
-    return st_makeString(filePathRes.c_str());
+    return true;
 }
 
 Ref<MediaSource>
@@ -1663,7 +1898,8 @@ MomentFFmpegModule::createMediaSource (CbDesc<MediaSource::Frontend> const &fron
     }
 	
     Ref<ChannelChecker> channel_checker = grab (new (std::nothrow) ChannelChecker);
-    channel_checker->init (timers, &m_recpath_config, channel_opts->channel_name);
+    channel_checker->init (timers, &m_recpath_config, channel_opts->channel_name, m_record_scanner,
+                           m_record_catalog /* catalogued */);
 
     ffmpeg_stream->init (frontend,
                       timers,
@@ -1676,7 +1912,11 @@ MomentFFmpegModule::createMediaSource (CbDesc<MediaSource::Frontend> const &fron
                       playback_item,
                       config,
                       &m_recpath_config,
-                      channel_checker);
+                      channel_checker,
+                      m_capture_engine,
+                      m_connect_scheduler,
+                      m_probe_cache,
+                      m_record_writer);
 
     logD(mutex, _func_, "MUTEX _locked");
     m_mutex.lock();
@@ -2158,6 +2398,258 @@ MomentFFmpegModule::init (MomentServer * const moment)
     m_media_viewer = grab (new (std::nothrow) MediaViewer);
     m_media_viewer->init (moment, &m_streams, &m_mutex);
 
+    {
+        Uint64 capture_threads = CAPTURE_THREADS;
+        {
+            ConstMemory const opt_name = "mod_ffmpeg/capture_threads";
+            MConfig::GetResult const res =
+                    config->getUint64_default (opt_name, &capture_threads, capture_threads);
+            if (!res)
+                logE_ (_func, "Invalid value for config option ", opt_name, ": ", config->getString (opt_name));
+            else
+                logD(ffmpeg_module, _func_, opt_name, ": ", capture_threads);
+        }
+
+        Uint64 capture_quantum = CAPTURE_QUANTUM;
+        {
+            ConstMemory const opt_name = "mod_ffmpeg/capture_quantum";
+            MConfig::GetResult const res =
+                    config->getUint64_default (opt_name, &capture_quantum, capture_quantum);
+            if (!res)
+                logE_ (_func, "Invalid value for config option ", opt_name, ": ", config->getString (opt_name));
+            else
+                logD(ffmpeg_module, _func_, opt_name, ": ", capture_quantum);
+        }
+
+        Uint64 capture_wait_timeout = CAPTURE_WAIT_TIMEOUT;
+        {
+            ConstMemory const opt_name = "mod_ffmpeg/capture_wait_timeout";
+            MConfig::GetResult const res =
+                    config->getUint64_default (opt_name, &capture_wait_timeout, capture_wait_timeout);
+            if (!res)
+                logE_ (_func, "Invalid value for config option ", opt_name, ": ", config->getString (opt_name));
+            else
+                logD(ffmpeg_module, _func_, opt_name, ": ", capture_wait_timeout);
+        }
+
+        m_capture_engine = grab (new (std::nothrow) CaptureEngine);
+        m_capture_engine->init (capture_threads, capture_quantum, capture_wait_timeout);
+        if (!m_capture_engine->spawn ())
+            logE_ (_func, "fail to spawn capture threads");
+    }
+
+    {
+        Uint64 connect_max = CONNECT_MAX;
+        {
+            ConstMemory const opt_name = "mod_ffmpeg/connect_max";
+            MConfig::GetResult const res =
+                    config->getUint64_default (opt_name, &connect_max, connect_max);
+            if (!res)
+                logE_ (_func, "Invalid value for config option ", opt_name, ": ", config->getString (opt_name));
+            else
+                logD(ffmpeg_module, _func_, opt_name, ": ", connect_max);
+        }
+
+        Uint64 connect_backoff_min = CONNECT_BACKOFF_MIN;
+        {
+            ConstMemory const opt_name = "mod_ffmpeg/connect_backoff_min";
+            MConfig::GetResult const res =
+                    config->getUint64_default (opt_name, &connect_backoff_min, connect_backoff_min);
+            if (!res)
+                logE_ (_func, "Invalid value for config option ", opt_name, ": ", config->getString (opt_name));
+            else
+                logD(ffmpeg_module, _func_, opt_name, ": ", connect_backoff_min);
+        }
+
+        Uint64 connect_backoff_max = CONNECT_BACKOFF_MAX;
+        {
+            ConstMemory const opt_name = "mod_ffmpeg/connect_backoff_max";
+            MConfig::GetResult const res =
+                    config->getUint64_default (opt_name, &connect_backoff_max, connect_backoff_max);
+            if (!res)
+                logE_ (_func, "Invalid value for config option ", opt_name, ": ", config->getString (opt_name));
+            else
+                logD(ffmpeg_module, _func_, opt_name, ": ", connect_backoff_max);
+        }
+
+        m_connect_scheduler = grab (new (std::nothrow) ConnectScheduler);
+        m_connect_scheduler->init (connect_max, connect_backoff_min, connect_backoff_max);
+    }
+
+    {
+        bool probe_cache_enable = true;
+        {
+            ConstMemory const opt_name = "mod_ffmpeg/probe_cache";
+            MConfig::BooleanValue const value = config->getBoolean (opt_name);
+            if (value == MConfig::Boolean_Invalid)
+                logE_ (_func, "Invalid value for config option ", opt_name, ": ", config->getString (opt_name));
+            else if (value == MConfig::Boolean_False)
+                probe_cache_enable = false;
+
+            logD(ffmpeg_module, _func_, opt_name, ": ", probe_cache_enable);
+        }
+
+        ConstMemory probe_cache_dir = PROBE_CACHE_DIR;
+        {
+            ConstMemory const opt_name = "mod_ffmpeg/probe_cache_dir";
+            bool probe_cache_dir_is_set = false;
+            ConstMemory const opt_val = config->getString (opt_name, &probe_cache_dir_is_set);
+            if (probe_cache_dir_is_set)
+                probe_cache_dir = opt_val;
+
+            logD(ffmpeg_module, _func_, opt_name, ": [", probe_cache_dir, "]");
+        }
+
+        if (probe_cache_enable) {
+            m_probe_cache = grab (new (std::nothrow) ProbeCache);
+            m_probe_cache->init (probe_cache_dir);
+        }
+    }
+
+    {
+        Uint64 record_threads = RECORD_THREADS;
+        {
+            ConstMemory const opt_name = "mod_ffmpeg/record_threads";
+            MConfig::GetResult const res =
+                    config->getUint64_default (opt_name, &record_threads, record_threads);
+            if (!res)
+                logE_ (_func, "Invalid value for config option ", opt_name, ": ", config->getString (opt_name));
+            else
+                logD(ffmpeg_module, _func_, opt_name, ": ", record_threads);
+        }
+
+        Uint64 record_queue_size = RECORD_QUEUE_SIZE;
+        {
+            ConstMemory const opt_name = "mod_ffmpeg/record_queue_size";
+            MConfig::GetResult const res =
+                    config->getUint64_default (opt_name, &record_queue_size, record_queue_size);
+            if (!res)
+                logE_ (_func, "Invalid value for config option ", opt_name, ": ", config->getString (opt_name));
+            else
+                logD(ffmpeg_module, _func_, opt_name, ": ", record_queue_size);
+        }
+
+        // "drop" - drop packets up to the next keyframe when the queue is full,
+        // "block" - stall the capture thread for up to record_block_timeout first.
+        RecordWriter::OverflowPolicy record_overflow = RecordWriter::OverflowPolicy_Drop;
+        {
+            ConstMemory const opt_name = "mod_ffmpeg/record_overflow";
+            ConstMemory const opt_val = config->getString (opt_name);
+            if (equal (opt_val, "block"))
+                record_overflow = RecordWriter::OverflowPolicy_Block;
+            else if (opt_val.len() != 0 && !equal (opt_val, "drop"))
+                logE_ (_func, "Invalid value for config option ", opt_name, ": ", opt_val);
+
+            logD(ffmpeg_module, _func_, opt_name, ": ", opt_val);
+        }
+
+        Uint64 record_block_timeout = RECORD_BLOCK_TIMEOUT;
+        {
+            ConstMemory const opt_name = "mod_ffmpeg/record_block_timeout";
+            MConfig::GetResult const res =
+                    config->getUint64_default (opt_name, &record_block_timeout, record_block_timeout);
+            if (!res)
+                logE_ (_func, "Invalid value for config option ", opt_name, ": ", config->getString (opt_name));
+            else
+                logD(ffmpeg_module, _func_, opt_name, ": ", record_block_timeout);
+        }
+
+        SegmentFile::Options segment_file_opts;
+        {
+            ConstMemory const opt_name = "mod_ffmpeg/record_preallocate";
+            MConfig::BooleanValue const value = config->getBoolean (opt_name);
+            if (value == MConfig::Boolean_Invalid)
+                logE_ (_func, "Invalid value for config option ", opt_name, ": ", config->getString (opt_name));
+            else if (value == MConfig::Boolean_False)
+                segment_file_opts.preallocate = false;
+
+            logD(ffmpeg_module, _func_, opt_name, ": ", segment_file_opts.preallocate);
+        }
+        {
+            ConstMemory const opt_name = "mod_ffmpeg/record_direct_io";
+            MConfig::BooleanValue const value = config->getBoolean (opt_name);
+            if (value == MConfig::Boolean_Invalid)
+                logE_ (_func, "Invalid value for config option ", opt_name, ": ", config->getString (opt_name));
+            else if (value == MConfig::Boolean_True)
+                segment_file_opts.direct_io = true;
+
+            logD(ffmpeg_module, _func_, opt_name, ": ", segment_file_opts.direct_io);
+        }
+        {
+            Uint64 direct_buffer_size = segment_file_opts.direct_buffer_size;
+            ConstMemory const opt_name = "mod_ffmpeg/record_direct_buffer_size";
+            MConfig::GetResult const res =
+                    config->getUint64_default (opt_name, &direct_buffer_size, direct_buffer_size);
+            if (!res)
+                logE_ (_func, "Invalid value for config option ", opt_name, ": ", config->getString (opt_name));
+            else
+                logD(ffmpeg_module, _func_, opt_name, ": ", direct_buffer_size);
+
+            segment_file_opts.direct_buffer_size = direct_buffer_size;
+        }
+        SegmentFile::setOptions (segment_file_opts);
+
+        m_record_writer = grab (new (std::nothrow) RecordWriter);
+        m_record_writer->init (record_threads, record_queue_size, record_overflow, record_block_timeout * 1000);
+        if (!m_record_writer->spawn ())
+            logE_ (_func, "fail to spawn record writer threads");
+    }
+
+    {
+        Uint64 scan_io_depth = SCAN_IO_DEPTH;
+        {
+            ConstMemory const opt_name = "mod_ffmpeg/scan_io_depth";
+            MConfig::GetResult const res =
+                    config->getUint64_default (opt_name, &scan_io_depth, scan_io_depth);
+            if (!res)
+                logE_ (_func, "Invalid value for config option ", opt_name, ": ", config->getString (opt_name));
+            else
+                logD(ffmpeg_module, _func_, opt_name, ": ", scan_io_depth);
+        }
+
+        bool record_catalog = true;
+        {
+            ConstMemory const opt_name = "mod_ffmpeg/record_catalog";
+            MConfig::BooleanValue const value = config->getBoolean (opt_name);
+            if (value == MConfig::Boolean_Invalid)
+                logE_ (_func, "Invalid value for config option ", opt_name, ": ", config->getString (opt_name));
+            else if (value == MConfig::Boolean_False)
+                record_catalog = false;
+
+            logD(ffmpeg_module, _func_, opt_name, ": ", record_catalog);
+        }
+
+        std::vector<std::string> diskNames;
+        std::string curPath = m_recpath_config.GetNextPath();
+        while(curPath.length() != 0)
+        {
+            diskNames.push_back(curPath);
+            curPath = m_recpath_config.GetNextPath(curPath);
+        }
+
+        if (!diskNames.empty())
+        {
+            m_record_scanner = grab (new (std::nothrow) RecordScanner);
+            m_record_scanner->init (diskNames.size(), scan_io_depth);
+            if (!m_record_scanner->spawn ())
+            {
+                logE_ (_func, "fail to spawn record scanner threads, archives are scanned synchronously");
+                m_record_scanner = NULL;
+            }
+        }
+
+        if (!diskNames.empty() && record_catalog)
+        {
+            m_record_catalog = grab (new (std::nothrow) RecordCatalog);
+            if (!m_record_catalog->init (diskNames, &m_streams, &m_mutex)
+                || !m_record_catalog->spawn ())
+            {
+                logE_ (_func, "record catalog is not available, recording directories are polled");
+                m_record_catalog = NULL;
+            }
+        }
+    }
+
     moment->setMediaSourceProvider (this);
 
     m_statMeasurer.Init(m_pTimers, TIMER_STATMEASURER);
@@ -2206,6 +2698,19 @@ MomentFFmpegModule::~MomentFFmpegModule ()
         this->m_timer_updateTimes = NULL;
     }
 
+    // Streams released below run their last turn on this thread.
+    if (m_capture_engine)
+        m_capture_engine->stop ();
+
+    // Scan threads call into the checkers of the channels deleted below.
+    if (m_record_scanner)
+        m_record_scanner->stop ();
+
+    // The catalog thread locks m_mutex and updates m_streams.
+    if (m_record_catalog)
+        m_record_catalog->stop ();
+
+    {
     logD(mutex, _func_, "MUTEX _locked in destructor");
   StateMutexLock l (&m_mutex);
 
@@ -2224,6 +2729,11 @@ MomentFFmpegModule::~MomentFFmpegModule ()
 	    delete recorder_entry;
 	}
     }
+    }
+
+    // Released streams have written out their record queues by now.
+    if (m_record_writer)
+        m_record_writer->stop ();
 }
 
 } // namespace Moment
@@ -31,9 +31,16 @@
 #include <moment/libmoment.h>
 #include <moment-ffmpeg/ffmpeg_stream.h>
 #include <moment-ffmpeg/channel_checker.h>
+#include <moment-ffmpeg/mp4_exporter.h>
 #include <moment-ffmpeg/media_viewer.h>
 #include <moment-ffmpeg/stat_measurer.h>
 #include <moment-ffmpeg/rec_path_config.h>
+#include <moment-ffmpeg/capture_engine.h>
+#include <moment-ffmpeg/connect_scheduler.h>
+#include <moment-ffmpeg/probe_cache.h>
+#include <moment-ffmpeg/record_writer.h>
+#include <moment-ffmpeg/record_scanner.h>
+#include <moment-ffmpeg/record_catalog.h>
 #include <moment/moment_request_handler.h>
 
 
@@ -160,6 +167,25 @@ private:
 
     mt_const Ref<MediaViewer>     m_media_viewer;
 
+    // shared pool of threads which read packets from all sources
+    mt_const Ref<CaptureEngine>   m_capture_engine;
+
+    // limits and staggers connections of all sources to their cameras
+    mt_const Ref<ConnectScheduler> m_connect_scheduler;
+
+    // stream parameters of all sources, to skip most of the probing on reconnect,
+    // NULL if disabled
+    mt_const Ref<ProbeCache>      m_probe_cache;
+
+    // shared pool of threads which write recorded packets of all sources
+    mt_const Ref<RecordWriter>    m_record_writer;
+
+    // builds the archive caches of all sources, in parallel across recording disks
+    mt_const Ref<RecordScanner>   m_record_scanner;
+
+    // reports new recordings to channel checkers, instead of polling the directories
+    mt_const Ref<RecordCatalog>   m_record_catalog;
+
     // statistics stuff
     Timers::TimerKey m_timer_keyStat;
     Timers::TimerKey m_timer_updateTimes;
@@ -204,8 +230,13 @@ private:
     static StRef<String>  channelExistenceToJson (
             ChannelChecker::ChannelTimes * const mt_nonnull existence);
 
+    // files overlapping [timeFrom, timeTo], 'limit' of them starting from 'offset'
     static StRef<String>  channelFilesExistenceToJson (
-            ChannelChecker::ChannelFileDiskTimes * const mt_nonnull chFileDiskTimes);
+            RecordFileIndex * const mt_nonnull fileIndex,
+            int   timeFrom,
+            int   timeTo,
+            Count offset,
+            Count limit);
 
     static StRef<String>  statisticsToJson (
             std::map<time_t, StatMeasure> * const mt_nonnull statPoints,
@@ -215,9 +246,11 @@ private:
     std::string GetAllSourcesInfo ();
     std::string GetSourceInfo (const std::string & source_name);
 
-    StRef<String> doGetFile (ConstMemory  stream_name,
-                    Time         start_unixtime_sec,
-                    Time         end_unixtime_sec);
+    // Builds the header of the mp4 file, the data is streamed by Mp4Exporter::Write().
+    bool doGetFile (ConstMemory   stream_name,
+                    Time          start_unixtime_sec,
+                    Time          end_unixtime_sec,
+                    Mp4Exporter * mt_nonnull mp4_exporter);
 
     static Result httpGetChannelsStat (HttpRequest  * mt_nonnull req,
 				       Sender       * mt_nonnull conn_sender,
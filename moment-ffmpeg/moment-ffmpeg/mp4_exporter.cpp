@@ -0,0 +1,362 @@
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <moment-ffmpeg/inc.h>
+#include <moment-ffmpeg/ffmpeg_common.h>
+#include <moment-ffmpeg/mp4_exporter.h>
+
+
+using namespace M;
+using namespace Moment;
+
+namespace MomentFFmpeg {
+
+static LogGroup libMary_logGroup_mp4export ("mod_ffmpeg.mp4_exporter", LogLevel::E);
+
+Mp4Exporter::Mp4Exporter()
+{
+    m_pagePool = NULL;
+    m_headerLen = 0;
+    m_bIsInit = false;
+    m_bGotAvcHeader = false;
+    m_bGotAacHeader = false;
+    nStartTime = 0;
+    nEndTime = 0;
+    m_totalFrames = 0;
+}
+
+Mp4Exporter::~Mp4Exporter()
+{
+    if(m_pagePool)
+        m_pagePool->msgUnref(m_header.first);
+}
+
+bool
+Mp4Exporter::openFile(Count idx)
+{
+    FileEntry & entry = m_files[idx];
+
+    if(!m_fileReader.Init(entry.filename))
+    {
+        logE_(_func_, "m_fileReader.Init failed: ", entry.filename);
+        return false;
+    }
+
+    if(entry.startTime < nStartTime)
+    {
+        if(!m_fileReader.Seek(nStartTime - entry.startTime))
+        {
+            logE_(_func_, "fail to seek in ", entry.filename);
+            return false;
+        }
+    }
+
+    logD(mp4export, _func_, "file is opened ", entry.filename);
+    return true;
+}
+
+void
+Mp4Exporter::pinFile(Count idx)
+{
+    FileEntry & entry = m_files[idx];
+
+    struct stat st;
+    if(stat(entry.filename->cstr(), &st) == -1)
+    {
+        logE_(_func_, "stat() failed: ", entry.filename, ": ", errnoString(errno));
+        return;
+    }
+
+    entry.dev = st.st_dev;
+    entry.ino = st.st_ino;
+    entry.size = (Uint64) st.st_size;
+}
+
+bool
+Mp4Exporter::checkFile(Count idx) const
+{
+    FileEntry const & entry = m_files[idx];
+
+    struct stat st;
+    if(stat(entry.filename->cstr(), &st) == -1)
+    {
+        logE_(_func_, "stat() failed: ", entry.filename, ": ", errnoString(errno));
+        return false;
+    }
+
+    // the file which is being recorded grows, the frames which have been read stay the same
+    if(st.st_dev != entry.dev || st.st_ino != entry.ino || (Uint64) st.st_size < entry.size)
+    {
+        logE_(_func_, "file has changed since the header was built: ", entry.filename);
+        return false;
+    }
+
+    return true;
+}
+
+bool
+Mp4Exporter::CheckFiles() const
+{
+    for(Count i = 0; i < m_files.size(); i++)
+    {
+        if(m_files[i].numFrames && !checkFile(i))
+            return false;
+    }
+
+    return true;
+}
+
+bool
+Mp4Exporter::processFrame(Pass pass, FileReader::Frame & frame, bool * isFinished)
+{
+    if(frame.timestamp_nanosec > nEndTime * 1000000000LL)
+    {
+        *isFinished = true;
+        return false;
+    }
+
+    // mp4 tracks are built for h.264 and AAC only
+    bool const isVideo = (frame.frame_type == VideoStream::Message::Type_Video);
+    if(isVideo)
+    {
+        if(frame.video_info.codec_id != VideoStream::VideoCodecId::AVC)
+            return false;
+    }
+    else if(frame.frame_type == VideoStream::Message::Type_Audio)
+    {
+        if(frame.audio_info.codec_id != VideoStream::AudioCodecId::AAC)
+            return false;
+    }
+    else
+    {
+        return false;
+    }
+
+    if(pass == Pass_Header && frame.header.len())
+    {
+        bool & bGotHeader = isVideo ? m_bGotAvcHeader : m_bGotAacHeader;
+        if(!bGotHeader)
+        {
+            PagePool::PageListHead pages;
+            m_pagePool->getFillPages(&pages, frame.header);
+
+            if(isVideo)
+                m_mp4Muxer.pass1_avcSequenceHeader(m_pagePool, pages.first, 0, frame.header.len());
+            else
+                m_mp4Muxer.pass1_aacSequenceHeader(m_pagePool, pages.first, 0, frame.header.len());
+
+            m_pagePool->msgUnref(pages.first);
+            bGotHeader = true;
+        }
+        else
+        {
+            // a single mp4 track can't switch codec parameters
+            logD(mp4export, _func_, "codec data has changed, keeping the first one");
+        }
+    }
+
+    if(frame.frame.len() == 0)
+        return false;
+
+    if(pass == Pass_Header)
+    {
+        Time const startNanosec = nStartTime * 1000000000LL;
+        Time const timestamp = (frame.timestamp_nanosec > startNanosec) ? frame.timestamp_nanosec - startNanosec : 0;
+
+        m_mp4Muxer.pass1_frame(isVideo ? Mp4Muxer::FrameType_Video : Mp4Muxer::FrameType_Audio,
+                               timestamp,
+                               frame.frame.len(),
+                               isVideo && frame.video_info.type == VideoStream::VideoFrameType::KeyFrame);
+        m_frameSizes.push_back((Uint32) frame.frame.len());
+        ++m_totalFrames;
+    }
+
+    return true;
+}
+
+void
+Mp4Exporter::writeData(std::ostream & out, Uint64 dataOffset, ConstMemory const mem, Uint64 rangeStart, Uint64 rangeEnd)
+{
+    Uint64 const begin = (dataOffset > rangeStart) ? dataOffset : rangeStart;
+    Uint64 const end = (dataOffset + mem.len() < rangeEnd + 1) ? dataOffset + mem.len() : rangeEnd + 1;
+    if(begin >= end)
+        return;
+
+    out.write((const char *) mem.mem() + (begin - dataOffset), end - begin);
+}
+
+bool
+Mp4Exporter::Init(PagePool * page_pool,
+                  RecordFileIndex * const mt_nonnull fileIndex,
+                  Time const start_unixtime_sec,
+                  Time const end_unixtime_sec)
+{
+    logD(mp4export, _func_, "start: ", start_unixtime_sec, ", end: ", end_unixtime_sec);
+
+    m_pagePool = page_pool;
+    nStartTime = start_unixtime_sec;
+    nEndTime = end_unixtime_sec;
+    m_mp4Muxer.init(page_pool, (end_unixtime_sec - start_unixtime_sec) * 1000);
+
+    if(nStartTime >= nEndTime)
+    {
+        logE_(_func_, "fail to init: nStartTime >= nEndTime");
+        return false;
+    }
+
+    Count begin = 0;
+    Count end = 0;
+    fileIndex->findFiles((int) nStartTime, (int) nEndTime, &begin, &end);
+    for(Count idx = begin; idx < end; idx++)
+    {
+        ChChTimes const times = fileIndex->getTimes(idx);
+        if(times.timeEnd <= nStartTime || times.timeStart >= nEndTime)
+            continue;
+
+        FileEntry entry;
+        entry.filename = st_makeString(fileIndex->getDiskName(idx).c_str(), "/", fileIndex->getPath(idx).c_str(), ".flv");
+        entry.startTime = times.timeStart;
+        entry.mdatOffset = 0;
+        entry.firstFrame = 0;
+        entry.numFrames = 0;
+        entry.dev = 0;
+        entry.ino = 0;
+        entry.size = 0;
+        m_files.push_back(entry);
+    }
+
+    for(Count i = 0; i < m_files.size(); i++)
+    {
+        m_files[i].mdatOffset = m_mp4Muxer.getTotalDataSize();
+        m_files[i].firstFrame = m_totalFrames;
+
+        if(!openFile(i))
+            continue;
+
+        pinFile(i);
+
+        bool isFinished = false;
+        FileReader::Frame frame;
+        while(!isFinished && m_fileReader.ReadFrame(frame))
+        {
+            processFrame(Pass_Header, frame, &isFinished);
+            m_fileReader.FreeFrame(frame);
+        }
+
+        m_files[i].numFrames = m_totalFrames - m_files[i].firstFrame;
+
+        if(isFinished)
+        {
+            m_files.resize(i + 1);
+            break;
+        }
+    }
+    m_fileReader.DeInit();
+
+    if(m_totalFrames == 0)
+    {
+        logD(mp4export, _func_, "there is no frames with such timestamps in storage");
+        return false;
+    }
+
+    m_header = m_mp4Muxer.pass1_complete();
+    m_headerLen = PagePool::countPageListDataLen(m_header.first, 0 /* msg_offset */);
+
+    logD(mp4export, _func_, "frames: ", m_totalFrames, ", header: ", m_headerLen, ", total size: ", GetTotalSize());
+
+    m_bIsInit = true;
+    return true;
+}
+
+Uint64
+Mp4Exporter::GetTotalSize() const
+{
+    return m_headerLen + m_mp4Muxer.getTotalDataSize();
+}
+
+bool
+Mp4Exporter::Write(std::ostream & out, Uint64 rangeStart, Uint64 rangeEnd)
+{
+    if(!m_bIsInit)
+    {
+        logE_(_func_, "is not inited");
+        return false;
+    }
+
+    Uint64 pos = 0;
+    for(PagePool::Page * page = m_header.first; page && pos <= rangeEnd; page = page->getNextMsgPage())
+    {
+        writeData(out, pos, ConstMemory(page->getData(), page->data_len), rangeStart, rangeEnd);
+        pos += page->data_len;
+    }
+
+    if(rangeEnd < m_headerLen)
+        return out.good();
+
+    // the files before the one containing the start of the range are skipped
+    Uint64 const mdatStart = (rangeStart > m_headerLen) ? rangeStart - m_headerLen : 0;
+    Count fileIdx = 0;
+    while(fileIdx + 1 < m_files.size() && m_files[fileIdx + 1].mdatOffset <= mdatStart)
+        fileIdx++;
+
+    Uint64 numFrames = m_files[fileIdx].firstFrame;
+    Uint64 dataOffset = m_headerLen + m_files[fileIdx].mdatOffset;
+    Uint64 const totalSize = GetTotalSize();
+    Uint64 const dataEnd = (rangeEnd < totalSize) ? rangeEnd + 1 : totalSize;
+
+    for(; fileIdx < m_files.size() && dataOffset < dataEnd; fileIdx++)
+    {
+        FileEntry const & entry = m_files[fileIdx];
+        if(entry.numFrames == 0)
+            continue;
+
+        if(!checkFile(fileIdx) || !openFile(fileIdx))
+            break;
+
+        Uint64 const fileEndFrame = entry.firstFrame + entry.numFrames;
+        bool isChanged = false;
+
+        bool isFinished = false;
+        FileReader::Frame frame;
+        while(!isFinished && numFrames < fileEndFrame && dataOffset < dataEnd && m_fileReader.ReadFrame(frame))
+        {
+            if(processFrame(Pass_Data, frame, &isFinished))
+            {
+                if(frame.frame.len() != m_frameSizes[numFrames])
+                {
+                    isChanged = true;
+                    m_fileReader.FreeFrame(frame);
+                    break;
+                }
+
+                writeData(out, dataOffset, frame.frame, rangeStart, rangeEnd);
+                dataOffset += frame.frame.len();
+                ++numFrames;
+            }
+            m_fileReader.FreeFrame(frame);
+
+            if(!out.good())
+            {
+                logD(mp4export, _func_, "output stream is closed");
+                m_fileReader.DeInit();
+                return false;
+            }
+        }
+
+        // the file has fewer frames than it had in pass 1
+        if(isChanged || (numFrames < fileEndFrame && dataOffset < dataEnd))
+            break;
+    }
+    m_fileReader.DeInit();
+
+    if(dataOffset < dataEnd)
+    {
+        logE_(_func_, "recorded data has changed since the header was built, written up to ",
+              dataOffset, " of ", dataEnd, ", frames: ", numFrames, " of ", m_totalFrames);
+        return false;
+    }
+
+    return true;
+}
+
+}
@@ -0,0 +1,105 @@
+
+#ifndef MOMENT__FFMPEG_MP4_EXPORTER__H__
+#define MOMENT__FFMPEG_MP4_EXPORTER__H__
+
+#include <ostream>
+#include <vector>
+
+#include <sys/types.h>
+
+#include <moment/libmoment.h>
+#include <libmary/types.h>
+#include <moment-ffmpeg/media_reader.h>
+#include <moment-ffmpeg/channel_checker.h>
+
+using namespace M;
+using namespace Moment;
+
+namespace MomentFFmpeg {
+
+// Exports a part of the archive as mp4 without writing it to disk.
+//
+// The first pass reads the requested interval and builds the moov atom with
+// Mp4Muxer, which gives the exact size of the file up front. The second pass
+// reads the same frames again and streams them as mdat payload, so any byte
+// range of the file can be served. Frames are taken from the recorded files
+// as they are: h.264 and AAC in FLV are already in the form mp4 expects.
+//
+// The list of files and the size of every frame are pinned by the first pass.
+// If the second pass finds different frames, e.g. because a file has been
+// deleted or replaced meanwhile, the output is stopped before the first byte
+// which doesn't match the header.
+mt_unsafe class Mp4Exporter
+{
+public:
+
+    Mp4Exporter();
+    ~Mp4Exporter();
+
+    // pass 1. returns false if there is no video data in the interval.
+    bool Init(PagePool * page_pool,
+              RecordFileIndex * mt_nonnull fileIndex,
+              Time const start_unixtime_sec,
+              Time const end_unixtime_sec);
+
+    // size of the whole mp4 file
+    Uint64 GetTotalSize() const;
+
+    // false if the files have been deleted, replaced or truncated since pass 1.
+    // To be checked before the response headers are sent.
+    bool CheckFiles() const;
+
+    // pass 2. writes bytes [rangeStart, rangeEnd] of the file to 'out'.
+    bool Write(std::ostream & out, Uint64 rangeStart, Uint64 rangeEnd);
+
+private:
+
+    enum Pass
+    {
+        Pass_Header,
+        Pass_Data
+    };
+
+    struct FileEntry
+    {
+        StRef<String> filename;
+        Time startTime;         // unixtime in seconds, from the file name
+        Uint64 mdatOffset;      // offset of the first frame of the file in mdat
+        Uint64 firstFrame;      // number of frames before the file
+        Uint64 numFrames;       // frames taken from the file
+
+        // the file as it has been read by pass 1
+        dev_t dev;
+        ino_t ino;
+        Uint64 size;
+    };
+
+    bool openFile(Count idx);
+    void pinFile(Count idx);
+    bool checkFile(Count idx) const;
+    // true if the frame belongs to the export
+    bool processFrame(Pass pass, FileReader::Frame & frame, bool * isFinished);
+    void writeData(std::ostream & out, Uint64 dataOffset, ConstMemory const mem, Uint64 rangeStart, Uint64 rangeEnd);
+
+    PagePool * m_pagePool;
+    Mp4Muxer m_mp4Muxer;
+    FileReader m_fileReader;
+
+    std::vector<FileEntry> m_files;
+    // sizes of the frames in mdat order
+    std::vector<Uint32> m_frameSizes;
+
+    PagePool::PageListHead m_header;
+    Size m_headerLen;
+
+    bool m_bIsInit;
+    bool m_bGotAvcHeader;
+    bool m_bGotAacHeader;
+    Time nStartTime;
+    Time nEndTime;
+    Uint64 m_totalFrames;
+};
+
+}
+
+#endif /* MOMENT__FFMPEG_MP4_EXPORTER__H__ */
@@ -25,6 +25,7 @@
 #include <moment-ffmpeg/inc.h>
 #include <moment-ffmpeg/ffmpeg_common.h>
 #include <moment-ffmpeg/time_checker.h>
+#include <moment-ffmpeg/keyframe_index.h>
 #include <moment-ffmpeg/nvr_cleaner.h>
 
 using namespace M;
@@ -41,6 +42,7 @@ NvrCleaner::doRemoveFiles (ConstMemory const filename, Vfs * vfs)
 {
   // TODO Check return values;
     vfs->removeFile (filename);
+    vfs->removeFile (KeyframeIndex::makeIndexPath (filename)->mem());
     vfs->removeSubdirsForFilename (filename);
 }
 
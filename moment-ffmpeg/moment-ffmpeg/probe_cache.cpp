@@ -0,0 +1,408 @@
+/*  Moment-FFmpeg - FFmpeg support module for Moment Video Server
+    Copyright (C) 2011-2013 Dmitry Shatrov
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <fstream>
+#include <sstream>
+
+#include <moment-ffmpeg/probe_cache.h>
+
+
+using namespace M;
+using namespace Moment;
+
+namespace MomentFFmpeg {
+
+static LogGroup libMary_logGroup_probe ("mod_ffmpeg.probe", LogLevel::E);
+
+static bool extradataDiffers (AVCodecContext    * const codec,
+                              std::string const &extradata)
+{
+    if (!codec->extradata || codec->extradata_size <= 0 || extradata.empty())
+        return false;
+
+    return (Size) codec->extradata_size != extradata.size()
+           || memcmp (codec->extradata, extradata.data(), extradata.size()) != 0;
+}
+
+bool
+ProbeCache::Entry::matchesLayout (AVFormatContext * const mt_nonnull format_ctx) const
+{
+    if (format_ctx->nb_streams != streams.size())
+        return false;
+
+    for (Count i = 0; i < streams.size(); ++i) {
+        AVCodecContext * const codec = format_ctx->streams[i]->codec;
+        StreamParams const &params = streams[i];
+
+        if (codec->codec_type != params.codec_type
+            || codec->codec_id != params.codec_id)
+        {
+            logD (probe, _func, "stream ", i, ": codec changed");
+            return false;
+        }
+
+        if (extradataDiffers (codec, params.extradata)) {
+            logD (probe, _func, "stream ", i, ": extradata changed");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void
+ProbeCache::Entry::apply (AVFormatContext * const mt_nonnull format_ctx) const
+{
+    // Frame size, pixel format and audio format are left for the decoder
+    // to find, so that matchesProbed() compares them with what's in the stream.
+    for (Count i = 0; i < streams.size(); ++i) {
+        AVStream * const stream = format_ctx->streams[i];
+        AVCodecContext * const codec = stream->codec;
+        StreamParams const &params = streams[i];
+
+        // With a known frame rate avformat_find_stream_info() doesn't wait
+        // for enough frames to estimate it.
+        if (stream->avg_frame_rate.num == 0)
+            stream->avg_frame_rate = params.avg_frame_rate;
+        if (stream->r_frame_rate.num == 0)
+            stream->r_frame_rate = params.r_frame_rate;
+
+        if ((!codec->extradata || codec->extradata_size <= 0) && !params.extradata.empty()) {
+            Size const len = params.extradata.size();
+            uint8_t * const buf = (uint8_t*) av_mallocz (len + FF_INPUT_BUFFER_PADDING_SIZE);
+            if (buf) {
+                memcpy (buf, params.extradata.data(), len);
+                av_free (codec->extradata);
+                codec->extradata = buf;
+                codec->extradata_size = (int) len;
+            }
+        }
+    }
+}
+
+bool
+ProbeCache::Entry::matchesProbed (AVFormatContext * const mt_nonnull format_ctx) const
+{
+    if (!matchesLayout (format_ctx))
+        return false;
+
+    for (Count i = 0; i < streams.size(); ++i) {
+        AVCodecContext * const codec = format_ctx->streams[i]->codec;
+        StreamParams const &params = streams[i];
+
+        // Zero frame size means that no frame has been decoded within
+        // the probe size, nothing to compare with. The caller fails
+        // such a stream and drops the entry.
+        if (codec->codec_type == AVMEDIA_TYPE_VIDEO
+            && codec->width != 0
+            && (codec->width  != params.width
+                || codec->height != params.height
+                || codec->pix_fmt != params.pix_fmt))
+        {
+            logD (probe, _func, "stream ", i, ": frame size changed: ",
+                  codec->width, "x", codec->height, ", was ", params.width, "x", params.height);
+            return false;
+        }
+
+        if (codec->codec_type == AVMEDIA_TYPE_AUDIO
+            && (codec->sample_rate != params.sample_rate
+                || codec->channels != params.channels))
+        {
+            logD (probe, _func, "stream ", i, ": audio format changed");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool
+ProbeCache::isCacheable (AVFormatContext * const mt_nonnull format_ctx)
+{
+    return format_ctx->nb_streams > 0
+           && !(format_ctx->ctx_flags & AVFMTCTX_NOHEADER);
+}
+
+std::string
+ProbeCache::getEntryPath (const std::string & uri) const
+{
+    // FNV-1a
+    Uint64 hash = 14695981039346656037ULL;
+    for (Size i = 0; i < uri.size(); ++i) {
+        hash ^= (Byte) uri[i];
+        hash *= 1099511628211ULL;
+    }
+
+    char name [32];
+    snprintf (name, sizeof (name), "%016llx.probe", (unsigned long long) hash);
+    return dir + "/" + name;
+}
+
+static void hexToString (const std::string &hex,
+                         std::string       * const mt_nonnull ret_str)
+{
+    ret_str->clear ();
+    for (Size i = 0; i + 1 < hex.size(); i += 2) {
+        unsigned byte = 0;
+        if (sscanf (hex.c_str() + i, "%2x", &byte) != 1) {
+            ret_str->clear ();
+            return;
+        }
+        ret_str->push_back ((char) byte);
+    }
+}
+
+// File format, one item per line:
+//     version 1
+//     uri <uri>
+//     probe_size <probe_size>
+//     stream <codec_type> <codec_id> <width> <height> <pix_fmt>
+//            <sample_rate> <channels> <sample_fmt> <channel_layout> <frame_size>
+//            <profile> <level> <avg_frame_rate> <r_frame_rate> <extradata in hex or "-">
+// (a 'stream' line for every stream, rationals as "num den").
+Ref<ProbeCache::Entry>
+ProbeCache::loadEntry (const std::string & uri)
+{
+    std::string const path = getEntryPath (uri);
+
+    std::ifstream file (path.c_str());
+    if (!file.is_open())
+        return NULL;
+
+    Ref<Entry> const entry = grab (new (std::nothrow) Entry);
+    if (!entry)
+        return NULL;
+
+    bool version_ok = false;
+    bool uri_ok = false;
+
+    std::string line;
+    while (std::getline (file, line)) {
+        std::istringstream in (line);
+        std::string key;
+        in >> key;
+
+        if (key == "version") {
+            int version = 0;
+            in >> version;
+            version_ok = (version == 1);
+        } else
+        if (key == "uri") {
+            // Hash collisions.
+            uri_ok = (line.size() > 4 && line.compare (4, std::string::npos, uri) == 0);
+        } else
+        if (key == "probe_size") {
+            in >> entry->probe_size;
+        } else
+        if (key == "stream") {
+            Entry::StreamParams params;
+            int codec_type, codec_id, pix_fmt, sample_fmt;
+            std::string extradata_hex;
+
+            in >> codec_type >> codec_id
+               >> params.width >> params.height >> pix_fmt
+               >> params.sample_rate >> params.channels >> sample_fmt
+               >> params.channel_layout >> params.frame_size
+               >> params.profile >> params.level
+               >> params.avg_frame_rate.num >> params.avg_frame_rate.den
+               >> params.r_frame_rate.num >> params.r_frame_rate.den
+               >> extradata_hex;
+            if (!in) {
+                logE_ (_func, "malformed entry: ", path.c_str());
+                return NULL;
+            }
+
+            params.codec_type = (AVMediaType)    codec_type;
+            params.codec_id   = (AVCodecID)      codec_id;
+            params.pix_fmt    = (AVPixelFormat)  pix_fmt;
+            params.sample_fmt = (AVSampleFormat) sample_fmt;
+            if (extradata_hex != "-")
+                hexToString (extradata_hex, &params.extradata);
+
+            entry->streams.push_back (params);
+        }
+    }
+
+    if (!version_ok || !uri_ok || entry->streams.empty())
+        return NULL;
+
+    logD (probe, _func, "loaded ", path.c_str(), " for ", uri.c_str());
+    return entry;
+}
+
+void
+ProbeCache::saveEntry (const std::string & uri,
+                       Entry             * const mt_nonnull entry)
+{
+    std::string const path = getEntryPath (uri);
+    std::string const tmp_path = path + ".tmp";
+
+    {
+        std::ofstream file (tmp_path.c_str(), std::ios::out | std::ios::trunc);
+        if (!file.is_open()) {
+            logE_ (_func, "could not open ", tmp_path.c_str());
+            return;
+        }
+
+        file << "version 1\n"
+             << "uri " << uri << "\n"
+             << "probe_size " << entry->probe_size << "\n";
+
+        for (Count i = 0; i < entry->streams.size(); ++i) {
+            Entry::StreamParams const &params = entry->streams[i];
+
+            file << "stream "
+                 << (int) params.codec_type << " " << (int) params.codec_id << " "
+                 << params.width << " " << params.height << " " << (int) params.pix_fmt << " "
+                 << params.sample_rate << " " << params.channels << " " << (int) params.sample_fmt << " "
+                 << params.channel_layout << " " << params.frame_size << " "
+                 << params.profile << " " << params.level << " "
+                 << params.avg_frame_rate.num << " " << params.avg_frame_rate.den << " "
+                 << params.r_frame_rate.num << " " << params.r_frame_rate.den << " ";
+
+            if (params.extradata.empty()) {
+                file << "-";
+            } else {
+                for (Size j = 0; j < params.extradata.size(); ++j) {
+                    char hex [3];
+                    snprintf (hex, sizeof (hex), "%02x", (unsigned) (Byte) params.extradata[j]);
+                    file << hex;
+                }
+            }
+            file << "\n";
+        }
+
+        file.flush ();
+        if (!file) {
+            logE_ (_func, "could not write ", tmp_path.c_str());
+            file.close ();
+            unlink (tmp_path.c_str());
+            return;
+        }
+    }
+
+    // A half-written file is never seen under 'path'.
+    if (rename (tmp_path.c_str(), path.c_str()) == -1) {
+        logE_ (_func, "rename() failed for ", path.c_str(), ": ", errnoString (errno));
+        unlink (tmp_path.c_str());
+    }
+}
+
+Ref<ProbeCache::Entry>
+ProbeCache::lookup (const std::string & uri)
+{
+    mutex.lock ();
+
+    Ref<Entry> entry;
+    EntryMap::iterator const iter = entry_map.find (uri);
+    if (iter != entry_map.end())
+        entry = iter->second;
+
+    mutex.unlock ();
+
+    if (!entry && !dir.empty()) {
+        entry = loadEntry (uri);
+        if (entry) {
+            mutex.lock ();
+            entry_map[uri] = entry;
+            mutex.unlock ();
+        }
+    }
+
+    return entry;
+}
+
+void
+ProbeCache::store (const std::string &       uri,
+                   AVFormatContext   * const mt_nonnull format_ctx,
+                   Int64               const probe_size)
+{
+    Ref<Entry> const entry = grab (new (std::nothrow) Entry);
+    if (!entry)
+        return;
+
+    entry->probe_size = probe_size;
+
+    entry->streams.resize (format_ctx->nb_streams);
+    for (Count i = 0; i < format_ctx->nb_streams; ++i) {
+        AVStream * const stream = format_ctx->streams[i];
+        AVCodecContext * const codec = stream->codec;
+        Entry::StreamParams &params = entry->streams[i];
+
+        params.codec_type     = codec->codec_type;
+        params.codec_id       = codec->codec_id;
+        params.width          = codec->width;
+        params.height         = codec->height;
+        params.pix_fmt        = codec->pix_fmt;
+        params.sample_rate    = codec->sample_rate;
+        params.channels       = codec->channels;
+        params.sample_fmt     = codec->sample_fmt;
+        params.channel_layout = codec->channel_layout;
+        params.frame_size     = codec->frame_size;
+        params.profile        = codec->profile;
+        params.level          = codec->level;
+        params.avg_frame_rate = stream->avg_frame_rate;
+        params.r_frame_rate   = stream->r_frame_rate;
+
+        if (codec->extradata && codec->extradata_size > 0)
+            params.extradata.assign ((const char*) codec->extradata, codec->extradata_size);
+    }
+
+    mutex.lock ();
+    entry_map[uri] = entry;
+    mutex.unlock ();
+
+    if (!dir.empty())
+        saveEntry (uri, entry);
+
+    logD (probe, _func, "uri: ", uri.c_str(), ", streams: ", entry->streams.size());
+}
+
+void
+ProbeCache::remove (const std::string & uri)
+{
+    mutex.lock ();
+    entry_map.erase (uri);
+    mutex.unlock ();
+
+    if (!dir.empty())
+        unlink (getEntryPath (uri).c_str());
+}
+
+mt_const void
+ProbeCache::init (ConstMemory const dir)
+{
+    this->dir.assign ((const char*) dir.mem(), dir.len());
+    if (this->dir.empty())
+        return;
+
+    if (mkdir (this->dir.c_str(), 0700) == -1 && errno != EEXIST) {
+        logE_ (_func, "could not create ", this->dir.c_str(), ": ", errnoString (errno),
+               ", probe results won't be saved");
+        this->dir.clear ();
+    }
+}
+
+}
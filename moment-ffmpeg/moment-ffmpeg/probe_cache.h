@@ -0,0 +1,155 @@
+/*  Moment-FFmpeg - FFmpeg support module for Moment Video Server
+    Copyright (C) 2011-2013 Dmitry Shatrov
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef MOMENT_FFMPEG__PROBE_CACHE__H__
+#define MOMENT_FFMPEG__PROBE_CACHE__H__
+
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <libmary/types.h>
+#include <moment/libmoment.h>
+
+extern "C" {
+#ifndef INT64_C
+#define INT64_C(c) (c ## LL)
+#define UINT64_C(c) (c ## ULL)
+#endif
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+
+namespace MomentFFmpeg {
+
+using namespace M;
+using namespace Moment;
+
+// Results of avformat_find_stream_info() for every source, keyed by URI.
+//
+// Cameras rarely change their codec parameters, so on reconnect the streams
+// which the demuxer has found are compared with the cached ones. If they
+// match, the frame rate and missing extradata are taken from the cache,
+// and probing completes as soon as the first frames have been decoded,
+// without estimating the frame rate. The frame size and audio format
+// found by the decoder must be the same as the cached ones, which catches
+// changes signalled in-band only. On any mismatch the entry is dropped
+// and the source is probed in full.
+//
+// Inputs which create their streams while being read (AVFMTCTX_NOHEADER)
+// are not cached: there's nothing to compare the cache with before probing.
+//
+// Every entry is kept in a small file in 'dir', so that the cache survives
+// restarts of the server.
+class ProbeCache : public Object
+{
+private:
+    StateMutex mutex;
+
+public:
+    class Entry : public Referenced
+    {
+        friend class ProbeCache;
+
+    private:
+        struct StreamParams
+        {
+            AVMediaType    codec_type;
+            AVCodecID      codec_id;
+
+            int            width;
+            int            height;
+            AVPixelFormat  pix_fmt;
+
+            int            sample_rate;
+            int            channels;
+            AVSampleFormat sample_fmt;
+            Uint64         channel_layout;
+            int            frame_size;
+
+            int            profile;
+            int            level;
+
+            AVRational     avg_frame_rate;
+            AVRational     r_frame_rate;
+
+            std::string    extradata;
+        };
+
+        mt_const std::vector<StreamParams> streams;
+        // Bytes which the full probe has read, plus a margin.
+        mt_const Int64 probe_size;
+
+    public:
+        Int64 getProbeSize () const { return probe_size; }
+
+        // Same number of streams with the same codecs. Extradata which has been
+        // received from the source (e.g. in SDP) must be the same as well.
+        bool matchesLayout (AVFormatContext * mt_nonnull format_ctx) const;
+
+        // Fills in the frame rate and extradata if the demuxer hasn't set them.
+        void apply (AVFormatContext * mt_nonnull format_ctx) const;
+
+        // Checked after probing: the parameters found in the stream are
+        // the same as the cached ones.
+        bool matchesProbed (AVFormatContext * mt_nonnull format_ctx) const;
+
+        Entry ()
+            : probe_size (0)
+        {}
+    };
+
+private:
+    typedef std::map< std::string, Ref<Entry> > EntryMap;
+
+    // Empty if the cache is not persistent.
+    mt_const std::string dir;
+
+    mt_mutex (mutex) EntryMap entry_map;
+
+    std::string getEntryPath (const std::string & uri) const;
+
+    Ref<Entry> loadEntry (const std::string & uri);
+
+    void saveEntry (const std::string & uri,
+                    Entry             * mt_nonnull entry);
+
+public:
+    // Returns false if the streams of the input are not known before probing.
+    static bool isCacheable (AVFormatContext * mt_nonnull format_ctx);
+
+    Ref<Entry> lookup (const std::string & uri);
+
+    void store (const std::string & uri,
+                AVFormatContext   * mt_nonnull format_ctx,
+                Int64               probe_size);
+
+    void remove (const std::string & uri);
+
+    // 'dir' is created if it doesn't exist. An empty 'dir' keeps the cache
+    // in memory only.
+    mt_const void init (ConstMemory dir);
+};
+
+}
+
+
+#endif /* MOMENT_FFMPEG__PROBE_CACHE__H__ */
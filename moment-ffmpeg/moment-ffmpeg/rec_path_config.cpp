@@ -2,6 +2,7 @@
 #include <limits>
 #include <json/json.h>
 #include <moment-ffmpeg/memory_dispatcher.h>
+#include <moment-ffmpeg/keyframe_index.h>
 #include <moment-ffmpeg/rec_path_config.h>
 
 using namespace M;
@@ -276,6 +277,7 @@ std::string RecpathConfig::GetNextPathForStream()
             logD(recpath, _func_, "filenameFull to remove = ", filenameFull);
 
             vfs->removeFile (filenameFull->mem());
+            vfs->removeFile (KeyframeIndex::makeIndexPath (filenameFull->mem())->mem());
             vfs->removeSubdirsForFilename (filenameFull->mem());
 
             std::string channel_name = fileName.substr(0,fileName.find("/"));
@@ -0,0 +1,408 @@
+/*  Moment-FFmpeg - FFmpeg support module for Moment Video Server
+    Copyright (C) 2011-2013 Dmitry Shatrov
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifdef __linux__
+#include <dirent.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/inotify.h>
+#endif
+
+#include <moment-ffmpeg/record_catalog.h>
+#include <moment-ffmpeg/channel_checker.h>
+#include <moment-ffmpeg/ffmpeg_stream.h>
+
+
+using namespace M;
+using namespace Moment;
+
+namespace MomentFFmpeg {
+
+static LogGroup libMary_logGroup_catalog ("mod_ffmpeg.record_catalog", LogLevel::E);
+
+#define POLL_TIMEOUT 1000 // in milliseconds, how soon stop() is noticed
+
+#ifdef __linux__
+
+#define WATCH_MASK (IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+static std::string makeFullPath (const std::string & diskName, const std::string & relPath)
+{
+    return relPath.empty() ? diskName : diskName + "/" + relPath;
+}
+
+static std::string makeRelPath (const std::string & relPath, const char * const name)
+{
+    return relPath.empty() ? std::string (name) : relPath + "/" + name;
+}
+
+bool
+RecordCatalog::addWatch (const std::string & diskName, const std::string & relPath, unsigned const depth)
+{
+    std::string const fullPath = makeFullPath (diskName, relPath);
+    int const wd = inotify_add_watch (m_fd, fullPath.c_str(), WATCH_MASK);
+    if (wd < 0) {
+        if (errno == ENOTDIR)
+            logD (catalog, _func, "not a directory: ", fullPath.c_str());
+        else
+            logE_ (_func, "inotify_add_watch() failed: ", fullPath.c_str(), ": ", errnoString (errno));
+
+        return false;
+    }
+
+    Watch & watch = m_watches [wd];
+    watch.diskName = diskName;
+    watch.relPath  = relPath;
+    watch.depth    = depth;
+
+    logD (catalog, _func, "wd ", wd, ": ", fullPath.c_str());
+    return true;
+}
+
+void
+RecordCatalog::watchLatest (const std::string & diskName,
+                            const std::string & relPath,
+                            unsigned            const depth,
+                            bool                const reportExisting)
+{
+    if (!addWatch (diskName, relPath, depth))
+        return;
+
+    std::string const fullPath = makeFullPath (diskName, relPath);
+    DIR * const dir = opendir (fullPath.c_str());
+    if (!dir)
+        return;
+
+    std::vector<std::string> subdirs;
+    std::string latest;
+    unsigned long latestNumber = 0;
+    while (struct dirent * const ent = readdir (dir)) {
+        if (ent->d_name [0] == '.')
+            continue;
+
+        if (depth == Depth_Hour) {
+            if (reportExisting)
+                recordEvent (diskName, relPath, ent->d_name, IN_CREATE);
+            continue;
+        }
+
+        if (ent->d_type != DT_DIR && ent->d_type != DT_UNKNOWN)
+            continue;
+
+        if (depth == 0) {
+            // every channel directory
+            subdirs.push_back (ent->d_name);
+            continue;
+        }
+
+        char *endptr = NULL;
+        unsigned long const number = strtoul (ent->d_name, &endptr, 10);
+        if (*endptr != 0)
+            continue;
+
+        if (latest.empty() || number > latestNumber) {
+            latest = ent->d_name;
+            latestNumber = number;
+        }
+    }
+    closedir (dir);
+
+    if (!latest.empty())
+        subdirs.push_back (latest);
+
+    for (Count i = 0; i < subdirs.size(); ++i)
+        watchLatest (diskName, makeRelPath (relPath, subdirs [i].c_str()), depth + 1, reportExisting);
+}
+
+void
+RecordCatalog::dropSiblings (const Watch & parent, const std::string & keepRelPath)
+{
+    std::string const prefix = makeRelPath (parent.relPath, "");
+    std::string const keepPrefix = keepRelPath + "/";
+
+    WatchMap::iterator it = m_watches.begin();
+    while (it != m_watches.end()) {
+        Watch const & watch = it->second;
+        if (watch.depth > parent.depth
+            && watch.diskName == parent.diskName
+            && watch.relPath.compare (0, prefix.size(), prefix) == 0
+            && watch.relPath != keepRelPath
+            && watch.relPath.compare (0, keepPrefix.size(), keepPrefix) != 0)
+        {
+            logD (catalog, _func, "wd ", it->first, ": ", watch.relPath.c_str());
+            inotify_rm_watch (m_fd, it->first);
+            m_watches.erase (it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+Ref<ChannelChecker>
+RecordCatalog::getChannelChecker (const std::string & channelName)
+{
+    Ref<ChannelChecker> channelChecker;
+
+    m_pStreamsMutex->lock ();
+    std::map<std::string, WeakRef<FFmpegStream> >::iterator const it = m_pStreams->find (channelName);
+    if (it != m_pStreams->end()) {
+        Ref<FFmpegStream> const stream = it->second.getRef();
+        if (stream)
+            channelChecker = stream->GetChannelChecker();
+    }
+    m_pStreamsMutex->unlock ();
+
+    return channelChecker;
+}
+
+void
+RecordCatalog::recordEvent (const std::string & diskName,
+                            const std::string & relPath,
+                            const char        * const name,
+                            Uint32              const mask)
+{
+    ConstMemory recName;
+    if (!stringHasSuffix (ConstMemory (name, strlen (name)), ".flv", &recName))
+        return;
+
+    std::string const path = makeRelPath (relPath, "") + std::string ((char const *) recName.mem(), recName.len());
+    std::string const channelName = relPath.substr (0, relPath.find ("/"));
+
+    Ref<ChannelChecker> const channelChecker = getChannelChecker (channelName);
+    if (!channelChecker) {
+        logD (catalog, _func, "unknown channel: ", channelName.c_str());
+        return;
+    }
+
+    if (mask & (IN_CREATE | IN_MOVED_TO))
+        channelChecker->OnRecordCreated (diskName, path);
+    else if (mask & IN_CLOSE_WRITE)
+        channelChecker->OnRecordClosed (diskName, path);
+    else if (mask & (IN_DELETE | IN_MOVED_FROM))
+        channelChecker->DeleteFromCache (diskName, path);
+}
+
+void
+RecordCatalog::handleEvent (int const wd, Uint32 const mask, const char * const name)
+{
+    if (mask & IN_Q_OVERFLOW) {
+        logE_ (_func, "inotify queue overflow, rescanning");
+        rescanAll ();
+        return;
+    }
+
+    WatchMap::iterator const it = m_watches.find (wd);
+    if (it == m_watches.end())
+        return;
+
+    if (mask & IN_IGNORED) {
+        // the directory is gone
+        m_watches.erase (it);
+        return;
+    }
+
+    if (!name || !name [0])
+        return;
+
+    Watch const watch = it->second;
+
+    if (mask & IN_ISDIR) {
+        if (!(mask & (IN_CREATE | IN_MOVED_TO)) || watch.depth >= Depth_Hour)
+            return;
+
+        std::string const relPath = makeRelPath (watch.relPath, name);
+        if (watch.depth >= Depth_Channel)
+            dropSiblings (watch, relPath);
+
+        // the directory may have got files before the watch was added
+        watchLatest (watch.diskName, relPath, watch.depth + 1, true /* reportExisting */);
+        return;
+    }
+
+    if (watch.depth == Depth_Hour)
+        recordEvent (watch.diskName, watch.relPath, name, mask);
+}
+
+void
+RecordCatalog::rescanAll ()
+{
+    for (WatchMap::iterator it = m_watches.begin(); it != m_watches.end(); ++it)
+        inotify_rm_watch (m_fd, it->first);
+    m_watches.clear ();
+
+    for (Count i = 0; i < m_diskNames.size(); ++i)
+        watchLatest (m_diskNames [i], std::string(), 0 /* depth */, false /* reportExisting */);
+
+    std::vector< Ref<ChannelChecker> > channelCheckers;
+
+    m_pStreamsMutex->lock ();
+    for (std::map<std::string, WeakRef<FFmpegStream> >::iterator it = m_pStreams->begin(); it != m_pStreams->end(); ++it) {
+        Ref<FFmpegStream> const stream = it->second.getRef();
+        if (stream)
+            channelCheckers.push_back (stream->GetChannelChecker());
+    }
+    m_pStreamsMutex->unlock ();
+
+    for (Count i = 0; i < channelCheckers.size(); ++i) {
+        if (channelCheckers [i])
+            channelCheckers [i]->Rescan ();
+    }
+}
+
+void
+RecordCatalog::threadFunc (void * const _self)
+{
+    RecordCatalog * const self = static_cast <RecordCatalog*> (_self);
+
+    updateTime ();
+
+    logD (catalog, _func_);
+
+    // Big enough for a burst of events with names of recordings.
+    Byte buf [64 << 10] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+
+    for (;;) {
+        self->mutex.lock ();
+        bool const should_stop = self->m_shouldStop;
+        self->mutex.unlock ();
+        if (should_stop)
+            break;
+
+        struct pollfd pfd;
+        pfd.fd = self->m_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int const res = poll (&pfd, 1, POLL_TIMEOUT);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+
+            logE_ (_func, "poll() failed: ", errnoString (errno));
+            break;
+        }
+
+        if (res == 0)
+            continue;
+
+        ssize_t const len = read (self->m_fd, buf, sizeof (buf));
+        if (len < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+
+            logE_ (_func, "read() failed: ", errnoString (errno));
+            break;
+        }
+
+        updateTime ();
+
+        for (ssize_t pos = 0; pos + (ssize_t) sizeof (struct inotify_event) <= len; ) {
+            struct inotify_event const * const ev = (struct inotify_event const *) (buf + pos);
+            self->handleEvent (ev->wd, ev->mask, ev->len ? ev->name : NULL);
+            pos += sizeof (struct inotify_event) + ev->len;
+        }
+    }
+
+    logD (catalog, _func_, "done");
+}
+
+bool
+RecordCatalog::init (std::vector<std::string> const & diskNames,
+                     std::map<std::string, WeakRef<FFmpegStream> > * const pStreams,
+                     StateMutex * const pStreamsMutex)
+{
+    m_diskNames = diskNames;
+    m_pStreams = pStreams;
+    m_pStreamsMutex = pStreamsMutex;
+
+    m_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    if (m_fd < 0) {
+        logE_ (_func, "inotify_init1() failed: ", errnoString (errno));
+        return false;
+    }
+
+    // existing recordings are picked up by the startup scan
+    for (Count i = 0; i < m_diskNames.size(); ++i)
+        watchLatest (m_diskNames [i], std::string(), 0 /* depth */, false /* reportExisting */);
+
+    logD (catalog, _func, "watches: ", m_watches.size());
+    return true;
+}
+
+#else
+
+bool
+RecordCatalog::init (std::vector<std::string> const & /* diskNames */,
+                     std::map<std::string, WeakRef<FFmpegStream> > * const /* pStreams */,
+                     StateMutex * const /* pStreamsMutex */)
+{
+    logD (catalog, _func, "not supported");
+    return false;
+}
+
+void
+RecordCatalog::threadFunc (void * const /* _self */)
+{
+}
+
+#endif
+
+mt_throws Result
+RecordCatalog::spawn ()
+{
+    if (!m_thread->spawn (true /* joinable */)) {
+        logE_ (_func, "m_thread->spawn() failed: ", exc->toString());
+        return Result::Failure;
+    }
+
+    return Result::Success;
+}
+
+void
+RecordCatalog::stop ()
+{
+    mutex.lock ();
+    m_shouldStop = true;
+    mutex.unlock ();
+
+    if (!m_thread->join ())
+        logE_ (_func, "m_thread->join() failed: ", exc->toString());
+}
+
+RecordCatalog::RecordCatalog ()
+    : m_fd (-1),
+      m_pStreams (NULL),
+      m_pStreamsMutex (NULL),
+      m_shouldStop (false)
+{
+    m_thread = grab (new (std::nothrow) Thread (
+            CbDesc<Thread::ThreadFunc> (threadFunc,
+                                        this /* cb_data */,
+                                        this /* coderef_container */)));
+}
+
+RecordCatalog::~RecordCatalog ()
+{
+#ifdef __linux__
+    if (m_fd >= 0)
+        ::close (m_fd);
+#endif
+}
+
+}
@@ -0,0 +1,125 @@
+/*  Moment-FFmpeg - FFmpeg support module for Moment Video Server
+    Copyright (C) 2011-2013 Dmitry Shatrov
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef MOMENT_FFMPEG__RECORD_CATALOG__H__
+#define MOMENT_FFMPEG__RECORD_CATALOG__H__
+
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <libmary/types.h>
+#include <moment/libmoment.h>
+
+
+namespace MomentFFmpeg {
+
+using namespace M;
+using namespace Moment;
+
+class FFmpegStream;
+class ChannelChecker;
+
+// Keeps ChannelCheckers up to date from inotify events on the recording disks.
+//
+// Recordings are kept as <disk>/<channel>/YYYY/MM/DD/HH/<file>.flv. Only the
+// live edge of the tree is watched: disk roots, channel directories and the
+// newest directory of every level below them. A new directory replaces the
+// watches of its older siblings, so the number of watches stays at a few per
+// channel no matter how large the archive is. Recordings are created and
+// closed at the live edge only; the oldest records are expired by
+// ChannelChecker's own consistency check.
+class RecordCatalog : public Object
+{
+private:
+    StateMutex mutex;
+
+    enum {
+        // <disk>/<channel>/YYYY/MM/DD/HH
+        Depth_Channel = 1,
+        Depth_Hour    = 5
+    };
+
+    struct Watch
+    {
+        std::string diskName;
+        // relative to diskName, empty for the disk itself
+        std::string relPath;
+        unsigned depth;
+    };
+
+    // [watch descriptor, watched directory]
+    typedef std::map<int, Watch> WatchMap;
+
+    mt_const int m_fd;
+    mt_const std::vector<std::string> m_diskNames;
+
+    mt_const std::map<std::string, WeakRef<FFmpegStream> > * m_pStreams;
+    mt_const StateMutex * m_pStreamsMutex;
+
+    mt_const Ref<Thread> m_thread;
+
+    mt_mutex (mutex) bool m_shouldStop;
+
+    // Accessed by the catalog thread only, once it is running.
+    WatchMap m_watches;
+
+    bool addWatch (const std::string & diskName, const std::string & relPath, unsigned depth);
+
+    // Watches 'relPath' and the newest directories below it. Recordings which
+    // are already there are reported as created if 'reportExisting' is set.
+    void watchLatest (const std::string & diskName,
+                      const std::string & relPath,
+                      unsigned            depth,
+                      bool                reportExisting);
+
+    // Removes the watches under 'parent' except for 'keepRelPath' and below.
+    void dropSiblings (const Watch & parent, const std::string & keepRelPath);
+
+    Ref<ChannelChecker> getChannelChecker (const std::string & channelName);
+
+    void handleEvent (int wd, Uint32 mask, const char * name);
+
+    void recordEvent (const std::string & diskName, const std::string & relPath, const char * name, Uint32 mask);
+
+    // Events have been lost, every channel is checked against the directories.
+    void rescanAll ();
+
+    static void threadFunc (void *_self);
+
+public:
+    // Returns 'false' if inotify is not available, the caller should poll then.
+    bool init (std::vector<std::string> const & diskNames,
+               std::map<std::string, WeakRef<FFmpegStream> > * pStreams,
+               StateMutex * pStreamsMutex);
+
+    mt_throws Result spawn ();
+
+    void stop ();
+
+    RecordCatalog ();
+
+    ~RecordCatalog ();
+};
+
+}
+
+
+#endif /* MOMENT_FFMPEG__RECORD_CATALOG__H__ */
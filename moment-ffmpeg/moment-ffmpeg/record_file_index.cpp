@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <climits>
+
+#include <moment-ffmpeg/record_file_index.h>
+
+using namespace M;
+using namespace Moment;
+
+namespace MomentFFmpeg {
+
+static bool entry_compare(const RecordFileIndex::Entry & a, const RecordFileIndex::Entry & b)
+{
+    if(a.times.timeStart != b.times.timeStart)
+        return a.times.timeStart < b.times.timeStart;
+
+    return a.path < b.path;
+}
+
+Ref<RecordFileIndex>
+RecordFileIndex::create(EntryList * entries)
+{
+    Ref<FileList> const files = grab(new (std::nothrow) FileList);
+    files->entries.swap(*entries);
+    std::sort(files->entries.begin(), files->entries.end(), entry_compare);
+
+    files->maxEnd.reserve(files->entries.size());
+    int maxEnd = INT_MIN;
+    for(Count i = 0; i < files->entries.size(); i++)
+    {
+        if(files->entries[i].times.timeEnd > maxEnd)
+            maxEnd = files->entries[i].times.timeEnd;
+        files->maxEnd.push_back(maxEnd);
+    }
+
+    Ref<RecordFileIndex> const index = grab(new (std::nothrow) RecordFileIndex);
+    index->m_files = files;
+    index->m_lastEnd = files->entries.empty() ? 0 : files->entries.back().times.timeEnd;
+    return index;
+}
+
+Ref<RecordFileIndex>
+RecordFileIndex::withLastEnd(int timeEnd) const
+{
+    Ref<RecordFileIndex> const index = grab(new (std::nothrow) RecordFileIndex);
+    index->m_files = m_files;
+    index->m_lastEnd = timeEnd;
+    return index;
+}
+
+int
+RecordFileIndex::getMaxEnd(Count idx) const
+{
+    if(idx + 1 < m_files->entries.size())
+        return m_files->maxEnd[idx];
+
+    // the last file, its end may have moved since the list was built
+    if(idx > 0 && m_files->maxEnd[idx - 1] > m_lastEnd)
+        return m_files->maxEnd[idx - 1];
+
+    return m_lastEnd;
+}
+
+ChChTimes
+RecordFileIndex::getTimes(Count idx) const
+{
+    ChChTimes times = m_files->entries[idx].times;
+    if(idx + 1 == m_files->entries.size())
+        times.timeEnd = m_lastEnd;
+
+    return times;
+}
+
+bool
+RecordFileIndex::overlaps(Count idx, int from, int to) const
+{
+    ChChTimes const times = getTimes(idx);
+    return times.timeStart <= to && times.timeEnd >= from;
+}
+
+void
+RecordFileIndex::findFiles(int from, int to, Count * ret_begin, Count * ret_end) const
+{
+    EntryList const & entries = m_files->entries;
+
+    // the first file which starts after the interval
+    Count end = entries.size();
+    {
+        Count left = 0;
+        while(left < end)
+        {
+            Count const mid = left + (end - left) / 2;
+            if(entries[mid].times.timeStart > to)
+                end = mid;
+            else
+                left = mid + 1;
+        }
+    }
+
+    // the first file before which nothing reaches the interval
+    Count begin = 0;
+    {
+        Count right = end;
+        while(begin < right)
+        {
+            Count const mid = begin + (right - begin) / 2;
+            if(getMaxEnd(mid) < from)
+                begin = mid + 1;
+            else
+                right = mid;
+        }
+    }
+
+    *ret_begin = begin;
+    *ret_end = end;
+}
+
+RecordFileIndex::RecordFileIndex(): m_lastEnd(0)
+{
+}
+
+}
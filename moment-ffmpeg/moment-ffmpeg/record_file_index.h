@@ -0,0 +1,76 @@
+#ifndef MOMENT_FFMPEG__RECORD_FILE_INDEX__H__
+#define MOMENT_FFMPEG__RECORD_FILE_INDEX__H__
+
+#include <vector>
+#include <string>
+
+#include <moment/libmoment.h>
+#include <moment-ffmpeg/record_timeline.h>
+
+using namespace M;
+using namespace Moment;
+
+namespace MomentFFmpeg {
+
+// Read-only snapshot of the recorded files of a channel, ordered by start time.
+//
+// ChannelChecker publishes a new snapshot after its cache changes; readers
+// take a reference to the current one and search it without any locks.
+// Along with the files the running maximum of their end times is kept, so
+// the files overlapping [from, to] are found with two binary searches even
+// if some of them overlap each other.
+//
+// The end time of the last file grows while it is being recorded. Such an
+// update makes a new snapshot which shares the file list with the old one.
+class RecordFileIndex : public Referenced
+{
+public:
+    struct Entry
+    {
+        std::string path;       // without ".flv", relative to the disk
+        std::string diskName;
+        ChChTimes times;
+    };
+
+    typedef std::vector<Entry> EntryList;
+
+private:
+    class FileList : public Referenced
+    {
+    public:
+        EntryList entries;
+        std::vector<int> maxEnd;    // maximum end time of entries [0, i]
+    };
+
+    Ref<FileList> m_files;
+    int m_lastEnd;
+
+    int getMaxEnd(Count idx) const;
+
+public:
+    // takes the contents of 'entries'
+    static Ref<RecordFileIndex> create(EntryList * entries);
+
+    // the same files, the last one ends at 'timeEnd'
+    Ref<RecordFileIndex> withLastEnd(int timeEnd) const;
+
+    Count getNumFiles() const { return m_files->entries.size(); }
+
+    const std::string & getPath(Count idx) const { return m_files->entries[idx].path; }
+    const std::string & getDiskName(Count idx) const { return m_files->entries[idx].diskName; }
+    ChChTimes getTimes(Count idx) const;
+
+    bool overlaps(Count idx, int from, int to) const;
+
+    // Files [*ret_begin, *ret_end) are the candidates for [from, to]: every
+    // file overlapping the interval is there. Unless the files overlap each
+    // other, which does not happen when a channel is recorded to one place
+    // at a time, all of the candidates overlap the interval too.
+    void findFiles(int from, int to, Count * ret_begin, Count * ret_end) const;
+
+    RecordFileIndex();
+};
+
+}
+
+#endif //MOMENT_FFMPEG__RECORD_FILE_INDEX__H__
@@ -0,0 +1,509 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <fstream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <moment-ffmpeg/record_index.h>
+
+
+using namespace M;
+using namespace Moment;
+
+namespace MomentFFmpeg {
+
+static LogGroup libMary_logGroup_recindex ("mod_ffmpeg.record_index", LogLevel::E);
+
+static char const record_index_magic [8] = { 'M', 'N', 'V', 'R', 'I', 'D', 'X', 0 };
+
+// Deleted records allowed on top of the live ones before the file gets
+// compacted by a rewrite.
+#define COMPACT_SLACK 64
+
+Uint32
+RecordIndex::recordChecksum (Record const * const mt_nonnull record)
+{
+    Byte const * const buf = (Byte const *) record;
+    Size const checksum_offs = offsetof (Record, checksum);
+
+    Uint32 hash = 2166136261U;
+    for (Size i = 0; i < sizeof (Record); ++i) {
+        if (i >= checksum_offs && i < checksum_offs + sizeof (record->checksum))
+            continue;
+
+        hash ^= buf [i];
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+void
+RecordIndex::fillRecord (Entry const &entry, Record * const mt_nonnull record)
+{
+    memset (record, 0, sizeof (*record));
+    record->time_start = entry.timeStart;
+    record->time_end   = entry.timeEnd;
+    record->flags      = 0;
+    memcpy (record->name, entry.name.c_str(), entry.name.length());
+    record->checksum   = recordChecksum (record);
+}
+
+bool
+RecordIndex::nameEquals (Record const * const mt_nonnull record, std::string const &name)
+{
+    return name.length() <= MaxNameLen
+           && memcmp (record->name, name.c_str(), name.length()) == 0
+           && record->name [name.length()] == 0;
+}
+
+bool
+RecordIndex::isLive (Record const * const mt_nonnull record)
+{
+    return !(record->flags & Flag_Deleted) && record->checksum == recordChecksum (record);
+}
+
+bool
+RecordIndex::writeRecords (int const fd, std::vector<Record> const &records)
+{
+    // A single write keeps the window for a torn append as small as possible.
+    Byte const *buf = (Byte const *) &records [0];
+    Size left = records.size() * sizeof (Record);
+    while (left > 0) {
+        ssize_t const res = ::write (fd, buf, left);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+
+            logE_ (_func, "write() failed: ", errnoString (errno));
+            return false;
+        }
+
+        buf  += res;
+        left -= res;
+    }
+
+    return true;
+}
+
+bool
+RecordIndex::open (const char * const path)
+{
+    close ();
+
+    int const fd = ::open (path, O_RDONLY);
+    if (fd < 0) {
+        logD (recindex, _func, "open() failed: ", path, ": ", errnoString (errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat (fd, &st) == -1 || (Size) st.st_size < sizeof (Header)) {
+        ::close (fd);
+        return false;
+    }
+
+    void * const data = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        logE_ (_func, "mmap() failed: ", path, ": ", errnoString (errno));
+        ::close (fd);
+        return false;
+    }
+
+    Header const * const header = (Header const *) data;
+    if (memcmp (header->magic, record_index_magic, sizeof (record_index_magic))
+        || header->version != Version
+        || header->header_size < sizeof (Header)
+        || header->record_size < sizeof (Record)
+        || header->header_size > (Size) st.st_size)
+    {
+        logD (recindex, _func, "not a binary index v", (Uint32) Version, ": ", path);
+        munmap (data, st.st_size);
+        ::close (fd);
+        return false;
+    }
+
+    m_fd   = fd;
+    m_data = (Byte*) data;
+    m_size = st.st_size;
+    m_count = (m_size - header->header_size) / header->record_size;
+
+    // An append that has not been completed leaves a damaged tail.
+    while (m_count > 0) {
+        Record const * const record = getRecord (m_count - 1);
+        if (record->checksum == recordChecksum (record))
+            break;
+
+        logD (recindex, _func, "dropping corrupt record #", m_count - 1, ": ", path);
+        --m_count;
+    }
+
+    m_validSize = header->header_size + m_count * header->record_size;
+
+    m_numDead = 0;
+    for (Count i = 0; i < m_count; ++i) {
+        if (!isLive (getRecord (i)))
+            ++m_numDead;
+    }
+
+    return true;
+}
+
+void
+RecordIndex::close ()
+{
+    if (m_data) {
+        munmap (m_data, m_size);
+        m_data = NULL;
+    }
+
+    if (m_fd >= 0) {
+        ::close (m_fd);
+        m_fd = -1;
+    }
+
+    m_size = 0;
+    m_validSize = 0;
+    m_count = 0;
+    m_numDead = 0;
+}
+
+RecordIndex::Record const *
+RecordIndex::getRecord (Count const idx) const
+{
+    Header const * const header = (Header const *) m_data;
+    return (Record const *) (m_data + header->header_size + idx * header->record_size);
+}
+
+void
+RecordIndex::getEntries (EntryList * const mt_nonnull entries) const
+{
+    entries->reserve (entries->size() + m_count - m_numDead);
+
+    for (Count i = 0; i < m_count; ++i) {
+        Record const * const record = getRecord (i);
+        if (!isLive (record))
+            continue;
+
+        char name [MaxNameLen + 1];
+        memcpy (name, record->name, MaxNameLen);
+        name [MaxNameLen] = 0;
+
+        Entry entry;
+        entry.name = name;
+        entry.timeStart = record->time_start;
+        entry.timeEnd   = record->time_end;
+        entries->push_back (entry);
+    }
+}
+
+bool
+RecordIndex::isBinary (const char * const path)
+{
+    char magic [sizeof (record_index_magic)];
+
+    std::ifstream file (path, std::ios::in | std::ios::binary);
+    if (!file.is_open())
+        return false;
+
+    if (!file.read (magic, sizeof (magic)))
+        return false;
+
+    return memcmp (magic, record_index_magic, sizeof (magic)) == 0;
+}
+
+bool
+RecordIndex::readText (const char * const path, EntryList * const mt_nonnull entries)
+{
+    std::ifstream idxFile (path);
+    if (!idxFile.is_open()) {
+        logD (recindex, _func, "fail to open idxFile: ", path);
+        return false;
+    }
+
+    std::string const delimiter = "|";
+    std::string line;
+    while (std::getline (idxFile, line))
+    {
+        int initTime = 0;
+        int endTime = 0;
+
+        size_t pos = line.rfind (delimiter);
+        if (pos == std::string::npos)
+            continue;
+        strToInt32_safe (line.c_str() + pos + delimiter.length(), &endTime);
+        line.erase (pos);
+
+        pos = line.rfind (delimiter);
+        if (pos == std::string::npos)
+            continue;
+        strToInt32_safe (line.c_str() + pos + delimiter.length(), &initTime);
+        line.erase (pos);
+
+        Entry entry;
+        entry.name = line;
+        entry.timeStart = initTime;
+        entry.timeEnd = endTime;
+        entries->push_back (entry);
+    }
+
+    return true;
+}
+
+bool
+RecordIndex::rewrite (const char * const path, EntryList const &entries)
+{
+    std::vector<Record> records;
+    records.reserve (entries.size());
+
+    StRef<String> const tmp_path = st_makeString (path, ".tmp");
+    int const fd = ::open (tmp_path->cstr(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        // The record directory may have been removed by the cleaner already.
+        if (errno == ENOENT)
+            logD (recindex, _func, "open() failed: ", tmp_path, ": ", errnoString (errno));
+        else
+            logE_ (_func, "open() failed: ", tmp_path, ": ", errnoString (errno));
+        return false;
+    }
+
+    Header header;
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, record_index_magic, sizeof (header.magic));
+    header.version     = Version;
+    header.header_size = sizeof (Header);
+    header.record_size = sizeof (Record);
+
+    bool res = true;
+    if (::write (fd, &header, sizeof (header)) != (ssize_t) sizeof (header)) {
+        logE_ (_func, "write() failed: ", tmp_path, ": ", errnoString (errno));
+        res = false;
+    }
+
+    if (res) {
+        for (Count i = 0; i < entries.size(); ++i) {
+            if (entries [i].name.length() > MaxNameLen) {
+                logE_ (_func, "name is too long, skipping: ", entries [i].name.c_str());
+                continue;
+            }
+
+            Record record;
+            fillRecord (entries [i], &record);
+            records.push_back (record);
+        }
+
+        if (!records.empty())
+            res = writeRecords (fd, records);
+    }
+
+    // The new index must be on disk before it replaces the old one.
+    if (res && fdatasync (fd) == -1) {
+        logE_ (_func, "fdatasync() failed: ", tmp_path, ": ", errnoString (errno));
+        res = false;
+    }
+
+    ::close (fd);
+
+    if (res && ::rename (tmp_path->cstr(), path) == -1) {
+        logE_ (_func, "rename() failed: ", path, ": ", errnoString (errno));
+        res = false;
+    }
+
+    if (!res)
+        ::unlink (tmp_path->cstr());
+
+    return res;
+}
+
+bool
+RecordIndex::update (const char * const path, EntryList const &entries)
+{
+    RecordIndex idx;
+    if (!idx.open (path))
+        return rewrite (path, entries);
+
+    Header const * const header = (Header const *) idx.m_data;
+    if (header->record_size != sizeof (Record) || idx.m_count == 0)
+        return rewrite (path, entries);
+
+    // Records to be overwritten in place, along with their numbers.
+    std::vector<Count>  changed_idx;
+    std::vector<Record> changed;
+    std::vector<Record> appended;
+
+    Count num_dead = idx.m_numDead;
+
+    // Both the records and the entries are sorted by start time.
+    Count i = 0;
+    Count j = 0;
+    while (i < idx.m_count && j < entries.size()) {
+        Record const * const record = idx.getRecord (i);
+        if (!isLive (record)) {
+            ++i;
+            continue;
+        }
+
+        Entry const &entry = entries [j];
+        if (entry.name.length() > MaxNameLen) {
+            // rewrite() would skip it as well.
+            ++j;
+            continue;
+        }
+
+        if (nameEquals (record, entry.name)) {
+            if (record->time_start != entry.timeStart)
+                return rewrite (path, entries);
+
+            if (record->time_end != entry.timeEnd) {
+                Record new_record;
+                fillRecord (entry, &new_record);
+                changed_idx.push_back (i);
+                changed.push_back (new_record);
+            }
+
+            ++i;
+            ++j;
+        } else
+        if (record->time_start < entry.timeStart) {
+            // The file has been deleted.
+            Record new_record = *record;
+            new_record.flags |= Flag_Deleted;
+            new_record.checksum = recordChecksum (&new_record);
+            changed_idx.push_back (i);
+            changed.push_back (new_record);
+            ++num_dead;
+            ++i;
+        } else {
+            // A new file in the middle of the index.
+            return rewrite (path, entries);
+        }
+    }
+
+    for (; i < idx.m_count; ++i) {
+        Record const * const record = idx.getRecord (i);
+        if (!isLive (record))
+            continue;
+
+        Record new_record = *record;
+        new_record.flags |= Flag_Deleted;
+        new_record.checksum = recordChecksum (&new_record);
+        changed_idx.push_back (i);
+        changed.push_back (new_record);
+        ++num_dead;
+    }
+
+    Int32 last_start = idx.getRecord (idx.m_count - 1)->time_start;
+    for (; j < entries.size(); ++j) {
+        if (entries [j].name.length() > MaxNameLen)
+            continue;
+
+        if (entries [j].timeStart < last_start)
+            return rewrite (path, entries);
+
+        Record record;
+        fillRecord (entries [j], &record);
+        appended.push_back (record);
+        last_start = entries [j].timeStart;
+    }
+
+    if (changed.empty() && appended.empty())
+        return true;
+
+    Count const num_live = idx.m_count + appended.size() - num_dead;
+    if (num_dead > num_live + COMPACT_SLACK)
+        return rewrite (path, entries);
+
+    Size const header_size = header->header_size;
+    Size const valid_size = idx.m_validSize;
+    idx.close ();
+
+    int const fd = ::open (path, O_WRONLY);
+    if (fd < 0) {
+        logE_ (_func, "open() failed: ", path, ": ", errnoString (errno));
+        return false;
+    }
+
+    bool res = true;
+    for (Count k = 0; k < changed.size(); ++k) {
+        off_t const offs = header_size + changed_idx [k] * sizeof (Record);
+        if (pwrite (fd, &changed [k], sizeof (Record), offs) != (ssize_t) sizeof (Record)) {
+            logE_ (_func, "pwrite() failed: ", path, ": ", errnoString (errno));
+            res = false;
+            break;
+        }
+    }
+
+    if (res && !appended.empty()) {
+        // Cutting off whatever is left of a torn append.
+        if (ftruncate (fd, valid_size) == -1
+            || lseek (fd, valid_size, SEEK_SET) == (off_t) -1)
+        {
+            logE_ (_func, "fail to seek to the end of valid records: ", path, ": ", errnoString (errno));
+            res = false;
+        }
+
+        if (res)
+            res = writeRecords (fd, appended);
+    }
+
+    ::close (fd);
+
+    logD (recindex, _func, path, ": changed ", changed.size(), ", appended ", appended.size(), " records");
+    return res;
+}
+
+bool
+RecordIndex::convertText (const char * const path)
+{
+    EntryList entries;
+    if (!readText (path, &entries))
+        return false;
+
+    for (Count i = 0; i < entries.size(); ++i) {
+        size_t const pos = entries [i].name.rfind ("/");
+        if (pos != std::string::npos)
+            entries [i].name.erase (0, pos + 1);
+    }
+
+    logD (recindex, _func, "converting ", path, ", ", entries.size(), " records");
+    return rewrite (path, entries);
+}
+
+RecordIndex::RecordIndex ()
+    : m_fd (-1),
+      m_data (NULL),
+      m_size (0),
+      m_validSize (0),
+      m_count (0),
+      m_numDead (0)
+{
+}
+
+RecordIndex::~RecordIndex ()
+{
+    close ();
+}
+
+}
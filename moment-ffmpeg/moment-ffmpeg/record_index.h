@@ -0,0 +1,146 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MOMENT_FFMPEG__RECORD_INDEX__H__
+#define MOMENT_FFMPEG__RECORD_INDEX__H__
+
+
+#include <string>
+#include <vector>
+
+#include <moment/libmoment.h>
+
+
+namespace MomentFFmpeg {
+
+using namespace M;
+using namespace Moment;
+
+// Binary index of the recorded files of one record directory
+// (<channel>/year/month/day/hour/<channel>.idx).
+//
+// The file is a Header followed by fixed-size Records sorted by start time,
+// so it can be memory-mapped and read without parsing. Changes are made to
+// the records in place: when the duration of a file changes, its record is
+// overwritten, and the record of a deleted file is marked with Flag_Deleted.
+// New files are appended. Every record carries a checksum, a record torn by
+// a crash is skipped on reading, an incomplete tail is cut off by the next
+// update. Start times and names are never changed in place, so the order of
+// the records holds even for torn ones. Any other change, and compaction of
+// deleted records, rewrites the file into a temporary one which is then
+// renamed over the index.
+//
+// Integers are stored in host byte order (little-endian on all supported
+// platforms). tools/convert_idx.py converts text indexes offline.
+mt_unsafe class RecordIndex
+{
+public:
+    enum {
+        Version    = 1,
+        MaxNameLen = 111
+    };
+
+    enum {
+        Flag_Deleted = 1
+    };
+
+    struct Header
+    {
+        char   magic [8];       // "MNVRIDX\0"
+        Uint32 version;
+        Uint32 header_size;
+        Uint32 record_size;
+        Uint32 reserved [3];
+    };
+
+    struct Record
+    {
+        Int32  time_start;
+        Int32  time_end;
+        Uint32 flags;           // Flag_Deleted
+        Uint32 checksum;        // FNV-1a of all other fields
+        char   name [MaxNameLen + 1];   // file name without extension, zero-padded
+    };
+
+    struct Entry
+    {
+        std::string name;
+        int timeStart;
+        int timeEnd;
+    };
+
+    typedef std::vector<Entry> EntryList;
+
+private:
+    int    m_fd;
+    Byte  *m_data;
+    Size   m_size;
+    Size   m_validSize;     // header and records up to the last valid one
+    Count  m_count;         // number of records, including deleted and torn ones
+    Count  m_numDead;       // deleted and torn records
+
+    static Uint32 recordChecksum (Record const * mt_nonnull record);
+    static void fillRecord (Entry const &entry, Record * mt_nonnull record);
+    static bool nameEquals (Record const * mt_nonnull record, std::string const &name);
+
+    static bool writeRecords (int fd, std::vector<Record> const &records);
+
+public:
+    // Maps an existing index for reading.
+    // Returns false if there's no file or it is not a binary index.
+    bool open (const char * path);
+    void close ();
+
+    bool isOpen () const { return m_data != NULL; }
+
+    Count getCount () const { return m_count; }
+    Record const * getRecord (Count idx) const;
+
+    // False for deleted records and the ones with a wrong checksum.
+    static bool isLive (Record const * mt_nonnull record);
+
+    // Fills 'entries' with the live records.
+    void getEntries (EntryList * mt_nonnull entries) const;
+
+    // Returns true if the file starts with the binary index magic.
+    static bool isBinary (const char * path);
+
+    // Parses a text index ("path|start|end" lines), names are left as they are.
+    static bool readText (const char * path, EntryList * mt_nonnull entries);
+
+    // Replaces the index with 'entries' (sorted by start time) atomically.
+    static bool rewrite (const char * path, EntryList const &entries);
+
+    // Brings the index in line with 'entries' (sorted by start time).
+    // Updates end times and deletions in place and appends new records which
+    // start after the last one, rewrites the index otherwise.
+    static bool update (const char * path, EntryList const &entries);
+
+    // Converts a text index into a binary one in place.
+    // Path components of the file names are stripped.
+    static bool convertText (const char * path);
+
+    RecordIndex ();
+    ~RecordIndex ();
+};
+
+}
+
+
+#endif /* MOMENT_FFMPEG__RECORD_INDEX__H__ */
@@ -0,0 +1,171 @@
+/*  Moment-FFmpeg - FFmpeg support module for Moment Video Server
+    Copyright (C) 2011-2013 Dmitry Shatrov
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include <moment-ffmpeg/record_scanner.h>
+#include <moment-ffmpeg/time_checker.h>
+
+
+using namespace M;
+using namespace Moment;
+
+namespace MomentFFmpeg {
+
+static LogGroup libMary_logGroup_recscanner ("mod_ffmpeg.record_scanner", LogLevel::E);
+
+mt_mutex (mutex) RecordScanner::JobList::iterator
+RecordScanner::findRunnableJob ()
+{
+    for (JobList::iterator it = jobs.begin(); it != jobs.end(); ++it) {
+        if (disk_scans [it->diskName] < io_depth)
+            return it;
+    }
+
+    return jobs.end();
+}
+
+void
+RecordScanner::threadFunc (void * const _self)
+{
+    RecordScanner * const self = static_cast <RecordScanner*> (_self);
+
+    updateTime ();
+
+    logD (recscanner, _func_);
+
+    self->mutex.lock ();
+    for (;;) {
+        JobList::iterator it;
+        while (!self->should_stop && (it = self->findRunnableJob()) == self->jobs.end())
+            self->job_cond.wait (self->mutex);
+
+        if (self->should_stop)
+            break;
+
+        Job const job = *it;
+        self->jobs.erase (it);
+        ++self->disk_scans [job.diskName];
+        self->mutex.unlock ();
+
+        updateTime ();
+        TimeChecker tc;tc.Start();
+
+        job.checker->scanDisk (job.diskName);
+
+        Time t;tc.Stop(&t);
+        logD (recscanner, _func_, "disk ", job.diskName.c_str(), " done in ", t);
+
+        self->mutex.lock ();
+        --self->disk_scans [job.diskName];
+        --self->num_pending;
+        if (self->num_pending == 0)
+            logD (recscanner, _func_, "all scans are done");
+
+        // The freed slot may let a job for this disk run on another thread.
+        self->job_cond.signal ();
+    }
+    self->mutex.unlock ();
+
+    logD (recscanner, _func_, "done");
+}
+
+void
+RecordScanner::addChannel (ChannelChecker                 * const mt_nonnull checker,
+                           std::vector<std::string> const &diskNames)
+{
+    mutex.lock ();
+    for (Count i = 0; i < diskNames.size(); ++i) {
+        Job job;
+        job.checker = checker;
+        job.diskName = diskNames [i];
+        jobs.push_back (job);
+        ++num_pending;
+
+        if (i < num_threads)
+            job_cond.signal ();
+    }
+    mutex.unlock ();
+}
+
+Count
+RecordScanner::getNumPending ()
+{
+    mutex.lock ();
+    Count const res = num_pending;
+    mutex.unlock ();
+    return res;
+}
+
+mt_throws Result
+RecordScanner::spawn ()
+{
+    logD (recscanner, _func_, "num_threads: ", num_threads, ", io_depth: ", io_depth);
+
+    multi_thread->setNumThreads (num_threads);
+    if (!multi_thread->spawn (true /* joinable */)) {
+        logE_ (_func, "multi_thread->spawn() failed: ", exc->toString());
+        return Result::Failure;
+    }
+
+    return Result::Success;
+}
+
+void
+RecordScanner::stop ()
+{
+    mutex.lock ();
+    should_stop = true;
+    // Waking up all threads.
+    for (Count i = 0; i < num_threads; ++i)
+        job_cond.signal ();
+    mutex.unlock ();
+
+    if (!multi_thread->join ())
+        logE_ (_func, "multi_thread->join() failed: ", exc->toString());
+}
+
+mt_const void
+RecordScanner::init (Count const num_disks,
+                     Count const io_depth)
+{
+    this->io_depth = (io_depth > 0 ? io_depth : 1);
+    // Enough threads to keep every disk busy at full depth.
+    this->num_threads = (num_disks > 0 ? num_disks : 1) * this->io_depth;
+}
+
+RecordScanner::RecordScanner ()
+    : io_depth (1),
+      num_threads (1),
+      num_pending (0),
+      should_stop (false)
+{
+    multi_thread = grab (new (std::nothrow) MultiThread (
+            1 /* num_threads */,
+            CbDesc<Thread::ThreadFunc> (threadFunc,
+                                        this /* cb_data */,
+                                        this /* coderef_container */)));
+}
+
+RecordScanner::~RecordScanner ()
+{
+    mutex.lock ();
+    jobs.clear ();
+    mutex.unlock ();
+}
+
+}
@@ -0,0 +1,102 @@
+/*  Moment-FFmpeg - FFmpeg support module for Moment Video Server
+    Copyright (C) 2011-2013 Dmitry Shatrov
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef MOMENT_FFMPEG__RECORD_SCANNER__H__
+#define MOMENT_FFMPEG__RECORD_SCANNER__H__
+
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <libmary/types.h>
+#include <moment/libmoment.h>
+#include <moment-ffmpeg/channel_checker.h>
+
+
+namespace MomentFFmpeg {
+
+using namespace M;
+using namespace Moment;
+
+// Builds the record caches of channels in the background.
+//
+// A channel is scanned separately on each recording disk, and the disks are
+// scanned in parallel. No more than 'io_depth' scans run on one disk at a
+// time, so a cold start doesn't thrash the heads of a single device.
+// ChannelChecker::scanDisk() publishes the records of a disk into the cache
+// as soon as the disk is done, and the cache serves what it has until then.
+class RecordScanner : public Object
+{
+private:
+    StateMutex mutex;
+
+    struct Job
+    {
+        Ref<ChannelChecker> checker;
+        std::string diskName;
+    };
+
+    typedef std::list<Job> JobList;
+    // [diskname, number of scans running on it]
+    typedef std::map<std::string, Count> DiskScans;
+
+    mt_const Count io_depth;
+    mt_const Count num_threads;
+
+    mt_const Ref<MultiThread> multi_thread;
+
+    mt_mutex (mutex) JobList jobs;
+    mt_mutex (mutex) DiskScans disk_scans;
+    mt_mutex (mutex) Cond job_cond;
+
+    mt_mutex (mutex) Count num_pending;
+    mt_mutex (mutex) bool should_stop;
+
+    // The first job whose disk has a free slot, or jobs.end().
+    mt_mutex (mutex) JobList::iterator findRunnableJob ();
+
+    static void threadFunc (void *_self);
+
+public:
+    // Queues a scan of the channel on each of 'diskNames'.
+    void addChannel (ChannelChecker                 * mt_nonnull checker,
+                     std::vector<std::string> const &diskNames);
+
+    // Number of channel/disk scans which haven't completed yet.
+    Count getNumPending ();
+
+    mt_throws Result spawn ();
+
+    void stop ();
+
+    // 'num_disks' is the number of recording disks known at startup.
+    mt_const void init (Count num_disks,
+                        Count io_depth);
+
+    RecordScanner ();
+
+    ~RecordScanner ();
+};
+
+}
+
+
+#endif /* MOMENT_FFMPEG__RECORD_SCANNER__H__ */
@@ -0,0 +1,155 @@
+#include <moment-ffmpeg/record_timeline.h>
+
+using namespace M;
+using namespace Moment;
+
+namespace MomentFFmpeg {
+
+void RecordTimeline::add(const ChChTimes & times)
+{
+    int const timeStart = times.timeStart;
+    int const timeEnd = (times.timeEnd > times.timeStart) ? times.timeEnd : times.timeStart;
+
+    m_fileTimes.insert(std::make_pair(timeStart, timeEnd));
+
+    int newStart = timeStart;
+    int newEnd = timeEnd;
+
+    // the range which starts before the file may be joined with it
+    RangeTimes::iterator it = m_rangeTimes.upper_bound(timeStart);
+    if(it != m_rangeTimes.begin())
+    {
+        RangeTimes::iterator prev = it;
+        --prev;
+        if(isJoinable(prev->second, timeStart))
+            it = prev;
+    }
+
+    // as well as the ranges which start before the end of the file
+    while(it != m_rangeTimes.end() && isJoinable(newEnd, it->first))
+    {
+        if(it->first < newStart)
+            newStart = it->first;
+        if(it->second > newEnd)
+            newEnd = it->second;
+
+        m_rangeTimes.erase(it++);
+    }
+
+    m_rangeTimes[newStart] = newEnd;
+}
+
+void RecordTimeline::remove(const ChChTimes & times)
+{
+    int const timeStart = times.timeStart;
+    int const timeEnd = (times.timeEnd > times.timeStart) ? times.timeEnd : times.timeStart;
+
+    std::pair<FileTimes::iterator, FileTimes::iterator> files = m_fileTimes.equal_range(timeStart);
+    FileTimes::iterator itFile = files.first;
+    while(itFile != files.second && itFile->second != timeEnd)
+        ++itFile;
+
+    if(itFile == files.second)
+        return;
+
+    m_fileTimes.erase(itFile);
+
+    // the range containing the file is built again from the files it consists of
+    RangeTimes::iterator itRange = m_rangeTimes.upper_bound(timeStart);
+    if(itRange == m_rangeTimes.begin())
+        return;
+    --itRange;
+
+    int const rangeStart = itRange->first;
+    int const rangeEnd = itRange->second;
+    m_rangeTimes.erase(itRange);
+
+    FileTimes::const_iterator it = m_fileTimes.lower_bound(rangeStart);
+    if(it == m_fileTimes.end() || it->first > rangeEnd)
+        return;
+
+    int curStart = it->first;
+    int curEnd = it->second;
+    for(++it; it != m_fileTimes.end() && it->first <= rangeEnd; ++it)
+    {
+        if(isJoinable(curEnd, it->first))
+        {
+            if(it->second > curEnd)
+                curEnd = it->second;
+        }
+        else
+        {
+            m_rangeTimes[curStart] = curEnd;
+            curStart = it->first;
+            curEnd = it->second;
+        }
+    }
+    m_rangeTimes[curStart] = curEnd;
+}
+
+bool RecordTimeline::extend(const ChChTimes & times, int newEnd)
+{
+    int const timeStart = times.timeStart;
+    int const timeEnd = (times.timeEnd > times.timeStart) ? times.timeEnd : times.timeStart;
+
+    if(newEnd < timeEnd)
+        return false;
+
+    std::pair<FileTimes::iterator, FileTimes::iterator> files = m_fileTimes.equal_range(timeStart);
+    FileTimes::iterator itFile = files.first;
+    while(itFile != files.second && itFile->second != timeEnd)
+        ++itFile;
+
+    if(itFile == files.second)
+        return false;
+
+    RangeTimes::iterator itRange = m_rangeTimes.upper_bound(timeStart);
+    if(itRange == m_rangeTimes.begin())
+        return false;
+
+    RangeTimes::iterator const itNext = itRange;
+    --itRange;
+
+    if(itRange->second != timeEnd)
+        return false;
+
+    if(itNext != m_rangeTimes.end() && isJoinable(newEnd, itNext->first))
+        return false;
+
+    itFile->second = newEnd;
+    itRange->second = newEnd;
+    return true;
+}
+
+void RecordTimeline::clear()
+{
+    m_fileTimes.clear();
+    m_rangeTimes.clear();
+}
+
+void RecordTimeline::getRanges(int from, int to, RangeList * ranges) const
+{
+    RangeTimes::const_iterator it = m_rangeTimes.upper_bound(from);
+    if(it != m_rangeTimes.begin())
+    {
+        RangeTimes::const_iterator prev = it;
+        --prev;
+        if(prev->second >= from)
+            it = prev;
+    }
+
+    for(; it != m_rangeTimes.end() && it->first <= to; ++it)
+    {
+        ChChTimes chChTimes;
+        chChTimes.timeStart = it->first;
+        chChTimes.timeEnd = it->second;
+        ranges->push_back(chChTimes);
+    }
+}
+
+RecordTimeline::RecordTimeline(int concatInterval):
+    m_concatInterval(concatInterval)
+{
+}
+
+}
@@ -0,0 +1,67 @@
+
+#ifndef MOMENT_FFMPEG__RECORD_TIMELINE__H__
+#define MOMENT_FFMPEG__RECORD_TIMELINE__H__
+
+#include <vector>
+#include <map>
+
+#include <moment/libmoment.h>
+
+using namespace M;
+using namespace Moment;
+
+namespace MomentFFmpeg {
+
+struct ChChTimes
+{
+    int timeStart;
+    int timeEnd;
+};
+
+// Recorded time ranges of a channel.
+//
+// Keeps the times of every recorded file along with the merged ranges they
+// form: files separated by less than 'concat_interval' seconds belong to
+// the same range. Merged ranges never overlap, so an ordered map keyed by
+// range start is enough to find the ones intersecting [from, to] in
+// O(log n + k). Adding or removing a file touches only its own range,
+// growing the last file of a range takes O(log n).
+class RecordTimeline
+{
+public:
+    typedef std::vector<ChChTimes> RangeList;
+
+private:
+    // [start time, end time] of files, several files may start at the same time
+    typedef std::multimap<int, int> FileTimes;
+    // [start time, end time] of merged ranges
+    typedef std::map<int, int> RangeTimes;
+
+    int m_concatInterval;
+
+    FileTimes m_fileTimes;
+    RangeTimes m_rangeTimes;
+
+    bool isJoinable(int endTime, int startTime) const { return startTime - endTime < m_concatInterval; }
+
+public:
+    void add(const ChChTimes & times);
+    void remove(const ChChTimes & times);
+    // moves the end of the file which ends its range forward in place, which is
+    // what happens to the record being written. returns false if the file
+    // doesn't end its range or the range would join the next one, remove()
+    // and add() are to be used then
+    bool extend(const ChChTimes & times, int newEnd);
+    void clear();
+
+    // appends ranges intersecting [from, to] to 'ranges' in chronological order
+    void getRanges(int from, int to, RangeList * ranges) const;
+
+    Count getRangeCount() const { return m_rangeTimes.size(); }
+
+    RecordTimeline(int concatInterval);
+};
+
+}
+
+#endif //MOMENT_FFMPEG__RECORD_TIMELINE__H__
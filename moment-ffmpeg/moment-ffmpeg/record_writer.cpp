@@ -0,0 +1,465 @@
+/*  Moment-FFmpeg - FFmpeg support module for Moment Video Server
+    Copyright (C) 2011-2013 Dmitry Shatrov
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include <moment-ffmpeg/record_writer.h>
+
+
+using namespace M;
+using namespace Moment;
+
+namespace MomentFFmpeg {
+
+static LogGroup libMary_logGroup_recwriter ("mod_ffmpeg.record_writer", LogLevel::E);
+
+#define WRITE_BATCH 32                  // entries per queue in a row
+
+Count
+RecordWriter::Queue::getDepth () const
+{
+    return ((Count) tail.get() + capacity - (Count) head.get()) % capacity;
+}
+
+RecordWriter::Queue::Queue ()
+    : entries (NULL),
+      capacity (0),
+      head (0),
+      tail (0),
+      scheduled (0),
+      wait_keyframe (false),
+      dropped (0),
+      overflows (0),
+      stall_time_microsec (0),
+      max_depth (0),
+      space_waiter (0),
+      written (0),
+      max_write_time_microsec (0),
+      in_run_queue (false),
+      running (false),
+      flushing (false),
+      removed (false),
+      running_tlocal (NULL)
+{
+}
+
+RecordWriter::Queue::~Queue ()
+{
+    if (entries) {
+        Count pos = (Count) head.get();
+        while (pos != (Count) tail.get()) {
+            if (!entries [pos].close)
+                av_free_packet (&entries [pos].packet);
+
+            pos = (pos + 1) % capacity;
+        }
+
+        delete[] entries;
+    }
+}
+
+void
+RecordWriter::schedule (Queue * const mt_nonnull queue)
+{
+    // The queue is already in the run queue or is being served.
+    if (!queue->scheduled.compareAndExchange (0, 1))
+        return;
+
+    mutex.lock ();
+    if (!queue->removed && !queue->flushing) {
+        queue->in_run_queue = true;
+        run_queue.append (queue);
+        run_cond.signal ();
+    } else {
+        queue->scheduled.set (0);
+    }
+    mutex.unlock ();
+}
+
+bool
+RecordWriter::tryPush (Queue             * const mt_nonnull queue,
+                       AVPacket          * const packet,
+                       TimeChecker const &tc_read)
+{
+    Count const tail = (Count) queue->tail.get();
+    Count const next = (tail + 1) % queue->capacity;
+    if (next == (Count) queue->head.get())
+        return false;
+
+    Queue::Entry * const entry = &queue->entries [tail];
+    if (packet) {
+        entry->packet = *packet;
+        entry->close = false;
+    } else {
+        memset (&entry->packet, 0, sizeof (entry->packet));
+        entry->close = true;
+    }
+    entry->tc_read = tc_read;
+
+    // Publishing the entry to the consumer.
+    queue->tail.set ((int) next);
+
+    Count const depth = queue->getDepth();
+    if (depth > queue->max_depth)
+        queue->max_depth = depth;
+
+    return true;
+}
+
+bool
+RecordWriter::blockingPush (Queue             * const mt_nonnull queue,
+                            AVPacket          * const mt_nonnull packet,
+                            TimeChecker const &tc_read)
+{
+    TimeChecker tc;tc.Start();
+
+    // The consumer checks 'space_waiter' after handing an entry back,
+    // so either it wakes us up or we see the free entry here.
+    queue->space_waiter.set (1);
+
+    mutex.lock ();
+    bool pushed = tryPush (queue, packet, tc_read);
+    Time waited = 0;
+    while (!pushed && !should_stop && waited < block_timeout_microsec) {
+        queue->space_cond.timedWait (mutex, block_timeout_microsec - waited);
+        pushed = tryPush (queue, packet, tc_read);
+        tc.Stop(&waited);
+    }
+    mutex.unlock ();
+
+    queue->space_waiter.set (0);
+
+    tc.Stop(&waited);
+    queue->stall_time_microsec += waited;
+    logD (recwriter, _func_, "stalled for ", waited, " microsec");
+
+    return pushed;
+}
+
+bool
+RecordWriter::push (Queue             * const mt_nonnull queue,
+                    AVPacket          * const mt_nonnull packet,
+                    TimeChecker const &tc_read,
+                    bool                const is_keyframe)
+{
+    if (queue->wait_keyframe) {
+        if (!is_keyframe) {
+            ++queue->dropped;
+            return false;
+        }
+
+        logD (recwriter, _func_, "resuming at keyframe, dropped so far: ", queue->dropped);
+        queue->wait_keyframe = false;
+    }
+
+    // The packet may point to the demuxer's internal buffer,
+    // which won't survive the next av_read_frame().
+    if (av_dup_packet (packet) < 0) {
+        logE_ (_func, "av_dup_packet() failed");
+        ++queue->dropped;
+        queue->wait_keyframe = true;
+        return false;
+    }
+
+    bool pushed = tryPush (queue, packet, tc_read);
+    if (!pushed
+        && overflow_policy == OverflowPolicy_Block
+        && block_timeout_microsec > 0)
+    {
+        pushed = blockingPush (queue, packet, tc_read);
+    }
+
+    if (!pushed) {
+        // Writing the rest of the GOP would only produce undecodable frames.
+        logD (recwriter, _func_, "queue is full, dropping up to the next keyframe");
+        ++queue->overflows;
+        ++queue->dropped;
+        queue->wait_keyframe = true;
+        return false;
+    }
+
+    memset (packet, 0, sizeof (*packet));
+    schedule (queue);
+    return true;
+}
+
+bool
+RecordWriter::pushClose (Queue * const mt_nonnull queue)
+{
+    TimeChecker tc_read;tc_read.Start();
+    if (!tryPush (queue, NULL /* packet */, tc_read))
+        return false;
+
+    schedule (queue);
+    return true;
+}
+
+void
+RecordWriter::writeEntries (Queue * const mt_nonnull queue,
+                            Count   const max_entries)
+{
+    Count num_written = 0;
+    while (max_entries == 0 || num_written < max_entries) {
+        // removeQueue() may have been called from within the write callback.
+        if (max_entries != 0 && queue->removed)
+            break;
+
+        Count const head = (Count) queue->head.get();
+        if (head == (Count) queue->tail.get())
+            break;
+
+        Queue::Entry * const entry = &queue->entries [head];
+        if (entry->close) {
+            queue->frontend.call (queue->frontend->closeRecord);
+        } else {
+            TimeChecker tc;tc.Start();
+
+            queue->frontend.call (queue->frontend->writePacket, /*(*/ &entry->packet, &entry->tc_read /*)*/);
+
+            Time t;tc.Stop(&t);
+            if (t > queue->max_write_time_microsec)
+                queue->max_write_time_microsec = t;
+
+            ++queue->written;
+            av_free_packet (&entry->packet);
+        }
+
+        // Handing the entry back to the producer.
+        queue->head.set ((int) ((head + 1) % queue->capacity));
+        ++num_written;
+
+        if (queue->space_waiter.get()) {
+            mutex.lock ();
+            queue->space_cond.signal ();
+            mutex.unlock ();
+        }
+    }
+}
+
+void
+RecordWriter::threadFunc (void * const _self)
+{
+    RecordWriter * const self = static_cast <RecordWriter*> (_self);
+
+    updateTime ();
+
+    logD (recwriter, _func_);
+
+    self->mutex.lock ();
+    for (;;) {
+        while (!self->should_stop && self->run_queue.isEmpty())
+            self->run_cond.wait (self->mutex);
+
+        if (self->should_stop)
+            break;
+
+        Ref<Queue> const queue = self->run_queue.getFirst();
+        self->run_queue.remove (self->run_queue.getFirstElement());
+        queue->in_run_queue = false;
+
+        if (queue->removed || queue->flushing)
+            continue;
+
+        queue->running = true;
+        queue->running_tlocal = libMary_getThreadLocal();
+        self->mutex.unlock ();
+
+        updateTime ();
+        self->writeEntries (queue, WRITE_BATCH);
+
+        self->mutex.lock ();
+        queue->running = false;
+        queue->running_tlocal = NULL;
+        queue->write_done_cond.signal ();
+
+        if (!queue->removed && !queue->flushing) {
+            queue->scheduled.set (0);
+            // The producer might have pushed more entries after the last check
+            // without scheduling the queue.
+            if (queue->getDepth() > 0
+                && queue->scheduled.compareAndExchange (0, 1))
+            {
+                // Appending to the tail gives other channels their turn first.
+                queue->in_run_queue = true;
+                self->run_queue.append (queue);
+                self->run_cond.signal ();
+            }
+        }
+    }
+    self->mutex.unlock ();
+
+    logD (recwriter, _func_, "done");
+}
+
+mt_mutex (mutex) void
+RecordWriter::detachQueue (Queue * const mt_nonnull queue)
+{
+    if (queue->in_run_queue) {
+        QueueList::iter iter (run_queue);
+        while (!run_queue.iter_done (iter)) {
+            QueueList::Element * const el = run_queue.iter_next (iter);
+            if (el->data == queue) {
+                run_queue.remove (el);
+                break;
+            }
+        }
+        queue->in_run_queue = false;
+    }
+
+    while (queue->running)
+        queue->write_done_cond.wait (mutex);
+}
+
+Ref<RecordWriter::Queue>
+RecordWriter::addQueue (CbDesc<Frontend> const &frontend)
+{
+    Ref<Queue> const queue = grab (new (std::nothrow) Queue);
+    queue->frontend = frontend;
+    // One entry is always kept free to tell a full queue from an empty one.
+    queue->capacity = queue_size + 1;
+    queue->entries = new (std::nothrow) Queue::Entry [queue->capacity];
+    assert (queue->entries);
+    return queue;
+}
+
+void
+RecordWriter::removeQueue (Queue * const mt_nonnull queue)
+{
+    mutex.lock ();
+    if (queue->removed) {
+        mutex.unlock ();
+        return;
+    }
+
+    queue->removed = true;
+
+    if (queue->running_tlocal == libMary_getThreadLocal()) {
+        // The stream is being destroyed from within its own write callback.
+        // The remaining packets are freed along with the queue.
+        mutex.unlock ();
+        return;
+    }
+
+    detachQueue (queue);
+    mutex.unlock ();
+
+    writeEntries (queue, 0 /* max_entries */);
+}
+
+void
+RecordWriter::flush (Queue * const mt_nonnull queue)
+{
+    mutex.lock ();
+    queue->flushing = true;
+    detachQueue (queue);
+    mutex.unlock ();
+
+    writeEntries (queue, 0 /* max_entries */);
+
+    mutex.lock ();
+    queue->flushing = false;
+    queue->scheduled.set (0);
+    mutex.unlock ();
+}
+
+RecordWriter::Stats
+RecordWriter::getStats (Queue * const mt_nonnull queue)
+{
+    Stats stats;
+    stats.depth     = queue->getDepth();
+    stats.max_depth = queue->max_depth;
+    stats.capacity  = queue->capacity - 1;
+    stats.written   = queue->written;
+    stats.dropped   = queue->dropped;
+    stats.overflows = queue->overflows;
+    stats.stall_time_microsec     = queue->stall_time_microsec;
+    stats.max_write_time_microsec = queue->max_write_time_microsec;
+    return stats;
+}
+
+mt_throws Result
+RecordWriter::spawn ()
+{
+    logD (recwriter, _func_, "num_threads: ", num_threads, ", queue_size: ", queue_size, ", "
+          "overflow_policy: ", (overflow_policy == OverflowPolicy_Block ? "block" : "drop"), ", "
+          "block_timeout_microsec: ", block_timeout_microsec);
+
+    multi_thread->setNumThreads (num_threads);
+    if (!multi_thread->spawn (true /* joinable */)) {
+        logE_ (_func, "multi_thread->spawn() failed: ", exc->toString());
+        return Result::Failure;
+    }
+
+    spawned = true;
+    return Result::Success;
+}
+
+void
+RecordWriter::stop ()
+{
+    if (!spawned)
+        return;
+
+    mutex.lock ();
+    should_stop = true;
+    // Waking up all threads.
+    for (Count i = 0; i < num_threads; ++i)
+        run_cond.signal ();
+    mutex.unlock ();
+
+    if (!multi_thread->join ())
+        logE_ (_func, "multi_thread->join() failed: ", exc->toString());
+
+    spawned = false;
+}
+
+mt_const void
+RecordWriter::init (Count          const num_threads,
+                    Count          const queue_size,
+                    OverflowPolicy const overflow_policy,
+                    Time           const block_timeout_microsec)
+{
+    this->num_threads = (num_threads > 0 ? num_threads : 1);
+    this->queue_size  = (queue_size  > 0 ? queue_size  : 1);
+    this->overflow_policy = overflow_policy;
+    this->block_timeout_microsec = block_timeout_microsec;
+}
+
+RecordWriter::RecordWriter ()
+    : num_threads (1),
+      queue_size (1),
+      overflow_policy (OverflowPolicy_Drop),
+      block_timeout_microsec (0),
+      spawned (false),
+      should_stop (false)
+{
+    multi_thread = grab (new (std::nothrow) MultiThread (
+            1 /* num_threads */,
+            CbDesc<Thread::ThreadFunc> (threadFunc,
+                                        this /* cb_data */,
+                                        this /* coderef_container */)));
+}
+
+RecordWriter::~RecordWriter ()
+{
+    mutex.lock ();
+    while (!run_queue.isEmpty())
+        run_queue.remove (run_queue.getFirstElement());
+    mutex.unlock ();
+}
+
+}
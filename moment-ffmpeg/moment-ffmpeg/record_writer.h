@@ -0,0 +1,230 @@
+/*  Moment-FFmpeg - FFmpeg support module for Moment Video Server
+    Copyright (C) 2011-2013 Dmitry Shatrov
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef MOMENT_FFMPEG__RECORD_WRITER__H__
+#define MOMENT_FFMPEG__RECORD_WRITER__H__
+
+
+#include <libmary/types.h>
+#include <moment/libmoment.h>
+#include <moment-ffmpeg/time_checker.h>
+
+extern "C" {
+#ifndef INT64_C
+#define INT64_C(c) (c ## LL)
+#define UINT64_C(c) (c ## ULL)
+#endif
+#include <libavcodec/avcodec.h>
+}
+
+
+namespace MomentFFmpeg {
+
+using namespace M;
+using namespace Moment;
+
+// A pool of threads writing recorded packets to disk.
+//
+// Every channel gets its own bounded single-producer/single-consumer queue.
+// The capture thread hands packets over without taking any locks, so a slow
+// or stalled disk delays only the writer threads and never the live stream.
+// A queue is served by at most one writer thread at a time, which keeps
+// the order of packets within a channel. What happens when a queue is full
+// is decided by OverflowPolicy.
+class RecordWriter : public Object
+{
+private:
+    StateMutex mutex;
+
+public:
+    enum OverflowPolicy {
+        // Drop the packet and everything after it up to the next video keyframe.
+        OverflowPolicy_Drop,
+        // Make the capture thread wait for free space for up to 'block_timeout',
+        // then drop as with OverflowPolicy_Drop.
+        OverflowPolicy_Block
+    };
+
+    struct Frontend
+    {
+        // Called on a writer thread. 'tc_read' has been started when
+        // the packet was read from the source.
+        void (*writePacket) (AVPacket    *packet,
+                             TimeChecker *tc_read,
+                             void        *cb_data);
+
+        // Recording has been turned off, the current file should be closed.
+        void (*closeRecord) (void *cb_data);
+    };
+
+    struct Stats
+    {
+        Count  depth;
+        Count  max_depth;
+        Count  capacity;
+        Uint64 written;
+        Uint64 dropped;
+        // How many times the queue has been found full.
+        Uint64 overflows;
+        // Total time the capture thread has been waiting for free space.
+        Time   stall_time_microsec;
+        // The longest single Frontend::writePacket() call.
+        Time   max_write_time_microsec;
+    };
+
+    class Queue : public Referenced
+    {
+        friend class RecordWriter;
+
+    private:
+        struct Entry
+        {
+            AVPacket    packet;
+            TimeChecker tc_read;
+            bool        close;
+        };
+
+        mt_const Cb<Frontend> frontend;
+
+        mt_const Entry *entries;
+        mt_const Count  capacity;
+
+        // Index of the next entry to write. Advanced by the consumer only.
+        AtomicInt head;
+        // Index of the next free entry. Advanced by the producer only.
+        AtomicInt tail;
+        // 1 if the queue is either in the run queue or being served.
+        AtomicInt scheduled;
+
+        // Producer-side state.
+        bool   wait_keyframe;
+        Uint64 dropped;
+        Uint64 overflows;
+        Time   stall_time_microsec;
+        Count  max_depth;
+
+        // 1 if the producer is waiting for free space.
+        AtomicInt space_waiter;
+
+        // Consumer-side state.
+        Uint64 written;
+        Time   max_write_time_microsec;
+
+        mt_mutex (RecordWriter::mutex) bool in_run_queue;
+        mt_mutex (RecordWriter::mutex) bool running;
+        mt_mutex (RecordWriter::mutex) bool flushing;
+        mt_mutex (RecordWriter::mutex) bool removed;
+        mt_mutex (RecordWriter::mutex) LibMary_ThreadLocal *running_tlocal;
+        // Signalled when a writer thread is done with the queue.
+        mt_mutex (RecordWriter::mutex) Cond write_done_cond;
+        // Signalled when entries are handed back to a waiting producer.
+        mt_mutex (RecordWriter::mutex) Cond space_cond;
+
+        Count getDepth () const;
+
+        Queue ();
+
+    public:
+        ~Queue ();
+    };
+
+private:
+    typedef List< Ref<Queue> > QueueList;
+
+    mt_const Count          num_threads;
+    mt_const Count          queue_size;
+    mt_const OverflowPolicy overflow_policy;
+    mt_const Time           block_timeout_microsec;
+
+    mt_const Ref<MultiThread> multi_thread;
+    mt_const bool spawned;
+
+    mt_mutex (mutex) QueueList run_queue;
+    mt_mutex (mutex) Cond run_cond;
+
+    mt_mutex (mutex) bool should_stop;
+
+    void schedule (Queue * mt_nonnull queue);
+
+    // Queues a close request if 'packet' is NULL.
+    // Returns 'false' if the queue is full.
+    bool tryPush (Queue             * mt_nonnull queue,
+                  AVPacket          *packet,
+                  TimeChecker const &tc_read);
+
+    // Waits for the consumer to free an entry for up to block_timeout.
+    // Returns 'false' if the packet has not been queued.
+    bool blockingPush (Queue             * mt_nonnull queue,
+                       AVPacket          * mt_nonnull packet,
+                       TimeChecker const &tc_read);
+
+    // Waits for the writer threads to leave the queue alone.
+    mt_mutex (mutex) void detachQueue (Queue * mt_nonnull queue);
+
+    // Writes up to 'max_entries' entries (all of them if 0).
+    // Must be called by the single consumer of the queue.
+    void writeEntries (Queue * mt_nonnull queue,
+                       Count  max_entries);
+
+    static void threadFunc (void *_self);
+
+public:
+    Ref<Queue> addQueue (CbDesc<Frontend> const &frontend);
+
+    // Writes out pending packets on the calling thread and detaches the queue.
+    // When called from within Frontend::writePacket(), pending packets are dropped.
+    void removeQueue (Queue * mt_nonnull queue);
+
+    // Producer side. Takes ownership of packet data if the packet has been
+    // queued, in which case '*packet' is reset. Returns 'false' if the packet
+    // has been dropped and remains owned by the caller.
+    bool push (Queue             * mt_nonnull queue,
+               AVPacket          * mt_nonnull packet,
+               TimeChecker const &tc_read,
+               bool               is_keyframe);
+
+    // Producer side. Queues a request to close the current file.
+    // Returns 'false' if the queue is full.
+    bool pushClose (Queue * mt_nonnull queue);
+
+    // Producer side. Writes out all pending packets on the calling thread.
+    // Should be called before the input format context is closed.
+    void flush (Queue * mt_nonnull queue);
+
+    Stats getStats (Queue * mt_nonnull queue);
+
+    mt_throws Result spawn ();
+
+    // Joins the writer threads. Queues are not served in the background after
+    // that, but flush() and removeQueue() still write out pending packets.
+    void stop ();
+
+    mt_const void init (Count          num_threads,
+                        Count          queue_size,
+                        OverflowPolicy overflow_policy,
+                        Time           block_timeout_microsec);
+
+     RecordWriter ();
+    ~RecordWriter ();
+};
+
+}
+
+
+#endif /* MOMENT_FFMPEG__RECORD_WRITER__H__ */
@@ -0,0 +1,74 @@
+/*  Moment-FFmpeg - FFmpeg support module for Moment Video Server
+    Copyright (C) 2011-2013 Dmitry Shatrov
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * State of libavformat's RTSP demuxer which is not available through the
+ * public API. Used by FFmpegStream to read sources only when av_read_frame()
+ * won't have to wait for the network. Needs the private headers of
+ * libavformat, which build.sh installs along with the libraries.
+ */
+
+#include <string.h>
+
+#include "libavformat/avformat.h"
+#include "libavformat/url.h"
+#include "libavformat/rtsp.h"
+
+
+static int IsRtspInput (AVFormatContext * s)
+{
+    return s->iformat && s->iformat->name && !strcmp (s->iformat->name, "rtsp");
+}
+
+int RtspInputFd (AVFormatContext * s)
+{
+    RTSPState * rt;
+
+    if (!IsRtspInput (s))
+        return -1;
+
+    rt = s->priv_data;
+
+    /* With RTP over UDP, the demuxer polls a pair of sockets per stream on its
+       own. TLS and HTTP tunneling buffer data above the socket. */
+    if (rt->lower_transport != RTSP_LOWER_TRANSPORT_TCP
+        || !rt->rtsp_hd
+        || !rt->rtsp_hd->prot
+        || strcmp (rt->rtsp_hd->prot->name, "tcp"))
+    {
+        return -1;
+    }
+
+    return ffurl_get_file_handle (rt->rtsp_hd);
+}
+
+int RtspInputBuffered (AVFormatContext * s)
+{
+    /* packets read ahead by avformat_find_stream_info() or by the parsers */
+    if (s->packet_buffer || s->parse_queue)
+        return 1;
+
+    /* the rest of the frames depacketized from the last RTP packet */
+    if (IsRtspInput (s)) {
+        RTSPState * const rt = s->priv_data;
+        if (rt->cur_transport_priv)
+            return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,363 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <moment-ffmpeg/segment_file.h>
+
+
+using namespace M;
+using namespace Moment;
+
+namespace MomentFFmpeg {
+
+static LogGroup libMary_logGroup_segfile ("mod_ffmpeg.segment_file", LogLevel::E);
+
+// Reservation step when the bitrate of the channel is not known yet,
+// and the least step when the segment outgrows its estimate.
+#define PREALLOCATE_CHUNK (8 << 20)
+#define DIRECT_BUFFER_SIZE (1 << 20)
+
+SegmentFile::Options SegmentFile::options;
+
+SegmentFile::Options::Options ()
+    : preallocate (true),
+      direct_io (false),
+      direct_buffer_size (DIRECT_BUFFER_SIZE)
+{
+}
+
+bool
+SegmentFile::writeAt (int          const fd,
+                      Byte const *       buf,
+                      Size               len,
+                      Int64              offset)
+{
+    while (len > 0) {
+        ssize_t const res = ::pwrite (fd, buf, len, offset);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+
+            logE_ (_func, "pwrite() failed: ", errnoString (errno));
+            return false;
+        }
+
+        buf    += res;
+        len    -= res;
+        offset += res;
+    }
+
+    return true;
+}
+
+bool
+SegmentFile::preallocate (Int64 const end)
+{
+#ifdef __linux__
+    if (m_alloc_chunk == 0 || end <= m_allocated)
+        return true;
+
+    int res;
+    do {
+        res = ::fallocate (m_fd, FALLOC_FL_KEEP_SIZE, m_allocated, end - m_allocated);
+    } while (res == -1 && errno == EINTR);
+
+    if (res == -1) {
+        // Not fatal: the file grows by appends as it did without preallocation.
+        if (errno == EOPNOTSUPP || errno == ENOSYS)
+            logD (segfile, _func, "fallocate() is not supported");
+        else
+            logE_ (_func, "fallocate() failed: ", errnoString (errno));
+
+        m_alloc_chunk = 0;
+        return false;
+    }
+
+    logD (segfile, _func, "reserved ", m_allocated, " -> ", end);
+    m_allocated = end;
+#endif
+
+    return true;
+}
+
+bool
+SegmentFile::flushStage ()
+{
+    if (!writeAt (m_direct_fd, m_stage_buf, m_stage_buf_size, m_stage_offset)) {
+        logE_ (_func, "direct write failed, falling back to buffered writes");
+        return dropDirectIo ();
+    }
+
+    m_stage_offset += m_stage_buf_size;
+    m_stage_len = 0;
+    return true;
+}
+
+bool
+SegmentFile::dropDirectIo ()
+{
+    if (m_direct_fd == -1)
+        return true;
+
+    bool const res = writeAt (m_fd, m_stage_buf, m_stage_len, m_stage_offset);
+
+    ::close (m_direct_fd);
+    m_direct_fd = -1;
+
+    free (m_stage_buf);
+    m_stage_buf = NULL;
+    m_stage_len = 0;
+
+    return res;
+}
+
+bool
+SegmentFile::open (const char * const path,
+                   Int64        const expected_size)
+{
+    close ();
+
+    m_fd = ::open (path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (m_fd == -1) {
+        logE_ (_func, "open() failed for ", path, ": ", errnoString (errno));
+        return false;
+    }
+
+    if (options.preallocate) {
+        m_alloc_chunk = PREALLOCATE_CHUNK;
+        if (expected_size / 8 > m_alloc_chunk)
+            m_alloc_chunk = expected_size / 8;
+
+        preallocate (expected_size > 0 ? expected_size : m_alloc_chunk);
+    }
+
+#ifdef __linux__
+    if (options.direct_io) {
+        m_stage_buf_size = (options.direct_buffer_size + DirectIoAlignment - 1) & ~((Size) DirectIoAlignment - 1);
+        if (m_stage_buf_size == 0)
+            m_stage_buf_size = DirectIoAlignment;
+
+        void *buf;
+        if (posix_memalign (&buf, DirectIoAlignment, m_stage_buf_size) != 0) {
+            logE_ (_func, "posix_memalign() failed");
+        } else {
+            m_direct_fd = ::open (path, O_WRONLY | O_DIRECT);
+            if (m_direct_fd == -1) {
+                logD (segfile, _func, "no direct I/O for ", path, ": ", errnoString (errno));
+                free (buf);
+            } else {
+                m_stage_buf = (Byte*) buf;
+            }
+        }
+    }
+#endif
+
+    logD (segfile, _func, path, ", expected size: ", expected_size, ", direct: ", m_direct_fd != -1);
+    return true;
+}
+
+bool
+SegmentFile::write (Byte const *buf,
+                    Size        len)
+{
+    if (m_alloc_chunk && m_pos + (Int64) len > m_allocated) {
+        Int64 end = m_allocated + m_alloc_chunk;
+        if (end < m_pos + (Int64) len)
+            end = m_pos + len;
+
+        preallocate (end);
+    }
+
+    while (len > 0) {
+        if (m_direct_fd == -1) {
+            if (!writeAt (m_fd, buf, len, m_pos))
+                return false;
+
+            m_pos += len;
+            break;
+        }
+
+        Size n;
+        if (m_pos < m_stage_offset) {
+            // rewriting the data which is on disk already
+            n = len;
+            if ((Int64) n > m_stage_offset - m_pos)
+                n = m_stage_offset - m_pos;
+
+            if (!writeAt (m_fd, buf, n, m_pos))
+                return false;
+        } else
+        if (m_pos <= m_stage_offset + (Int64) m_stage_len) {
+            Size const at = m_pos - m_stage_offset;
+            n = m_stage_buf_size - at;
+            if (n > len)
+                n = len;
+
+            memcpy (m_stage_buf + at, buf, n);
+            if (at + n > m_stage_len)
+                m_stage_len = at + n;
+
+            if (m_stage_len == m_stage_buf_size) {
+                if (!flushStage ())
+                    return false;
+            }
+        } else {
+            // a hole would break the alignment of the staged data
+            if (!dropDirectIo ())
+                return false;
+
+            continue;
+        }
+
+        buf   += n;
+        len   -= n;
+        m_pos += n;
+    }
+
+    if (m_pos > m_size)
+        m_size = m_pos;
+
+    return true;
+}
+
+Int64
+SegmentFile::seek (Int64 const offset,
+                   int   const whence)
+{
+    Int64 pos;
+    switch (whence) {
+        case SEEK_SET: pos = offset;          break;
+        case SEEK_CUR: pos = m_pos + offset;  break;
+        case SEEK_END: pos = m_size + offset; break;
+        default:
+            return -1;
+    }
+
+    if (pos < 0)
+        return -1;
+
+    m_pos = pos;
+    return m_pos;
+}
+
+bool
+SegmentFile::close ()
+{
+    if (m_fd == -1)
+        return true;
+
+    bool res = dropDirectIo ();
+
+    if (m_allocated > m_size) {
+        if (::ftruncate (m_fd, m_size) == -1) {
+            logE_ (_func, "ftruncate() failed: ", errnoString (errno));
+            res = false;
+        }
+    }
+
+    if (::close (m_fd) == -1) {
+        logE_ (_func, "close() failed: ", errnoString (errno));
+        res = false;
+    }
+
+    logD (segfile, _func, "size: ", m_size, ", reserved: ", m_allocated);
+
+    m_fd = -1;
+    m_pos = 0;
+    m_size = 0;
+    m_allocated = 0;
+    m_alloc_chunk = 0;
+    m_stage_offset = 0;
+
+    return res;
+}
+
+SegmentFile::SegmentFile ()
+    : m_fd (-1),
+      m_direct_fd (-1),
+      m_pos (0),
+      m_size (0),
+      m_allocated (0),
+      m_alloc_chunk (0),
+      m_stage_buf (NULL),
+      m_stage_buf_size (0),
+      m_stage_offset (0),
+      m_stage_len (0)
+{
+}
+
+SegmentFile::~SegmentFile ()
+{
+    close ();
+}
+
+}
+
+// Used by the segment muxer, which is plain C.
+extern "C"
+{
+    void * SegmentFileOpen (const char * path, int64_t expected_size)
+    {
+        MomentFFmpeg::SegmentFile * const file = new (std::nothrow) MomentFFmpeg::SegmentFile;
+        if (!file)
+            return NULL;
+
+        if (!file->open (path, expected_size)) {
+            delete file;
+            return NULL;
+        }
+
+        return file;
+    }
+
+    int SegmentFileWrite (void * file, const uint8_t * buf, int buf_size)
+    {
+        return static_cast <MomentFFmpeg::SegmentFile*> (file)->write (buf, buf_size) ? 1 : 0;
+    }
+
+    int64_t SegmentFileSeek (void * file, int64_t offset, int whence)
+    {
+        return static_cast <MomentFFmpeg::SegmentFile*> (file)->seek (offset, whence);
+    }
+
+    int64_t SegmentFileSize (void * file)
+    {
+        return static_cast <MomentFFmpeg::SegmentFile*> (file)->getSize ();
+    }
+
+    int64_t SegmentFileAllocated (void * file)
+    {
+        return static_cast <MomentFFmpeg::SegmentFile*> (file)->getAllocated ();
+    }
+
+    int SegmentFileClose (void * file)
+    {
+        MomentFFmpeg::SegmentFile * const segment_file = static_cast <MomentFFmpeg::SegmentFile*> (file);
+        bool const res = segment_file->close ();
+        delete segment_file;
+        return res ? 1 : 0;
+    }
+}
@@ -0,0 +1,113 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MOMENT_FFMPEG__SEGMENT_FILE__H__
+#define MOMENT_FFMPEG__SEGMENT_FILE__H__
+
+
+#include <moment/libmoment.h>
+
+
+namespace MomentFFmpeg {
+
+using namespace M;
+using namespace Moment;
+
+// Output file of one recorded segment, written by the segment muxer.
+//
+// Disk space is reserved with fallocate() ahead of the data, so that
+// a segment occupies few large extents even when many channels are
+// recorded to the same disk at once. The reservation keeps the file size
+// as it is, readers of a segment being recorded see only written data.
+// Space reserved past the end of the data is released on close().
+//
+// With direct I/O, data goes to disk with O_DIRECT in aligned blocks
+// of the staging buffer. The tail of the file and rewrites of the data
+// which is already on disk (FLV trailer) go through the page cache.
+// Direct I/O is dropped for the file if the filesystem does not support
+// it or if the muxer seeks past the end of the data.
+mt_unsafe class SegmentFile
+{
+public:
+    struct Options
+    {
+        bool preallocate;
+        bool direct_io;
+        Size direct_buffer_size;    // rounded up to DirectIoAlignment
+
+        Options ();
+    };
+
+    enum {
+        DirectIoAlignment = 4096
+    };
+
+private:
+    mt_const static Options options;
+
+    int   m_fd;
+    int   m_direct_fd;          // -1 if direct I/O is not used
+
+    Int64 m_pos;
+    Int64 m_size;
+
+    Int64 m_allocated;          // reserved with fallocate()
+    Int64 m_alloc_chunk;        // 0 if preallocation is not used
+
+    Byte *m_stage_buf;
+    Size  m_stage_buf_size;
+    Int64 m_stage_offset;       // aligned, the data before it is on disk
+    Size  m_stage_len;
+
+    bool preallocate (Int64 end);
+    bool writeAt (int fd, Byte const *buf, Size len, Int64 offset);
+    bool flushStage ();
+    bool dropDirectIo ();
+
+public:
+    // Options are set once at module init, before recording starts.
+    static void setOptions (Options const &new_options) { options = new_options; }
+
+    // 'expected_size' is the estimate of the segment size in bytes,
+    // 0 if it is not known yet.
+    bool open (const char *path,
+               Int64       expected_size);
+
+    bool write (Byte const *buf,
+                Size        len);
+
+    // Returns the new position, -1 on error.
+    Int64 seek (Int64 offset,
+                int   whence);
+
+    Int64 getSize      () const { return m_size; }
+    Int64 getAllocated () const { return m_allocated; }
+
+    // Writes the rest of the data and trims the reservation to the size
+    // of the file.
+    bool close ();
+
+    SegmentFile ();
+    ~SegmentFile ();
+};
+
+}
+
+
+#endif /* MOMENT_FFMPEG__SEGMENT_FILE__H__ */
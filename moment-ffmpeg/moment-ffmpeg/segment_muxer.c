@@ -67,6 +67,19 @@
     extern unsigned long GetPermission(const char * filename, int64_t nDuration);
     extern int Notify(const char * filename, int bDone, unsigned long size);
 
+    extern void * KeyframeIndexCreate(const char * flv_path);
+    extern void KeyframeIndexAppend(void * index, int64_t pts_millisec, int64_t offset);
+    extern void KeyframeIndexClose(void * index);
+
+    extern void * SegmentFileOpen(const char * path, int64_t expected_size);
+    extern int SegmentFileWrite(void * file, const uint8_t * buf, int buf_size);
+    extern int64_t SegmentFileSeek(void * file, int64_t offset, int whence);
+    extern int64_t SegmentFileSize(void * file);
+    extern int64_t SegmentFileAllocated(void * file);
+    extern int SegmentFileClose(void * file);
+
+    #define SEGMENT_FILE_IO_SIZE 65536
+
 #endif  // MOMENT_CHANGE ]
 
 
@@ -132,6 +145,8 @@ typedef struct {
     int is_first_pkt;      ///< tells if it is the first packet in the segment
 #ifdef MOMENT_CHANGE    // MOMENT_CHANGE [
     int is_first_segment;      ///< tells if it is the first segment
+    void *kf_index;            ///< keyframe table of the current segment file
+    int64_t bytes_per_sec;     ///< measured on the previous segment, 0 if unknown
 #endif  // !MOMENT_CHANGE ]
 } SegmentContext;
 
@@ -145,6 +160,79 @@ typedef struct FLVContext {
 } FLVContext;
 #endif  // !MOMENT_CHANGE ]
 
+#ifdef MOMENT_CHANGE    // MOMENT_CHANGE [
+static void kf_index_close(SegmentContext *seg)
+{
+    if (seg->kf_index) {
+        KeyframeIndexClose(seg->kf_index);
+        seg->kf_index = NULL;
+    }
+}
+
+// Failing to create the table is not fatal: readers fall back to searching the file.
+static void kf_index_open(SegmentContext *seg, AVFormatContext *oc)
+{
+    kf_index_close(seg);
+    seg->kf_index = KeyframeIndexCreate(oc->filename);
+}
+
+static int seg_file_write(void *opaque, uint8_t *buf, int buf_size)
+{
+    return SegmentFileWrite(opaque, buf, buf_size) ? buf_size : AVERROR(EIO);
+}
+
+static int64_t seg_file_seek(void *opaque, int64_t offset, int whence)
+{
+    if (whence & AVSEEK_SIZE)
+        return SegmentFileSize(opaque);
+
+    return SegmentFileSeek(opaque, offset, whence & ~AVSEEK_FORCE);
+}
+
+// Segment files are written through SegmentFile, which reserves disk space
+// for the expected size of the segment. The size is estimated from
+// the bitrate of the previous segment of the channel.
+static int seg_file_open(SegmentContext *seg, AVFormatContext *oc)
+{
+    int64_t expected_size = seg->bytes_per_sec * (seg->time / AV_TIME_BASE);
+    uint8_t *buf;
+    void *file;
+
+    expected_size += expected_size / 4; // bitrate varies, unused space is trimmed on close
+
+    file = SegmentFileOpen(oc->filename, expected_size);
+    if (!file)
+        return AVERROR(EIO);
+
+    buf = av_malloc(SEGMENT_FILE_IO_SIZE);
+    if (!buf) {
+        SegmentFileClose(file);
+        return AVERROR(ENOMEM);
+    }
+
+    oc->pb = avio_alloc_context(buf, SEGMENT_FILE_IO_SIZE, AVIO_FLAG_WRITE, file,
+                                NULL, seg_file_write, seg_file_seek);
+    if (!oc->pb) {
+        av_free(buf);
+        SegmentFileClose(file);
+        return AVERROR(ENOMEM);
+    }
+
+    return 0;
+}
+
+static void seg_file_close(AVFormatContext *oc)
+{
+    if (!oc->pb)
+        return;
+
+    avio_flush(oc->pb);
+    SegmentFileClose(oc->pb->opaque);
+    av_free(oc->pb->buffer);
+    av_freep(&oc->pb);
+}
+#endif  // !MOMENT_CHANGE ]
+
 static void print_csv_escaped_str(AVIOContext *ctx, const char *str)
 {
     int needs_quoting = !!str[strcspn(str, "\",\n\r")];
@@ -252,9 +340,15 @@ static int segment_start(AVFormatContext *s, int write_header)
 #endif // MOMENT_CHANGE ]
     seg->segment_count++;
 
+#ifdef MOMENT_CHANGE    // MOMENT_CHANGE [
+    if ((err = seg_file_open(seg, oc)) < 0)
+        return err;
+    kf_index_open(seg, oc);
+#else   // MOMENT_CHANGE ], [ !MOMENT_CHANGE
     if ((err = avio_open2(&oc->pb, oc->filename, AVIO_FLAG_WRITE,
                           &s->interrupt_callback, NULL)) < 0)
         return err;
+#endif  // !MOMENT_CHANGE ]
 
     if (oc->oformat->priv_class && oc->priv_data)
         av_opt_set(oc->priv_data, "resend_headers", "1", 0); /* mpegts specific */
@@ -385,7 +479,10 @@ static int segment_end(AVFormatContext *s, int write_trailer, int is_last)
 
 end:
 #ifdef MOMENT_CHANGE    // MOMENT_CHANGE [
-    avio_close(oc->pb);
+    if (oc->pb && seg->cur_entry.end_time - seg->cur_entry.start_time >= 1.0)
+        seg->bytes_per_sec = avio_tell(oc->pb) / (seg->cur_entry.end_time - seg->cur_entry.start_time);
+    seg_file_close(oc);
+    kf_index_close(seg);
     Notify(oc->filename, 1, 0);
 #else   // MOMENT_CHANGE ], [ !MOMENT_CHANGE
     avio_close(oc->pb);
@@ -685,17 +782,28 @@ static int seg_write_header(AVFormatContext *s)
         ret = ERR_NOSPACE;
         goto fail;
     }
-#endif // MOMENT_CHANGE ]
+        if ((ret = seg_file_open(seg, oc)) < 0)
+            goto fail;
+        kf_index_open(seg, oc);
+#else   // MOMENT_CHANGE ], [ !MOMENT_CHANGE
         if ((ret = avio_open2(&oc->pb, oc->filename, AVIO_FLAG_WRITE,
                               &s->interrupt_callback, NULL)) < 0)
             goto fail;
+#endif  // !MOMENT_CHANGE ]
     } else {
         if ((ret = open_null_ctx(&oc->pb)) < 0)
             goto fail;
     }
 
     if ((ret = avformat_write_header(oc, NULL)) < 0) {
+#ifdef MOMENT_CHANGE    // MOMENT_CHANGE [
+        if (seg->write_header_trailer)
+            seg_file_close(oc);
+        else
+            close_null_ctx(oc->pb);
+#else   // MOMENT_CHANGE ], [ !MOMENT_CHANGE
         avio_close(oc->pb);
+#endif  // !MOMENT_CHANGE ]
         goto fail;
     }
     seg->is_first_pkt = 1;
@@ -705,13 +813,22 @@ static int seg_write_header(AVFormatContext *s)
 
     if (!seg->write_header_trailer) {
         close_null_ctx(oc->pb);
+#ifdef MOMENT_CHANGE    // MOMENT_CHANGE [
+        if ((ret = seg_file_open(seg, oc)) < 0)
+            goto fail;
+        kf_index_open(seg, oc);
+#else   // MOMENT_CHANGE ], [ !MOMENT_CHANGE
         if ((ret = avio_open2(&oc->pb, oc->filename, AVIO_FLAG_WRITE,
                               &s->interrupt_callback, NULL)) < 0)
             goto fail;
+#endif  // !MOMENT_CHANGE ]
     }
 
 fail:
     if (ret) {
+#ifdef MOMENT_CHANGE    // MOMENT_CHANGE [
+        kf_index_close(seg);
+#endif  // MOMENT_CHANGE ]
         if (seg->list)
             avio_close(seg->list_pb);
         if (seg->avf)
@@ -880,8 +997,18 @@ static int seg_write_packet(AVFormatContext *s, AVPacket *pkt)
     {
         if(check_packet_dts(s, oc, pkt) <= 0)
         {
+            // the tag of the packet starts at the current position of the segment file
+            if(seg->kf_index && (pkt->flags & AV_PKT_FLAG_KEY) && pkt->pts != AV_NOPTS_VALUE &&
+               oc->streams[pkt->stream_index]->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+            {
+                KeyframeIndexAppend(seg->kf_index,
+                                    av_rescale_q(pkt->pts, st->time_base, (AVRational){1, 1000}),
+                                    avio_tell(oc->pb));
+            }
+
             ret = ff_write_chained(oc, pkt->stream_index, pkt, s);
-            Notify(oc->filename, 0, oc->pb->pos+1);
+            // the reserved space is taken from the disk already
+            Notify(oc->filename, 0, FFMAX(oc->pb->pos, SegmentFileAllocated(oc->pb->opaque))+1);
         }
         else
         {
@@ -902,8 +1029,19 @@ fail:
         if (seg->list)
             avio_close(seg->list_pb);
 #ifdef MOMENT_CHANGE    // MOMENT_CHANGE [
-    if(ret != ERR_NOSPACE){
-        avformat_free_context(oc);
+    kf_index_close(seg);
+    // segment_start() may have replaced the context already
+    oc = seg->avf;
+    if (oc) {
+        // the segment file is trimmed to its data and its reservation is released
+        if (oc->pb) {
+            seg_file_close(oc);
+            Notify(oc->filename, 1, 0);
+        }
+        if (ret != ERR_NOSPACE) {
+            avformat_free_context(oc);
+            seg->avf = NULL;
+        }
     }
 #else   // MOMENT_CHANGE ], [ !MOMENT_CHANGE
         avformat_free_context(oc);
@@ -920,6 +1058,13 @@ static int seg_write_trailer(struct AVFormatContext *s)
     SegmentListEntry *cur, *next;
 
     int ret;
+#ifdef MOMENT_CHANGE    // MOMENT_CHANGE [
+    // the context has been freed by seg_write_packet() on error
+    if (!oc) {
+        ret = 0;
+        goto fail;
+    }
+#endif  // MOMENT_CHANGE ]
     if (!seg->write_header_trailer) {
         if ((ret = segment_end(s, 0, 1)) < 0)
             goto fail;
@@ -930,6 +1075,9 @@ static int seg_write_trailer(struct AVFormatContext *s)
         ret = segment_end(s, 1, 1);
     }
 fail:
+#ifdef MOMENT_CHANGE    // MOMENT_CHANGE [
+    kf_index_close(seg);
+#endif  // MOMENT_CHANGE ]
     if (seg->list)
         avio_close(seg->list_pb);
 
@@ -18,6 +18,10 @@
 
 
 #include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <Poco/Net/HTTPServerRequestImpl.h>
+#include <Poco/Net/StreamSocket.h>
 #include <libmary/module_init.h>
 #include <moment/libmoment.h>
 #include <moment/moment_request_handler.h>
@@ -37,7 +41,7 @@
 #define MOMENT_HLS__COMMON_HEADERS \
 	"Server: Moment/1.0\r\n" \
 	"Date: ", ConstMemory (date_buf, date_len), "\r\n" \
-	"Connection: Keep-Alive\r\n"
+	"Connection: close\r\n"
 
 #define MOMENT_HLS__OK_HEADERS(mime_type, content_length) \
 	"HTTP/1.1 200 OK\r\n" \
@@ -80,57 +84,6 @@ static std::string _m3u8_mime_type = "application/vnd.apple.mpegurl";
 static std::string _mpegts_mime_type = "video/mp2t";
 
 
-class HandlerContext
-{
-public:
-    HandlerContext()
-    {
-        pMutex = NULL;
-        pCond = NULL;
-        pRequest = NULL;
-        pResponse = NULL;
-        bBool = false;
-    }
-
-    pthread_mutex_t* pMutex;
-    pthread_cond_t* pCond;
-    volatile bool bBool;
-    HTTPServerRequest* pRequest;
-    HTTPServerResponse* pResponse;
-};
-
-void waitForSignal(HandlerContext & ctx)
-{
-    pthread_mutex_lock(ctx.pMutex);
-    while(!ctx.bBool)
-    {
-        pthread_cond_wait(ctx.pCond, ctx.pMutex);
-    }
-    pthread_mutex_unlock(ctx.pMutex);
-}
-
-void doSignal(HandlerContext & ctx)
-{
-    pthread_mutex_lock(ctx.pMutex);
-    ctx.bBool = true;
-    pthread_cond_signal(ctx.pCond);
-    pthread_mutex_unlock(ctx.pMutex);
-}
-
-void initMutexCond(HandlerContext & ctx)
-{
-    pthread_mutex_init(ctx.pMutex, NULL);
-    pthread_cond_init(ctx.pCond, NULL);
-}
-
-void destroyMutexCond(HandlerContext & ctx)
-{
-    pthread_mutex_destroy(ctx.pMutex);
-    ctx.pMutex = NULL;
-    pthread_cond_destroy(ctx.pCond);
-    ctx.pCond = NULL;
-}
-
 namespace {
 class HlsServer : public Object
 {
@@ -182,6 +135,9 @@ private:
         bool excluded;
         Uint64 excluded_time;
 
+        // Filled in while the segment is forming, never modified after that.
+        // Segment data is released along with the last reference to the segment.
+        CodeDepRef<PagePool> page_pool;
         PagePool::PageListHead page_list;
 
         HlsSegment ()
@@ -192,6 +148,8 @@ private:
         ~HlsSegment ()
         {
             logD (hls_msg, _this_func_);
+            if (page_pool)
+                page_pool->msgUnref (page_list.first);
         }
     };
 
@@ -207,8 +165,20 @@ private:
     public:
         mt_const WeakRef<StreamSession> weak_stream_session;
 
-        HandlerContext * pHandlerCtx;
-        mt_const bool        conn_keepalive;
+        // Valid only while a Poco worker thread is processing the request.
+        // Segments which are ready are sent through 'resp' right away.
+        HTTPServerRequest  *req;
+        HTTPServerResponse *resp;
+
+        // If the segment is not ready yet, the connection is taken over from
+        // Poco and the reply is sent through 'conn_sender' later on, so that
+        // pending requests do not occupy Poco threads.
+        mt_const ServerThreadContext *thread_ctx;
+        TcpConnection tcp_conn;
+        DeferredConnectionSender conn_sender;
+        mt_mutex (StreamSession::mutex) bool detached;
+        mt_const PollGroup::PollableKey pollable_key;
+
         mt_const IpAddress   client_address;
         mt_const Ref<String> request_line;
 
@@ -219,8 +189,16 @@ private:
         mt_mutex (StreamSession::mutex) bool valid;
         mt_mutex (StreamSession::mutex) GenericInformer::SubscriptionKey sender_sbn;
 
+        mt_mutex (StreamSession::mutex) Result detachConnection ();
+
         SegmentSession ()
-            : pHandlerCtx(NULL)
+            : req          (NULL),
+              resp         (NULL),
+              thread_ctx   (NULL),
+              tcp_conn     (this /* coderef_container */),
+              conn_sender  (this /* coderef_container */),
+              detached     (false),
+              pollable_key (NULL)
         {}
 
         ~SegmentSession ()
@@ -251,6 +229,9 @@ public:
     {
     public:
         mt_const bool one_session_per_stream;
+        // A single segmenter per stream, viewer sessions only keep their
+        // position in its segment list. Ignored if one_session_per_stream is set.
+        mt_const bool shared_segmenter;
         mt_const bool realtime_mode;
         mt_const bool no_audio;
         mt_const bool no_video;
@@ -287,6 +268,14 @@ private:
 
         mt_const Ref<String> session_id;
 
+        // 'true' for the session bound to hls_stream (one_session_per_stream
+        // or shared_segmenter). Bound sessions are not subject to timeouts.
+        mt_const bool bound;
+
+        // Set for viewer sessions in shared_segmenter mode. Such sessions have
+        // no muxer and no segments of their own.
+        mt_const Ref<StreamSession> segmenter;
+
         mt_const TsMux        *tsmux;
         mt_const TsMuxStream  *audio_ts;
         mt_const TsMuxStream  *video_ts;
@@ -338,6 +327,18 @@ private:
 
         mt_mutex (mutex) void destroySegmentSession (SegmentSession * mt_nonnull seg_session);
 
+        // For detached segment sessions only.
+        mt_mutex (mutex) void sendSegmentHeaders (SegmentSession * mt_nonnull seg_session,
+                                                  Size            content_length);
+
+        // For detached segment sessions only. Pages of a formed segment are
+        // sent as is, pages of the forming segment are copied because more
+        // data is appended to them later.
+        mt_mutex (mutex) void sendSegmentPages (SegmentSession * mt_nonnull seg_session,
+                                                PagePool::Page *first_page,
+                                                Size            msg_offset,
+                                                bool            formed);
+
         mt_mutex (mutex) static gboolean new_packet_cb (guint8 *data,
                                                         guint   len,
                                                         void   *_new_packet_cb_data,
@@ -363,6 +364,10 @@ private:
               release_time         (0),
               watched_now          (false),
               last_request_time_millisec (0),
+              bound                (false),
+              tsmux                (NULL),
+              audio_ts             (NULL),
+              video_ts             (NULL),
               page_pool            (this /* coderef_container */),
               last_frame_timestamp (0),
               oldest_seg_no        (0),
@@ -512,6 +517,7 @@ private:
 
     mt_const Timers *timers;
     mt_const PagePool *page_pool;
+    mt_const ServerContext *server_ctx;
 
     DeferredProcessor::Registration def_reg;
 
@@ -602,7 +608,8 @@ private:
 
     mt_unlocks (mutex) void markStreamSessionRequest (StreamSession * mt_nonnull stream_session);
 
-    mt_mutex (mutex) Ref<HlsServer::StreamSession> doCreateStreamSession (HlsStream *hls_stream);
+    mt_mutex (mutex) Ref<HlsServer::StreamSession> doCreateStreamSession (HlsStream *hls_stream,
+                                                                           bool       bound);
 
     mt_mutex (mutex) bool destroyStreamSession (StreamSession * mt_nonnull stream_session,
                                                 bool           force_destroy);
@@ -620,22 +627,13 @@ private:
                                                                 StreamSession *stream_session,
                                                                 std::string path_prefix);
 
-    Result processSegmentHttpRequest (HandlerContext & ctx,
+    Result processSegmentHttpRequest (HTTPServerRequest &req,
+                                       HTTPServerResponse &resp,
                                        std::string & stream_session_id,
                                        std::string & seg_no_mem);
 
     static bool httpRequest(HTTPServerRequest &req, HTTPServerResponse &resp, void * _self);
 
-    static bool PagesToBuf(PagePool::Page * const page,
-                         uint8_t ** out_buf,
-                         size_t * out_len,
-                         Size           const first_page_offs = 0);
-
-    static bool PagesToBuf(PagePool::PageListHead * const mt_nonnull page_list,
-                         uint8_t ** out_buf,
-                         size_t * out_len,
-                         Size           const first_page_offs = 0);
-
     static Time localGetTimeMilliseconds();
 
 public:
@@ -666,115 +664,6 @@ HlsServer::localGetTimeMilliseconds()
     return new_microseconds / 1000;
 }
 
-bool
-HlsServer::PagesToBuf(PagePool::PageListHead * const mt_nonnull page_list,
-                       uint8_t ** out_buf,
-                       size_t * out_len,
-                       Size           const first_page_offs)
-{
-    // getting size of pages
-    size_t msg_len = 0;
-    {
-        PagePool::Page *cur_page = page_list->first;
-        while (cur_page != NULL)
-        {
-            if (cur_page == page_list->first)
-            {
-                assert (cur_page->data_len >= first_page_offs);
-                msg_len += cur_page->data_len - first_page_offs;
-            }
-            else
-            {
-                msg_len += cur_page->data_len;
-            }
-            cur_page = cur_page->getNextMsgPage ();
-        }
-    }
-    if(msg_len == 0)
-        return false;
-    // writing pages to buffer
-    *out_buf = new uint8_t [msg_len];
-    {
-        PagePool::Page *cur_page = page_list->first;
-        Size pos = 0;
-        while (cur_page != NULL)
-        {
-            if (cur_page == page_list->first)
-            {
-                assert (cur_page->data_len >= first_page_offs);
-                memcpy (*out_buf + pos,
-                        cur_page->getData() + first_page_offs,
-                        cur_page->data_len - first_page_offs);
-                pos += cur_page->data_len - first_page_offs;
-            }
-            else
-            {
-                memcpy (*out_buf + pos, cur_page->getData(), cur_page->data_len);
-                pos += cur_page->data_len;
-            }
-
-            cur_page = cur_page->getNextMsgPage();
-        }
-    }
-    *out_len = msg_len;
-    return true;
-}
-
-bool
-HlsServer::PagesToBuf(PagePool::Page * const page,
-                       uint8_t ** out_buf,
-                       size_t * out_len,
-                       Size           const first_page_offs)
-{
-    // getting size of pages
-    size_t msg_len = 0;
-    {
-        PagePool::Page *cur_page = page;
-        while (cur_page != NULL)
-        {
-            if (cur_page == page)
-            {
-                assert (cur_page->data_len >= first_page_offs);
-                msg_len += cur_page->data_len - first_page_offs;
-            }
-            else
-            {
-                msg_len += cur_page->data_len;
-            }
-            cur_page = cur_page->getNextMsgPage ();
-        }
-    }
-    if(msg_len == 0)
-        return false;
-    // writing pages to buffer
-    *out_buf = new uint8_t [msg_len];
-    {
-        PagePool::Page *cur_page = page;
-        Size pos = 0;
-        while (cur_page != NULL)
-        {
-            if (cur_page == page)
-            {
-                assert (cur_page->data_len >= first_page_offs);
-                memcpy (*out_buf + pos,
-                        cur_page->getData() + first_page_offs,
-                        cur_page->data_len - first_page_offs);
-                pos += cur_page->data_len - first_page_offs;
-            }
-            else
-            {
-                memcpy (*out_buf + pos, cur_page->getData(), cur_page->data_len);
-                pos += cur_page->data_len;
-            }
-
-            cur_page = cur_page->getNextMsgPage();
-        }
-    }
-    *out_len = msg_len;
-    return true;
-}
-
-
 // TODO mod_hls _must_ be loaded before mod_gst (!)
 
 void
@@ -796,7 +685,6 @@ HlsServer::StreamSession::trimSegmentList (Time const cur_time)
         {
             logD (hls_seg, _this_func, "removing segment ", oldest_seg_no);
             segment_list.remove (segment);
-            page_pool->msgUnref (segment->page_list.first);
             segment->unref ();
             ++oldest_seg_no;
         }
@@ -1643,8 +1531,10 @@ HlsServer::videoStreamAdded (VideoStream * const mt_nonnull video_stream,
     self->mutex.lock ();
     hls_stream->hash_key = self->hls_stream_hash.add (stream_name, hls_stream);
 
-    if (self->default_opts.one_session_per_stream) {
-        Ref<StreamSession> const stream_session = self->doCreateStreamSession (hls_stream);
+    if (self->default_opts.one_session_per_stream
+        || self->default_opts.shared_segmenter)
+    {
+        Ref<StreamSession> const stream_session = self->doCreateStreamSession (hls_stream, true /* bound */);
         assert (stream_session);
         self->mutex.unlock ();
 
@@ -1716,54 +1606,19 @@ HlsServer::StreamSession::finishSegment (PagePool::Page ** const first_new_page,
             SegmentSession * const seg_session = forming_seg_sessions.iter_next (iter);
 
             if (opts.realtime_mode) {
-                uint8_t * out_buf = 0;
-                size_t len_buf = 0;
-                bool bRes = PagesToBuf(*first_new_page, &out_buf, &len_buf, *new_page_offs);
-
-                HandlerContext * ctx = seg_session->pHandlerCtx;
-
-                if(bRes)
-                {
-                    std::ostream& out = ctx->pResponse->send();
-                    out << out_buf;
-                    out.flush();
-
-                    delete [] out_buf;
-                }
-
-                doSignal(*ctx);
+                sendSegmentPages (seg_session, *first_new_page, *new_page_offs, false /* formed */);
+            } else {
+                sendSegmentHeaders (seg_session, forming_segment->seg_len);
+                sendSegmentPages (seg_session, forming_segment->page_list.first, 0 /* msg_offset */, true /* formed */);
             }
-            else
-            {
-                uint8_t * out_buf = 0;
-                size_t len_buf = 0;
-                bool bRes = PagesToBuf(forming_segment->page_list.first, &out_buf, &len_buf);
-
-                HandlerContext * ctx = seg_session->pHandlerCtx;
-
-                if(bRes)
-                {
-                    HTTPServerResponse* pResponse = ctx->pResponse;
-                    pResponse->setContentLength(len_buf);
 
-                    pResponse->setStatus(HTTPResponse::HTTP_OK);
-                    pResponse->setContentType(_mpegts_mime_type);
-                    pResponse->sendBuffer(out_buf, len_buf);
-
-                    delete [] out_buf;
-
-                    page_pool->msgRef (forming_segment->page_list.first);
-                }
+            logD(hls_seg, _func_, "segment sent: ", forming_segment->seg_len, " bytes, ",
+                  seg_session->client_address, " ", seg_session->request_line);
 
-                doSignal(*ctx);
-            }
             destroySegmentSession (seg_session);
 
             forming_seg_sessions.remove (seg_session);
             seg_session->unref ();
-
-            logD(hls_seg, _func_, "segment sent: ", forming_segment->seg_len, " bytes, ",
-                  seg_session->client_address, " ", seg_session->request_line);
         }
         assert (forming_seg_sessions.isEmpty());
     }
@@ -1795,6 +1650,7 @@ HlsServer::StreamSession::finishSegment (PagePool::Page ** const first_new_page,
     ++forming_seg_no;
 
     forming_segment = grab (new HlsSegment);
+    forming_segment->page_pool = page_pool;
     forming_segment->first_timestamp = last_frame_timestamp;
     forming_segment->seg_no = forming_seg_no;
     forming_segment->seg_len = 0;
@@ -1854,6 +1710,7 @@ HlsServer::StreamSession::newFrameAdded_unlocked (HlsFrame * const mt_nonnull fr
 
     if (!forming_segment) {
         forming_segment = grab (new HlsSegment);
+        forming_segment->page_pool = page_pool;
         forming_segment->first_timestamp = last_frame_timestamp;
         forming_segment->seg_no = forming_seg_no;
         forming_segment->seg_len = 0;
@@ -2003,31 +1860,7 @@ HlsServer::StreamSession::newFrameAdded_unlocked (HlsFrame * const mt_nonnull fr
             logD(hls_seg, _func_, "new_page_offs: ", new_page_offs, ", "
                   "first_new_page->data_len: ", first_new_page->data_len);
 
-            {
-              // Copying the pages because forming_segment->page_list is not finalized yet,
-              // i.e. new pages will be appended to it soon.
-                uint8_t * out_buf = 0;
-                size_t len_buf = 0;
-                bool bRes = PagesToBuf(first_new_page, &out_buf, &len_buf);
-
-                HandlerContext * ctx = seg_session->pHandlerCtx;
-
-                if(bRes)
-                {
-                    HTTPServerResponse* pResponse = ctx->pResponse;
-
-                    pResponse->setStatus(HTTPResponse::HTTP_OK);
-                    pResponse->setContentType(_mpegts_mime_type);
-                    pResponse->setContentLength(len_buf);
-                    std::ostream& out = pResponse->send();
-                    out << out_buf;
-                    out.flush();
-
-                    delete [] out_buf;
-                }
-
-                doSignal(*ctx);
-            }
+            sendSegmentPages (seg_session, first_new_page, new_page_offs, false /* formed */);
         }
     }
 }
@@ -2041,21 +1874,72 @@ HlsServer::StreamSession::newFrameAdded (HlsFrame * const mt_nonnull frame,
     mutex.unlock ();
 }
 
+mt_mutex (StreamSession::mutex) Result
+HlsServer::SegmentSession::detachConnection ()
+{
+    HTTPServerRequestImpl * const req_impl = dynamic_cast <HTTPServerRequestImpl*> (req);
+    if (!req_impl) {
+        logE_ (_func, "unexpected request type");
+        return Result::Failure;
+    }
+
+    int fd;
+    {
+      // Poco closes its own descriptor when the worker thread is done with
+      // the connection, so the socket is dup'ed.
+        Poco::Net::StreamSocket const socket = req_impl->detachSocket ();
+        fd = dup (socket.impl()->sockfd());
+    }
+    if (fd == -1) {
+        logE_ (_func, "dup() failed: ", errnoString (errno));
+        return Result::Failure;
+    }
+
+    {
+        int flags = fcntl (fd, F_GETFL, 0);
+        if (flags == -1
+            || fcntl (fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        {
+            logE_ (_func, "fcntl() failed: ", errnoString (errno));
+            close (fd);
+            return Result::Failure;
+        }
+    }
+
+    req = NULL;
+    resp = NULL;
+
+    tcp_conn.setFd (fd);
+    conn_sender.setConnection (&tcp_conn);
+    conn_sender.setQueue (thread_ctx->getDeferredConnectionSenderQueue());
+    sender_sbn = conn_sender.getEventInformer()->subscribe (
+            CbDesc<Sender::Frontend> (&StreamSession::sender_event_handler, this, this));
+
+    pollable_key = thread_ctx->getPollGroup()->addPollable (tcp_conn.getPollable(), true /* activate */);
+    if (!pollable_key) {
+        logE_ (_func, "addPollable() failed: ", exc->toString());
+        // 'fd' is closed by tcp_conn.
+        return Result::Failure;
+    }
+
+    // Released in senderClosed().
+    this->ref ();
+    detached = true;
+
+    return Result::Success;
+}
+
 Result
 HlsServer::StreamSession::addSegmentSession (SegmentSession * const mt_nonnull seg_session)
 {
     mutex.lock ();
 
     if (!valid) {
-        logD(hls_seg, _func_, "stream session gone");
-
-        HandlerContext * ctx = seg_session->pHandlerCtx;
-        Result const res = sendHttpNotFound(*ctx->pRequest, *ctx->pResponse);
-        doSignal(*ctx);
-
         destroySegmentSession (seg_session);
         mutex.unlock ();
-        return res;
+
+        logD(hls_seg, _func_, "stream session gone");
+        return sendHttpNotFound (*seg_session->req, *seg_session->resp);
     }
 
     // If the segment is too old or if it has not been advertised yet, reply 404.
@@ -2065,13 +1949,10 @@ HlsServer::StreamSession::addSegmentSession (SegmentSession * const mt_nonnull s
         logD(hls_seg, _func_, "seg_no ", seg_session->seg_no, " not in segment window "
               "[", oldest_seg_no, ", ", newest_seg_no + opts.num_lead_segments, "]");
 
-        HandlerContext * ctx = seg_session->pHandlerCtx;
-        Result const res = sendHttpNotFound(*ctx->pRequest, *ctx->pResponse);
-        doSignal(*ctx);
-
         destroySegmentSession (seg_session);
         mutex.unlock ();
-        return res;
+
+        return sendHttpNotFound (*seg_session->req, *seg_session->resp);
     }
 
     // If the segment has already been formed, send it in reply.
@@ -2094,32 +1975,24 @@ HlsServer::StreamSession::addSegmentSession (SegmentSession * const mt_nonnull s
 
         Size const segment_len = segment->seg_len;
 
-        uint8_t * out_buf = 0;
-        size_t len_buf = 0;
-
-        bool bRes = PagesToBuf(segment->page_list.first, &out_buf, &len_buf);
+        // Formed segments are immutable and the reference keeps their pages
+        // alive, so the segment is sent without holding the session lock.
+        // This matters when many viewers share one segmenter.
+        Ref<HlsSegment> const segment_ref = segment;
 
-        HandlerContext * ctx = seg_session->pHandlerCtx;
-
-        if(bRes)
-        {
-            HTTPServerResponse* pResponse = ctx->pResponse;
-
-            pResponse->setStatus(HTTPResponse::HTTP_OK);
-            pResponse->setContentType(_mpegts_mime_type);
-            pResponse->setContentLength(segment->seg_len);
-
-            pResponse->sendBuffer(out_buf, len_buf);
-
-            delete [] out_buf;
+        destroySegmentSession (seg_session);
+        mutex.unlock ();
 
-            page_pool->msgRef (segment->page_list.first);
-        }
+        HTTPServerResponse * const resp = seg_session->resp;
 
-        doSignal(*ctx);
+        resp->setStatus(HTTPResponse::HTTP_OK);
+        resp->setContentType(_mpegts_mime_type);
+        resp->setContentLength(segment_len);
 
-        destroySegmentSession (seg_session);
-        mutex.unlock ();
+        std::ostream& out = resp->send();
+        for (PagePool::Page *page = segment_ref->page_list.first; page; page = page->getNextMsgPage())
+            out.write ((char const *) page->getData(), page->data_len);
+        out.flush();
 
         logD(hls_seg, _func_, "segment sent: ", segment_len, " bytes, ",
               seg_session->client_address, " ", seg_session->request_line);
@@ -2127,19 +2000,17 @@ HlsServer::StreamSession::addSegmentSession (SegmentSession * const mt_nonnull s
         return Result::Success;
     }
 
-    if (opts.realtime_mode) {
-        HandlerContext * ctx = seg_session->pHandlerCtx;
-        HTTPServerResponse* pResponse = ctx->pResponse;
-
-        pResponse->setStatus(HTTPResponse::HTTP_OK);
-        pResponse->setContentType(_mpegts_mime_type);
-        pResponse->setContentLength(opts.realtime_target_len);
-
-        pResponse->send();
-
-        doSignal(*ctx);
+    // The segment is not ready yet. The request stays on one of the lists
+    // below until the segment is formed, and the Poco thread is released.
+    if (!seg_session->detachConnection ()) {
+        destroySegmentSession (seg_session);
+        mutex.unlock ();
+        return Result::Failure;
     }
 
+    if (opts.realtime_mode)
+        sendSegmentHeaders (seg_session, opts.realtime_target_len);
+
     if (!forming_segment
         || forming_seg_no < seg_session->seg_no)
     {
@@ -2151,30 +2022,8 @@ HlsServer::StreamSession::addSegmentSession (SegmentSession * const mt_nonnull s
         return Result::Success;
     }
 
-    if (opts.realtime_mode) {
-
-      // Copying the pages because forming_segment->page_list is not finalized yet,
-      // i.e. new pages will be appended to it soon.
-
-        uint8_t * out_buf = 0;
-        size_t len_buf = 0;
-        bool bRes = PagesToBuf(forming_segment->page_list.first, &out_buf, &len_buf);
-
-        HandlerContext * ctx = seg_session->pHandlerCtx;
-
-        if(bRes)
-        {
-            HTTPServerResponse* pResponse = ctx->pResponse;
-
-            std::ostream& out = pResponse->send();
-            out << out_buf;
-            out.flush();
-
-            delete [] out_buf;
-        }
-
-        doSignal(*ctx);
-    }
+    if (opts.realtime_mode)
+        sendSegmentPages (seg_session, forming_segment->page_list.first, 0 /* msg_offset */, false /* formed */);
 
     seg_session->in_forming_list = true;
     forming_seg_sessions.append (seg_session);
@@ -2192,6 +2041,45 @@ HlsServer::StreamSession::destroySegmentSession (SegmentSession * const mt_nonnu
         return;
     }
     seg_session->valid = false;
+
+    if (seg_session->detached)
+        seg_session->conn_sender.closeAfterFlush ();
+}
+
+mt_mutex (mutex) void
+HlsServer::StreamSession::sendSegmentHeaders (SegmentSession * const mt_nonnull seg_session,
+                                              Size             const content_length)
+{
+    MOMENT_HLS__HEADERS_DATE
+
+    seg_session->conn_sender.send (page_pool,
+                                   false /* do_flush */,
+                                   MOMENT_HLS__OK_HEADERS (mpegts_mime_type, content_length),
+                                   "\r\n");
+}
+
+mt_mutex (mutex) void
+HlsServer::StreamSession::sendSegmentPages (SegmentSession * const mt_nonnull seg_session,
+                                            PagePool::Page * const first_page,
+                                            Size             const msg_offset,
+                                            bool             const formed)
+{
+    if (!first_page)
+        return;
+
+    if (formed) {
+        page_pool->msgRef (first_page);
+        seg_session->conn_sender.sendPages (page_pool, first_page, msg_offset, true /* do_flush */);
+        return;
+    }
+
+    Size const len = PagePool::countPageListDataLen (first_page, msg_offset);
+    if (len == 0)
+        return;
+
+    PagePool::PageListHead page_list;
+    page_pool->getFillPagesFromPages (&page_list, first_page, msg_offset, len);
+    seg_session->conn_sender.sendPages (page_pool, page_list.first, true /* do_flush */);
 }
 
 Result
@@ -2222,7 +2110,7 @@ HlsServer::createStreamSession (ConstMemory const stream_name)
         hls_stream = entry.getData();
     }
 
-    Ref<HlsServer::StreamSession> const stream_session = doCreateStreamSession (hls_stream);
+    Ref<HlsServer::StreamSession> const stream_session = doCreateStreamSession (hls_stream, false /* bound */);
 
     mutex.unlock ();
 
@@ -2232,8 +2120,18 @@ HlsServer::createStreamSession (ConstMemory const stream_name)
 MOMENT_HLS__INC
 
 mt_mutex (mutex) Ref<HlsServer::StreamSession>
-HlsServer::doCreateStreamSession (HlsStream * const hls_stream)
+HlsServer::doCreateStreamSession (HlsStream * const hls_stream,
+                                  bool        const bound)
 {
+    StreamSession *segmenter = NULL;
+    if (!bound && default_opts.shared_segmenter) {
+        segmenter = hls_stream->bound_stream_session;
+        if (!segmenter) {
+            logD (hls, _func, "no segmenter for hls_stream 0x", fmt_hex, (UintPtr) hls_stream);
+            return NULL;
+        }
+    }
+
     Ref<StreamSession> const stream_session = grab (new StreamSession (&default_opts));
     stream_session->weak_hls_server = this;
     stream_session->valid = true;
@@ -2241,12 +2139,17 @@ HlsServer::doCreateStreamSession (HlsStream * const hls_stream)
     stream_session->last_request_time_millisec = getTimeMilliseconds();
     stream_session->page_pool = page_pool;
     stream_session->hls_stream = hls_stream;
+    stream_session->bound = bound;
 
-    stream_session->tsmux = tsmux_new ();
-    tsmux_set_write_func (stream_session->tsmux, StreamSession::new_packet_cb, &stream_session->new_packet_cb_data);
-    TsMuxProgram * const prog = tsmux_program_new (stream_session->tsmux);
+    if (segmenter) {
+      // Viewer session: segments are muxed once by the segmenter and shared
+      // by all viewers of the stream.
+        stream_session->segmenter = segmenter;
+    } else {
+        stream_session->tsmux = tsmux_new ();
+        tsmux_set_write_func (stream_session->tsmux, StreamSession::new_packet_cb, &stream_session->new_packet_cb_data);
+        TsMuxProgram * const prog = tsmux_program_new (stream_session->tsmux);
 
-    {
         if (default_opts.no_video
             || (default_opts.no_rtmp_video && hls_stream->is_rtmp_stream)
             || hls_stream->no_video)
@@ -2278,7 +2181,7 @@ HlsServer::doCreateStreamSession (HlsStream * const hls_stream)
             tsmux_program_set_pcr_stream (prog, stream_session->audio_ts);
     }
 
-    if (stream_session->opts.one_session_per_stream) {
+    if (bound) {
         assert (!hls_stream->bound_stream_session);
         logD (hls, _func, "creating bound stream session, hls_stream 0x", fmt_hex, (UintPtr) hls_stream);
         hls_stream->bound_stream_session = stream_session;
@@ -2291,7 +2194,7 @@ HlsServer::doCreateStreamSession (HlsStream * const hls_stream)
 
     logD (hls, _func, "adding stream session: ", stream_session->session_id);
     stream_sessions.add (stream_session);
-    if (!stream_session->opts.one_session_per_stream)
+    if (!bound)
         stream_session_cleanup_list.append (stream_session);
 
     MOMENT_HLS__INIT
@@ -2307,7 +2210,7 @@ HlsServer::markStreamSessionRequest (StreamSession * const mt_nonnull stream_ses
     stream_session->last_request_time_millisec = localGetTimeMilliseconds();
     logD (hls, _func_, "last_request_time_millisec = ", stream_session->last_request_time_millisec);
 
-    if (!stream_session->opts.one_session_per_stream) {
+    if (!stream_session->bound) {
         stream_session_cleanup_list.remove (stream_session);
         stream_session_cleanup_list.append (stream_session);
     }
@@ -2366,7 +2269,8 @@ HlsServer::destroyStreamSession (StreamSession * const mt_nonnull stream_session
     }
 
     stream_session->valid = false;
-    stream_session->hls_stream->bound_stream_session = NULL;
+    if (stream_session->hls_stream->bound_stream_session == stream_session)
+        stream_session->hls_stream->bound_stream_session = NULL;
 
     if (stream_session->started) {
         stream_session->hls_stream->started_stream_sessions.remove (stream_session);
@@ -2379,7 +2283,16 @@ HlsServer::destroyStreamSession (StreamSession * const mt_nonnull stream_session
             SegmentSession * const seg_session = stream_session->waiting_seg_sessions.iter_next (iter);
             assert (!seg_session->in_forming_list);
 
-            StreamSession::senderClosed(NULL, seg_session);
+            if (!stream_session->opts.realtime_mode) {
+              // Nothing has been sent in reply yet.
+                MOMENT_HLS__HEADERS_DATE
+                ConstMemory const msg = "404 Not Found";
+                seg_session->conn_sender.send (page_pool,
+                                               true /* do_flush */,
+                                               MOMENT_HLS__404_HEADERS (msg.len()),
+                                               "\r\n",
+                                               msg);
+            }
 
             stream_session->destroySegmentSession (seg_session);
             seg_session->unref ();
@@ -2393,8 +2306,6 @@ HlsServer::destroyStreamSession (StreamSession * const mt_nonnull stream_session
             SegmentSession * const seg_session = stream_session->forming_seg_sessions.iter_next (iter);
             assert (seg_session->in_forming_list);
 
-            StreamSession::senderClosed(NULL, seg_session);
-
             stream_session->destroySegmentSession (seg_session);
             seg_session->unref ();
         }
@@ -2405,25 +2316,27 @@ HlsServer::destroyStreamSession (StreamSession * const mt_nonnull stream_session
         HlsSegmentList::iter iter (stream_session->segment_list);
         while (!stream_session->segment_list.iter_done (iter)) {
             HlsSegment * const segment = stream_session->segment_list.iter_next (iter);
-            page_pool->msgUnref (segment->page_list.first);
             segment->unref ();
         }
         stream_session->segment_list.clear ();
         stream_session->num_active_segments = 0;
     }
 
-    bool const tmp_one_per_stream = stream_session->opts.one_session_per_stream;
+    bool const tmp_bound = stream_session->bound;
     bool const tmp_in_release_queue = stream_session->in_release_queue;
 
-    logD (hls, _func, "calling tsmux_free: stream_session: 0x", fmt_hex, (UintPtr) stream_session, ", "
-          "tsmux: 0x", (UintPtr) stream_session->tsmux);
-    tsmux_free (stream_session->tsmux);
+    if (stream_session->tsmux) {
+        logD (hls, _func, "calling tsmux_free: stream_session: 0x", fmt_hex, (UintPtr) stream_session, ", "
+              "tsmux: 0x", (UintPtr) stream_session->tsmux);
+        tsmux_free (stream_session->tsmux);
+        stream_session->tsmux = NULL;
+    }
 
     stream_session->mutex.unlock ();
     stream_session->hls_stream->mutex.unlock ();
 
     stream_sessions.remove (stream_session);
-    if (!tmp_one_per_stream)
+    if (!tmp_bound)
         stream_session_cleanup_list.remove (stream_session);
     else
     if (tmp_in_release_queue)
@@ -2558,16 +2471,21 @@ HlsServer::doProcessSegmentListHttpRequest (HTTPServerRequest &req,
 
     std::stringstream msg_body;
 
-    stream_session->mutex.lock ();
-    if (!stream_session->valid)
+    // Viewer sessions of a shared segmenter list the segmenter's segments
+    // under their own session id.
+    StreamSession * const seg_source =
+            stream_session->segmenter ? stream_session->segmenter.ptr() : stream_session;
+
+    seg_source->mutex.lock ();
+    if (!seg_source->valid)
     {
-        stream_session->mutex.unlock ();
+        seg_source->mutex.unlock ();
         logD(hls_seg, _func_, "stream session invalidated");
         return sendHttpNotFound (req, resp);
     }
 
     bool just_started = false;
-    if (!stream_session->started)
+    if (!seg_source->started)
         just_started = true;
 
     {
@@ -2575,13 +2493,13 @@ HlsServer::doProcessSegmentListHttpRequest (HTTPServerRequest &req,
         msg_body << "#EXT-X-VERSION:3\n";
         msg_body << "#EXT-X-TARGETDURATION:" << target_duration_seconds << "\n";
         msg_body << "#EXT-X-ALLOW-CACHE:NO\n";
-        msg_body << "#EXT-X-MEDIA-SEQUENCE:" << stream_session->head_seg_no << "\n";
+        msg_body << "#EXT-X-MEDIA-SEQUENCE:" << seg_source->head_seg_no << "\n";
 
         Size num_segments = 0;
-        HlsSegmentList::iter iter (stream_session->segment_list);
-        while (!stream_session->segment_list.iter_done (iter))
+        HlsSegmentList::iter iter (seg_source->segment_list);
+        while (!seg_source->segment_list.iter_done (iter))
         {
-            HlsSegment * const segment = stream_session->segment_list.iter_next (iter);
+            HlsSegment * const segment = seg_source->segment_list.iter_next (iter);
             if (segment->excluded)
                 continue;
 
@@ -2595,21 +2513,21 @@ HlsServer::doProcessSegmentListHttpRequest (HTTPServerRequest &req,
         for (unsigned i = 0; i < stream_session->opts.num_lead_segments; ++i) {
             msg_body << "#EXTINF:" << extinf_str->cstr() << "\n";
             StRef<String> session_id = st_makeString(stream_session->session_id->mem());
-            msg_body << path_prefix << "segment.ts?s=" << session_id->cstr() << "&n=" << stream_session->forming_seg_no + i << "\n";
+            msg_body << path_prefix << "segment.ts?s=" << session_id->cstr() << "&n=" << seg_source->forming_seg_no + i << "\n";
         }
     }
-    stream_session->mutex.unlock ();
+    seg_source->mutex.unlock ();
 
     if (just_started)
     {
         logD(hls_seg, _func_, "just_started");
-        stream_session->hls_stream->mutex.lock ();
-        stream_session->mutex.lock ();
+        seg_source->hls_stream->mutex.lock ();
+        seg_source->mutex.lock ();
 
-        if (!stream_session->started)
+        if (!seg_source->started)
         {
-            stream_session->hls_stream->started_stream_sessions.append (stream_session);
-            stream_session->started = true;
+            seg_source->hls_stream->started_stream_sessions.append (seg_source);
+            seg_source->started = true;
             {
               // TEST: Buffer eaters.
 
@@ -2629,12 +2547,12 @@ HlsServer::doProcessSegmentListHttpRequest (HTTPServerRequest &req,
                 }
 
                 for (unsigned i = 0; i < num_dummy_starters; ++i)
-                    stream_session->newFrameAdded_unlocked (&frame, true /* force_finish_segment */);
+                    seg_source->newFrameAdded_unlocked (&frame, true /* force_finish_segment */);
             }
-
-            stream_session->mutex.unlock ();
-            stream_session->hls_stream->mutex.unlock ();
         }
+
+        seg_source->mutex.unlock ();
+        seg_source->hls_stream->mutex.unlock ();
     }
 
     resp.setStatus(HTTPResponse::HTTP_OK);
@@ -2661,34 +2579,35 @@ HlsServer::StreamSession::senderClosed (Exception * const /* exc_ */,
 {
     logD(hls_seg, _func_, "senderClosed");
     SegmentSession * const seg_session = static_cast <SegmentSession*> (_seg_session);
-    Ref<StreamSession> const stream_session = seg_session->weak_stream_session.getRef ();
-    if (!stream_session) {
-      // If StreamSession is gone, then this SegmentSession should have been
-      // released already.
-        return;
-    }
 
-    stream_session->mutex.lock ();
-    if (!seg_session->valid) {
-        stream_session->mutex.unlock ();
-        return;
-    }
-    seg_session->valid = false;
+    // If StreamSession is gone, then this SegmentSession has been removed
+    // from its lists already.
+    if (Ref<StreamSession> const stream_session = seg_session->weak_stream_session.getRef ()) {
+        stream_session->mutex.lock ();
+        if (seg_session->valid) {
+          // The client has gone before the segment was formed.
+            seg_session->valid = false;
 
-    stream_session->destroySegmentSession (seg_session);
+            if (seg_session->in_forming_list)
+                stream_session->forming_seg_sessions.remove (seg_session);
+            else
+                stream_session->waiting_seg_sessions.remove (seg_session);
 
-    if (seg_session->in_forming_list)
-        stream_session->forming_seg_sessions.remove (seg_session);
-    else
-        stream_session->waiting_seg_sessions.remove (seg_session);
+            seg_session->unref ();
+        }
+        stream_session->mutex.unlock ();
+    }
 
-    stream_session->mutex.unlock ();
+    seg_session->thread_ctx->getPollGroup()->removePollable (seg_session->pollable_key);
+    seg_session->pollable_key = NULL;
 
+    // Taken in detachConnection().
     seg_session->unref ();
 }
 
 Result
-HlsServer::processSegmentHttpRequest (HandlerContext & ctx,
+HlsServer::processSegmentHttpRequest (HTTPServerRequest &req,
+                                       HTTPServerResponse &resp,
                                        std::string & stream_session_id,
                                        std::string & seg_no_str)
 {
@@ -2699,9 +2618,7 @@ HlsServer::processSegmentHttpRequest (HandlerContext & ctx,
     if (!strToUint64_safe (seg_no_str_mem, &seg_no, 10))
     {
         logD (hls_seg, _func, "Bad seg no param \"n\": ", seg_no_str.c_str());
-        Result res = sendHttpNotFound (*ctx.pRequest, *ctx.pResponse);
-        doSignal(ctx);
-        return res;
+        return sendHttpNotFound (req, resp);
     }
 
     mutex.lock ();
@@ -2709,7 +2626,7 @@ HlsServer::processSegmentHttpRequest (HandlerContext & ctx,
 #ifdef MOMENT_HLS_DEMO
     if (send_delimiters) {
         mutex.unlock ();
-        return sendHttpNotFound (req, conn_sender);
+        return sendHttpNotFound (req, resp);
     }
 #endif
 
@@ -2718,54 +2635,41 @@ HlsServer::processSegmentHttpRequest (HandlerContext & ctx,
     {
         mutex.unlock ();
         logD(hls_seg, _func_, "stream session not found, id ", stream_session_id_mem);
-        Result res = sendHttpNotFound (*ctx.pRequest, *ctx.pResponse);
-        doSignal(ctx);
-        return res;
+        return sendHttpNotFound (req, resp);
     }
 
     logD(hls_seg, _func_, "hls_stream 0x", fmt_hex, (UintPtr) stream_session->hls_stream.ptr());
 
     mt_unlocks (mutex) markStreamSessionRequest (stream_session);
 
+    StreamSession *seg_source = stream_session;
+    if (stream_session->segmenter)
+        seg_source = stream_session->segmenter;
+
     Ref<SegmentSession> const seg_session = grab (new SegmentSession);
-    seg_session->weak_stream_session = stream_session;
+    seg_session->weak_stream_session = seg_source;
     seg_session->valid = true;
     seg_session->in_forming_list = false;
 
-    //seg_session->conn_sender = conn_sender;
-    seg_session->pHandlerCtx = &ctx;
-
-    seg_session->conn_keepalive = ctx.pRequest->getKeepAlive();
+    seg_session->req = &req;
+    seg_session->resp = &resp;
+    seg_session->thread_ctx = server_ctx->selectThreadContext();
 
     // client_address and request_line are not actually used (just for log msgs)
-    Uint32 uiAddr = *(Uint32*)ctx.pRequest->clientAddress().host().addr();
+    Uint32 uiAddr = *(Uint32*)req.clientAddress().host().addr();
     seg_session->client_address.ip_addr = uiAddr;
-    seg_session->client_address.port = Uint16(ctx.pRequest->clientAddress().port());
-    ConstMemory request_line_mem = ConstMemory(ctx.pRequest->getURI().c_str(),ctx.pRequest->getURI().size());
+    seg_session->client_address.port = Uint16(req.clientAddress().port());
+    ConstMemory request_line_mem = ConstMemory(req.getURI().c_str(),req.getURI().size());
     seg_session->request_line = grab (new String (request_line_mem));
 
     seg_session->seg_no = seg_no;
 
-    return stream_session->addSegmentSession (seg_session);
+    return seg_source->addSegmentSession (seg_session);
 }
 
 bool
 HlsServer::httpRequest (HTTPServerRequest &req, HTTPServerResponse &resp, void * _self)
 {
-    // make Foo
-    pthread_mutex_t mmutex;
-    pthread_cond_t  ccond_var;
-
-    HandlerContext ctx;
-    ctx.pMutex = &mmutex;
-    ctx.pCond = &ccond_var;
-    ctx.bBool = false;
-    ctx.pRequest = &req;
-    ctx.pResponse = &resp;
-
-    initMutexCond(ctx);
-
-
     HlsServer * const self = static_cast <HlsServer*> (_self);
 
     logD(hls_seg, _func_, req.getURI().c_str());
@@ -2787,8 +2691,6 @@ HlsServer::httpRequest (HTTPServerRequest &req, HTTPServerResponse &resp, void *
 
             Result res = self->processSegmentListHttpRequest (req, resp, stream_session_id);
 
-            destroyMutexCond(ctx);
-
             return res == Result::Success;
         }
         else if(file_name.size() >= ts_ext.size()
@@ -2802,12 +2704,10 @@ HlsServer::httpRequest (HTTPServerRequest &req, HTTPServerResponse &resp, void *
             NameValueCollection::ConstIterator seg_no_mem_iter = form.find("n");
             std::string seg_no_mem = (seg_no_mem_iter != form.end()) ? seg_no_mem_iter->second: "";
 
-            Result res = self->processSegmentHttpRequest (ctx, stream_session_id, seg_no_mem);
-
-            waitForSignal(ctx);
-            destroyMutexCond(ctx);
-
-            return res == Result::Success;
+            // The request has been either answered or taken over from Poco
+            // at this point, 'resp' must not be used anymore.
+            self->processSegmentHttpRequest (req, resp, stream_session_id, seg_no_mem);
+            return true;
         }
 
     }
@@ -2823,7 +2723,6 @@ HlsServer::httpRequest (HTTPServerRequest &req, HTTPServerResponse &resp, void *
             if (!self->default_opts.one_session_per_stream)
             {
                 Result res = self->processStreamHttpRequest (req, resp, stream_name);
-                destroyMutexCond(ctx);
                 return res == Result::Success;
             }
             else
@@ -2837,7 +2736,6 @@ HlsServer::httpRequest (HTTPServerRequest &req, HTTPServerResponse &resp, void *
                         self->mutex.unlock ();
                         logA_ ("hls_stream 404 ", req.clientAddress().toString().c_str(), " ", req.getURI().c_str());
                         Result res = self->sendHttpNotFound (req, resp);
-                        destroyMutexCond(ctx);
                         return res == Result::Success;
                     }
 
@@ -2848,7 +2746,6 @@ HlsServer::httpRequest (HTTPServerRequest &req, HTTPServerResponse &resp, void *
                     self->mutex.unlock ();
                     logA_ ("hls_stream 404 (bound) ", req.clientAddress().toString().c_str(), " ", req.getURI().c_str());
                     Result res = self->sendHttpNotFound (req, resp);
-                    destroyMutexCond(ctx);
                     return res == Result::Success;
                 }
                 Ref<StreamSession> const stream_session = hls_stream->bound_stream_session;
@@ -2857,7 +2754,6 @@ HlsServer::httpRequest (HTTPServerRequest &req, HTTPServerResponse &resp, void *
                                                                                  resp,
                                                                                  stream_session,
                                                                                  "data/");
-                destroyMutexCond(ctx);
                 return res == Result::Success;
             }
         }
@@ -2918,6 +2814,7 @@ HlsServer::init (MomentServer  * const mt_nonnull moment,
 
     timers = server_app->getServerContext()->getMainThreadContext()->getTimers();
     page_pool = moment->getPagePool();
+    server_ctx = server_app->getServerContext();
 
     segments_cleanup_timer =
             timers->addTimer (CbDesc<Timers::TimerCallback> (
@@ -2959,7 +2856,8 @@ HlsServer::init (MomentServer  * const mt_nonnull moment,
 
 HlsServer::HlsServer ()
     : timers (NULL),
-      page_pool (NULL)
+      page_pool (NULL),
+      server_ctx (NULL)
 #ifdef MOMENT_HLS_DEMO
       , send_delimiters (false)
 #endif
@@ -3019,6 +2917,21 @@ static void momentHlsInit ()
         logI(hls_seg, _func, opt_name, ": ", one_session_per_stream);
     }
 
+    bool shared_segmenter = false;
+    {
+        ConstMemory const opt_name = "mod_hls/shared_segmenter";
+        MConfig::BooleanValue const val = config->getBoolean (opt_name);
+        if (val == MConfig::Boolean_Invalid) {
+            logE_ (_func, "Invalid value for ", opt_name, ": ", config->getString (opt_name));
+            return;
+        }
+
+        if (val == MConfig::Boolean_True)
+            shared_segmenter = true;
+
+        logI(hls_seg, _func, opt_name, ": ", shared_segmenter);
+    }
+
     bool realtime_mode = false;
     {
         ConstMemory const opt_name = "mod_hls/realtime_mode";
@@ -3226,6 +3139,7 @@ static void momentHlsInit ()
 
     HlsServer::StreamOptions opts;
     opts.one_session_per_stream    = one_session_per_stream;
+    opts.shared_segmenter          = shared_segmenter;
     opts.realtime_mode             = realtime_mode;
     opts.no_audio                  = no_audio;
     opts.no_video                  = no_video;
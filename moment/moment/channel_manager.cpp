@@ -17,6 +17,7 @@
 */
 
 #include <stdio.h>
+#include <sys/stat.h>
 #include <fstream>
 #include <algorithm>
 #include <string>
@@ -94,6 +95,30 @@ ChannelManager::adminHttpRequest (HTTPServerRequest &req, HTTPServerResponse &re
         logA_ ("moment__channel_manager OK ", req.clientAddress().toString().c_str(), " ", req.getURI().c_str());
 
     }
+    else if (segments.size() >= 2 && segments[1].compare("reload_channels") == 0)
+    {
+        logD_ (_func, "reload_channels");
+
+        if (!self->loadConfigFull ())
+        {
+            resp.setStatus(HTTPResponse::HTTP_INTERNAL_SERVER_ERROR);
+            std::ostream& out = resp.send();
+            out << "500 Internal Server Error: loadConfigFull() failed";
+            out.flush();
+
+            logA_ ("moment__channel_manager 500 ", req.clientAddress().toString().c_str(), " ", req.getURI().c_str());
+
+            goto _return;
+        }
+
+        resp.setStatus(HTTPResponse::HTTP_OK);
+        resp.setContentType("text/plain");
+        std::ostream& out = resp.send();
+        out << "OK";
+        out.flush();
+
+        logA_ ("moment__channel_manager OK ", req.clientAddress().toString().c_str(), " ", req.getURI().c_str());
+    }
     else if (segments.size() >= 2 && segments[1].compare("add_channel") == 0)
     {
         HTMLForm form( req );
@@ -533,6 +558,96 @@ ChannelManager::channelCreatedTask (void * const _self)
     return false /* do not rechedule */;
 }
 
+bool
+ChannelManager::statConfigFile (ConfigFile * const mt_nonnull file)
+{
+    struct stat st;
+    if (stat (file->item_path->cstr(), &st) == -1) {
+        logE_ (_func, "stat() failed for ", file->item_path, ": ", errnoString (errno));
+        return false;
+    }
+
+    file->mtime = (Time) st.st_mtime;
+    file->size  = (Uint64) st.st_size;
+    return true;
+}
+
+// Reads the file and parses it unless the contents are the same as when
+// the file was loaded last time. Called from config loader threads.
+void
+ChannelManager::readConfigFile (ConfigFile * const mt_nonnull file)
+{
+    FILE * const f = fopen (file->item_path->cstr(), "r");
+    if (!f) {
+        logE_ (_func, "could not open ", file->item_path, ": ", errnoString (errno));
+        return;
+    }
+
+    // FNV-1a
+    Uint64 hash = 14695981039346656037ULL;
+    {
+        Byte buf [4096];
+        for (;;) {
+            size_t const len = fread (buf, 1, sizeof (buf), f);
+            for (size_t i = 0; i < len; ++i) {
+                hash ^= buf [i];
+                hash *= 1099511628211ULL;
+            }
+
+            if (len < sizeof (buf))
+                break;
+        }
+    }
+
+    bool const read_error = ferror (f);
+    fclose (f);
+
+    if (read_error) {
+        logE_ (_func, "could not read ", file->item_path);
+        return;
+    }
+
+    file->content_hash = hash;
+    if (file->has_old_item && file->old_content_hash == hash) {
+        file->unchanged = true;
+        return;
+    }
+
+    Ref<MConfig::Config> const config = grab (new (std::nothrow) MConfig::Config);
+    if (!MConfig::parseConfig (file->item_path->mem(), config)) {
+        logE_ (_func, "could not parse config file ", file->item_path);
+        return;
+    }
+
+    file->config = config;
+}
+
+void
+ChannelManager::configLoadThreadFunc (void * const _batch)
+{
+    ConfigLoadBatch * const batch = static_cast <ConfigLoadBatch*> (_batch);
+
+    for (;;) {
+        Count const idx = (Count) batch->next_file.fetchAdd (1);
+        if (idx >= batch->num_files)
+            break;
+
+        readConfigFile (batch->files [idx]);
+    }
+}
+
+void
+ChannelManager::removeConfigItem (ConstMemory const item_name)
+{
+    mutex.lock ();
+    if (ItemHash::EntryKey const old_item_key = item_hash.lookup (item_name)) {
+        StRef<ConfigItem> const item = old_item_key.getData();
+        item->channel->getPlayback()->stop ();
+        item_hash.remove (old_item_key);
+    }
+    mutex.unlock ();
+}
+
 Result
 ChannelManager::loadConfigFull ()
 {
@@ -547,10 +662,14 @@ ChannelManager::loadConfigFull ()
         return Result::Success;
     }
 
+    config_load_mutex.lock ();
+
+    std::vector<ConfigFile> files;
     for (;;) {
         Ref<String> filename;
         if (!dir->getNextEntry (filename)) {
             logE_ (_func, "Vfs::VfsDirectory::getNextEntry() failed: ", exc->toString());
+            config_load_mutex.unlock ();
             return Result::Failure;
         }
         if (!filename)
@@ -563,12 +682,125 @@ ChannelManager::loadConfigFull ()
         if (filename->len() > 0 && filename->mem().mem() [0] == '.')
             continue;
 
-        StRef<String> const path = st_makeString (dir_name, "/", filename->mem());
-        if (!loadConfigItem (filename->mem(), path->mem()))
-            return Result::Failure;
+        files.push_back (ConfigFile ());
+        ConfigFile * const file = &files.back();
+        file->item_name = st_grab (new (std::nothrow) String (filename->mem()));
+        file->item_path = st_makeString (dir_name, "/", filename->mem());
     }
 
-    return Result::Success;
+    // Files which have to be read, and the names of the channels to keep.
+    std::vector<ConfigFile*> changed_files;
+    StringHash<bool> present_items;
+    Count num_unchanged = 0;
+
+    mutex.lock ();
+    for (Count i = 0; i < files.size(); ++i) {
+        ConfigFile * const file = &files [i];
+        present_items.add (file->item_name->mem(), true);
+
+        // A file which can't be stat'ed is read anyway and most likely
+        // fails, which removes its channel.
+        bool const stat_ok = statConfigFile (file);
+
+        if (ItemHash::EntryKey const old_item_key = item_hash.lookup (file->item_name->mem())) {
+            StRef<ConfigItem> const item = old_item_key.getData();
+            if (stat_ok
+                && item->file_mtime == file->mtime
+                && item->file_size  == file->size)
+            {
+                ++num_unchanged;
+                continue;
+            }
+
+            file->has_old_item = true;
+            file->old_content_hash = item->content_hash;
+        }
+
+        changed_files.push_back (file);
+    }
+    mutex.unlock ();
+
+    if (!changed_files.empty()) {
+        ConfigLoadBatch batch;
+        batch.files = &changed_files [0];
+        batch.num_files = changed_files.size();
+
+        // The calling thread reads files as well.
+        Count const num_threads = std::min (config_load_threads, (Count) changed_files.size()) - 1;
+        Ref<MultiThread> multi_thread;
+        if (num_threads > 0) {
+            multi_thread = grab (new (std::nothrow) MultiThread (
+                    num_threads,
+                    CbDesc<Thread::ThreadFunc> (configLoadThreadFunc,
+                                                &batch /* cb_data */,
+                                                NULL   /* coderef_container */)));
+            if (!multi_thread->spawn (true /* joinable */)) {
+                logE_ (_func, "multi_thread->spawn() failed: ", exc->toString());
+                multi_thread = NULL;
+            }
+        }
+
+        configLoadThreadFunc (&batch);
+
+        if (multi_thread) {
+            if (!multi_thread->join ())
+                logE_ (_func, "multi_thread->join() failed: ", exc->toString());
+        }
+    }
+
+    Result res = Result::Success;
+    Count num_reloaded = 0;
+    for (Count i = 0; i < changed_files.size(); ++i) {
+        ConfigFile * const file = changed_files [i];
+
+        if (file->unchanged) {
+            // Touched but not modified.
+            mutex.lock ();
+            if (ItemHash::EntryKey const old_item_key = item_hash.lookup (file->item_name->mem())) {
+                StRef<ConfigItem> const item = old_item_key.getData();
+                item->file_mtime = file->mtime;
+                item->file_size  = file->size;
+            }
+            mutex.unlock ();
+
+            ++num_unchanged;
+            continue;
+        }
+
+        if (!file->config) {
+            removeConfigItem (file->item_name->mem());
+            res = Result::Failure;
+            continue;
+        }
+
+        applyConfigFile (file);
+        ++num_reloaded;
+    }
+
+    // Channels whose config files have been removed.
+    {
+        std::vector< StRef<String> > removed_items;
+
+        mutex.lock ();
+        ItemHash::iter iter (item_hash);
+        while (!item_hash.iter_done (iter)) {
+            ItemHash::EntryKey const item_key = item_hash.iter_next (iter);
+            if (!present_items.lookup (item_key.getKey()))
+                removed_items.push_back (st_grab (new (std::nothrow) String (item_key.getKey())));
+        }
+        mutex.unlock ();
+
+        for (Count i = 0; i < removed_items.size(); ++i) {
+            logD_ (_func, "config file removed: ", removed_items [i]);
+            removeConfigItem (removed_items [i]->mem());
+        }
+    }
+
+    config_load_mutex.unlock ();
+
+    logD_ (_func, "unchanged: ", num_unchanged, ", reloaded: ", num_reloaded);
+
+    return res;
 }
 
 #if 0
@@ -893,21 +1125,34 @@ ChannelManager::loadConfigItem (ConstMemory const item_name,
 {
     logD_ (_func, "item_name: ", item_name, ", item_path: ", item_path);
 
-    Ref<MConfig::Config> const config = grab (new (std::nothrow) MConfig::Config);
-    if (!MConfig::parseConfig (item_path, config)) {
-        logE_ (_func, "could not parse config file ", item_path);
+    config_load_mutex.lock ();
 
-        mutex.lock ();
-        if (ItemHash::EntryKey const old_item_key = item_hash.lookup (item_name)) {
-            StRef<ConfigItem> const item = old_item_key.getData();
-            item->channel->getPlayback()->stop ();
-            item_hash.remove (old_item_key);
-        }
-        mutex.unlock ();
+    ConfigFile file;
+    file.item_name = st_grab (new (std::nothrow) String (item_name));
+    file.item_path = st_grab (new (std::nothrow) String (item_path));
 
+    // Always parsed: the channel is recreated even if the file is the same.
+    if (statConfigFile (&file))
+        readConfigFile (&file);
+
+    if (!file.config) {
+        removeConfigItem (item_name);
+        config_load_mutex.unlock ();
         return Result::Failure;
     }
 
+    applyConfigFile (&file);
+
+    config_load_mutex.unlock ();
+    return Result::Success;
+}
+
+void
+ChannelManager::applyConfigFile (ConfigFile * const mt_nonnull file)
+{
+    ConstMemory const item_name = file->item_name->mem();
+    Ref<MConfig::Config> const &config = file->config;
+
     Ref<VideoStream> const stream = grab (new (std::nothrow) VideoStream);
 
     mutex.lock ();
@@ -948,6 +1193,9 @@ ChannelManager::loadConfigItem (ConstMemory const item_name,
     item->channel->init (moment, channel_opts);
 
     item->config = config;
+    item->file_mtime   = file->mtime;
+    item->file_size    = file->size;
+    item->content_hash = file->content_hash;
 
     // Calling with 'mutex' locked for extra safety.
     item->channel->getPlayback()->setSingleItem (playback_item);
@@ -962,8 +1210,6 @@ ChannelManager::loadConfigItem (ConstMemory const item_name,
 
         notifyChannelCreated (&channel_info);
     }
-
-    return Result::Success;
 }
 
 void
@@ -986,6 +1232,18 @@ ChannelManager::init (MomentServer * const mt_nonnull moment,
         confd_dirname = st_grab (new (std::nothrow) String (
                                 config->getString_default ("moment/confd_dir", "/opt/moment/conf.d")));
 
+        {
+            ConstMemory const opt_name = "moment/confd_load_threads";
+            Uint64 val = config_load_threads;
+            MConfig::GetResult const res = config->getUint64_default (opt_name, &val, val);
+            if (!res)
+                logE_ (_func, "Invalid value for ", opt_name, ": ", config->getString (opt_name));
+            else
+                config_load_threads = (val > 0 ? (Count) val : 1);
+
+            logI_ (_func, opt_name, ": ", config_load_threads);
+        }
+
         {
             ConstMemory const opt_name = "moment/playlist_json";
             MConfig::BooleanValue const val = config->getBoolean (opt_name);
@@ -1029,6 +1287,7 @@ ChannelManager::init (MomentServer * const mt_nonnull moment,
 ChannelManager::ChannelManager ()
     : event_informer (this /* coderef_container */, &mutex),
       page_pool      (this /* coderef_container */),
+      config_load_threads (4),
       serve_playlist_json (true)
 {
     channel_created_task.cb = CbDesc<DeferredProcessor::TaskCallback> (channelCreatedTask, this, this);
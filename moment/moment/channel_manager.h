@@ -84,12 +84,60 @@ private:
         Ref<Channel> channel;
         StRef<String> channel_name;
         StRef<String> channel_title;
+
+        // The version of the config file which the channel has been created from.
+        Time   file_mtime;
+        Uint64 file_size;
+        Uint64 content_hash;
+
+        ConfigItem ()
+            : file_mtime   (0),
+              file_size    (0),
+              content_hash (0)
+        {}
+    };
+
+    // A config file which is new or has been modified since it was loaded.
+    // Read and parsed by config loader threads.
+    struct ConfigFile
+    {
+        StRef<String> item_name;
+        StRef<String> item_path;
+
+        Time   mtime;
+        Uint64 size;
+
+        bool   has_old_item;
+        Uint64 old_content_hash;
+
+        Uint64 content_hash;
+        // Same contents as the loaded one, the file has not been parsed.
+        bool   unchanged;
+        // NULL if parsing has failed.
+        Ref<MConfig::Config> config;
+
+        ConfigFile ()
+            : mtime (0),
+              size (0),
+              has_old_item (false),
+              old_content_hash (0),
+              content_hash (0),
+              unchanged (false)
+        {}
+    };
+
+    struct ConfigLoadBatch
+    {
+        ConfigFile **files;
+        Count       num_files;
+        AtomicInt   next_file;
     };
 
     mt_const Ref<MomentServer> moment;
     mt_const DataDepRef<PagePool> page_pool;
 
     mt_const StRef<String> confd_dirname;
+    mt_const Count         config_load_threads;
     mt_const bool          serve_playlist_json;
     mt_const StRef<String> playlist_json_protocol;
 
@@ -98,6 +146,19 @@ private:
 
     mt_mutex (mutex) Ref<ChannelOptions> default_channel_opts;
 
+    // Serializes loadConfigFull() and loadConfigItem() calls.
+    Mutex config_load_mutex;
+
+    static bool statConfigFile (ConfigFile * mt_nonnull file);
+
+    static void readConfigFile (ConfigFile * mt_nonnull file);
+
+    static void configLoadThreadFunc (void *_batch);
+
+    void removeConfigItem (ConstMemory item_name);
+
+    void applyConfigFile (ConfigFile * mt_nonnull file);
+
     static bool adminHttpRequest (HTTPServerRequest &req, HTTPServerResponse &resp, void * _self);
 
     static bool serverHttpRequest (HTTPServerRequest &req, HTTPServerResponse &resp, void * _self);
@@ -130,6 +191,9 @@ public:
     void channelManagerLock   () { mutex.lock (); }
     void channelManagerUnlock () { mutex.unlock (); }
 
+    // Loads new and modified config files in parallel and removes channels
+    // whose config files are gone. Channels with unchanged config files
+    // are not touched.
     Result loadConfigFull ();
 
     Result loadConfigItem (ConstMemory item_name,
@@ -24,6 +24,19 @@
 #include <moment/libmoment.h>
 #include <moment/moment_request_handler.h>
 #include <fstream>
+#include <map>
+
+#include <Poco/Net/HTTPServerRequestImpl.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #ifdef MOMENT_CTEMPLATE
 #include <ctemplate/template.h>
@@ -117,6 +130,289 @@ static Result momentFile_sendMemory (ConstMemory  mem,
 				     ConstMemory  mime_type);
 
 
+class FileCacheLru_name;
+
+// An open file with its metadata, shared by all requests for it.
+// The descriptor is closed when the last reference goes away.
+class CachedFile : public Referenced,
+                   public IntrusiveListElement<FileCacheLru_name>
+{
+public:
+    int    fd;
+    Uint64 size;
+    time_t mtime;
+    dev_t  dev;
+    ino_t  ino;
+
+    StRef<String> etag;
+    StRef<String> last_modified;
+
+    // Key in 'file_cache'.
+    std::string path;
+
+    CachedFile ()
+        : fd (-1),
+          size (0),
+          mtime (0),
+          dev (0),
+          ino (0)
+    {}
+
+    ~CachedFile ()
+    {
+        if (fd != -1) {
+            for (;;) {
+                int const res = close (fd);
+                if (res == -1 && errno == EINTR)
+                    continue;
+
+                if (res == -1)
+                    logE_ (_func, "close() failed: ", errnoString (errno));
+
+                break;
+            }
+        }
+    }
+};
+
+typedef std::map< std::string, Ref<CachedFile> > FileCache;
+typedef IntrusiveList< CachedFile, FileCacheLru_name > FileCacheLru;
+
+static StateMutex file_cache_mutex;
+static mt_mutex (file_cache_mutex) FileCache file_cache;
+// Entries of 'file_cache', the least recently used one first.
+static mt_mutex (file_cache_mutex) FileCacheLru file_cache_lru;
+static mt_const Count file_cache_max_size = 256;
+
+// Returns true if the cached file has been deleted.
+static bool isUnlinked (CachedFile * const mt_nonnull cached_file)
+{
+    struct stat st;
+    if (fstat (cached_file->fd, &st) == -1) {
+        logE_ (_func, "fstat() failed: ", errnoString (errno));
+        return true;
+    }
+
+    return st.st_nlink == 0;
+}
+
+static mt_mutex (file_cache_mutex) void doForgetCachedFile (FileCache::iterator const iter)
+{
+    file_cache_lru.remove (iter->second.ptr());
+    file_cache.erase (iter);
+}
+
+static void forgetCachedFile (std::string const &path)
+{
+    file_cache_mutex.lock ();
+    FileCache::iterator const iter = file_cache.find (path);
+    if (iter != file_cache.end())
+        doForgetCachedFile (iter);
+    file_cache_mutex.unlock ();
+}
+
+// Returns an open file for 'filename', reusing the cached descriptor
+// while the file stays the same. Sets 'exc' and returns NULL on failure.
+static Ref<CachedFile> getCachedFile (ConstMemory const filename)
+{
+    std::string const path ((char const *) filename.mem(), filename.len());
+
+    // A file which is gone is not kept open by the cache.
+    struct stat st;
+    if (stat (path.c_str(), &st) == -1) {
+        int const errnum = errno;
+        forgetCachedFile (path);
+        exc_throw (PosixException, errnum);
+        return NULL;
+    }
+
+    if (!S_ISREG (st.st_mode)) {
+        forgetCachedFile (path);
+        exc_throw (PosixException, EISDIR);
+        return NULL;
+    }
+
+    file_cache_mutex.lock ();
+    {
+        FileCache::iterator const iter = file_cache.find (path);
+        if (iter != file_cache.end()) {
+            CachedFile * const cached_file = iter->second;
+            if (cached_file->dev   == st.st_dev  &&
+                cached_file->ino   == st.st_ino  &&
+                cached_file->size  == (Uint64) st.st_size &&
+                cached_file->mtime == st.st_mtime &&
+                !isUnlinked (cached_file))
+            {
+                file_cache_lru.remove (cached_file);
+                file_cache_lru.append (cached_file);
+                Ref<CachedFile> const res = cached_file;
+                file_cache_mutex.unlock ();
+                return res;
+            }
+
+            // The file has been replaced, modified or deleted.
+            doForgetCachedFile (iter);
+        }
+    }
+    file_cache_mutex.unlock ();
+
+    Ref<CachedFile> const cached_file = grab (new (std::nothrow) CachedFile);
+
+    for (;;) {
+        cached_file->fd = open (path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (cached_file->fd == -1 && errno == EINTR)
+            continue;
+
+        break;
+    }
+    if (cached_file->fd == -1) {
+        exc_throw (PosixException, errno);
+        return NULL;
+    }
+
+    // Metadata of the file which has actually been opened.
+    if (fstat (cached_file->fd, &st) == -1) {
+        exc_throw (PosixException, errno);
+        return NULL;
+    }
+
+    cached_file->path  = path;
+    cached_file->size  = (Uint64) st.st_size;
+    cached_file->mtime = st.st_mtime;
+    cached_file->dev   = st.st_dev;
+    cached_file->ino   = st.st_ino;
+    cached_file->etag  = st_makeString ("\"", fmt_hex, (Uint64) st.st_ino, "-",
+                                                        (Uint64) st.st_size, "-",
+                                                        (Uint64) st.st_mtime, "\"");
+    {
+        struct tm mtime_tm;
+        gmtime_r (&st.st_mtime, &mtime_tm);
+
+        Byte mtime_buf [unixtimeToString_BufSize];
+        Size const mtime_len = timeToHttpString (Memory::forObject (mtime_buf), &mtime_tm);
+        cached_file->last_modified = st_makeString (ConstMemory (mtime_buf, mtime_len));
+    }
+
+    file_cache_mutex.lock ();
+    {
+        // Another request may have opened the file meanwhile.
+        FileCache::iterator const iter = file_cache.find (path);
+        if (iter != file_cache.end())
+            doForgetCachedFile (iter);
+    }
+
+    // Evicting the least recently used entries. Requests which are still
+    // sending a file keep it open. Deleted files are caught on lookup.
+    while (!file_cache.empty() && file_cache.size() >= file_cache_max_size)
+        doForgetCachedFile (file_cache.find (file_cache_lru.getFirst()->path));
+
+    if (file_cache_max_size > 0) {
+        file_cache [path] = cached_file;
+        file_cache_lru.append (cached_file);
+    }
+    file_cache_mutex.unlock ();
+
+    return cached_file;
+}
+
+// Returns true if the client's copy of the file is up to date.
+static bool isNotModified (HTTPServerRequest &req,
+                           CachedFile * const mt_nonnull cached_file)
+{
+    if (req.has ("If-None-Match")) {
+        // If-Modified-Since is ignored when If-None-Match is present.
+        std::string const &if_none_match = req.get ("If-None-Match");
+        if (if_none_match.compare ("*") == 0)
+            return true;
+
+        return if_none_match.find (cached_file->etag->cstr()) != std::string::npos;
+    }
+
+    if (req.has ("If-Modified-Since")) {
+        std::string const &if_modified_since = req.get ("If-Modified-Since");
+
+        struct tm ims_tm;
+        if (!parseHttpTime (ConstMemory (if_modified_since.c_str(), if_modified_since.size()), &ims_tm)) {
+            logD_ (_func, "Could not parse If-Modified-Since: ", if_modified_since.c_str());
+            return false;
+        }
+
+        struct tm mtime_tm;
+        gmtime_r (&cached_file->mtime, &mtime_tm);
+
+        return compareTime (&mtime_tm, &ims_tm) != ComparisonResult::Greater;
+    }
+
+    return false;
+}
+
+// Writes bytes [offset, offset + len) of the file to the connection.
+// Headers must have been sent already.
+static bool sendFileData (HTTPServerRequest &req,
+                          std::ostream      &out,
+                          CachedFile        * const mt_nonnull cached_file,
+                          Uint64              offset,
+                          Uint64              len)
+{
+#ifdef __linux__
+    HTTPServerRequestImpl * const req_impl = dynamic_cast <HTTPServerRequestImpl*> (&req);
+    if (req_impl) {
+        // The data goes from the page cache to the socket without being copied to userspace.
+        int const sock = req_impl->socket().impl()->sockfd();
+        off_t file_offset = (off_t) offset;
+        while (len > 0) {
+            size_t const toSend = (len < (1 << 30) ? (size_t) len : (size_t) (1 << 30));
+            ssize_t const res = sendfile (sock, cached_file->fd, &file_offset, toSend);
+            if (res == -1) {
+                if (errno == EINTR)
+                    continue;
+
+                logD_ (_func, "sendfile() failed: ", errnoString (errno));
+                return false;
+            }
+
+            if (res == 0) {
+                logE_ (_func, "unexpected end of file, ", len, " bytes left");
+                return false;
+            }
+
+            len -= (Uint64) res;
+        }
+
+        return true;
+    }
+#endif
+
+    Byte buf [65536];
+    while (len > 0) {
+        size_t const toRead = (len < sizeof (buf) ? (size_t) len : sizeof (buf));
+        ssize_t const res = pread (cached_file->fd, buf, toRead, (off_t) offset);
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+
+            logE_ (_func, "pread() failed: ", errnoString (errno));
+            return false;
+        }
+
+        if (res == 0) {
+            logE_ (_func, "unexpected end of file, ", len, " bytes left");
+            return false;
+        }
+
+        out.write ((char const *) buf, res);
+        if (!out.good())
+            return false;
+
+        offset += (Uint64) res;
+        len -= (Uint64) res;
+    }
+
+    out.flush();
+    return out.good();
+}
+
+
 bool
 httpRequest (HTTPServerRequest &req, HTTPServerResponse &resp, void * _path_entry )
 {
@@ -237,11 +533,9 @@ httpRequest (HTTPServerRequest &req, HTTPServerResponse &resp, void * _path_entr
                                                   !path_entry->path->isNull() ? "/" : "",
                                                   file_path);
 
-    NativeFile native_file;
     logD_ (_func, "Trying ", filename->mem());
-    if (!native_file.open (filename->mem(),
-                           0 /* open_flags */,
-                           File::AccessMode::ReadOnly))
+    Ref<CachedFile> cached_file = getCachedFile (filename->mem());
+    if (!cached_file)
     {
         struct AcceptedLanguage {
             ConstMemory lang;
@@ -470,12 +764,11 @@ httpRequest (HTTPServerRequest &req, HTTPServerResponse &resp, void * _path_entr
                     AcceptedLanguage * const alang = &iter.next ().value;
                     logD_ (_func, "Trying .html for language \"", alang->lang, "\"");
 
-                    if (native_file.open (st_makeString (filename->mem().region (0, filename->mem().len() - ext_length),
-                                                         ".",
-                                                         alang->lang,
-                                                         ".html")->mem(),
-                                          0 /* open_flags */,
-                                          File::AccessMode::ReadOnly))
+                    cached_file = getCachedFile (st_makeString (filename->mem().region (0, filename->mem().len() - ext_length),
+                                                                ".",
+                                                                alang->lang,
+                                                                ".html")->mem());
+                    if (cached_file)
                     {
                         opened = true;
                         break;
@@ -498,168 +791,74 @@ httpRequest (HTTPServerRequest &req, HTTPServerResponse &resp, void * _path_entr
         }
     }
 
-    bool got_mtime = false;
-    struct tm mtime;
+    resp.set ("ETag", cached_file->etag->cstr());
+    resp.set ("Last-Modified", cached_file->last_modified->cstr());
+    resp.set ("Accept-Ranges", "bytes");
 
-    if (native_file.getModificationTime (&mtime))
-        got_mtime = true;
-    else
-        logE_ (_func, "native_file.getModificationTime() failed: ", exc->toString());
-
-    if (got_mtime)
+    if (isNotModified (req, cached_file))
     {
-        bool if_none_match__any = false;
-        List<HttpRequest::EntityTag> etags;
-
-        bool send_not_modified = false;
-        if (if_none_match__any) {
-          // We have already opened the file, so it does exist.
-            send_not_modified = true;
-        } else {
-            bool got_if_modified_since = false;
-            struct tm if_modified_since;
-
-            if (got_if_modified_since ||
-                if_none_match__any    ||
-                !etags.isEmpty())
-            {
-                bool expired = false;
-                if (compareTime (&mtime, &if_modified_since) == ComparisonResult::Greater)
-                    expired = true;
+        resp.setStatus(HTTPResponse::HTTP_NOT_MODIFIED);
+        std::ostream& out = resp.send();
+        out.flush();
 
-                bool etag_match = etags.isEmpty();
-                {
-                    List<HttpRequest::EntityTag>::iter iter (etags);
-                    while (!etags.iter_done (iter)) {
-                        HttpRequest::EntityTag * const etag = &etags.iter_next (iter)->data;
-
-                        struct tm etag_time;
-                        if (parseHttpTime (etag->etag->mem(), &etag_time)) {
-                            if (compareTime (&mtime, &etag_time) == ComparisonResult::Equal) {
-                                etag_match = true;
-                                break;
-                            }
-                        } else {
-                            logW_ (_func, "Could not parse etag time: ", etag->etag->mem());
-                        }
-                    }
-                }
+        logA_ ("file 304 ", req.clientAddress().toString().c_str(), " ", req.getURI().c_str());
 
-                if (etag_match && !expired)
-                    send_not_modified = true;
-            }
-        }
+        return true;
+    }
 
-        if (send_not_modified)
+    Uint64 range_start = 0;
+    Uint64 range_end = (cached_file->size > 0 ? cached_file->size - 1 : 0);
+    bool is_partial = false;
+    // A range is only valid for the version of the file named by If-Range.
+    if (req.has ("Range")
+        && (!req.has ("If-Range") || req.get ("If-Range").compare (cached_file->etag->cstr()) == 0))
+    {
+        if (!parseHttpByteRange (req.get ("Range"), cached_file->size, &range_start, &range_end, &is_partial))
         {
-            resp.setStatus(HTTPResponse::HTTP_NOT_MODIFIED);
-            std::ostream& out = resp.send();
-            out.flush();
+            resp.setStatus(HTTPResponse::HTTP_REQUESTED_RANGE_NOT_SATISFIABLE);
+            resp.set ("Content-Range", st_makeString ("bytes */", cached_file->size)->cstr());
+            resp.setContentLength (0);
+            resp.send().flush();
 
-            logA_ ("file 304 ", req.clientAddress().toString().c_str(), " ", req.getURI().c_str());
+            logA_ ("file 416 ", req.clientAddress().toString().c_str(), " ", req.getURI().c_str());
 
             return true;
         }
     }
 
-    NativeFile::FileStat stat;
-    if (!native_file.stat (&stat))
-    {
-        logE_ (_func, "native_file.stat() failed: ", exc->toString());
-
-        resp.setStatus(HTTPResponse::HTTP_INTERNAL_SERVER_ERROR);
-        std::ostream& out = resp.send();
-        out << "500 Internal Server Error";
-        out.flush();
-
-        logA_ ("file 500 ", req.clientAddress().toString().c_str(), " ", req.getURI().c_str());
+    Uint64 const content_length = (cached_file->size > 0 ? range_end - range_start + 1 : 0);
 
-        return Result::Success;
-    }
-
-    Byte mtime_buf [unixtimeToString_BufSize];
-    Size mtime_len = 0;
-    if (got_mtime)
-        mtime_len = timeToHttpString (Memory::forObject (mtime_buf), &mtime);
     StRef<String> st_mime_type = st_makeString(mime_type);
-    resp.setStatus(HTTPResponse::HTTP_OK);
+    if (is_partial)
+    {
+        resp.setStatus(HTTPResponse::HTTP_PARTIAL_CONTENT);
+        resp.set ("Content-Range", st_makeString ("bytes ", range_start, "-", range_end, "/", cached_file->size)->cstr());
+    }
+    else
+    {
+        resp.setStatus(HTTPResponse::HTTP_OK);
+    }
     resp.setContentType(st_mime_type->cstr());
+    resp.setContentLength ((std::streamsize) content_length);
     std::ostream& out = resp.send();
+    // Headers are on the wire, the body bypasses the stream.
+    out.flush();
 
     if (req.getMethod().compare("HEAD") == 0)
     {
-        out.flush();
-        logA_ ("file 200 ", req.clientAddress().toString().c_str(), " ", req.getURI().c_str());
+        logA_ ("file ", (is_partial ? "206 " : "200 "), req.clientAddress().toString().c_str(), " ", req.getURI().c_str());
 
         return true;
     }
 
-    PagePool::PageListHead page_list;
-    // TODO This doesn't work well with large files (eats too much memory).
-    Byte buf [65536];
-    if(std::string(st_mime_type->cstr()).compare("application/x-shockwave-flash") == 0 ||
-       std::string(st_mime_type->cstr()).compare("image/png") == 0 ||
-        std::string(st_mime_type->cstr()).compare("image/jpeg") == 0 ||
-        std::string(st_mime_type->cstr()).compare("video/quicktime") == 0 ||
-        std::string(st_mime_type->cstr()).compare("video/MP2T") == 0 ||
-        std::string(st_mime_type->cstr()).compare("application/vnd.apple.mpegurl") == 0)
+    if (!sendFileData (req, out, cached_file, range_start, content_length))
     {
-        std::string line;
-        std::ifstream myfile (filename->cstr());
-        if (myfile.is_open())
-        {
-          while ( std::getline (myfile,line) )
-          {
-              out << line << "\n";
-          }
-          myfile.close();
-        }
+        // The client has got less than Content-Length, the connection can't be reused.
+        resp.setKeepAlive (false);
+        logD_ (_func, "sending of \"", filename, "\" is interrupted");
     }
-    else{
-        Size total_sent = 0;
-        for (;;)
-        {
-            Size toread = sizeof (buf);
-            if (stat.size - total_sent < toread)
-                toread = stat.size - total_sent;
-
-            Size num_read;
-            IoResult const res = native_file.read (Memory (buf, toread), &num_read);
-            if (res == IoResult::Error)
-            {
-                logE_ (_func, "native_file.read() failed: ", exc->toString());
-                out.flush();
-                return true;
-            }
-            assert (num_read <= toread);
-
-            // TODO Double copy - not very smart.
-            page_pool->getFillPages (&page_list, ConstMemory (buf, num_read));
 
-            StRef<String> st_buf = st_makeString(ConstMemory (buf, num_read));
-            out << st_buf->cstr();
-
-            total_sent += num_read;
-            assert (total_sent <= stat.size);
-            if (total_sent == stat.size)
-                break;
-
-            if (res == IoResult::Eof)
-                break;
-        }
-        assert (total_sent <= stat.size);
-        if (total_sent != stat.size)
-        {
-            logE_ (_func, "File size mismatch: total_sent: ", total_sent, ", stat.size: ", stat.size);
-            out.flush();
-            logA_ ("file 200 ", req.clientAddress().toString().c_str(), " ", req.getURI().c_str());
-            return true;
-        }
-    }
-
-    out.flush();
-
-    logA_ ("file 200 ", req.clientAddress().toString().c_str(), " ", req.getURI().c_str());
+    logA_ ("file ", (is_partial ? "206 " : "200 "), req.clientAddress().toString().c_str(), " ", req.getURI().c_str());
 
     return true;
 }
@@ -1023,6 +1222,18 @@ void momentFileInit ()
 
     page_pool = moment->getPagePool ();
 
+    {
+        ConstMemory const opt_name = "mod_file/fd_cache_size";
+        Uint64 fd_cache_size = file_cache_max_size;
+        MConfig::GetResult const res = config->getUint64_default (opt_name, &fd_cache_size, fd_cache_size);
+        if (!res)
+            logE_ (_func, "Invalid value for ", opt_name, ": ", config->getString (opt_name));
+        else
+            file_cache_max_size = (Count) fd_cache_size;
+
+        logI_ (_func, opt_name, ": ", file_cache_max_size);
+    }
+
     {
 	ConstMemory const opt_name = "mod_file/enable";
 	MConfig::BooleanValue const enable = config->getBoolean (opt_name);
@@ -1141,6 +1352,10 @@ void momentFileInit ()
 
 void momentFileUnload ()
 {
+    file_cache_mutex.lock ();
+    file_cache_lru.clear ();
+    file_cache.clear ();
+    file_cache_mutex.unlock ();
 }
 
 } // namespace {}
@@ -25,9 +25,6 @@
 #include <moment/moment_request_handler.h>
 
 
-#define MOMENT_RTMP__FLOW_CONTROL
-
-
 namespace Moment {
 
 namespace {
@@ -59,6 +56,7 @@ public:
 };
 
 mt_const bool audio_waits_video = false;
+mt_const bool gop_drop = true;
 mt_const bool wait_for_keyframe = true;
 mt_const bool default_start_paused = false;
 mt_const Uint64 paused_avc_interframes = 3;
@@ -156,10 +154,6 @@ public:
     mt_mutex (mutex) StreamingParams streaming_params;
     mt_mutex (mutex) WatchingParams watching_params;
 
-#ifdef MOMENT_RTMP__FLOW_CONTROL
-    mt_mutex (mutex) bool overloaded;
-#endif
-
     mt_mutex (mutex) Count no_keyframe_counter;
     mt_mutex (mutex) bool keyframe_sent;
     mt_mutex (mutex) bool first_keyframe_sent;
@@ -182,9 +176,6 @@ public:
           rtmp_server (this /* coderef_container */),
 	  recorder_thread_ctx (NULL),
 	  recorder (this),
-#ifdef MOMENT_RTMP__FLOW_CONTROL
-	  overloaded (false),
-#endif
 	  no_keyframe_counter (0),
 	  keyframe_sent       (false),
 	  first_keyframe_sent (false),
@@ -380,20 +371,12 @@ void streamAudioMessage (VideoStream::AudioMessage * const mt_nonnull msg,
         }
     }
 
-#ifdef MOMENT_RTMP__FLOW_CONTROL
-    if (client_session->overloaded
-	&& msg->frame_type == VideoStream::AudioFrameType::RawData)
-    {
-      // Connection overloaded, dropping this audio frame.
-	logD (framedrop, _func, "Connection overloaded, dropping audio frame");
-	client_session->mutex.unlock ();
-	return;
-    }
-#endif
+    // Chunked pages are shared between all watchers of the stream.
+    Ref<VideoStream> const chunk_cache = client_session->watching_video_stream;
 
     client_session->mutex.unlock ();
 
-    client_session->rtmp_conn->sendAudioMessage (msg);
+    client_session->rtmp_conn->sendAudioMessage (msg, chunk_cache);
 }
 
 void streamVideoMessage (VideoStream::VideoMessage * const mt_nonnull msg,
@@ -411,27 +394,6 @@ void streamVideoMessage (VideoStream::VideoMessage * const mt_nonnull msg,
 
     client_session->mutex.lock ();
 
-#ifdef MOMENT_RTMP__FLOW_CONTROL
-    if (client_session->overloaded
-	&& (   msg->frame_type == VideoStream::VideoFrameType::KeyFrame
-	    || msg->frame_type == VideoStream::VideoFrameType::InterFrame
-	    || msg->frame_type == VideoStream::VideoFrameType::DisposableInterFrame
-	    || msg->frame_type == VideoStream::VideoFrameType::GeneratedKeyFrame))
-    {
-      // Connection overloaded, dropping this video frame. In general, we'll
-      // have to wait for the next keyframe after we've dropped a frame.
-      // We do not care about disposable frames yet.
-
-	logD (framedrop, _func, "Connection overloaded, dropping video frame");
-
-	client_session->no_keyframe_counter = 0;
-	client_session->keyframe_sent = false;
-
-	client_session->mutex.unlock ();
-	return;
-    }
-#endif // MOMENT_RTMP__FLOW_CONTROL
-
     bool got_keyframe = false;
     if (/* TODO WRONG? !msg->is_saved_frame
         && */ (msg->frame_type == VideoStream::VideoFrameType::KeyFrame ||
@@ -507,11 +469,13 @@ void streamVideoMessage (VideoStream::VideoMessage * const mt_nonnull msg,
 	client_session->keyframe_sent = true;
     }
 
+    Ref<VideoStream> const chunk_cache = client_session->watching_video_stream;
+
     client_session->mutex.unlock ();
 
 //    logD_ (_func, "sending ", toString (msg->codec_id), ", ", toString (msgo->frame_type));
 
-    client_session->rtmp_conn->sendVideoMessage (msg);
+    client_session->rtmp_conn->sendVideoMessage (msg, chunk_cache);
 }
 
 void streamClosed (void * const _session)
@@ -1093,25 +1057,13 @@ void sendStateChanged (Sender::SendState   const send_state,
     switch (send_state) {
 	case Sender::ConnectionReady:
 	    logD (framedrop, _func, "ConnectionReady");
-#ifdef MOMENT_RTMP__FLOW_CONTROL
-	    client_session->mutex.lock ();
-	    client_session->overloaded = false;
-	    client_session->mutex.unlock ();
-#endif
 	    break;
 	case Sender::ConnectionOverloaded:
 	    logD (framedrop, _func, "ConnectionOverloaded");
-            // We used to set 'client_session->overloaded' to 'true' here,
-            // but this turned out to happen too frequently.
-            // Moved that to QueueSoftLimit instead.
 	    break;
 	case Sender::QueueSoftLimit:
+          // Video is dropped by rtmp_conn until the queue drains (mod_rtmp/gop_drop).
 	    logD (framedrop, _func, "QueueSoftLimit");
-#ifdef MOMENT_RTMP__FLOW_CONTROL
-	    client_session->mutex.lock ();
-	    client_session->overloaded = true;
-	    client_session->mutex.unlock ();
-#endif
 	    break;
 	case Sender::QueueHardLimit:
 	    logE_ (_func, "QueueHardLimit");
@@ -1155,6 +1107,7 @@ Result clientConnected (RtmpConnection  * const mt_nonnull rtmp_conn,
     Ref<ClientSession> const client_session = grab (new (std::nothrow) ClientSession);
     client_session->client_addr = client_addr;
     client_session->rtmp_conn = rtmp_conn;
+    rtmp_conn->setGopDropEnabled (gop_drop);
 
     {
 	MomentServer * const moment = MomentServer::getInstance();
@@ -1305,6 +1258,9 @@ MomentRtmpModule::adminHttpRequest (HTTPServerRequest &req, HTTPServerResponse &
                                                        "<td>", sinfo->last_recv_unixtime, "</td>"
                                                        "<td>", sinfo->last_play_stream, "</td>"
                                                        "<td>", sinfo->last_publish_stream, "</td>"
+                                                       "<td>", sinfo->frame_drop_stats.num_dropped_gops, "</td>"
+                                                       "<td>", sinfo->frame_drop_stats.num_dropped_frames, "</td>"
+                                                       "<td>", sinfo->frame_drop_stats.num_dropped_bytes, "</td>"
                                                        "</tr>");
                 strResponse += std::string(strClientSessionInfo->cstr());
             }
@@ -1553,6 +1509,20 @@ static Result momentRtmpInit ()
         logI_ (_func, opt_name, ": ", audio_waits_video);
     }
 
+    {
+	ConstMemory const opt_name = "mod_rtmp/gop_drop";
+	MConfig::BooleanValue const opt_val = config->getBoolean (opt_name);
+	if (opt_val == MConfig::Boolean_Invalid)
+	    logE_ (_func, "Invalid value for config option ", opt_name);
+	else
+	if (opt_val == MConfig::Boolean_False)
+	    gop_drop = false;
+	else
+	    gop_drop = true;
+
+        logI_ (_func, opt_name, ": ", gop_drop);
+    }
+
     {
 	ConstMemory const opt_name = "mod_rtmp/wait_for_keyframe";
 	MConfig::BooleanValue const opt_val = config->getBoolean (opt_name);
@@ -135,6 +135,10 @@ private:
         Uint64 min_pages;
         Uint64 num_threads;
         Uint64 num_file_threads;
+        bool   load_aware_threads;
+
+        bool   log_async;
+        Uint64 log_buffer_size;
 
         StRef<String> profile_filename;
         StRef<String> ctl_filename;
@@ -563,6 +567,9 @@ MomentInstance::doConfigReload (MConfig::Config * const new_config)
 static char const opt_name__min_pages[]               = "moment/min_pages";
 static char const opt_name__num_threads[]             = "moment/num_threads";
 static char const opt_name__num_file_threads[]        = "moment/num_file_threads";
+static char const opt_name__load_aware_threads[]      = "moment/load_aware_threads";
+static char const opt_name__log_async[]               = "moment/log_async";
+static char const opt_name__log_buffer_size[]         = "moment/log_buffer_size";
 static char const opt_name__profile[]                 = "moment/profile";
 static char const opt_name__ctl_pipe[]                = "moment/ctl_pipe";
 static char const opt_name__ctl_pipe_reopen_timeout[] = "moment/ctl_pipe_reopen_timeout";
@@ -589,6 +596,19 @@ MomentInstance::processConfig (MConfig::Config    * const config,
         res = Result::Failure;
     logI_ (_func, opt_name__num_file_threads, ": ", params->num_file_threads);
 
+    if (!configGetBoolean (config, opt_name__load_aware_threads, &params->load_aware_threads, true))
+        res = Result::Failure;
+    logI_ (_func, opt_name__load_aware_threads, ": ", params->load_aware_threads);
+
+    if (!configGetBoolean (config, opt_name__log_async, &params->log_async, true))
+        res = Result::Failure;
+    logI_ (_func, opt_name__log_async, ": ", params->log_async);
+
+    // Per thread.
+    if (!configGetUint64 (config, opt_name__log_buffer_size, &params->log_buffer_size, 1 << 18 /* 256 KB */))
+        res = Result::Failure;
+    logI_ (_func, opt_name__log_buffer_size, ": ", params->log_buffer_size);
+
     params->profile_filename = st_grab (new (std::nothrow) String (
             config->getString_default (opt_name__profile, "/opt/moment/moment_profile")));
     params->ctl_filename = st_grab (new (std::nothrow) String (
@@ -686,6 +706,15 @@ void MomentInstance::applyConfigParams (MConfig::Config * const new_config)
     if (old_params && old_params->num_file_threads != params->num_file_threads)
         configWarnNoEffect (opt_name__num_file_threads);
 
+    if (old_params && old_params->load_aware_threads != params->load_aware_threads)
+        configWarnNoEffect (opt_name__load_aware_threads);
+
+    if (old_params && old_params->log_async != params->log_async)
+        configWarnNoEffect (opt_name__log_async);
+
+    if (old_params && old_params->log_buffer_size != params->log_buffer_size)
+        configWarnNoEffect (opt_name__log_buffer_size);
+
     if (old_params && !equal (old_params->profile_filename->mem(), params->profile_filename->mem()))
         configWarnNoEffect (opt_name__profile);
 
@@ -822,6 +851,12 @@ MomentInstance::run ()
     cur_params = params;
     mutex.unlock ();
 
+    // Before any other threads are spawned, so that they all log the same way.
+    if (params->log_async) {
+        if (!startAsyncLogging (params->log_buffer_size))
+            logE_ (_func, "could not start asynchronous logging, logging synchronously");
+    }
+
     server_app.getEventInformer()->subscribe (CbDesc<ServerApp::Events> (&server_app_events, NULL, NULL));
 
     if (!server_app.init ()) {
@@ -834,6 +869,10 @@ MomentInstance::run ()
     recorder_thread_pool.setNumThreads (params->num_file_threads);
     reader_thread_pool.setNumThreads (params->num_file_threads /* TODO Separate config parameter? */);
 
+    server_app.setLoadAwareSelection (params->load_aware_threads);
+    recorder_thread_pool.setLoadAwareSelection (params->load_aware_threads);
+    reader_thread_pool.setLoadAwareSelection (params->load_aware_threads);
+
     recorder_thread_pool.setMainThreadContext (server_app.getServerContext()->getMainThreadContext());
     if (!recorder_thread_pool.spawn ()) {
 	logE_ (_func, "recorder_thread_pool.spawn() failed");
@@ -1094,6 +1133,11 @@ int main (int argc, char **argv)
     }
 
     Ref<MomentInstance> const moment_instance = grab (new (std::nothrow) MomentInstance);
-    return moment_instance->run ();
+    int const res = moment_instance->run ();
+
+    // Writes out the lines which are still buffered.
+    stopAsyncLogging ();
+
+    return res;
 }
 
@@ -6,6 +6,55 @@ using namespace Moment;
 
 namespace Moment {
 
+bool
+parseHttpByteRange (const std::string & range,
+                    Uint64              const total_size,
+                    Uint64            * const mt_nonnull ret_start,
+                    Uint64            * const mt_nonnull ret_end,
+                    bool              * const mt_nonnull ret_partial)
+{
+    *ret_partial = false;
+
+    if (range.compare (0, 6, "bytes=") != 0 || range.find (',') != std::string::npos)
+        return true;
+
+    size_t const dash = range.find ('-', 6);
+    if (dash == std::string::npos)
+        return true;
+
+    std::string const first = range.substr (6, dash - 6);
+    std::string const last = range.substr (dash + 1);
+
+    Uint64 start = 0;
+    Uint64 end = total_size - 1;
+    if (first.empty()) {
+        // suffix range, the last N bytes
+        Uint64 suffix_len = 0;
+        if (!strToUint64_safe (last.c_str(), &suffix_len, 10 /* base */))
+            return true;
+        if (suffix_len == 0 || total_size == 0)
+            return false;
+        if (suffix_len < total_size)
+            start = total_size - suffix_len;
+    } else {
+        if (!strToUint64_safe (first.c_str(), &start, 10 /* base */))
+            return true;
+        if (!last.empty()) {
+            if (!strToUint64_safe (last.c_str(), &end, 10 /* base */) || end < start)
+                return true;
+            if (end >= total_size)
+                end = total_size - 1;
+        }
+        if (start >= total_size)
+            return false;
+    }
+
+    *ret_start = start;
+    *ret_end = end;
+    *ret_partial = true;
+    return true;
+}
+
 
 //======== common handler
 
@@ -16,6 +16,8 @@
 #include <iostream>
 #include <string>
 
+#include <libmary/types.h>
+
 using namespace Poco::Net;
 using namespace Poco::Util;
 using Poco::Net::HTTPClientSession;
@@ -25,6 +27,15 @@ using Poco::URI;
 
 namespace Moment {
 
+// Parses a single "bytes=first-last" range of RFC 2616 against a file of 'total_size' bytes.
+// Anything else leaves the whole file to be sent ('*ret_partial' is false).
+// Returns 'false' if the range is not satisfiable.
+bool parseHttpByteRange (const std::string & range,
+                         M::Uint64           total_size,
+                         M::Uint64         * ret_start,
+                         M::Uint64         * ret_end,
+                         bool              * ret_partial);
+
 typedef bool (*HandlerFunc)(HTTPServerRequest &req, HTTPServerResponse &resp, void * data);
 typedef std::multimap<std::string, std::pair<HandlerFunc, void*> > HandlerMap;
 
@@ -38,6 +38,7 @@ static LogGroup libMary_logGroup_time      ("rtmp_time",       LogLevel::I);
 static LogGroup libMary_logGroup_close     ("rtmp_conn_close", LogLevel::I);
 static LogGroup libMary_logGroup_proto_in  ("rtmp_proto_in",   LogLevel::I);
 static LogGroup libMary_logGroup_proto_out ("rtmp_proto_out",  LogLevel::I);
+static LogGroup libMary_logGroup_framedrop ("rtmp_framedrop",  LogLevel::I);
 
 Sender::Frontend const RtmpConnection::sender_frontend = {
     senderStateChanged,
@@ -561,7 +562,8 @@ RtmpConnection::sendMessagePages (MessageDesc const      * const mt_nonnull mdes
 				  bool                     const take_ownership,
 				  bool                     const unlocked,
                                   Byte const             * const extra_header_buf,
-                                  unsigned                 const extra_header_len)
+                                  unsigned                 const extra_header_len,
+                                  VideoStream            * const chunk_cache)
 {
     logD (send, _func, "prechunk_size: ", prechunk_size);
 
@@ -628,41 +630,60 @@ RtmpConnection::sendMessagePages (MessageDesc const      * const mt_nonnull mdes
 
 	prechunk_size = PrechunkSize;
 
-	PrechunkContext prechunk_ctx;
 	PagePool::PageListHead prechunked_pages;
 
-        bool first_chunk = true;
-        if (extra_header_len > 0) {
-            fillPrechunkedPages (&prechunk_ctx,
-                                 ConstMemory (extra_header_buf, extra_header_len),
-                                 page_pool,
-                                 &prechunked_pages,
-                                 chunk_stream->chunk_stream_id,
-                                 timestamp,
-                                 true /* first_chunk */);
-            first_chunk = false;
-        }
-
-	PagePool::Page *page = page_list->first;
-	while (page) {
-            ConstMemory mem;
-	    if (page == page_list->first)
-                mem = page->mem().region (msg_offset);
-            else
-                mem = page->mem();
+        // Continuation chunks have type 3 headers which do not depend on
+        // the connection, so prechunked pages of a message are the same for
+        // all connections.
+        VideoStream::ChunkCacheKey cache_key;
+        cache_key.msg_first_page  = page_list->first;
+        cache_key.msg_offset      = msg_offset;
+        cache_key.msg_len         = mdesc->msg_len;
+        cache_key.chunk_size      = prechunk_size;
+        cache_key.chunk_stream_id = chunk_stream->chunk_stream_id;
+        cache_key.extra_header    = ConstMemory (extra_header_buf, extra_header_len);
+
+        if (!chunk_cache
+            || !chunk_cache->getChunkedPages (&cache_key, &prechunked_pages.first))
+        {
+	    PrechunkContext prechunk_ctx;
 
-            if (mem.len() > 0) {
+	    bool first_chunk = true;
+	    if (extra_header_len > 0) {
 		fillPrechunkedPages (&prechunk_ctx,
-				     mem,
+				     ConstMemory (extra_header_buf, extra_header_len),
 				     page_pool,
 				     &prechunked_pages,
 				     chunk_stream->chunk_stream_id,
 				     timestamp,
-				     first_chunk);
-                first_chunk = false;
-            }
+				     true /* first_chunk */);
+		first_chunk = false;
+	    }
 
-	    page = page->getNextMsgPage();
+	    PagePool::Page *page = page_list->first;
+	    while (page) {
+		ConstMemory mem;
+		if (page == page_list->first)
+		    mem = page->mem().region (msg_offset);
+		else
+		    mem = page->mem();
+
+		if (mem.len() > 0) {
+		    fillPrechunkedPages (&prechunk_ctx,
+					 mem,
+					 page_pool,
+					 &prechunked_pages,
+					 chunk_stream->chunk_stream_id,
+					 timestamp,
+					 first_chunk);
+		    first_chunk = false;
+		}
+
+		page = page->getNextMsgPage();
+	    }
+
+	    if (chunk_cache)
+		chunk_cache->putChunkedPages (&cache_key, page_pool, prechunked_pages.first);
 	}
 
 	msg_pages->setFirstPage (prechunked_pages.first);
@@ -1085,7 +1106,8 @@ RtmpConnection::sendCommandMessage_AMF0_Pages (Uint32                   const ms
 }
 
 void
-RtmpConnection::sendVideoMessage (VideoStream::VideoMessage * const mt_nonnull msg)
+RtmpConnection::sendVideoMessage (VideoStream::VideoMessage * const mt_nonnull msg,
+                                  VideoStream               * const chunk_cache)
 {
 #if 0
     logD_ (_func_);
@@ -1098,6 +1120,32 @@ RtmpConnection::sendVideoMessage (VideoStream::VideoMessage * const mt_nonnull m
     if (msg->frame_type == VideoStream::VideoFrameType::RtmpClearMetaData)
 	return;
 
+    if (gop_drop_enabled && msg->frame_type.isVideoData()) {
+        send_mutex.lock ();
+
+        if (dropping_gop) {
+            if (msg->frame_type.isKeyFrame() && !send_congested.get()) {
+                logD (framedrop, _this_func, "resuming at keyframe, "
+                      "dropped frames: ", frame_drop_stats.num_dropped_frames);
+                dropping_gop = false;
+            }
+        } else
+        if (send_congested.get()) {
+            logD (framedrop, _this_func, "send queue congested, dropping video until the next keyframe");
+            dropping_gop = true;
+            ++frame_drop_stats.num_dropped_gops;
+        }
+
+        if (dropping_gop) {
+            ++frame_drop_stats.num_dropped_frames;
+            frame_drop_stats.num_dropped_bytes += msg->msg_len;
+            send_mutex.unlock ();
+            return;
+        }
+
+        send_mutex.unlock ();
+    }
+
     MessageDesc mdesc;
     if (!momentrtmp_proto)
         mdesc.timestamp = (Uint64) msg->timestamp_nanosec / 1000000;
@@ -1138,11 +1186,13 @@ RtmpConnection::sendVideoMessage (VideoStream::VideoMessage * const mt_nonnull m
                       false /* take_ownership */,
                       false /* unlocked */,
                       flv_video_header,
-                      flv_video_header_len);
+                      flv_video_header_len,
+                      chunk_cache);
 }
 
 void
-RtmpConnection::sendAudioMessage (VideoStream::AudioMessage * const mt_nonnull msg)
+RtmpConnection::sendAudioMessage (VideoStream::AudioMessage * const mt_nonnull msg,
+                                  VideoStream               * const chunk_cache)
 {
     // Note that nellymoser codec may generate data which makes valgrind
     // complain about uninitialized bytes.
@@ -1183,7 +1233,8 @@ RtmpConnection::sendAudioMessage (VideoStream::AudioMessage * const mt_nonnull m
                       false /* take_ownership */,
                       false /* unlocked */,
                       flv_audio_header,
-                      flv_audio_header_len);
+                      flv_audio_header_len,
+                      chunk_cache);
 }
 
 void
@@ -1819,9 +1870,33 @@ RtmpConnection::senderStateChanged (Sender::SendState   const send_state,
 				    void              * const _self)
 {
     RtmpConnection * const self = static_cast <RtmpConnection*> (_self);
+
+    switch (send_state) {
+        case Sender::QueueSoftLimit:
+        case Sender::QueueHardLimit:
+            self->send_congested.set (1);
+            break;
+        case Sender::ConnectionReady:
+        case Sender::ConnectionOverloaded:
+          // ConnectionOverloaded alone happens too often to drop frames on it.
+            self->send_congested.set (0);
+            break;
+        default:
+            break;
+    }
+
     self->frontend.call (self->frontend->sendStateChanged, /* ( */ send_state /* ) */);
 }
 
+RtmpConnection::FrameDropStats
+RtmpConnection::getFrameDropStats ()
+{
+    send_mutex.lock ();
+    FrameDropStats const stats = frame_drop_stats;
+    send_mutex.unlock ();
+    return stats;
+}
+
 void
 RtmpConnection::senderClosed (Exception * const exc_,
 			      void      * const _self)
@@ -2941,6 +3016,10 @@ RtmpConnection::RtmpConnection (Object * const coderef_container)
 
       out_last_flush_time (0),
 
+      gop_drop_enabled (false),
+      send_congested (0),
+      dropping_gop (false),
+
       extended_timestamp_is_delta (false),
       ignore_extended_timestamp (false),
 
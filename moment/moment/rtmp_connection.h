@@ -75,6 +75,20 @@ public:
         bool momentrtmp_proto;
     };
 
+    // Counters for video dropped by sendVideoMessage() on a congested connection.
+    struct FrameDropStats
+    {
+        Uint64 num_dropped_frames;
+        Uint64 num_dropped_bytes;
+        Uint64 num_dropped_gops;
+
+        FrameDropStats ()
+            : num_dropped_frames (0),
+              num_dropped_bytes  (0),
+              num_dropped_gops   (0)
+        {}
+    };
+
     struct Frontend
     {
 	Result (*handshakeComplete) (void *cb_data);
@@ -308,6 +322,13 @@ private:
 
     mt_mutex (send_mutex) Time out_last_flush_time;
 
+    mt_const bool gop_drop_enabled;
+    // Set when the send queue reaches its soft limit, cleared when it drains.
+    AtomicInt send_congested;
+    // Video is being dropped up to the next keyframe.
+    mt_mutex (send_mutex) bool dropping_gop;
+    mt_mutex (send_mutex) FrameDropStats frame_drop_stats;
+
     mt_sync_domain (receiver) bool extended_timestamp_is_delta;
     mt_sync_domain (receiver) bool ignore_extended_timestamp;
 
@@ -441,7 +462,8 @@ public:
 			   bool                    take_ownership,
 			   bool                    unlocked,
                            Byte const             *extra_header_buf,
-                           unsigned                extra_header_len);
+                           unsigned                extra_header_len,
+                           VideoStream            *chunk_cache = NULL);
 
     void sendRawPages (PagePool::Page *first_page);
 
@@ -494,9 +516,13 @@ public:
 
   // Extra send utility methods.
 
-    void sendVideoMessage (VideoStream::VideoMessage * mt_nonnull msg);
+    // If 'chunk_cache' is not null, chunked message pages are shared with other
+    // connections through that stream's chunk cache.
+    void sendVideoMessage (VideoStream::VideoMessage * mt_nonnull msg,
+                           VideoStream               *chunk_cache = NULL);
 
-    void sendAudioMessage (VideoStream::AudioMessage * mt_nonnull msg);
+    void sendAudioMessage (VideoStream::AudioMessage * mt_nonnull msg,
+                           VideoStream               *chunk_cache = NULL);
 
     void sendConnect (ConstMemory const &app_name);
 
@@ -578,6 +604,14 @@ public:
 
     Sender* getSender () const { return sender; }
 
+    // When enabled, sendVideoMessage() stops sending video once the send queue
+    // reaches its soft limit and resumes at the first keyframe after the queue
+    // drains, so that a slow client loses whole groups of pictures instead of
+    // being disconnected. Audio and codec data are never dropped.
+    mt_const void setGopDropEnabled (bool const enable) { gop_drop_enabled = enable; }
+
+    FrameDropStats getFrameDropStats ();
+
     mt_const void startClient ();
     mt_const void startServer ();
 
@@ -48,6 +48,8 @@ public:
         Time last_recv_unixtime;
         StRef<String> last_play_stream;
         StRef<String> last_publish_stream;
+        // Updated by SessionInfoIterator::next().
+        RtmpConnection::FrameDropStats frame_drop_stats;
 
         ClientSessionInfo ()
             : creation_unixtime  (0),
@@ -171,6 +173,7 @@ public:
         ClientSessionInfo* next ()
         {
             ClientSession * const session = iter.next ();
+            session->session_info.frame_drop_stats = session->rtmp_conn.getFrameDropStats ();
             return &session->session_info;
         }
     };
@@ -712,29 +712,85 @@ VideoStream::informClosed (EventHandler * const event_handler,
 	event_handler->closed (cb_data);
 }
 
+VideoStream::PendingFrame*
+VideoStream::PendingFrameRing::append ()
+{
+    if (num_frames == num_allocated) {
+        Count const new_num_allocated = num_allocated * 2;
+        PendingFrame * const new_frames = new (std::nothrow) PendingFrame [new_num_allocated];
+        assert (new_frames);
+
+        for (Count i = 0; i < num_frames; ++i)
+            new_frames [i] = frames [(first_idx + i) % num_allocated];
+
+        delete[] frames;
+        frames = new_frames;
+        num_allocated = new_num_allocated;
+        first_idx = 0;
+    }
+
+    PendingFrame * const frame = &frames [(first_idx + num_frames) % num_allocated];
+    ++num_frames;
+    return frame;
+}
+
+VideoStream::PendingFrame*
+VideoStream::PendingFrameRing::removeFirst ()
+{
+    assert (num_frames > 0);
+
+    PendingFrame * const frame = &frames [first_idx];
+    first_idx = (first_idx + 1) % num_allocated;
+    --num_frames;
+    return frame;
+}
+
+VideoStream::PendingFrameRing::PendingFrameRing (Count const initial_size)
+    : num_allocated (initial_size),
+      first_idx     (0),
+      num_frames    (0)
+{
+    assert (initial_size > 0);
+    frames = new (std::nothrow) PendingFrame [initial_size];
+    assert (frames);
+}
+
+VideoStream::PendingFrameRing::~PendingFrameRing ()
+{
+    while (!isEmpty()) {
+        PendingFrame * const frame = removeFirst ();
+        if (frame->type == PendingFrame::t_Audio)
+            frame->audio_msg.release ();
+        else
+            frame->video_msg.release ();
+    }
+
+    delete[] frames;
+}
+
 mt_mutex (mutex) void
 VideoStream::reportPendingFrames ()
 {
-    while (!pending_frame_list.isEmpty()) {
-        PendingFrame * const pending_frame = pending_frame_list.getFirst();
-        pending_frame_list.remove (pending_frame);
+    while (!pending_frames.isEmpty()) {
+        // The slot may be reused as soon as 'mutex' is unlocked.
+        PendingFrame * const pending_frame = pending_frames.removeFirst ();
 
-        switch (pending_frame->getType()) {
+        switch (pending_frame->type) {
             case PendingFrame::t_Audio: {
-                PendingAudioFrame * const audio_frame = static_cast <PendingAudioFrame*> (pending_frame);
-                frame_saver.processAudioFrame (&audio_frame->audio_msg);
-                InformAudioMessage_Data inform_data (&audio_frame->audio_msg);
-                mt_unlocks_locks (mutex) event_informer.informAll_unlocked (informAudioMessage, &inform_data);
+                AudioMessage audio_msg = pending_frame->audio_msg;
+                frame_saver.processAudioFrame (&audio_msg);
+                InformAudioMessage_Data inform_data (&audio_msg);
+                mt_unlocks_locks (mutex) event_informer.informAllSnapshot_unlocked (informAudioMessage, &inform_data);
+                audio_msg.release ();
             } break;
             case PendingFrame::t_Video: {
-                PendingVideoFrame * const video_frame = static_cast <PendingVideoFrame*> (pending_frame);
-                frame_saver.processVideoFrame (&video_frame->video_msg);
-                InformVideoMessage_Data inform_data (&video_frame->video_msg);
-                mt_unlocks_locks (mutex) event_informer.informAll_unlocked (informVideoMessage, &inform_data);
+                VideoMessage video_msg = pending_frame->video_msg;
+                frame_saver.processVideoFrame (&video_msg);
+                InformVideoMessage_Data inform_data (&video_msg);
+                mt_unlocks_locks (mutex) event_informer.informAllSnapshot_unlocked (informVideoMessage, &inform_data);
+                video_msg.release ();
             } break;
         }
-
-        delete pending_frame;
     }
 }
 
@@ -757,19 +813,20 @@ VideoStream::fireAudioMessage_unlocked (AudioMessage * const mt_nonnull audio_ms
     logS_ (_this_func, "ts ", audio_msg->timestamp_nanosec, " ", audio_msg->frame_type);
 
     if (pending_report_in_progress) {
-        PendingAudioFrame * const audio_frame = new (std::nothrow) PendingAudioFrame (audio_msg);
-        assert (audio_frame);
-        pending_frame_list.append (audio_frame);
+        PendingFrame * const pending_frame = pending_frames.append ();
+        pending_frame->type = PendingFrame::t_Audio;
+        pending_frame->audio_msg = *audio_msg;
+        audio_msg->seize ();
         return;
     }
 
     ++msg_inform_counter;
-    assert (pending_frame_list.isEmpty());
+    assert (pending_frames.isEmpty());
 
     frame_saver.processAudioFrame (audio_msg);
     {
         InformAudioMessage_Data inform_data (audio_msg);
-        mt_unlocks_locks (mutex) event_informer.informAll_unlocked (informAudioMessage, &inform_data);
+        mt_unlocks_locks (mutex) event_informer.informAllSnapshot_unlocked (informAudioMessage, &inform_data);
     }
 
     --msg_inform_counter;
@@ -785,19 +842,20 @@ VideoStream::fireVideoMessage_unlocked (VideoMessage * const mt_nonnull video_ms
     logS_ (_this_func, "ts ", video_msg->timestamp_nanosec, " ", video_msg->frame_type);
 
     if (pending_report_in_progress) {
-        PendingVideoFrame * const video_frame = new (std::nothrow) PendingVideoFrame (video_msg);
-        assert (video_frame);
-        pending_frame_list.append (video_frame);
+        PendingFrame * const pending_frame = pending_frames.append ();
+        pending_frame->type = PendingFrame::t_Video;
+        pending_frame->video_msg = *video_msg;
+        video_msg->seize ();
         return;
     }
 
     ++msg_inform_counter;
-    assert (pending_frame_list.isEmpty());
+    assert (pending_frames.isEmpty());
 
     frame_saver.processVideoFrame (video_msg);
     {
         InformVideoMessage_Data inform_data (video_msg);
-        mt_unlocks_locks (mutex) event_informer.informAll_unlocked (informVideoMessage, &inform_data);
+        mt_unlocks_locks (mutex) event_informer.informAllSnapshot_unlocked (informVideoMessage, &inform_data);
     }
 
     --msg_inform_counter;
@@ -1129,11 +1187,11 @@ VideoStream::bind_savedAudioFrame (AudioMessage * const mt_nonnull audio_msg,
         return Result::Success;
     }
 
-    PendingAudioFrame * const audio_frame = new (std::nothrow) PendingAudioFrame (audio_msg);
-    assert (audio_frame);
-    audio_frame->audio_msg = *audio_msg;
-    audio_frame->audio_msg.timestamp_nanosec = self->stream_timestamp_nanosec;
-    self->pending_frame_list.append (audio_frame);
+    PendingFrame * const pending_frame = self->pending_frames.append ();
+    pending_frame->type = PendingFrame::t_Audio;
+    pending_frame->audio_msg = *audio_msg;
+    pending_frame->audio_msg.timestamp_nanosec = self->stream_timestamp_nanosec;
+    audio_msg->seize ();
 
     return Result::Success;
 }
@@ -1152,11 +1210,11 @@ VideoStream::bind_savedVideoFrame (VideoMessage * const mt_nonnull video_msg,
         return Result::Success;
     }
 
-    PendingVideoFrame * const video_frame = new (std::nothrow) PendingVideoFrame (video_msg);
-    assert (video_frame);
-    video_frame->video_msg = *video_msg;
-    video_frame->video_msg.timestamp_nanosec = self->stream_timestamp_nanosec;
-    self->pending_frame_list.append (video_frame);
+    PendingFrame * const pending_frame = self->pending_frames.append ();
+    pending_frame->type = PendingFrame::t_Video;
+    pending_frame->video_msg = *video_msg;
+    pending_frame->video_msg.timestamp_nanosec = self->stream_timestamp_nanosec;
+    video_msg->seize ();
 
     return Result::Success;
 }
@@ -1542,13 +1600,112 @@ VideoStream::close ()
     mutex.unlock ();
 }
 
+bool
+VideoStream::ChunkCacheEntry::matches (ChunkCacheKey const * const mt_nonnull key) const
+{
+    return msg_first_page
+           && msg_first_page  == key->msg_first_page
+           && msg_offset      == key->msg_offset
+           && msg_len         == key->msg_len
+           && chunk_size      == key->chunk_size
+           && chunk_stream_id == key->chunk_stream_id
+           && equal (ConstMemory (extra_header_buf, extra_header_len), key->extra_header);
+}
+
+void
+VideoStream::ChunkCacheEntry::release ()
+{
+    if (msg_first_page) {
+        page_pool->msgUnref (msg_first_page);
+        msg_first_page = NULL;
+    }
+
+    if (chunked_first_page) {
+        page_pool->msgUnref (chunked_first_page);
+        chunked_first_page = NULL;
+    }
+}
+
+bool
+VideoStream::getChunkedPages (ChunkCacheKey   const * const mt_nonnull key,
+                              PagePool::Page       ** const mt_nonnull ret_first_page)
+{
+    *ret_first_page = NULL;
+
+    if (!key->msg_first_page)
+        return false;
+
+    chunk_cache_mutex.lock ();
+    for (Count i = 0; i < ChunkCache_NumEntries; ++i) {
+        ChunkCacheEntry * const entry = &chunk_cache [i];
+        if (entry->matches (key)) {
+            if (entry->chunked_first_page)
+                entry->page_pool->msgRef (entry->chunked_first_page);
+
+            *ret_first_page = entry->chunked_first_page;
+            chunk_cache_mutex.unlock ();
+            return true;
+        }
+    }
+    chunk_cache_mutex.unlock ();
+
+    return false;
+}
+
+void
+VideoStream::putChunkedPages (ChunkCacheKey const * const mt_nonnull key,
+                              PagePool            * const mt_nonnull page_pool,
+                              PagePool::Page      * const chunked_first_page)
+{
+    if (!key->msg_first_page
+        || key->extra_header.len() > ChunkCache_MaxHeaderLen)
+    {
+        return;
+    }
+
+    chunk_cache_mutex.lock ();
+
+    for (Count i = 0; i < ChunkCache_NumEntries; ++i) {
+        if (chunk_cache [i].matches (key)) {
+          // Another connection has got ahead of us.
+            chunk_cache_mutex.unlock ();
+            return;
+        }
+    }
+
+    ChunkCacheEntry * const entry = &chunk_cache [chunk_cache_next];
+    chunk_cache_next = (chunk_cache_next + 1) % ChunkCache_NumEntries;
+
+    entry->release ();
+
+    entry->page_pool = page_pool;
+
+    entry->msg_first_page = key->msg_first_page;
+    page_pool->msgRef (entry->msg_first_page);
+    entry->msg_offset = key->msg_offset;
+    entry->msg_len = key->msg_len;
+
+    entry->chunk_size = key->chunk_size;
+    entry->chunk_stream_id = key->chunk_stream_id;
+    memcpy (entry->extra_header_buf, key->extra_header.mem(), key->extra_header.len());
+    entry->extra_header_len = key->extra_header.len();
+
+    entry->chunked_first_page = chunked_first_page;
+    if (chunked_first_page)
+        page_pool->msgRef (chunked_first_page);
+
+    chunk_cache_mutex.unlock ();
+}
+
 VideoStream::VideoStream ()
     : is_closed (false),
       num_watchers (0),
       event_informer (this, &mutex),
       stream_timestamp_nanosec (0),
       pending_report_in_progress (false),
-      msg_inform_counter (0)
+      msg_inform_counter (0),
+      pending_frames (16 /* initial_size */),
+      chunk_cache_next (0)
 {
 }
 
@@ -1579,6 +1736,9 @@ VideoStream::~VideoStream ()
             mutex.lock ();
         }
     }
+
+    for (Count i = 0; i < ChunkCache_NumEntries; ++i)
+        chunk_cache [i].release ();
 }
 
 }
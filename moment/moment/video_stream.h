@@ -423,54 +423,40 @@ public:
     };
 
 private:
-    class PendingFrameList_name;
-
-    // TODO PendingFrame looks like a bad idea.
-    //      It adds quite a lot of extra malloc/free pairs
-    //      when streaming video+audio from gstreamer
-    //      (when video and audio come from separate threads).
-    class PendingFrame : public IntrusiveListElement<PendingFrameList_name> {
-    public:
+    // Frames which arrive while saved frames of a bound stream are being
+    // reported. Kept in a ring buffer which is allocated once and grows
+    // only if it gets full, so that queueing a frame does not malloc.
+    struct PendingFrame
+    {
         enum Type {
             t_Audio,
             t_Video
         };
-    private:
-        Type const type;
-    public:
-        Type getType() const { return type; }
-        PendingFrame (Type const type) : type (type) {}
-        virtual ~PendingFrame () {}
-    };
 
-    typedef IntrusiveList<PendingFrame, PendingFrameList_name> PendingFrameList;
-
-    struct PendingAudioFrame : public PendingFrame
-    {
+        Type type;
         AudioMessage audio_msg;
-
-        PendingAudioFrame (AudioMessage * const mt_nonnull msg)
-            : PendingFrame (t_Audio)
-        {
-            audio_msg = *msg;
-            msg->seize ();
-        }
-
-        ~PendingAudioFrame () { audio_msg.release (); }
+        VideoMessage video_msg;
     };
 
-    struct PendingVideoFrame : public PendingFrame
+    class PendingFrameRing
     {
-        VideoMessage video_msg;
+    private:
+        PendingFrame *frames;
+        Count num_allocated;
+        Count first_idx;
+        Count num_frames;
 
-        PendingVideoFrame (VideoMessage * const mt_nonnull msg)
-            : PendingFrame (t_Video)
-        {
-            video_msg = *msg;
-            msg->seize ();
-        }
+    public:
+        bool isEmpty () const { return num_frames == 0; }
 
-        ~PendingVideoFrame () { video_msg.release (); }
+        // Returns a free slot at the tail of the ring.
+        PendingFrame* append ();
+
+        // The returned frame is valid until the next call to append().
+        PendingFrame* removeFirst ();
+
+         PendingFrameRing (Count initial_size);
+        ~PendingFrameRing ();
     };
 
     mt_const Ref<StreamParameters> stream_params;
@@ -634,7 +620,7 @@ private:
 
     mt_mutex (mutex) bool  pending_report_in_progress;
     mt_mutex (mutex) Count msg_inform_counter;
-    mt_mutex (mutex) PendingFrameList pending_frame_list;
+    mt_mutex (mutex) PendingFrameRing pending_frames;
 
     mt_mutex (mutex) void bind_messageBegin (BindInfo * mt_nonnull bind_info,
                                              Message  * mt_nonnull msg);
@@ -688,6 +674,74 @@ public:
                           bool         bind_audio,
                           bool         bind_video);
 
+  // ______________________________ Chunk cache ________________________________
+
+    // RTMP connections which send the same message with the same chunk size
+    // produce identical chunked pages. The last few of them are kept here,
+    // so that every watcher does not have to build its own copy.
+    //
+    // An entry is keyed by the first page of the source message. The entry
+    // holds a reference to that page, so it can't be reused for other data
+    // while the entry exists.
+
+    struct ChunkCacheKey
+    {
+        PagePool::Page *msg_first_page;
+        Size msg_offset;
+        Size msg_len;
+
+        Uint32 chunk_size;
+        Uint32 chunk_stream_id;
+        // FLV audio/video tag header which precedes message data.
+        ConstMemory extra_header;
+    };
+
+private:
+    enum {
+        ChunkCache_NumEntries   = 4,
+        ChunkCache_MaxHeaderLen = 16
+    };
+
+    struct ChunkCacheEntry
+    {
+        // Both the source message and chunked pages belong to 'page_pool'.
+        PagePool *page_pool;
+
+        PagePool::Page *msg_first_page;
+        Size msg_offset;
+        Size msg_len;
+
+        Uint32 chunk_size;
+        Uint32 chunk_stream_id;
+        Byte extra_header_buf [ChunkCache_MaxHeaderLen];
+        unsigned extra_header_len;
+
+        PagePool::Page *chunked_first_page;
+
+        bool matches (ChunkCacheKey const * mt_nonnull key) const;
+        void release ();
+
+        ChunkCacheEntry () : msg_first_page (NULL), chunked_first_page (NULL) {}
+    };
+
+    // Not 'mutex': getChunkedPages() may be called from FrameSaver callbacks,
+    // when 'mutex' is locked.
+    Mutex chunk_cache_mutex;
+    mt_mutex (chunk_cache_mutex) ChunkCacheEntry chunk_cache [ChunkCache_NumEntries];
+    mt_mutex (chunk_cache_mutex) Count chunk_cache_next;
+
+public:
+    // Returns true and references the cached pages if the message has already
+    // been chunked with the same parameters.
+    bool getChunkedPages (ChunkCacheKey   const * mt_nonnull key,
+                          PagePool::Page       ** mt_nonnull ret_first_page);
+
+    // Takes extra references to the source message and 'chunked_first_page',
+    // both of which must belong to 'page_pool'.
+    void putChunkedPages (ChunkCacheKey const * mt_nonnull key,
+                          PagePool            * mt_nonnull page_pool,
+                          PagePool::Page      *chunked_first_page);
+
   // ___________________________________________________________________________
 
 
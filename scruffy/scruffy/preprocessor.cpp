@@ -1234,20 +1234,27 @@ CppPreprocessor::do_translateIfDirective (PpItemStream *pp_stream,
     StRef<ListTokenStream> token_stream =
 	    st_grab (new (std::nothrow) ListTokenStream (&token_list));
 
-    StRef<Grammar> grammar = create_cpp_cond_grammar ();
-    optimizeGrammar (grammar);
-
     StRef<StReferenced> cpp_element_container;
     ParserElement *cpp_element = NULL;
-    parse (token_stream,
-	   NULL,
-	   NULL /* user_data */,
-	   grammar,
-	   &cpp_element,
-           &cpp_element_container,
-	   "default",
-	   Pargen::createDefaultParserConfig (),
-	   false /* debug_dump */);
+
+    // The grammar is shared by all preprocessors, which may run in several
+    // threads. Its reference counter and optimizeGrammar() are not thread-safe.
+    helperLock ();
+    {
+        StRef<Grammar> grammar = create_cpp_cond_grammar ();
+        optimizeGrammar (grammar);
+
+        parse (token_stream,
+               NULL,
+               NULL /* user_data */,
+               grammar,
+               &cpp_element,
+               &cpp_element_container,
+               "default",
+               Pargen::createDefaultParserConfig (),
+               false /* debug_dump */);
+    }
+    helperUnlock ();
 
 #if 0
     errf->print ("--- #if:").pendl ();
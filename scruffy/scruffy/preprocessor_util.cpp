@@ -1402,6 +1402,7 @@ namespace Scruffy_PreprocessorUtil_priv {
 	    KeywordHash;
 
     KeywordHash keyword_hash;
+    AtomicInt keyword_hash_filled;
 
     static void
     fill_keywords ()
@@ -1409,6 +1410,12 @@ namespace Scruffy_PreprocessorUtil_priv {
       // TODO Make this part of initialization process.
       // helperLock() / helperUnlock() won't be necessary then.
 
+	// Config files are parsed by several threads at once.
+	if (keyword_hash_filled.get ())
+	    return;
+
+      helperLock ();
+
 	if (keyword_hash.isEmpty ()) {
 	    for (Size i = 0; i < num_keywords; i++) {
 //		keywords_set.insert (keywords [i]);
@@ -1420,6 +1427,10 @@ namespace Scruffy_PreprocessorUtil_priv {
 		keyword_hash.add (keyword_entry);
 	    }
 	}
+
+	keyword_hash_filled.set (1);
+
+      helperUnlock ();
     }
 
     static bool is_keyword (ConstMemory const mem)
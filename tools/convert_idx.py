@@ -0,0 +1,74 @@
+import os
+import struct
+import sys
+
+# Converts text record indexes (path|start|end lines) under the given record
+# directories into the binary format of moment-ffmpeg/record_index.h.
+# mod_ffmpeg converts them on the fly as well, this is for doing it offline.
+
+MAGIC = 'MNVRIDX\0'
+VERSION = 1
+HEADER_SIZE = 32
+RECORD_SIZE = 128
+MAX_NAME_LEN = 111
+
+def fnv1a(data):
+    h = 2166136261
+    for c in data:
+        h ^= ord(c)
+        h = (h * 16777619) & 0xffffffff
+    return h
+
+def make_record(name, time_start, time_end):
+    fields = struct.pack('<iiI', time_start, time_end, 0)
+    name_field = name + '\0' * (MAX_NAME_LEN + 1 - len(name))
+    checksum = fnv1a(fields + name_field)
+    return fields + struct.pack('<I', checksum) + name_field
+
+def convert(path):
+    f = open(path, 'rb')
+    data = f.read()
+    f.close()
+
+    if data.startswith(MAGIC):
+        return False
+
+    records = ''
+    for line in data.splitlines():
+        parts = line.rsplit('|', 2)
+        if len(parts) != 3:
+            continue
+        name = parts[0].split('/')[-1]
+        if len(name) > MAX_NAME_LEN:
+            print 'name is too long, skipping: ' + name
+            continue
+        records += make_record(name, int(parts[1]), int(parts[2]))
+
+    header = MAGIC + struct.pack('<III', VERSION, HEADER_SIZE, RECORD_SIZE) + '\0' * 12
+
+    tmp_path = path + '.tmp'
+    f = open(tmp_path, 'wb')
+    f.write(header + records)
+    f.flush()
+    os.fsync(f.fileno())
+    f.close()
+    os.rename(tmp_path, path)
+    return True
+
+def main():
+
+    if len(sys.argv) < 2:
+        print 'usage: convert_idx.py <record dir> [<record dir> ...]'
+        return
+
+    cc = 0
+    for record_dir in sys.argv[1:]:
+        for root, dirs, files in os.walk(record_dir):
+            for filename in files:
+                if filename.endswith('.idx') and convert(os.path.join(root, filename)):
+                    cc += 1
+
+    print 'converted ' + str(cc) + ' idx files'
+
+if __name__ == "__main__":
+    main()